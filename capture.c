@@ -0,0 +1,257 @@
+//
+// 截图抓取结果的序列化，抓取(网络IO)和渲染(解码编码)可以在不同的进程或机器上进行
+// 所有整数按大端写入
+//
+#include "capture.h"
+#include "custom_io.h"
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#include <stdio.h>
+
+
+/**
+ * 创建抓取结果并复制解码参数
+ * @param codecpar
+ * @return 失败返回NULL
+ */
+ShotCapture *alloc_shot_capture(const AVCodecParameters *codecpar) {
+    ShotCapture *capture = (ShotCapture *) av_mallocz(sizeof(ShotCapture));
+    if (!capture) {
+        return NULL;
+    }
+    capture->start_time = AV_NOPTS_VALUE;
+    if (!(capture->codecpar = avcodec_parameters_alloc()) ||
+        (codecpar && avcodec_parameters_copy(capture->codecpar, codecpar) < 0)) {
+        printf("copy codec parameters failed\n");
+        free_shot_capture(&capture);
+    }
+    return capture;
+}
+
+
+/**
+ * 追加一个包的引用
+ * @param capture
+ * @param packet
+ * @return
+ */
+int add_shot_capture_packet(ShotCapture *capture, const AVPacket *packet) {
+    AVPacket *copy, **packets;
+    int ret;
+    if (!(packets = (AVPacket **) av_realloc_array(capture->packets, capture->nb_packets + 1, sizeof(AVPacket *)))) {
+        return AVERROR(ENOMEM);
+    }
+    capture->packets = packets;
+    if (!(copy = av_packet_alloc())) {
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = av_packet_ref(copy, packet)) < 0) {
+        printf("av_packet_ref failed, %s\n", av_err2str(ret));
+        av_packet_free(&copy);
+        return ret;
+    }
+    capture->packets[capture->nb_packets++] = copy;
+    return 0;
+}
+
+
+void free_shot_capture(ShotCapture **capture) {
+    int i;
+    if (!*capture) {
+        return;
+    }
+    for (i = 0; i < (*capture)->nb_packets; ++i) {
+        av_packet_free(&((*capture)->packets[i]));
+    }
+    av_freep(&((*capture)->packets));
+    avcodec_parameters_free(&((*capture)->codecpar));
+    av_freep(capture);
+}
+
+
+static void write_rational(AVIOContext *pb, AVRational rational) {
+    avio_wb32(pb, (unsigned int) rational.num);
+    avio_wb32(pb, (unsigned int) rational.den);
+}
+
+
+static AVRational read_rational(AVIOContext *pb) {
+    AVRational rational;
+    rational.num = (int) avio_rb32(pb);
+    rational.den = (int) avio_rb32(pb);
+    return rational;
+}
+
+
+/**
+ * 序列化抓取结果，解码参数只保存视频解码需要的字段，包的side data不保存
+ * @param capture
+ * @param blob 返回的数据，需av_free
+ * @param size
+ * @return
+ */
+int serialize_shot_capture(const ShotCapture *capture, uint8_t **blob, int *size) {
+    const AVCodecParameters *par = capture->codecpar;
+    AVIOContext *pb = NULL;
+    int ret, i;
+    if ((ret = avio_open_dyn_buf(&pb)) < 0) {
+        printf("avio_open_dyn_buf failed, %s\n", av_err2str(ret));
+        return ret;
+    }
+    avio_wb32(pb, SHOT_CAPTURE_MAGIC);
+    avio_wb32(pb, SHOT_CAPTURE_VERSION);
+    // 解码参数
+    avio_wb32(pb, (unsigned int) par->codec_type);
+    avio_wb32(pb, (unsigned int) par->codec_id);
+    avio_wb32(pb, par->codec_tag);
+    avio_wb32(pb, (unsigned int) par->format);
+    avio_wb32(pb, (unsigned int) par->width);
+    avio_wb32(pb, (unsigned int) par->height);
+    avio_wb32(pb, (unsigned int) par->profile);
+    avio_wb32(pb, (unsigned int) par->level);
+    avio_wb64(pb, (uint64_t) par->bit_rate);
+    avio_wb32(pb, (unsigned int) par->bits_per_coded_sample);
+    avio_wb32(pb, (unsigned int) par->bits_per_raw_sample);
+    write_rational(pb, par->sample_aspect_ratio);
+    avio_wb32(pb, (unsigned int) par->field_order);
+    avio_wb32(pb, (unsigned int) par->color_range);
+    avio_wb32(pb, (unsigned int) par->color_primaries);
+    avio_wb32(pb, (unsigned int) par->color_trc);
+    avio_wb32(pb, (unsigned int) par->color_space);
+    avio_wb32(pb, (unsigned int) par->chroma_location);
+    avio_wb32(pb, (unsigned int) par->video_delay);
+    avio_wb32(pb, (unsigned int) par->extradata_size);
+    avio_write(pb, par->extradata, par->extradata_size);
+    // 时间信息
+    write_rational(pb, capture->time_base);
+    write_rational(pb, capture->framerate);
+    avio_wb64(pb, (uint64_t) capture->start_time);
+    avio_wb64(pb, (uint64_t) capture->position);
+    avio_wb32(pb, (unsigned int) capture->random_access);
+    avio_wb32(pb, (unsigned int) capture->recovery_frames);
+    avio_wb32(pb, (unsigned int) capture->skipped_packets);
+    avio_wb32(pb, (unsigned int) capture->elapsed);
+    // 包
+    avio_wb32(pb, (unsigned int) capture->nb_packets);
+    for (i = 0; i < capture->nb_packets; ++i) {
+        const AVPacket *packet = capture->packets[i];
+        avio_wb64(pb, (uint64_t) packet->pts);
+        avio_wb64(pb, (uint64_t) packet->dts);
+        avio_wb64(pb, (uint64_t) packet->duration);
+        avio_wb32(pb, (unsigned int) packet->flags);
+        avio_wb32(pb, (unsigned int) packet->size);
+        avio_write(pb, packet->data, packet->size);
+    }
+    *size = avio_close_dyn_buf(pb, blob);
+    if (!*blob) {
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+
+/**
+ * 解析serialize_shot_capture的数据，extradata和包数据都会复制
+ * @param blob
+ * @param size
+ * @param capture 返回的抓取结果，需free_shot_capture
+ * @return
+ */
+int parse_shot_capture(const uint8_t *blob, int size, ShotCapture **capture) {
+    AVIOContext *pb = open_buffer_read_avio(blob, size, 0);
+    AVCodecParameters *par;
+    AVPacket *packet = NULL;
+    int64_t pts, dts, duration;
+    int ret = AVERROR_INVALIDDATA, i, nb_packets, packet_size, flags;
+    *capture = NULL;
+    if (!pb) {
+        return AVERROR(ENOMEM);
+    }
+    if (avio_rb32(pb) != SHOT_CAPTURE_MAGIC || avio_rb32(pb) != SHOT_CAPTURE_VERSION) {
+        printf("invalid shot capture blob\n");
+        goto end;
+    }
+    if (!(*capture = alloc_shot_capture(NULL))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    par = (*capture)->codecpar;
+    par->codec_type = (enum AVMediaType) avio_rb32(pb);
+    par->codec_id = (enum AVCodecID) avio_rb32(pb);
+    par->codec_tag = avio_rb32(pb);
+    par->format = (int) avio_rb32(pb);
+    par->width = (int) avio_rb32(pb);
+    par->height = (int) avio_rb32(pb);
+    par->profile = (int) avio_rb32(pb);
+    par->level = (int) avio_rb32(pb);
+    par->bit_rate = (int64_t) avio_rb64(pb);
+    par->bits_per_coded_sample = (int) avio_rb32(pb);
+    par->bits_per_raw_sample = (int) avio_rb32(pb);
+    par->sample_aspect_ratio = read_rational(pb);
+    par->field_order = (enum AVFieldOrder) avio_rb32(pb);
+    par->color_range = (enum AVColorRange) avio_rb32(pb);
+    par->color_primaries = (enum AVColorPrimaries) avio_rb32(pb);
+    par->color_trc = (enum AVColorTransferCharacteristic) avio_rb32(pb);
+    par->color_space = (enum AVColorSpace) avio_rb32(pb);
+    par->chroma_location = (enum AVChromaLocation) avio_rb32(pb);
+    par->video_delay = (int) avio_rb32(pb);
+    par->extradata_size = (int) avio_rb32(pb);
+    if (par->extradata_size < 0 || par->extradata_size > size) {
+        par->extradata_size = 0;
+        goto end;
+    }
+    if (par->extradata_size > 0) {
+        if (!(par->extradata = (uint8_t *) av_mallocz(par->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE))) {
+            par->extradata_size = 0;
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        avio_read(pb, par->extradata, par->extradata_size);
+    }
+    (*capture)->time_base = read_rational(pb);
+    (*capture)->framerate = read_rational(pb);
+    (*capture)->start_time = (int64_t) avio_rb64(pb);
+    (*capture)->position = (int64_t) avio_rb64(pb);
+    (*capture)->random_access = (int) avio_rb32(pb);
+    (*capture)->recovery_frames = (int) avio_rb32(pb);
+    (*capture)->skipped_packets = (int) avio_rb32(pb);
+    (*capture)->elapsed = (int) avio_rb32(pb);
+    nb_packets = (int) avio_rb32(pb);
+    if (nb_packets <= 0 || nb_packets > SHOT_CAPTURE_MAX_PACKETS + 1) {
+        goto end;
+    }
+    for (i = 0; i < nb_packets; ++i) {
+        if (!(packet = av_packet_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        pts = (int64_t) avio_rb64(pb);
+        dts = (int64_t) avio_rb64(pb);
+        duration = (int64_t) avio_rb64(pb);
+        flags = (int) avio_rb32(pb);
+        packet_size = (int) avio_rb32(pb);
+        // av_new_packet会重置时间戳和flags，分配之后再设置
+        if (packet_size <= 0 || packet_size > FFMIN(size, SHOT_CAPTURE_MAX_PACKET_SIZE) ||
+            (ret = av_new_packet(packet, packet_size)) < 0 || avio_read(pb, packet->data, packet_size) != packet_size) {
+            ret = ret < 0 ? ret : AVERROR_INVALIDDATA;
+            goto end;
+        }
+        packet->pts = pts;
+        packet->dts = dts;
+        packet->duration = duration;
+        packet->flags = flags;
+        if ((ret = add_shot_capture_packet(*capture, packet)) < 0) {
+            goto end;
+        }
+        av_packet_free(&packet);
+    }
+    ret = pb->eof_reached ? AVERROR_INVALIDDATA : 0;
+    end:
+    if (ret < 0) {
+        printf("parse shot capture failed, %s\n", av_err2str(ret));
+        free_shot_capture(capture);
+    }
+    av_packet_free(&packet);
+    close_custom_avio(&pb);
+    return ret;
+}
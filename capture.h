@@ -0,0 +1,35 @@
+#include <libavformat/avformat.h>
+
+#define SHOT_CAPTURE_MAGIC MKBETAG('S', 'C', 'A', 'P')
+#define SHOT_CAPTURE_VERSION 1
+#define SHOT_CAPTURE_MAX_PACKETS 256 // recovery point之后最多抓取的包数
+#define SHOT_CAPTURE_MAX_PACKET_SIZE (64 * 1024 * 1024)
+
+/**
+ * 截图所需的最小包集合：视频流的解码参数、从随机访问点开始的视频包和时间信息
+ * 网络抓取与解码分离时由抓取端序列化，在其他进程或机器上解析后解码
+ * 包的时间戳以time_base为单位
+ */
+typedef struct ShotCapture {
+    AVCodecParameters *codecpar;
+    AVRational time_base;
+    AVRational framerate;
+    int64_t start_time; // 视频流的起始时间，AV_NOPTS_VALUE为未知
+    int64_t position; // 请求的截图时间点，单位ms
+    int random_access; // RandomAccessType
+    int recovery_frames; // recovery point之后需丢弃的帧数
+    int skipped_packets; // 随机访问点之前跳过的包
+    int elapsed; // 抓取耗时，单位ms
+    AVPacket **packets;
+    int nb_packets;
+} ShotCapture;
+
+ShotCapture *alloc_shot_capture(const AVCodecParameters *codecpar);
+
+int add_shot_capture_packet(ShotCapture *capture, const AVPacket *packet);
+
+void free_shot_capture(ShotCapture **capture);
+
+int serialize_shot_capture(const ShotCapture *capture, uint8_t **blob, int *size);
+
+int parse_shot_capture(const uint8_t *blob, int size, ShotCapture **capture);
@@ -0,0 +1,238 @@
+//
+// 输出文件先写临时文件再原子rename，按持久化方式合并fsync
+//
+#include "commit.h"
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static unsigned int temp_counter = 0;
+
+
+/**
+ * 生成与目标同目录的临时文件路径，rename不会跨文件系统
+ * @param path
+ * @return 需av_free
+ */
+char *make_temp_path(const char *path) {
+    return av_asprintf("%s.%d.%u.tmp", path, (int) getpid(), __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED));
+}
+
+
+/**
+ * 打开文件或目录并fsync
+ * @param path
+ * @param data_only 非0时fdatasync
+ * @return
+ */
+static int sync_path(const char *path, int data_only) {
+    int fd, ret = 0;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return AVERROR(errno);
+    }
+    if ((data_only ? fdatasync(fd) : fsync(fd)) < 0) {
+        ret = AVERROR(errno);
+    }
+    close(fd);
+    return ret;
+}
+
+
+/**
+ * fsync文件所在目录，使rename持久化
+ * @param path
+ * @return
+ */
+static int sync_parent_dir(const char *path) {
+    char *dir = av_strdup(path), *slash;
+    int ret;
+    if (!dir) {
+        return AVERROR(ENOMEM);
+    }
+    if ((slash = strrchr(dir, '/'))) {
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+    ret = sync_path(slash ? dir : ".", 0);
+    av_free(dir);
+    return ret;
+}
+
+
+/**
+ * 提交写完的临时文件
+ * @param temp_path make_temp_path生成，提交或加入group后由本函数释放
+ * @param path 最终路径
+ * @param durability Durability
+ * @param group DURABILITY_GROUP_COMMIT时加入的批次，为NULL时退化为DURABILITY_FDATASYNC
+ * @return
+ */
+int commit_output_file(char *temp_path, const char *path, int durability, CommitGroup *group) {
+    int ret = 0;
+    if (durability == DURABILITY_GROUP_COMMIT && group) {
+        pthread_mutex_lock(&(group->mutex));
+        if (group->nb_files == group->nb_allocated) {
+            // 扩容失败时保留原数组，已排队的文件仍可提交
+            int nb_allocated = group->nb_allocated ? group->nb_allocated * 2 : 64;
+            char **temp_paths, **paths;
+            if ((temp_paths = (char **) av_realloc_array(group->temp_paths, nb_allocated, sizeof(char *)))) {
+                group->temp_paths = temp_paths;
+            }
+            if ((paths = (char **) av_realloc_array(group->paths, nb_allocated, sizeof(char *)))) {
+                group->paths = paths;
+            }
+            if (temp_paths && paths) {
+                group->nb_allocated = nb_allocated;
+            } else {
+                ret = AVERROR(ENOMEM);
+            }
+        }
+        if (ret == 0) {
+            group->temp_paths[group->nb_files] = temp_path;
+            group->paths[group->nb_files] = av_strdup(path);
+            group->nb_files++;
+        }
+        pthread_mutex_unlock(&(group->mutex));
+        if (ret < 0) {
+            printf("queue commit failed, %s: %s\n", path, av_err2str(ret));
+            unlink(temp_path);
+            av_free(temp_path);
+        }
+        return ret;
+    }
+    if (durability != DURABILITY_NONE && (ret = sync_path(temp_path, 1)) < 0) {
+        printf("fdatasync failed, %s: %s\n", temp_path, av_err2str(ret));
+    } else if (rename(temp_path, path) < 0) {
+        ret = AVERROR(errno);
+        printf("rename failed, %s: %s\n", path, av_err2str(ret));
+    } else if (durability != DURABILITY_NONE) {
+        ret = sync_parent_dir(path);
+    }
+    if (ret < 0) {
+        unlink(temp_path);
+    }
+    av_free(temp_path);
+    return ret;
+}
+
+
+/**
+ * 截图失败时删除临时文件
+ * @param temp_path
+ */
+void abort_output_file(char **temp_path) {
+    if (!*temp_path) {
+        return;
+    }
+    unlink(*temp_path);
+    av_freep(temp_path);
+}
+
+
+CommitGroup *create_commit_group(void) {
+    CommitGroup *group = (CommitGroup *) calloc(1, sizeof(CommitGroup));
+    if (group) {
+        pthread_mutex_init(&(group->mutex), NULL);
+    }
+    return group;
+}
+
+
+/**
+ * 提交一批文件：逐个fdatasync临时文件后rename，所有rename完成后每个目录fsync一次
+ * fdatasync失败的文件不rename，目录fsync失败时该目录下的文件计为失败
+ * @param group
+ * @return 失败的文件数，未rename的临时文件被删除
+ */
+int flush_commit_group(CommitGroup *group) {
+    char **dirs = NULL, *slash;
+    int *file_dirs = NULL;
+    int i, j, nb_files, nb_dirs = 0, nb_failed = 0;
+    pthread_mutex_lock(&(group->mutex));
+    if ((nb_files = group->nb_files) == 0) {
+        pthread_mutex_unlock(&(group->mutex));
+        return 0;
+    }
+    file_dirs = (int *) calloc(nb_files, sizeof(int));
+    dirs = (char **) calloc(nb_files, sizeof(char *));
+    for (i = 0; i < nb_files; ++i) {
+        int ret = 0;
+        if (!file_dirs || !dirs || !group->paths[i]) { // 无法记录目录时整批放弃
+            ret = AVERROR(ENOMEM);
+        } else if ((ret = sync_path(group->temp_paths[i], 1)) < 0) {
+            printf("fdatasync failed, %s: %s\n", group->temp_paths[i], av_err2str(ret));
+        } else if (rename(group->temp_paths[i], group->paths[i]) < 0) {
+            ret = AVERROR(errno);
+        }
+        if (ret < 0) {
+            printf("commit failed, %s: %s\n", group->paths[i] ? group->paths[i] : "", av_err2str(ret));
+            unlink(group->temp_paths[i]);
+            if (file_dirs) {
+                file_dirs[i] = -1;
+            }
+            nb_failed++;
+        } else {
+            char *dir = av_strdup(group->paths[i]);
+            if (dir && (slash = strrchr(dir, '/'))) {
+                slash[slash == dir ? 1 : 0] = '\0';
+            } else if (dir) {
+                av_freep(&dir);
+                dir = av_strdup(".");
+            }
+            for (j = 0; dir && j < nb_dirs && strcmp(dirs[j], dir); ++j);
+            if (!dir) { // 无法fsync目录，rename不保证持久化
+                file_dirs[i] = -1;
+                nb_failed++;
+            } else if (j == nb_dirs) {
+                dirs[nb_dirs++] = dir;
+            } else {
+                av_free(dir);
+            }
+            if (dir) {
+                file_dirs[i] = j;
+            }
+        }
+        av_freep(&(group->temp_paths[i]));
+        av_freep(&(group->paths[i]));
+    }
+    group->nb_files = 0;
+    pthread_mutex_unlock(&(group->mutex));
+    for (i = 0; i < nb_dirs; ++i) {
+        if (sync_path(dirs[i], 0) < 0) {
+            printf("fsync dir failed, %s\n", dirs[i]);
+            for (j = 0; j < nb_files; ++j) {
+                nb_failed += file_dirs[j] == i;
+            }
+        }
+        av_free(dirs[i]);
+    }
+    free(dirs);
+    free(file_dirs);
+    return nb_failed;
+}
+
+
+/**
+ * 提交剩余文件并释放
+ * @param group
+ * @return 失败的文件数
+ */
+int free_commit_group(CommitGroup **group) {
+    int ret;
+    if (!*group) {
+        return 0;
+    }
+    ret = flush_commit_group(*group);
+    av_free((*group)->temp_paths);
+    av_free((*group)->paths);
+    pthread_mutex_destroy(&((*group)->mutex));
+    free(*group);
+    *group = NULL;
+    return ret;
+}
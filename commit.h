@@ -0,0 +1,33 @@
+#include <pthread.h>
+
+/**
+ * 输出文件的持久化方式，输出总是先写临时文件再rename
+ */
+typedef enum Durability {
+    DURABILITY_NONE = 0, // 只rename，崩溃后可能丢失但不会出现截断的文件
+    DURABILITY_FDATASYNC, // 每个文件fdatasync，rename后fsync目录
+    DURABILITY_GROUP_COMMIT, // rename推迟到flush_commit_group，逐个fdatasync后rename，每个目录只fsync一次
+} Durability;
+
+/**
+ * 一批等待提交的输出文件，多线程共用时由mutex串行
+ */
+typedef struct CommitGroup {
+    pthread_mutex_t mutex;
+    char **temp_paths;
+    char **paths;
+    int nb_files;
+    int nb_allocated;
+} CommitGroup;
+
+char *make_temp_path(const char *path);
+
+int commit_output_file(char *temp_path, const char *path, int durability, CommitGroup *group);
+
+void abort_output_file(char **temp_path);
+
+CommitGroup *create_commit_group(void);
+
+int flush_commit_group(CommitGroup *group);
+
+int free_commit_group(CommitGroup **group);
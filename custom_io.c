@@ -0,0 +1,905 @@
+//
+// 自定义AVIOContext，用于直接读写调用方提供的fd、回调
+//
+#include "custom_io.h"
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define LOCAL_IO_PREFETCH 8 // 随机读取时预读的buffer_size个数
+#define LOCAL_IO_DIRECT_READ 0 // io_uring请求的user_data：读入调用方缓冲
+#define LOCAL_IO_PREFETCH_READ 1 // io_uring请求的user_data：预读
+#define HTTP_RANGE_MIN_SIZE HTTP_POOL_MAX_DRAIN // seek后第一段可以读完放回连接池
+#define HTTP_RANGE_MAX_SIZE (8 * 1024 * 1024)
+
+typedef struct BufferSource {
+    const uint8_t *data;
+    int64_t size;
+    int64_t pos;
+} BufferSource;
+
+
+typedef struct CallbackSource {
+    ShotReadCallback read_cb;
+    ShotSeekCallback seek_cb;
+    void *opaque;
+} CallbackSource;
+
+
+/**
+ * 不可seek的fd输入，同时按顶层box扫描mp4数据，moov位于mdat之后时需要回退seek，直接报错
+ */
+typedef struct FdSource {
+    int fd;
+    int read_timeout;
+    int64_t pos;
+    int scan_done;
+    int64_t next_box;
+    uint8_t box_header[16];
+    int box_header_len;
+} FdSource;
+
+
+/**
+ * 不依赖liburing的最小io_uring封装，只用于读取
+ */
+typedef struct IoUring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} IoUring;
+
+
+/**
+ * 本地文件输入：顺序读取(探测、从头解复用)直接从mmap复制
+ * seek之后的随机读取由io_uring直接读入调用方的缓冲，同一次提交中异步预读之后的一段，解复用时预读在后台完成
+ * 每种请求同时最多一个，按user_data区分，完成前不会复用对应的缓冲
+ */
+typedef struct LocalFileSource {
+    int fd;
+    uint8_t *map;
+    int64_t size;
+    int64_t pos;
+    int random; // 发生过非顺序seek
+    IoUring *ring; // 为NULL时随机读取也走mmap
+    int chunk_size;
+    struct iovec iovs[2]; // 提交中的请求，按user_data索引，完成前保持有效
+    int direct_pending;
+    int direct_result;
+    uint8_t *prefetch;
+    int64_t prefetch_pos;
+    int prefetch_len; // 预读完成的字节数
+    int prefetch_pending;
+} LocalFileSource;
+
+
+/**
+ * 通过连接池按Range分段读取的http输入，连续读取时分段逐步加倍，seek后从最小分段重新开始
+ */
+typedef struct HttpSource {
+    HttpPool *pool;
+    char *url;
+    HttpConnection *conn;
+    HttpResponse response;
+    int64_t size;
+    int64_t pos;
+    int64_t range_size;
+} HttpSource;
+
+
+typedef struct WriteTarget {
+    int fd;
+    ShotWriteCallback write_cb;
+    void *opaque;
+} WriteTarget;
+
+
+/**
+ * 写入fd，处理EINTR和部分写入
+ * @param fd
+ * @param buf
+ * @param buf_size
+ * @return 写入字节数或AVERROR
+ */
+static int write_fd_fully(int fd, const uint8_t *buf, int buf_size) {
+    int written = 0;
+    ssize_t n;
+    while (written < buf_size) {
+        n = write(fd, buf + written, buf_size - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        written += n;
+    }
+    return written;
+}
+
+
+static int write_packet(void *opaque, uint8_t *buf, int buf_size) {
+    WriteTarget *target = (WriteTarget *) opaque;
+    if (target->write_cb) {
+        return target->write_cb(target->opaque, buf, buf_size);
+    }
+    return write_fd_fully(target->fd, buf, buf_size);
+}
+
+
+/**
+ * 用opaque和读写函数创建AVIOContext，失败时释放opaque
+ */
+static AVIOContext *alloc_custom_avio(void *opaque, int buffer_size, int write_flag,
+                                      int (*read_packet)(void *opaque, uint8_t *buf, int buf_size),
+                                      int (*write_packet)(void *opaque, uint8_t *buf, int buf_size),
+                                      int64_t (*seek)(void *opaque, int64_t offset, int whence)) {
+    AVIOContext *pb = NULL;
+    uint8_t *buffer = NULL;
+    if (buffer_size <= 0) {
+        buffer_size = DEFAULT_AVIO_BUFFER_SIZE;
+    }
+    buffer = (uint8_t *) av_malloc(buffer_size);
+    if (!opaque || !buffer) {
+        printf("av_malloc avio buffer failed\n");
+        goto fail;
+    }
+    pb = avio_alloc_context(buffer, buffer_size, write_flag, opaque, read_packet, write_packet, seek);
+    if (!pb) {
+        printf("avio_alloc_context failed\n");
+        goto fail;
+    }
+    return pb;
+    fail:
+    av_free(opaque);
+    av_free(buffer);
+    return NULL;
+}
+
+
+/**
+ * 打开写入fd或回调的AVIOContext，使用direct模式，packet数据不经过avio缓冲直接写出
+ * @param fd write_cb为NULL时写入的fd
+ * @param write_cb 写回调，返回写入字节数或负数错误码
+ * @param opaque 写回调的参数
+ * @param buffer_size avio缓冲大小，<=0时使用默认值
+ * @return 失败返回NULL
+ */
+AVIOContext *open_write_avio(int fd, ShotWriteCallback write_cb, void *opaque, int buffer_size) {
+    AVIOContext *pb;
+    WriteTarget *target = (WriteTarget *) av_mallocz(sizeof(WriteTarget));
+    if (target) {
+        target->fd = fd;
+        target->write_cb = write_cb;
+        target->opaque = opaque;
+    }
+    pb = alloc_custom_avio(target, buffer_size, 1, NULL, write_packet, NULL);
+    if (pb) {
+        pb->direct = 1;
+        pb->seekable = 0;
+    }
+    return pb;
+}
+
+
+static int read_buffer(void *opaque, uint8_t *buf, int buf_size) {
+    BufferSource *source = (BufferSource *) opaque;
+    int64_t left = source->size - source->pos;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+    if (buf_size > left) {
+        buf_size = (int) left;
+    }
+    memcpy(buf, source->data + source->pos, buf_size);
+    source->pos += buf_size;
+    return buf_size;
+}
+
+
+static int64_t seek_buffer(void *opaque, int64_t offset, int whence) {
+    BufferSource *source = (BufferSource *) opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return source->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = source->pos + offset;
+            break;
+        case SEEK_END:
+            pos = source->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > source->size) {
+        return AVERROR(EINVAL);
+    }
+    source->pos = pos;
+    return pos;
+}
+
+
+/**
+ * 打开读取内存数据的AVIOContext，直接引用调用方的内存，关闭前调用方需保证数据有效
+ * @param data
+ * @param size
+ * @param buffer_size avio缓冲大小，<=0时使用默认值
+ * @return 失败返回NULL
+ */
+AVIOContext *open_buffer_read_avio(const uint8_t *data, int64_t size, int buffer_size) {
+    AVIOContext *pb;
+    BufferSource *source = (BufferSource *) av_mallocz(sizeof(BufferSource));
+    if (source) {
+        source->data = data;
+        source->size = size;
+    }
+    pb = alloc_custom_avio(source, buffer_size, 0, read_buffer, NULL, seek_buffer);
+    if (pb) {
+        pb->seekable = AVIO_SEEKABLE_NORMAL;
+    }
+    return pb;
+}
+
+
+/**
+ * 扫描流经的mp4顶层box，在moov之前遇到mdat时返回错误
+ * @param source
+ * @param buf 本次读到的数据，起始位置为source->pos
+ * @param size
+ * @return
+ */
+static int scan_mp4_boxes(FdSource *source, const uint8_t *buf, int size) {
+    int64_t end = source->pos + size, box_size;
+    int offset, need, header_size;
+    while (!source->scan_done && source->next_box + source->box_header_len < end) {
+        offset = (int) (source->next_box + source->box_header_len - source->pos);
+        header_size = source->box_header_len >= 8 && AV_RB32(source->box_header) == 1 ? 16 : 8;
+        need = FFMIN(header_size - source->box_header_len, size - offset);
+        memcpy(source->box_header + source->box_header_len, buf + offset, need);
+        source->box_header_len += need;
+        if (source->box_header_len < 8 ||
+            (AV_RB32(source->box_header) == 1 && source->box_header_len < 16)) {
+            continue;
+        }
+        box_size = AV_RB32(source->box_header);
+        if (box_size == 1) {
+            box_size = (int64_t) AV_RB64(source->box_header + 8);
+        }
+        if (source->next_box == 0 && memcmp(source->box_header + 4, "ftyp", 4)) {
+            source->scan_done = 1; // 非mp4数据
+            break;
+        }
+        if (!memcmp(source->box_header + 4, "moov", 4)) {
+            source->scan_done = 1;
+            break;
+        }
+        if (!memcmp(source->box_header + 4, "mdat", 4)) {
+            printf("mp4 moov is after mdat, can not seek back on non-seekable input\n");
+            return AVERROR(ESPIPE);
+        }
+        if (box_size < source->box_header_len) { // size为0(到文件尾)或非法的box
+            source->scan_done = 1;
+            break;
+        }
+        source->next_box += box_size;
+        source->box_header_len = 0;
+    }
+    return 0;
+}
+
+
+static int read_fd(void *opaque, uint8_t *buf, int buf_size) {
+    FdSource *source = (FdSource *) opaque;
+    struct pollfd pfd;
+    ssize_t n;
+    int ret;
+    while (true) {
+        if (source->read_timeout > 0) {
+            pfd.fd = source->fd;
+            pfd.events = POLLIN;
+            ret = poll(&pfd, 1, source->read_timeout);
+            if (ret == 0) {
+                printf("read fd timeout\n");
+                return AVERROR(ETIMEDOUT);
+            } else if (ret < 0 && errno != EINTR) {
+                return AVERROR(errno);
+            } else if (ret < 0) {
+                continue;
+            }
+        }
+        n = read(source->fd, buf, buf_size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+    if (n < 0) {
+        return AVERROR(errno);
+    }
+    if (n == 0) {
+        return AVERROR_EOF;
+    }
+    if ((ret = scan_mp4_boxes(source, buf, (int) n)) < 0) {
+        return ret;
+    }
+    source->pos += n;
+    return (int) n;
+}
+
+
+/**
+ * 打开读取管道、socket等不可seek fd的AVIOContext，不关闭调用方的fd
+ * 探测所需的缓冲由probesize限定，mp4的moov在mdat之后时立即失败而不是读完整个输入
+ * @param fd
+ * @param read_timeout 单次读取等待数据的超时，单位ms，<=0时一直等待
+ * @param buffer_size avio缓冲大小，<=0时使用默认值
+ * @return 失败返回NULL
+ */
+AVIOContext *open_fd_read_avio(int fd, int read_timeout, int buffer_size) {
+    AVIOContext *pb;
+    FdSource *source = (FdSource *) av_mallocz(sizeof(FdSource));
+    if (source) {
+        source->fd = fd;
+        source->read_timeout = read_timeout;
+    }
+    pb = alloc_custom_avio(source, buffer_size, 0, read_fd, NULL, NULL);
+    if (pb) {
+        pb->seekable = 0;
+    }
+    return pb;
+}
+
+
+static void free_io_uring(IoUring **ring) {
+    if (!*ring) {
+        return;
+    }
+    if ((*ring)->sqes && (*ring)->sqes != MAP_FAILED) {
+        munmap((*ring)->sqes, (*ring)->sqes_size);
+    }
+    if ((*ring)->cq_ring && (*ring)->cq_ring != MAP_FAILED && (*ring)->cq_ring != (*ring)->sq_ring) {
+        munmap((*ring)->cq_ring, (*ring)->cq_ring_size);
+    }
+    if ((*ring)->sq_ring && (*ring)->sq_ring != MAP_FAILED) {
+        munmap((*ring)->sq_ring, (*ring)->sq_ring_size);
+    }
+    if ((*ring)->fd >= 0) {
+        close((*ring)->fd);
+    }
+    av_freep(ring);
+}
+
+
+/**
+ * 创建io_uring并映射提交、完成队列，内核不支持时返回NULL
+ * @param entries 队列深度
+ * @return
+ */
+static IoUring *alloc_io_uring(unsigned entries) {
+    struct io_uring_params params;
+    IoUring *ring = (IoUring *) av_mallocz(sizeof(IoUring));
+    if (!ring) {
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+        printf("io_uring_setup failed, %s\n", av_err2str(AVERROR(errno)));
+        goto fail;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = ring->cq_ring_size = FFMAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+    ring->sq_head = (unsigned *) ((uint8_t *) ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((uint8_t *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((uint8_t *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((uint8_t *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((uint8_t *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((uint8_t *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((uint8_t *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((uint8_t *) ring->cq_ring + params.cq_off.cqes);
+    return ring;
+    fail:
+    free_io_uring(&ring);
+    return NULL;
+}
+
+
+/**
+ * 在提交队列尾部加入一个读请求，由reap_local_reads提交
+ * @param source
+ * @param user_data LOCAL_IO_DIRECT_READ或LOCAL_IO_PREFETCH_READ
+ * @param buf
+ * @param size
+ * @param offset
+ */
+static void queue_local_read(LocalFileSource *source, int user_data, uint8_t *buf, int size, int64_t offset) {
+    IoUring *ring = source->ring;
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    source->iovs[user_data].iov_base = buf;
+    source->iovs[user_data].iov_len = (size_t) size;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV; // IORING_OP_READ需要5.6内核
+    sqe->fd = source->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &(source->iovs[user_data]);
+    sqe->len = 1;
+    sqe->off = (uint64_t) offset;
+    sqe->user_data = (uint64_t) user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (user_data == LOCAL_IO_DIRECT_READ) {
+        source->direct_pending = 1;
+    } else {
+        source->prefetch_pending = 1;
+    }
+}
+
+
+/**
+ * 提交排队的请求并收割完成事件
+ * @param source
+ * @param pending 等待该标志清零，为NULL时不等待
+ * @return
+ */
+static int reap_local_reads(LocalFileSource *source, const int *pending) {
+    IoUring *ring = source->ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, submit;
+    int ret;
+    do {
+        submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        ret = (int) syscall(__NR_io_uring_enter, ring->fd, submit, pending && *pending ? 1 : 0,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return AVERROR(errno);
+        }
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data == LOCAL_IO_DIRECT_READ) {
+                source->direct_result = cqe->res;
+                source->direct_pending = 0;
+            } else if (cqe->user_data == LOCAL_IO_PREFETCH_READ) {
+                source->prefetch_len = FFMAX(cqe->res, 0);
+                source->prefetch_pending = 0;
+            }
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    } while (pending && *pending);
+    return 0;
+}
+
+
+/**
+ * 等待所有提交的请求完成后释放io_uring，之后随机读取走mmap
+ * @param source
+ */
+static void close_local_io_uring(LocalFileSource *source) {
+    int ret;
+    if (!source->ring) {
+        return;
+    }
+    if ((ret = reap_local_reads(source, &(source->direct_pending))) < 0 ||
+        (ret = reap_local_reads(source, &(source->prefetch_pending))) < 0) {
+        // 关闭io_uring时内核会取消并等待未完成的请求
+        printf("io_uring drain failed, %s\n", av_err2str(ret));
+    }
+    free_io_uring(&(source->ring));
+}
+
+
+/**
+ * 预读从pos开始的一段，上一次预读完成前不提交
+ * @param source
+ * @param pos
+ */
+static void queue_local_prefetch(LocalFileSource *source, int64_t pos) {
+    if (source->prefetch_pending || pos >= source->size) {
+        return;
+    }
+    source->prefetch_pos = pos;
+    source->prefetch_len = 0;
+    queue_local_read(source, LOCAL_IO_PREFETCH_READ, source->prefetch,
+                     (int) FFMIN((int64_t) source->chunk_size * LOCAL_IO_PREFETCH, source->size - pos), pos);
+}
+
+
+/**
+ * 随机读取：命中预读时从预读缓冲复制，否则直接读入buf并在同一次提交中预读之后的一段
+ * @param source
+ * @param buf
+ * @param buf_size
+ * @return 读取字节数或AVERROR
+ */
+static int read_local_file_random(LocalFileSource *source, uint8_t *buf, int buf_size) {
+    int64_t prefetch_end = source->prefetch_pos + (int64_t) source->chunk_size * LOCAL_IO_PREFETCH;
+    int ret;
+    if (source->prefetch_pending && source->pos >= source->prefetch_pos && source->pos < prefetch_end &&
+        (ret = reap_local_reads(source, &(source->prefetch_pending))) < 0) {
+        return ret;
+    }
+    prefetch_end = source->prefetch_pos + source->prefetch_len;
+    if (!source->prefetch_pending && source->pos >= source->prefetch_pos && source->pos < prefetch_end) {
+        buf_size = (int) FFMIN(buf_size, prefetch_end - source->pos);
+        memcpy(buf, source->prefetch + (source->pos - source->prefetch_pos), buf_size);
+        if (source->pos + buf_size == prefetch_end) { // 读完预读的数据后继续预读下一段
+            queue_local_prefetch(source, prefetch_end);
+            if ((ret = reap_local_reads(source, NULL)) < 0) {
+                return ret;
+            }
+        }
+        return buf_size;
+    }
+    queue_local_read(source, LOCAL_IO_DIRECT_READ, buf, buf_size, source->pos);
+    queue_local_prefetch(source, source->pos + buf_size);
+    if ((ret = reap_local_reads(source, &(source->direct_pending))) < 0) {
+        return ret;
+    }
+    return source->direct_result;
+}
+
+
+static int read_local_file(void *opaque, uint8_t *buf, int buf_size) {
+    LocalFileSource *source = (LocalFileSource *) opaque;
+    int64_t left = source->size - source->pos;
+    int ret;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+    if (buf_size > left) {
+        buf_size = (int) left;
+    }
+    if (source->random && source->ring) {
+        if ((ret = read_local_file_random(source, buf, buf_size)) < 0) {
+            // io_uring出错后关闭，之后的读取和本次读取都走mmap
+            printf("io_uring read failed, %s, fallback to mmap\n", av_err2str(ret));
+            close_local_io_uring(source);
+        } else if (ret == 0) {
+            return AVERROR_EOF;
+        } else {
+            source->pos += ret;
+            return ret;
+        }
+    }
+    memcpy(buf, source->map + source->pos, buf_size);
+    source->pos += buf_size;
+    return buf_size;
+}
+
+
+static int64_t seek_local_file(void *opaque, int64_t offset, int whence) {
+    LocalFileSource *source = (LocalFileSource *) opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return source->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = source->pos + offset;
+            break;
+        case SEEK_END:
+            pos = source->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > source->size) {
+        return AVERROR(EINVAL);
+    }
+    // 跳出顺序预读范围后改为随机读取，关闭mmap的预读
+    if (!source->random && (pos < source->pos || pos > source->pos + source->chunk_size * LOCAL_IO_PREFETCH)) {
+        source->random = 1;
+        madvise(source->map, (size_t) source->size, MADV_RANDOM);
+    }
+    if (source->random && !source->ring) {
+        madvise(source->map + (pos & ~(int64_t) (getpagesize() - 1)),
+                (size_t) FFMIN((int64_t) source->chunk_size * LOCAL_IO_PREFETCH, source->size - pos), MADV_WILLNEED);
+    }
+    source->pos = pos;
+    return pos;
+}
+
+
+static void free_local_file_source(LocalFileSource *source) {
+    if (source->map && source->map != MAP_FAILED) {
+        munmap(source->map, (size_t) source->size);
+    }
+    if (source->fd >= 0) {
+        close(source->fd);
+    }
+    close_local_io_uring(source);
+    av_freep(&(source->prefetch));
+}
+
+
+/**
+ * 打开读取本地文件的AVIOContext，避免file协议经avio缓冲的大量小read系统调用
+ * 文件整体mmap并按顺序读取madvise，发生非顺序seek后(定位关键帧、ts二分)由io_uring直接读入avio缓冲，
+ * 同时异步预读之后LOCAL_IO_PREFETCH个buffer_size，内核不支持io_uring时回退mmap加MADV_WILLNEED
+ * @param path
+ * @param buffer_size avio缓冲和io_uring单个读请求的大小，<=0时使用默认值，大文件批量处理时可设为1MB以上
+ * @return 失败返回NULL
+ */
+AVIOContext *open_local_file_avio(const char *path, int buffer_size) {
+    AVIOContext *pb;
+    struct stat st;
+    LocalFileSource resources, *source = (LocalFileSource *) av_mallocz(sizeof(LocalFileSource));
+    if (!source) {
+        return NULL;
+    }
+    source->chunk_size = buffer_size > 0 ? buffer_size : DEFAULT_AVIO_BUFFER_SIZE;
+    if ((source->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(source->fd, &st) < 0) {
+        printf("open local file failed, %s: %s\n", path, av_err2str(AVERROR(errno)));
+        goto fail;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size <= 0) {
+        printf("not a regular file: %s\n", path);
+        goto fail;
+    }
+    source->size = st.st_size;
+    source->map = (uint8_t *) mmap(NULL, (size_t) source->size, PROT_READ, MAP_PRIVATE, source->fd, 0);
+    if (source->map == MAP_FAILED) {
+        printf("mmap failed, %s: %s\n", path, av_err2str(AVERROR(errno)));
+        goto fail;
+    }
+    madvise(source->map, (size_t) source->size, MADV_SEQUENTIAL);
+    if ((source->ring = alloc_io_uring(2)) &&
+        !(source->prefetch = (uint8_t *) av_malloc((size_t) source->chunk_size * LOCAL_IO_PREFETCH))) {
+        free_io_uring(&(source->ring));
+    }
+    resources = *source; // alloc_custom_avio失败时会释放source
+    pb = alloc_custom_avio(source, buffer_size, 0, read_local_file, NULL, seek_local_file);
+    if (!pb) {
+        free_local_file_source(&resources);
+        return NULL;
+    }
+    pb->seekable = AVIO_SEEKABLE_NORMAL;
+    return pb;
+    fail:
+    free_local_file_source(source);
+    av_free(source);
+    return NULL;
+}
+
+
+/**
+ * 在连接池上请求从pos开始的下一段
+ * @param source
+ * @return
+ */
+static int request_http_range(HttpSource *source) {
+    int64_t end = source->pos + source->range_size - 1;
+    int ret;
+    if (source->size >= 0) {
+        end = FFMIN(end, source->size - 1);
+    }
+    if ((ret = http_pool_get(source->pool, source->url, source->pos, end, &(source->conn), &(source->response))) < 0) {
+        return ret;
+    }
+    if (source->response.total_size >= 0) {
+        source->size = source->response.total_size;
+    }
+    if (source->response.status != 206) { // 服务端不支持Range，之后的seek无法进行
+        printf("http server ignores range request: %s\n", source->url);
+        http_pool_release(source->pool, &(source->conn), &(source->response));
+        return AVERROR(ENOSYS);
+    }
+    source->range_size = FFMIN(source->range_size * 2, HTTP_RANGE_MAX_SIZE);
+    return 0;
+}
+
+
+static int read_http(void *opaque, uint8_t *buf, int buf_size) {
+    HttpSource *source = (HttpSource *) opaque;
+    int ret;
+    if (source->size >= 0 && source->pos >= source->size) {
+        return AVERROR_EOF;
+    }
+    if (source->conn && source->response.remaining <= 0) {
+        http_pool_release(source->pool, &(source->conn), &(source->response));
+    }
+    if (!source->conn && (ret = request_http_range(source)) < 0) {
+        return ret;
+    }
+    if ((ret = http_read_body(source->conn, &(source->response), buf, buf_size)) <= 0) {
+        http_pool_release(source->pool, &(source->conn), &(source->response));
+        return ret == 0 ? AVERROR_EOF : ret;
+    }
+    source->pos += ret;
+    return ret;
+}
+
+
+static int64_t seek_http(void *opaque, int64_t offset, int whence) {
+    HttpSource *source = (HttpSource *) opaque;
+    uint8_t skip[4096];
+    int64_t pos;
+    int ret;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return source->size >= 0 ? source->size : AVERROR(ENOSYS);
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = source->pos + offset;
+            break;
+        case SEEK_END:
+            if (source->size < 0) {
+                return AVERROR(ENOSYS);
+            }
+            pos = source->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || (source->size >= 0 && pos > source->size)) {
+        return AVERROR(EINVAL);
+    }
+    // 当前分段内的小幅前跳直接读过去，连接不中断
+    while (source->conn && pos > source->pos && pos - source->pos <= HTTP_POOL_MAX_DRAIN &&
+           pos - source->pos <= source->response.remaining) {
+        if ((ret = http_read_body(source->conn, &(source->response), skip,
+                                  (int) FFMIN(pos - source->pos, (int64_t) sizeof(skip)))) <= 0) {
+            break;
+        }
+        source->pos += ret;
+    }
+    if (pos != source->pos) {
+        http_pool_release(source->pool, &(source->conn), &(source->response));
+        source->range_size = HTTP_RANGE_MIN_SIZE;
+        source->pos = pos;
+    }
+    return pos;
+}
+
+
+static void free_http_source(HttpSource *source) {
+    http_pool_release(source->pool, &(source->conn), &(source->response));
+    av_freep(&(source->url));
+}
+
+
+/**
+ * 打开通过连接池读取http(s) url的AVIOContext，同一origin的截图复用keep-alive连接和TLS会话
+ * 打开时即请求第一段，服务端不可用或不支持Range时返回NULL，调用方可回退ffmpeg的http协议
+ * @param pool
+ * @param url
+ * @param buffer_size avio缓冲大小，<=0时使用默认值
+ * @return 失败返回NULL
+ */
+AVIOContext *open_http_pool_avio(HttpPool *pool, const char *url, int buffer_size) {
+    AVIOContext *pb;
+    HttpSource resources, *source = (HttpSource *) av_mallocz(sizeof(HttpSource));
+    if (!source) {
+        return NULL;
+    }
+    source->pool = pool;
+    source->size = -1;
+    source->range_size = HTTP_RANGE_MIN_SIZE;
+    if (!(source->url = av_strdup(url)) || request_http_range(source) < 0) {
+        free_http_source(source);
+        av_free(source);
+        return NULL;
+    }
+    resources = *source; // alloc_custom_avio失败时会释放source
+    pb = alloc_custom_avio(source, buffer_size, 0, read_http, NULL, seek_http);
+    if (!pb) {
+        free_http_source(&resources);
+        return NULL;
+    }
+    pb->seekable = AVIO_SEEKABLE_NORMAL;
+    return pb;
+}
+
+
+static int read_callback(void *opaque, uint8_t *buf, int buf_size) {
+    CallbackSource *source = (CallbackSource *) opaque;
+    int ret = source->read_cb(source->opaque, buf, buf_size);
+    return ret == 0 ? AVERROR_EOF : ret;
+}
+
+
+static int64_t seek_callback(void *opaque, int64_t offset, int whence) {
+    CallbackSource *source = (CallbackSource *) opaque;
+    return source->seek_cb(source->opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+
+/**
+ * 打开由调用方回调读取的AVIOContext
+ * @param read_cb 读回调，返回读取字节数，0表示结束，负数为错误码
+ * @param seek_cb seek回调，语义同lseek，whence为AVSEEK_SIZE时返回总长度；为NULL时输入不可seek
+ * @param opaque 回调参数
+ * @param buffer_size avio缓冲大小，<=0时使用默认值
+ * @return 失败返回NULL
+ */
+AVIOContext *open_callback_read_avio(ShotReadCallback read_cb, ShotSeekCallback seek_cb, void *opaque,
+                                     int buffer_size) {
+    AVIOContext *pb;
+    CallbackSource *source = (CallbackSource *) av_mallocz(sizeof(CallbackSource));
+    if (source) {
+        source->read_cb = read_cb;
+        source->seek_cb = seek_cb;
+        source->opaque = opaque;
+    }
+    pb = alloc_custom_avio(source, buffer_size, 0, read_callback, NULL, seek_cb ? seek_callback : NULL);
+    if (pb) {
+        pb->seekable = seek_cb ? AVIO_SEEKABLE_NORMAL : 0;
+    }
+    return pb;
+}
+
+
+/**
+ * 刷新并释放自定义AVIOContext，不关闭调用方的fd
+ * @param pb
+ */
+void close_custom_avio(AVIOContext **pb) {
+    if (!*pb) {
+        return;
+    }
+    if ((*pb)->write_flag) {
+        avio_flush(*pb);
+    }
+    if ((*pb)->read_packet == read_local_file) {
+        free_local_file_source((LocalFileSource *) (*pb)->opaque);
+    } else if ((*pb)->read_packet == read_http) {
+        free_http_source((HttpSource *) (*pb)->opaque);
+    }
+    av_freep(&((*pb)->opaque));
+    av_freep(&((*pb)->buffer));
+    avio_context_free(pb);
+}
@@ -0,0 +1,26 @@
+#include <libavformat/avio.h>
+#include <stdbool.h>
+#include "httppool.h"
+
+#define DEFAULT_AVIO_BUFFER_SIZE 32768
+
+typedef int (*ShotWriteCallback)(void *opaque, uint8_t *buf, int buf_size);
+
+typedef int (*ShotReadCallback)(void *opaque, uint8_t *buf, int buf_size);
+
+typedef int64_t (*ShotSeekCallback)(void *opaque, int64_t offset, int whence);
+
+AVIOContext *open_write_avio(int fd, ShotWriteCallback write_cb, void *opaque, int buffer_size);
+
+AVIOContext *open_buffer_read_avio(const uint8_t *data, int64_t size, int buffer_size);
+
+AVIOContext *open_fd_read_avio(int fd, int read_timeout, int buffer_size);
+
+AVIOContext *open_callback_read_avio(ShotReadCallback read_cb, ShotSeekCallback seek_cb, void *opaque,
+                                     int buffer_size);
+
+AVIOContext *open_local_file_avio(const char *path, int buffer_size);
+
+AVIOContext *open_http_pool_avio(HttpPool *pool, const char *url, int buffer_size);
+
+void close_custom_avio(AVIOContext **pb);
@@ -0,0 +1,263 @@
+//
+// 跨进程、跨重启的磁盘截图缓存，命中时不需要打开输入
+//
+#include "diskcache.h"
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME UINT64_C(0x100000001b3)
+#define CHECK_SEED UINT64_C(0x9e3779b97f4a7c15)
+#define CHECK_PRIME UINT64_C(0xff51afd7ed558ccd)
+
+/**
+ * data文件中每条记录的头，读取时校验，防止哈希冲突或索引与数据不一致
+ * check为DiskCacheKey.check折叠的32位，旧版本写入的记录为0，读取时视为未命中
+ */
+typedef struct DiskCacheRecord {
+    uint64_t key;
+    uint32_t size;
+    uint32_t check;
+} DiskCacheRecord;
+
+
+/**
+ * FNV-1a哈希，可以链式累加多个字段
+ * @param hash 初始为0
+ * @param data
+ * @param size
+ * @return
+ */
+uint64_t disk_cache_hash(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *) data;
+    size_t i;
+    if (!hash) {
+        hash = FNV_OFFSET_BASIS;
+    }
+    for (i = 0; i < size; ++i) {
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+
+/**
+ * 同时累加key的两个哈希：hash为FNV-1a，check为独立的移位乘法哈希，两者同时冲突才会读到其他视频的数据
+ * @param key 初始为全0
+ * @param data
+ * @param size
+ */
+void disk_cache_key_update(DiskCacheKey *key, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t check = key->check ? key->check : CHECK_SEED;
+    size_t i;
+    key->hash = disk_cache_hash(key->hash, data, size);
+    for (i = 0; i < size; ++i) {
+        check = ((check << 5 | check >> 59) ^ p[i]) * CHECK_PRIME;
+    }
+    key->check = check;
+}
+
+
+/**
+ * 初始化新建的索引文件，多个进程同时打开时由flock保证只初始化一次
+ * @param fd
+ * @param nb_slots
+ * @return
+ */
+static int init_index_file(int fd, uint64_t nb_slots) {
+    DiskCacheHeader header;
+    struct stat st;
+    int ret = 0;
+    if (flock(fd, LOCK_EX) < 0) {
+        return AVERROR(errno);
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = AVERROR(errno);
+    } else if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        header.magic = DISK_CACHE_MAGIC;
+        header.nb_slots = nb_slots;
+        if (ftruncate(fd, sizeof(DiskCacheHeader) + nb_slots * sizeof(DiskCacheSlot)) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            ret = AVERROR(errno);
+        }
+    }
+    flock(fd, LOCK_UN);
+    return ret;
+}
+
+
+/**
+ * 打开缓存目录下的index和data文件，不存在时创建
+ * @param dir 缓存目录，需已存在
+ * @param nb_slots 新建索引的槽数，为0时取默认值；已有索引时以文件为准
+ * @return
+ */
+DiskCache *open_disk_cache(const char *dir, uint64_t nb_slots) {
+    char path[4096];
+    struct stat st;
+    DiskCache *cache = (DiskCache *) calloc(1, sizeof(DiskCache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->index_fd = cache->data_fd = -1;
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if ((cache->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+        init_index_file(cache->index_fd, nb_slots ? nb_slots : DISK_CACHE_DEFAULT_SLOTS) < 0 ||
+        fstat(cache->index_fd, &st) < 0) {
+        printf("open disk cache index failed, %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    cache->map_size = (size_t) st.st_size;
+    cache->header = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->index_fd, 0);
+    if (cache->header == MAP_FAILED) {
+        cache->header = NULL;
+        printf("mmap disk cache index failed, %s\n", strerror(errno));
+        goto fail;
+    }
+    if (cache->header->magic != DISK_CACHE_MAGIC || !cache->header->nb_slots ||
+        sizeof(DiskCacheHeader) + cache->header->nb_slots * sizeof(DiskCacheSlot) > cache->map_size) {
+        printf("invalid disk cache index: %s\n", path);
+        goto fail;
+    }
+    cache->nb_slots = cache->header->nb_slots;
+    cache->slots = (DiskCacheSlot *) (cache->header + 1);
+    snprintf(path, sizeof(path), "%s/data", dir);
+    if ((cache->data_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        printf("open disk cache data failed, %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    return cache;
+    fail:
+    close_disk_cache(&cache);
+    return NULL;
+}
+
+
+void close_disk_cache(DiskCache **cache) {
+    if (!*cache) {
+        return;
+    }
+    if ((*cache)->header) {
+        munmap((*cache)->header, (*cache)->map_size);
+    }
+    if ((*cache)->index_fd >= 0) {
+        close((*cache)->index_fd);
+    }
+    if ((*cache)->data_fd >= 0) {
+        close((*cache)->data_fd);
+    }
+    free(*cache);
+    *cache = NULL;
+}
+
+
+/**
+ * 读取缓存的数据，不加锁
+ * @param cache
+ * @param cache_key disk_cache_key_update生成的key，记录头的hash和check都一致才命中
+ * @param data 命中时返回av_malloc的数据
+ * @param size
+ * @return 命中返回0，未命中返回AVERROR(ENOENT)
+ */
+int disk_cache_get(DiskCache *cache, const DiskCacheKey *cache_key, uint8_t **data, int *size) {
+    DiskCacheRecord record;
+    uint64_t key = cache_key->hash ? cache_key->hash : 1, slot_key, location, i, index;
+    uint32_t check = (uint32_t) (cache_key->check ^ cache_key->check >> 32);
+    int64_t offset;
+    for (i = 0; i < DISK_CACHE_MAX_PROBES && i < cache->nb_slots; ++i) {
+        index = (key + i) % cache->nb_slots;
+        slot_key = __atomic_load_n(&(cache->slots[index].key), __ATOMIC_ACQUIRE);
+        if (!slot_key) {
+            break;
+        }
+        if (slot_key != key) {
+            continue;
+        }
+        if (!(location = __atomic_load_n(&(cache->slots[index].location), __ATOMIC_ACQUIRE))) {
+            break;
+        }
+        offset = (int64_t) (location >> 24);
+        *size = (int) (location & DISK_CACHE_MAX_ENTRY_SIZE);
+        if (pread(cache->data_fd, &record, sizeof(record), offset) != sizeof(record) ||
+            record.key != key || record.size != (uint32_t) *size) {
+            printf("disk cache record mismatch, offset:%"PRId64"\n", offset);
+            break;
+        }
+        if (record.check != check) { // 索引hash冲突或旧版本记录，put会覆盖这个槽
+            break;
+        }
+        if (!(*data = av_malloc(*size))) {
+            return AVERROR(ENOMEM);
+        }
+        if (pread(cache->data_fd, *data, *size, offset + sizeof(record)) != *size) {
+            av_freep(data);
+            break;
+        }
+        return 0;
+    }
+    return AVERROR(ENOENT);
+}
+
+
+/**
+ * 追加写入数据并发布到索引，相同hash覆盖旧的位置，旧数据留在data文件中
+ * @param cache
+ * @param cache_key
+ * @param data
+ * @param size
+ * @return
+ */
+int disk_cache_put(DiskCache *cache, const DiskCacheKey *cache_key, const uint8_t *data, int size) {
+    DiskCacheRecord record = {cache_key->hash ? cache_key->hash : 1, (uint32_t) size,
+                              (uint32_t) (cache_key->check ^ cache_key->check >> 32)};
+    uint64_t magic = DISK_CACHE_MAGIC, key = record.key, expected, location, i, index;
+    off_t offset;
+    int ret = 0;
+    if (size <= 0 || size > DISK_CACHE_MAX_ENTRY_SIZE) {
+        return AVERROR(EINVAL);
+    }
+    if (flock(cache->data_fd, LOCK_EX) < 0) {
+        return AVERROR(errno);
+    }
+    // 偏移0为文件magic，location不会为0
+    if ((offset = lseek(cache->data_fd, 0, SEEK_END)) == 0) {
+        if (pwrite(cache->data_fd, &magic, sizeof(magic), 0) != sizeof(magic)) {
+            ret = AVERROR(errno);
+        }
+        offset = sizeof(magic);
+    }
+    if (!ret && (offset < 0 || (uint64_t) offset >> 40 ||
+                 pwrite(cache->data_fd, &record, sizeof(record), offset) != sizeof(record) ||
+                 pwrite(cache->data_fd, data, size, offset + sizeof(record)) != size)) {
+        ret = AVERROR(EIO);
+    }
+    flock(cache->data_fd, LOCK_UN);
+    if (ret < 0) {
+        printf("disk cache append failed, %s\n", av_err2str(ret));
+        return ret;
+    }
+    location = ((uint64_t) offset << 24) | (uint64_t) size;
+    for (i = 0; i < DISK_CACHE_MAX_PROBES && i < cache->nb_slots; ++i) {
+        index = (key + i) % cache->nb_slots;
+        expected = 0;
+        if (__atomic_compare_exchange_n(&(cache->slots[index].key), &expected, key, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == key) {
+            // 读取方先校验key再读location，location为0时视为未命中
+            __atomic_store_n(&(cache->slots[index].location), location, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    printf("disk cache index full near slot %"PRIu64"\n", key % cache->nb_slots);
+    return AVERROR(ENOSPC);
+}
@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#define DISK_CACHE_MAGIC UINT64_C(0x3143444653484653) // "SFHSFDC1"
+#define DISK_CACHE_DEFAULT_SLOTS (1 << 20)
+#define DISK_CACHE_MAX_PROBES 64
+#define DISK_CACHE_MAX_ENTRY_SIZE ((1 << 24) - 1) // location低24位为长度，高40位为偏移
+
+/**
+ * 索引槽，key为0表示空槽，location为0表示数据尚未写入
+ */
+typedef struct DiskCacheSlot {
+    uint64_t key;
+    uint64_t location;
+} DiskCacheSlot;
+
+/**
+ * 缓存key：hash用于索引寻址，check是相同字段的另一个独立哈希，写入数据记录头，读取时一起校验
+ */
+typedef struct DiskCacheKey {
+    uint64_t hash;
+    uint64_t check;
+} DiskCacheKey;
+
+typedef struct DiskCacheHeader {
+    uint64_t magic;
+    uint64_t nb_slots;
+    uint64_t reserved[6];
+} DiskCacheHeader;
+
+/**
+ * 磁盘截图缓存：追加写入的data文件和mmap的开放寻址哈希索引
+ * 读取不加锁，多进程写入时数据追加由flock串行，索引槽由CAS占用
+ */
+typedef struct DiskCache {
+    int index_fd;
+    int data_fd;
+    DiskCacheHeader *header;
+    DiskCacheSlot *slots;
+    uint64_t nb_slots;
+    size_t map_size;
+} DiskCache;
+
+DiskCache *open_disk_cache(const char *dir, uint64_t nb_slots);
+
+void close_disk_cache(DiskCache **cache);
+
+uint64_t disk_cache_hash(uint64_t hash, const void *data, size_t size);
+
+void disk_cache_key_update(DiskCacheKey *key, const void *data, size_t size);
+
+int disk_cache_get(DiskCache *cache, const DiskCacheKey *key, uint8_t **data, int *size);
+
+int disk_cache_put(DiskCache *cache, const DiskCacheKey *key, const uint8_t *data, int size);
@@ -0,0 +1,768 @@
+//
+// HTTP/1.1 keep-alive连接池，同一origin的截图复用TCP连接和TLS会话
+// 由CONFIG_HTTP_POOL开启(make HTTP_POOL=1)，依赖OpenSSL 1.1.0及以上，需链接 -lssl -lcrypto
+// 未开启时不依赖OpenSSL，create_http_pool返回NULL，http(s) url由ffmpeg的http协议读取
+//
+#include "httppool.h"
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if CONFIG_HTTP_POOL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/**
+ * 与socket BIO相同，但发送时带MSG_NOSIGNAL
+ * 对端已关闭的keep-alive连接上SSL_write不会因SIGPIPE终止进程
+ */
+static int nosignal_bio_write(BIO *bio, const char *data, int size) {
+    int n;
+    BIO_clear_retry_flags(bio);
+    while ((n = (int) send((int) BIO_get_fd(bio, NULL), data, (size_t) size, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        BIO_set_retry_write(bio);
+    }
+    return n;
+}
+
+
+static BIO_METHOD *create_nosignal_bio_method(void) {
+    const BIO_METHOD *socket_method = BIO_s_socket();
+    BIO_METHOD *method = BIO_meth_new(BIO_TYPE_SOCKET, "socket nosignal");
+    if (!method) {
+        return NULL;
+    }
+    BIO_meth_set_write(method, nosignal_bio_write);
+    BIO_meth_set_read(method, BIO_meth_get_read(socket_method));
+    BIO_meth_set_ctrl(method, BIO_meth_get_ctrl(socket_method));
+    BIO_meth_set_create(method, BIO_meth_get_create(socket_method));
+    BIO_meth_set_destroy(method, BIO_meth_get_destroy(socket_method));
+    return method;
+}
+
+
+/**
+ * 收到新的TLS会话(TLS1.3在握手后才下发ticket)时保存到origin，接管session的引用
+ */
+static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+    HttpOrigin *origin = (HttpOrigin *) SSL_get_app_data(ssl);
+    if (!origin) {
+        return 0;
+    }
+    pthread_mutex_lock(&(origin->pool->mutex));
+    if (origin->session) {
+        SSL_SESSION_free(origin->session);
+    }
+    origin->session = session;
+    pthread_mutex_unlock(&(origin->pool->mutex));
+    return 1;
+}
+
+
+/**
+ * 创建连接池
+ * @param max_per_host 每个origin的最大连接数，<=0时使用默认值
+ * @param idle_timeout 空闲连接保留时间，单位ms，<=0时使用默认值
+ * @param timeout 连接、读写和等待空闲连接的超时，单位ms，<=0时使用默认值
+ * @param verify_peer 非0时校验https证书和主机名
+ * @return 失败返回NULL
+ */
+HttpPool *create_http_pool(int max_per_host, int idle_timeout, int timeout, int verify_peer) {
+    HttpPool *pool = (HttpPool *) av_mallocz(sizeof(HttpPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->max_per_host = max_per_host > 0 ? max_per_host : HTTP_POOL_DEFAULT_MAX_PER_HOST;
+    pool->idle_timeout = idle_timeout > 0 ? idle_timeout : HTTP_POOL_DEFAULT_IDLE_TIMEOUT;
+    pool->timeout = timeout > 0 ? timeout : HTTP_POOL_DEFAULT_TIMEOUT;
+    if (!(pool->ssl_ctx = SSL_CTX_new(TLS_client_method())) || !(pool->bio_method = create_nosignal_bio_method())) {
+        printf("create ssl context failed\n");
+        SSL_CTX_free(pool->ssl_ctx);
+        av_free(pool);
+        return NULL;
+    }
+    if (verify_peer) {
+        SSL_CTX_set_default_verify_paths(pool->ssl_ctx);
+        SSL_CTX_set_verify(pool->ssl_ctx, SSL_VERIFY_PEER, NULL);
+    }
+    // 会话由origin保存，不使用OpenSSL的内部缓存
+    SSL_CTX_set_session_cache_mode(pool->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(pool->ssl_ctx, on_new_session);
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pthread_cond_init(&(pool->cond), NULL);
+    return pool;
+}
+
+
+static void close_connection(HttpConnection *conn) {
+    if (conn->ssl) {
+        SSL_set_app_data(conn->ssl, NULL);
+        // 不发送close_notify直接关闭，SSL_free不会把会话标记为不可恢复
+        SSL_set_shutdown(conn->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        SSL_free(conn->ssl);
+    }
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+    av_free(conn);
+}
+
+
+/**
+ * 关闭所有空闲连接并释放，调用前所有连接需已http_pool_release
+ * @param pool
+ */
+void free_http_pool(HttpPool **pool) {
+    HttpConnection *conn;
+    HttpOrigin *origin;
+    if (!*pool) {
+        return;
+    }
+    while ((conn = (*pool)->idle)) {
+        (*pool)->idle = conn->next;
+        close_connection(conn);
+    }
+    while ((origin = (*pool)->origins)) {
+        (*pool)->origins = origin->next;
+        if (origin->session) {
+            SSL_SESSION_free(origin->session);
+        }
+        av_free(origin->origin);
+        av_free(origin->host);
+        av_free(origin);
+    }
+    SSL_CTX_free((*pool)->ssl_ctx);
+    BIO_meth_free((*pool)->bio_method);
+    pthread_mutex_destroy(&((*pool)->mutex));
+    pthread_cond_destroy(&((*pool)->cond));
+    av_freep(pool);
+}
+
+
+/**
+ * 查找或创建url的origin，需持有mutex
+ * @param pool
+ * @param proto
+ * @param host
+ * @param port
+ * @return
+ */
+static HttpOrigin *get_origin(HttpPool *pool, const char *proto, const char *host, int port) {
+    HttpOrigin *origin;
+    int tls = !strcmp(proto, "https");
+    char *key;
+    if (port < 0) {
+        port = tls ? 443 : 80;
+    }
+    if (!(key = av_asprintf("%s://%s:%d", proto, host, port))) {
+        return NULL;
+    }
+    for (origin = pool->origins; origin; origin = origin->next) {
+        if (!strcmp(origin->origin, key)) {
+            av_free(key);
+            return origin;
+        }
+    }
+    if (!(origin = (HttpOrigin *) av_mallocz(sizeof(HttpOrigin))) || !(origin->host = av_strdup(host))) {
+        av_free(origin);
+        av_free(key);
+        return NULL;
+    }
+    origin->origin = key;
+    origin->port = port;
+    origin->tls = tls;
+    origin->pool = pool;
+    origin->next = pool->origins;
+    pool->origins = origin;
+    return origin;
+}
+
+
+/**
+ * 关闭超过idle_timeout的空闲连接，需持有mutex
+ * @param pool
+ */
+static void evict_idle_connections(HttpPool *pool) {
+    HttpConnection **link = &(pool->idle), *conn;
+    int64_t now = av_gettime_relative();
+    while ((conn = *link)) {
+        if (now - conn->idle_since > (int64_t) pool->idle_timeout * 1000) {
+            *link = conn->next;
+            conn->origin->nb_connections--;
+            close_connection(conn);
+            pthread_cond_broadcast(&(pool->cond));
+        } else {
+            link = &(conn->next);
+        }
+    }
+}
+
+
+/**
+ * 空闲连接可读说明服务端已关闭或发来了多余数据，不能复用
+ * @param conn
+ * @return
+ */
+static int is_connection_alive(HttpConnection *conn) {
+    struct pollfd pfd;
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0 && (!conn->ssl || SSL_pending(conn->ssl) == 0);
+}
+
+
+/**
+ * 非阻塞connect并等待timeout，成功后恢复阻塞模式并设置读写超时
+ * @param host
+ * @param port
+ * @param timeout 单位ms
+ * @return fd或AVERROR
+ */
+static int connect_tcp(const char *host, int port, int timeout) {
+    struct addrinfo hints, *addrs = NULL, *addr;
+    struct timeval tv;
+    struct pollfd pfd;
+    char service[16];
+    int fd = -1, ret, err = 0, one = 1;
+    socklen_t len = sizeof(err);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if ((ret = getaddrinfo(host, service, &hints, &addrs)) != 0) {
+        printf("getaddrinfo failed, %s: %s\n", host, gai_strerror(ret));
+        return AVERROR(EHOSTUNREACH);
+    }
+    ret = AVERROR(ECONNREFUSED);
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        if ((fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol)) < 0) {
+            ret = AVERROR(errno);
+            continue;
+        }
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            ret = AVERROR(errno);
+        } else {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if ((ret = poll(&pfd, 1, timeout)) == 0) {
+                ret = AVERROR(ETIMEDOUT);
+            } else if (ret < 0) {
+                ret = AVERROR(errno);
+            } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                ret = AVERROR(err ? err : errno);
+            } else {
+                break;
+            }
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) {
+        printf("connect failed, %s:%d: %s\n", host, port, av_err2str(ret));
+        return ret;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+
+/**
+ * 新建连接，https时用origin保存的会话做TLS会话恢复
+ * @param pool
+ * @param origin 已计入nb_connections
+ * @param conn
+ * @return
+ */
+static int open_connection(HttpPool *pool, HttpOrigin *origin, HttpConnection **conn) {
+    HttpConnection *c = (HttpConnection *) av_mallocz(sizeof(HttpConnection));
+    int ret;
+    if (!c) {
+        return AVERROR(ENOMEM);
+    }
+    c->origin = origin;
+    if ((c->fd = connect_tcp(origin->host, origin->port, pool->timeout)) < 0) {
+        ret = c->fd;
+        goto fail;
+    }
+    if (origin->tls) {
+        BIO *bio = NULL;
+        if (!(c->ssl = SSL_new(pool->ssl_ctx)) || !(bio = BIO_new(pool->bio_method))) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        BIO_set_fd(bio, c->fd, BIO_NOCLOSE);
+        SSL_set_bio(c->ssl, bio, bio);
+        SSL_set_app_data(c->ssl, origin);
+        SSL_set_tlsext_host_name(c->ssl, origin->host);
+        if (SSL_CTX_get_verify_mode(pool->ssl_ctx) & SSL_VERIFY_PEER) {
+            SSL_set1_host(c->ssl, origin->host);
+        }
+        pthread_mutex_lock(&(pool->mutex));
+        if (origin->session) {
+            SSL_set_session(c->ssl, origin->session);
+        }
+        pthread_mutex_unlock(&(pool->mutex));
+        if (SSL_connect(c->ssl) != 1) {
+            printf("SSL_connect failed, %s: %s\n", origin->host, ERR_reason_error_string(ERR_get_error()));
+            ret = AVERROR(ECONNREFUSED);
+            goto fail;
+        }
+    }
+    pthread_mutex_lock(&(pool->mutex));
+    pool->connects++;
+    if (c->ssl && SSL_session_reused(c->ssl)) {
+        pool->tls_resumed++;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+    *conn = c;
+    return 0;
+    fail:
+    close_connection(c);
+    return ret;
+}
+
+
+/**
+ * 取一个可用的空闲连接，没有时在max_per_host内新建，否则等待其他请求释放
+ * @param pool
+ * @param origin
+ * @param conn
+ * @param reused 返回是否为复用的连接
+ * @return
+ */
+static int acquire_connection(HttpPool *pool, HttpOrigin *origin, HttpConnection **conn, int *reused) {
+    HttpConnection **link, *c;
+    struct timespec deadline;
+    int ret;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += pool->timeout / 1000;
+    deadline.tv_nsec += (pool->timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&(pool->mutex));
+    while (true) {
+        evict_idle_connections(pool);
+        for (link = &(pool->idle); (c = *link); link = &(c->next)) {
+            if (c->origin == origin) {
+                *link = c->next;
+                break;
+            }
+        }
+        if (c && !is_connection_alive(c)) {
+            origin->nb_connections--;
+            close_connection(c);
+            continue;
+        }
+        if (c) {
+            pool->reuses++;
+            pthread_mutex_unlock(&(pool->mutex));
+            c->next = NULL;
+            *conn = c;
+            *reused = 1;
+            return 0;
+        }
+        if (origin->nb_connections < pool->max_per_host) {
+            break;
+        }
+        if (pthread_cond_timedwait(&(pool->cond), &(pool->mutex), &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&(pool->mutex));
+            printf("wait http connection timeout: %s\n", origin->origin);
+            return AVERROR(ETIMEDOUT);
+        }
+    }
+    origin->nb_connections++;
+    pthread_mutex_unlock(&(pool->mutex));
+    *reused = 0;
+    if ((ret = open_connection(pool, origin, conn)) < 0) {
+        pthread_mutex_lock(&(pool->mutex));
+        origin->nb_connections--;
+        pthread_cond_broadcast(&(pool->cond));
+        pthread_mutex_unlock(&(pool->mutex));
+    }
+    return ret;
+}
+
+
+static int conn_write(HttpConnection *conn, const char *data, int size) {
+    int written = 0, n;
+    while (written < size) {
+        if (conn->ssl) {
+            n = SSL_write(conn->ssl, data + written, size - written);
+            if (n <= 0) {
+                return AVERROR(EIO);
+            }
+        } else if ((n = (int) send(conn->fd, data + written, size - written, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        written += n;
+    }
+    return written;
+}
+
+
+/**
+ * 从socket读取，不经过rbuf
+ * @return 读取字节数，0为连接关闭
+ */
+static int conn_read(HttpConnection *conn, uint8_t *buf, int size) {
+    int n;
+    if (conn->ssl) {
+        n = SSL_read(conn->ssl, buf, size);
+        if (n <= 0) {
+            return SSL_get_error(conn->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : AVERROR(EIO);
+        }
+        return n;
+    }
+    while ((n = (int) recv(conn->fd, buf, size, 0)) < 0 && errno == EINTR) {
+    }
+    if (n < 0) {
+        return errno == EAGAIN ? AVERROR(ETIMEDOUT) : AVERROR(errno);
+    }
+    return n;
+}
+
+
+/**
+ * 读取响应头，响应头之后的数据留在rbuf中
+ * @param conn
+ * @return 响应头的长度或AVERROR
+ */
+static int read_response_header(HttpConnection *conn) {
+    char *end;
+    int n;
+    conn->rpos = conn->rlen = 0;
+    while (true) {
+        conn->rbuf[conn->rlen] = '\0';
+        if ((end = strstr((char *) conn->rbuf, "\r\n\r\n"))) {
+            return (int) (end - (char *) conn->rbuf) + 4;
+        }
+        if (conn->rlen >= HTTP_POOL_HEADER_SIZE - 1) {
+            printf("http response header too large\n");
+            return AVERROR_INVALIDDATA;
+        }
+        if ((n = conn_read(conn, conn->rbuf + conn->rlen, HTTP_POOL_HEADER_SIZE - 1 - conn->rlen)) <= 0) {
+            return n == 0 ? AVERROR(ECONNRESET) : n;
+        }
+        conn->rlen += n;
+    }
+}
+
+
+/**
+ * 解析响应头
+ * @param header 以'\0'结尾
+ * @param response
+ * @param location 重定向地址，需av_free
+ * @return
+ */
+static int parse_response_header(char *header, HttpResponse *response, char **location) {
+    char *line, *save = NULL, *value;
+    int minor = 1, chunked = 0;
+    int64_t first, last, total;
+    response->content_length = -1;
+    response->range_start = 0;
+    response->total_size = -1;
+    if (sscanf(header, "HTTP/1.%d %d", &minor, &(response->status)) != 2) {
+        printf("invalid http status line\n");
+        return AVERROR_INVALIDDATA;
+    }
+    response->keep_alive = minor >= 1;
+    strtok_r(header, "\r\n", &save);
+    while ((line = strtok_r(NULL, "\r\n", &save))) {
+        if (!(value = strchr(line, ':'))) {
+            continue;
+        }
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        if (!av_strcasecmp(line, "Content-Length")) {
+            response->content_length = strtoll(value, NULL, 10);
+        } else if (!av_strcasecmp(line, "Content-Range")) {
+            if (sscanf(value, "bytes %" SCNd64 "-%" SCNd64 "/%" SCNd64, &first, &last, &total) >= 2) {
+                response->range_start = first;
+                response->total_size = value[strcspn(value, "/") + 1] == '*' ? -1 : total;
+            }
+        } else if (!av_strcasecmp(line, "Connection")) {
+            if (av_stristr(value, "close")) {
+                response->keep_alive = 0;
+            } else if (av_stristr(value, "keep-alive")) {
+                response->keep_alive = 1;
+            }
+        } else if (!av_strcasecmp(line, "Transfer-Encoding")) {
+            chunked = av_stristr(value, "chunked") != NULL;
+        } else if (!av_strcasecmp(line, "Location") && location) {
+            av_free(*location);
+            *location = av_strdup(value);
+        }
+    }
+    if (chunked) {
+        printf("chunked http response is not supported\n");
+        response->keep_alive = 0;
+        return AVERROR_PATCHWELCOME;
+    }
+    if (response->status == 200 && response->content_length >= 0) {
+        response->total_size = response->content_length;
+    }
+    if (response->content_length < 0) {
+        response->keep_alive = 0; // 响应体到连接关闭为止
+    }
+    response->remaining = response->content_length < 0 ? INT64_MAX : response->content_length;
+    return 0;
+}
+
+
+/**
+ * 按请求的url解析Location，支持绝对url、//host/path、/path和相对路径
+ * @param base 请求的url
+ * @param location
+ * @return 需av_free，失败返回NULL
+ */
+static char *resolve_location(const char *base, const char *location) {
+    char proto[16], host[256], path[4096], *slash;
+    int port;
+    if (av_strstart(location, "http://", NULL) || av_strstart(location, "https://", NULL)) {
+        return av_strdup(location);
+    }
+    av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host), &port, path, sizeof(path), base);
+    if (av_strstart(location, "//", NULL)) {
+        return av_asprintf("%s:%s", proto, location);
+    }
+    if (location[0] != '/') { // 相对当前路径的目录，不含查询串
+        path[strcspn(path, "?#")] = '\0';
+        if ((slash = strrchr(path, '/'))) {
+            slash[1] = '\0';
+        } else {
+            snprintf(path, sizeof(path), "/");
+        }
+    } else {
+        path[0] = '\0';
+    }
+    return port < 0 ? av_asprintf("%s://%s%s%s", proto, host, path, location) :
+           av_asprintf("%s://%s:%d%s%s", proto, host, port, path, location);
+}
+
+
+/**
+ * 在连接池的连接上发送Range请求并读取响应头，跟随重定向
+ * 复用的连接已被服务端关闭时换一个连接重试
+ * @param pool
+ * @param url http或https url
+ * @param start 请求的起始字节
+ * @param end 请求的结束字节(包含)，<0时请求到文件尾
+ * @param conn 返回的连接，之后由http_read_body读取响应体，http_pool_release释放
+ * @param response
+ * @return 2xx时返回0
+ */
+int http_pool_get(HttpPool *pool, const char *url, int64_t start, int64_t end, HttpConnection **conn,
+                  HttpResponse *response) {
+    char proto[16], host[256], path[4096], hostport[300], *request = NULL, *location = NULL, *target = NULL;
+    int port, ret = 0, reused, header_size, redirects = 0, attempts = 0;
+    HttpOrigin *origin;
+    *conn = NULL;
+    while (true) {
+        av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host), &port, path, sizeof(path),
+                     target ? target : url);
+        if (strcmp(proto, "http") && strcmp(proto, "https")) {
+            printf("unsupported http pool url: %s\n", target ? target : url);
+            ret = AVERROR(EINVAL);
+            goto end;
+        }
+        pthread_mutex_lock(&(pool->mutex));
+        origin = get_origin(pool, proto, host, port);
+        pthread_mutex_unlock(&(pool->mutex));
+        if (!origin) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if ((ret = acquire_connection(pool, origin, conn, &reused)) < 0) {
+            goto end;
+        }
+        if (port < 0 || port == (origin->tls ? 443 : 80)) {
+            snprintf(hostport, sizeof(hostport), "%s", host);
+        } else {
+            snprintf(hostport, sizeof(hostport), "%s:%d", host, port);
+        }
+        av_free(request);
+        request = end >= 0 ?
+                  av_asprintf("GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: ffshot\r\nAccept: */*\r\n"
+                              "Range: bytes=%" PRId64 "-%" PRId64 "\r\nConnection: keep-alive\r\n\r\n",
+                              path[0] ? path : "/", hostport, start, end) :
+                  av_asprintf("GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: ffshot\r\nAccept: */*\r\n"
+                              "Range: bytes=%" PRId64 "-\r\nConnection: keep-alive\r\n\r\n",
+                              path[0] ? path : "/", hostport, start);
+        if (!request) {
+            ret = AVERROR(ENOMEM);
+        } else if ((ret = conn_write(*conn, request, (int) strlen(request))) >= 0 &&
+                   (ret = header_size = read_response_header(*conn)) >= 0) {
+            (*conn)->rbuf[header_size - 1] = '\0';
+            (*conn)->rpos = header_size;
+            ret = parse_response_header((char *) (*conn)->rbuf, response, &location);
+        }
+        if (ret < 0) {
+            response->keep_alive = 0;
+            http_pool_release(pool, conn, response);
+            // 复用的连接可能刚被服务端因空闲超时关闭
+            if (reused && ret != AVERROR_PATCHWELCOME && ++attempts <= pool->max_per_host) {
+                continue;
+            }
+            goto end;
+        }
+        if (response->status >= 300 && response->status < 400 && location) {
+            char *redirect;
+            http_pool_release(pool, conn, response);
+            if (++redirects > HTTP_POOL_MAX_REDIRECTS ||
+                !(redirect = resolve_location(target ? target : url, location))) {
+                printf("http redirect failed: %s\n", location);
+                ret = AVERROR(EINVAL);
+                goto end;
+            }
+            av_free(target);
+            av_freep(&location);
+            target = redirect;
+            continue;
+        }
+        break;
+    }
+    if (response->status / 100 != 2) {
+        printf("http request failed, status %d: %s\n", response->status, target ? target : url);
+        http_pool_release(pool, conn, response);
+        ret = AVERROR_HTTP_OTHER_4XX;
+        if (response->status == 404) {
+            ret = AVERROR_HTTP_NOT_FOUND;
+        } else if (response->status >= 500) {
+            ret = AVERROR_HTTP_SERVER_ERROR;
+        }
+        goto end;
+    }
+    ret = 0;
+    end:
+    av_free(request);
+    av_free(location);
+    av_free(target);
+    return ret;
+}
+
+
+/**
+ * 读取响应体
+ * @param conn
+ * @param response
+ * @param buf
+ * @param size
+ * @return 读取字节数，0为响应体结束
+ */
+int http_read_body(HttpConnection *conn, HttpResponse *response, uint8_t *buf, int size) {
+    int n;
+    if (response->remaining <= 0) {
+        return 0;
+    }
+    if (size > response->remaining) {
+        size = (int) response->remaining;
+    }
+    if (conn->rpos < conn->rlen) {
+        n = FFMIN(size, conn->rlen - conn->rpos);
+        memcpy(buf, conn->rbuf + conn->rpos, n);
+        conn->rpos += n;
+    } else if ((n = conn_read(conn, buf, size)) <= 0) {
+        response->keep_alive = 0;
+        if (n == 0 && response->content_length < 0) {
+            response->remaining = 0;
+            return 0;
+        }
+        return n == 0 ? AVERROR(ECONNRESET) : n;
+    }
+    if (response->content_length >= 0) {
+        response->remaining -= n;
+    }
+    return n;
+}
+
+
+/**
+ * 释放连接：响应体已读完(或剩余不超过HTTP_POOL_MAX_DRAIN，读完后)且可keep-alive时放回连接池，否则关闭
+ * @param pool
+ * @param conn
+ * @param response
+ */
+void http_pool_release(HttpPool *pool, HttpConnection **conn, HttpResponse *response) {
+    uint8_t drain[4096];
+    int reusable, n;
+    if (!*conn) {
+        return;
+    }
+    if (response->keep_alive && response->remaining > 0 && response->remaining <= HTTP_POOL_MAX_DRAIN) {
+        while ((n = http_read_body(*conn, response, drain, sizeof(drain))) > 0) {
+        }
+    }
+    reusable = response->keep_alive && response->remaining == 0 && (*conn)->rpos == (*conn)->rlen;
+    pthread_mutex_lock(&(pool->mutex));
+    if (reusable) {
+        (*conn)->idle_since = av_gettime_relative();
+        (*conn)->next = pool->idle;
+        pool->idle = *conn;
+    } else {
+        (*conn)->origin->nb_connections--;
+        close_connection(*conn);
+    }
+    pthread_cond_broadcast(&(pool->cond));
+    pthread_mutex_unlock(&(pool->mutex));
+    *conn = NULL;
+}
+
+#else
+
+
+HttpPool *create_http_pool(int max_per_host, int idle_timeout, int timeout, int verify_peer) {
+    printf("http pool not enabled, build libshot.so with HTTP_POOL=1\n");
+    return NULL;
+}
+
+
+void free_http_pool(HttpPool **pool) {
+}
+
+
+int http_pool_get(HttpPool *pool, const char *url, int64_t start, int64_t end, HttpConnection **conn,
+                  HttpResponse *response) {
+    return AVERROR(ENOSYS);
+}
+
+
+int http_read_body(HttpConnection *conn, HttpResponse *response, uint8_t *buf, int size) {
+    return AVERROR(ENOSYS);
+}
+
+
+void http_pool_release(HttpPool *pool, HttpConnection **conn, HttpResponse *response) {
+}
+
+#endif
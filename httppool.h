@@ -0,0 +1,79 @@
+#include <pthread.h>
+#include <stdint.h>
+
+#define HTTP_POOL_DEFAULT_MAX_PER_HOST 8
+#define HTTP_POOL_DEFAULT_IDLE_TIMEOUT 30000 // 空闲连接保留时间，单位ms
+#define HTTP_POOL_DEFAULT_TIMEOUT 10000 // 连接和单次读写的超时，单位ms
+#define HTTP_POOL_HEADER_SIZE 16384
+#define HTTP_POOL_MAX_DRAIN 65536 // 未读完的响应体小于该值时读完再放回连接池，否则断开
+#define HTTP_POOL_MAX_REDIRECTS 5
+
+/**
+ * 同一个scheme://host:port的连接计数和TLS会话
+ */
+typedef struct HttpOrigin {
+    char *origin;
+    char *host;
+    int port;
+    int tls;
+    int nb_connections; // 空闲和使用中的连接数
+    struct ssl_session_st *session; // 最近的TLS会话，新连接用于会话恢复
+    struct HttpPool *pool;
+    struct HttpOrigin *next;
+} HttpOrigin;
+
+/**
+ * 一个HTTP/1.1连接，rbuf缓存响应头之后已读到的数据
+ */
+typedef struct HttpConnection {
+    HttpOrigin *origin;
+    int fd;
+    struct ssl_st *ssl;
+    int64_t idle_since; // 放回连接池的时间，单位us
+    uint8_t rbuf[HTTP_POOL_HEADER_SIZE];
+    int rpos;
+    int rlen;
+    struct HttpConnection *next;
+} HttpConnection;
+
+/**
+ * 一次请求的响应状态
+ */
+typedef struct HttpResponse {
+    int status;
+    int keep_alive;
+    int64_t content_length; // -1为未知，读到连接关闭
+    int64_t range_start; // 响应体在文件中的起始位置
+    int64_t total_size; // 文件总长度，-1为未知
+    int64_t remaining; // 未读的响应体字节数
+} HttpResponse;
+
+/**
+ * 进程内共享的HTTP连接池，多线程安全
+ * 每个origin最多max_per_host个连接，超过时等待其他请求释放；空闲超过idle_timeout的连接被关闭
+ */
+typedef struct HttpPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    HttpConnection *idle;
+    HttpOrigin *origins;
+    int max_per_host;
+    int idle_timeout;
+    int timeout;
+    struct ssl_ctx_st *ssl_ctx;
+    struct bio_method_st *bio_method; // 发送时不触发SIGPIPE的socket BIO
+    int64_t connects; // 新建的连接数
+    int64_t reuses; // 复用的连接数
+    int64_t tls_resumed; // 恢复了TLS会话的新连接数
+} HttpPool;
+
+HttpPool *create_http_pool(int max_per_host, int idle_timeout, int timeout, int verify_peer);
+
+void free_http_pool(HttpPool **pool);
+
+int http_pool_get(HttpPool *pool, const char *url, int64_t start, int64_t end, HttpConnection **conn,
+                  HttpResponse *response);
+
+int http_read_body(HttpConnection *conn, HttpResponse *response, uint8_t *buf, int size);
+
+void http_pool_release(HttpPool *pool, HttpConnection **conn, HttpResponse *response);
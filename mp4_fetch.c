@@ -0,0 +1,644 @@
+//
+// mp4远程最小字节读取：按range请求只读取moov和截图时间点的同步样本，不经过demuxer顺序读取
+//
+#include "mp4_fetch.h"
+#include <libavutil/intreadwrite.h>
+#include <libavutil/opt.h>
+#include <string.h>
+
+typedef struct RangeReader {
+    AVIOContext *pb;
+    int64_t size;
+    int64_t bytes_fetched;
+} RangeReader;
+
+
+/**
+ * 视频轨的样本表，指向moov内的box负载
+ */
+typedef struct SampleTables {
+    const uint8_t *stsd, *stts, *ctts, *stss, *stsz, *stsc, *stco;
+    int64_t stsd_size, stts_size, ctts_size, stss_size, stsz_size, stsc_size, stco_size;
+    int co64;
+    uint32_t timescale;
+    int64_t media_time; // elst中第一个显示的样本在媒体时间轴上的位置
+} SampleTables;
+
+
+/**
+ * 读取[offset, offset+size)的数据，http协议通过end_offset限定range，只请求需要的字节
+ * @param reader
+ * @param offset
+ * @param buf
+ * @param size
+ * @return
+ */
+static int read_range(RangeReader *reader, int64_t offset, uint8_t *buf, int size) {
+    int ret, n = 0;
+    int64_t pos;
+    av_opt_set_int(reader->pb, "end_offset", offset + size, AV_OPT_SEARCH_CHILDREN); // 非http协议没有该选项
+    if ((pos = avio_seek(reader->pb, offset, SEEK_SET)) < 0) {
+        printf("avio_seek failed, %s\n", av_err2str((int) pos));
+        return (int) pos;
+    }
+    while (n < size) {
+        ret = avio_read(reader->pb, buf + n, size - n);
+        if (ret <= 0) {
+            printf("avio_read range failed, %s\n", av_err2str(ret == 0 ? AVERROR_EOF : ret));
+            return ret == 0 ? AVERROR_EOF : ret;
+        }
+        n += ret;
+    }
+    reader->bytes_fetched += size;
+    return 0;
+}
+
+
+/**
+ * 解析box头
+ * @param buf
+ * @param size buf中可用的字节数
+ * @param box_size 返回box总长度，size字段为0时返回0表示到文件尾
+ * @param header_size 返回box头长度
+ * @return 可用字节不足以解析box头时返回0，成功返回1
+ */
+static int parse_box_header(const uint8_t *buf, int64_t size, int64_t *box_size, int *header_size) {
+    if (size < 8) {
+        return 0;
+    }
+    *box_size = AV_RB32(buf);
+    *header_size = 8;
+    if (*box_size == 1) {
+        if (size < 16) {
+            return 0;
+        }
+        *box_size = (int64_t) AV_RB64(buf + 8);
+        *header_size = 16;
+    }
+    return 1;
+}
+
+
+/**
+ * 遍历内存中的同级box
+ * @param buf
+ * @param size
+ * @param offset 当前位置，返回时指向下一个box
+ * @param type 返回box类型
+ * @param payload 返回box负载
+ * @param payload_size 返回负载长度
+ * @return 结束返回0，成功返回1，box越界返回-1
+ */
+static int next_box(const uint8_t *buf, int64_t size, int64_t *offset, const uint8_t **type,
+                    const uint8_t **payload, int64_t *payload_size) {
+    int64_t box_size;
+    int header_size;
+    if (!parse_box_header(buf + *offset, size - *offset, &box_size, &header_size)) {
+        return 0;
+    }
+    if (box_size == 0) {
+        box_size = size - *offset;
+    }
+    if (box_size < header_size || box_size > size - *offset) {
+        return -1;
+    }
+    *type = buf + *offset + 4;
+    *payload = buf + *offset + header_size;
+    *payload_size = box_size - header_size;
+    *offset += box_size;
+    return 1;
+}
+
+
+/**
+ * 查找第一个指定类型的子box
+ * @return 未找到返回NULL
+ */
+static const uint8_t *find_box(const uint8_t *buf, int64_t size, const char *name, int64_t *payload_size) {
+    int64_t offset = 0;
+    const uint8_t *type, *payload;
+    while (next_box(buf, size, &offset, &type, &payload, payload_size) > 0) {
+        if (!memcmp(type, name, 4)) {
+            return payload;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * 逐个读取顶层box头定位moov并读入内存，moov在mdat之后时用一次range请求读取文件尾
+ * @param reader
+ * @param moov 返回av_malloc的moov负载
+ * @param moov_size
+ * @return
+ */
+static int read_moov(RangeReader *reader, uint8_t **moov, int64_t *moov_size) {
+    uint8_t head[MP4_FETCH_HEAD_SIZE], header[16];
+    const uint8_t *type, *payload;
+    int64_t offset = 0, box_size, head_size = MP4_FETCH_HEAD_SIZE, tail_offset, payload_size;
+    int header_size, ret;
+    uint8_t *tail = NULL;
+    if (reader->size > 0 && reader->size < head_size) {
+        head_size = reader->size;
+    }
+    if ((ret = read_range(reader, 0, head, (int) head_size)) < 0) {
+        return ret;
+    }
+    if (head_size < 8 || memcmp(head + 4, "ftyp", 4)) {
+        printf("not a mp4 file\n");
+        return -1;
+    }
+    while (reader->size <= 0 || offset < reader->size) {
+        if (offset + 16 <= head_size || (offset + 8 <= head_size && AV_RB32(head + offset) != 1)) {
+            memcpy(header, head + offset, 16 < head_size - offset ? 16 : head_size - offset);
+        } else {
+            int n = reader->size > 0 && reader->size - offset < 16 ? (int) (reader->size - offset) : 16;
+            if ((ret = read_range(reader, offset, header, n)) < 0) {
+                return ret;
+            }
+        }
+        if (!parse_box_header(header, 16, &box_size, &header_size)) {
+            return -1;
+        }
+        if (box_size == 0 && reader->size > 0) {
+            box_size = reader->size - offset;
+        }
+        if (box_size < header_size) {
+            printf("invalid mp4 box at %"PRId64"\n", offset);
+            return -1;
+        }
+        if (!memcmp(header + 4, "moov", 4)) {
+            if (box_size > MP4_FETCH_MAX_MOOV_SIZE) {
+                printf("mp4 moov too large, %"PRId64"\n", box_size);
+                return -1;
+            }
+            *moov_size = box_size - header_size;
+            if (!(*moov = av_malloc(*moov_size))) {
+                return AVERROR(ENOMEM);
+            }
+            if (offset + box_size <= head_size) { // moov已在文件头数据内
+                memcpy(*moov, head + offset + header_size, *moov_size);
+                return 0;
+            }
+            ret = read_range(reader, offset + header_size, *moov, (int) *moov_size);
+            if (ret < 0) {
+                av_freep(moov);
+            }
+            return ret;
+        }
+        tail_offset = offset + box_size;
+        if (!memcmp(header + 4, "mdat", 4) && reader->size > tail_offset &&
+            reader->size - tail_offset <= MP4_FETCH_MAX_MOOV_SIZE) {
+            // moov位于mdat之后，一次请求读取mdat之后的全部数据
+            if (!(tail = av_malloc(reader->size - tail_offset))) {
+                return AVERROR(ENOMEM);
+            }
+            if ((ret = read_range(reader, tail_offset, tail, (int) (reader->size - tail_offset))) < 0) {
+                av_free(tail);
+                return ret;
+            }
+            offset = 0;
+            while (next_box(tail, reader->size - tail_offset, &offset, &type, &payload, &payload_size) > 0) {
+                if (!memcmp(type, "moov", 4)) {
+                    *moov_size = payload_size;
+                    if (!(*moov = av_malloc(payload_size))) {
+                        av_free(tail);
+                        return AVERROR(ENOMEM);
+                    }
+                    memcpy(*moov, payload, payload_size);
+                    av_free(tail);
+                    return 0;
+                }
+            }
+            av_free(tail);
+            break;
+        }
+        offset = tail_offset;
+    }
+    printf("mp4 moov not found\n");
+    return -1;
+}
+
+
+/**
+ * 解析elst，只支持单个速率为1的编辑
+ * @param elst
+ * @param elst_size
+ * @param media_time 编辑开始的媒体时间，以timescale为单位
+ * @return 空编辑、多个编辑或变速时返回负数，交由demuxer处理
+ */
+static int parse_edit_list(const uint8_t *elst, int64_t elst_size, int64_t *media_time) {
+    // 每项为segment_duration、media_time和media_rate，version 1时前两个字段为64位
+    int entry_size = elst_size >= 8 && elst[0] == 1 ? 20 : 12;
+    if (elst_size < 8 + entry_size || AV_RB32(elst + 4) != 1) {
+        return -1;
+    }
+    *media_time = entry_size == 20 ? (int64_t) AV_RB64(elst + 16) : (int32_t) AV_RB32(elst + 12);
+    if (*media_time < 0 || AV_RB32(elst + 8 + entry_size - 4) != 0x10000) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * 在moov中查找第一个视频轨的样本表
+ * @param moov
+ * @param moov_size
+ * @param tables
+ * @return
+ */
+static int find_video_tables(const uint8_t *moov, int64_t moov_size, SampleTables *tables) {
+    int64_t offset = 0, trak_size, mdia_size, hdlr_size, mdhd_size, minf_size, stbl_size, edts_size, elst_size;
+    const uint8_t *type, *trak, *mdia, *hdlr, *mdhd, *minf, *stbl, *edts, *elst;
+    while (next_box(moov, moov_size, &offset, &type, &trak, &trak_size) > 0) {
+        if (memcmp(type, "trak", 4)) {
+            continue;
+        }
+        if (!(mdia = find_box(trak, trak_size, "mdia", &mdia_size)) ||
+            !(hdlr = find_box(mdia, mdia_size, "hdlr", &hdlr_size)) || hdlr_size < 12 ||
+            memcmp(hdlr + 8, "vide", 4)) {
+            continue;
+        }
+        if (!(mdhd = find_box(mdia, mdia_size, "mdhd", &mdhd_size)) || mdhd_size < 24 ||
+            !(minf = find_box(mdia, mdia_size, "minf", &minf_size)) ||
+            !(stbl = find_box(minf, minf_size, "stbl", &stbl_size))) {
+            continue;
+        }
+        memset(tables, 0, sizeof(*tables));
+        tables->timescale = AV_RB32(mdhd + (mdhd[0] == 1 ? 20 : 12));
+        tables->stsd = find_box(stbl, stbl_size, "stsd", &tables->stsd_size);
+        tables->stts = find_box(stbl, stbl_size, "stts", &tables->stts_size);
+        tables->ctts = find_box(stbl, stbl_size, "ctts", &tables->ctts_size);
+        tables->stss = find_box(stbl, stbl_size, "stss", &tables->stss_size);
+        tables->stsz = find_box(stbl, stbl_size, "stsz", &tables->stsz_size);
+        tables->stsc = find_box(stbl, stbl_size, "stsc", &tables->stsc_size);
+        tables->stco = find_box(stbl, stbl_size, "stco", &tables->stco_size);
+        if (!tables->stco) {
+            tables->stco = find_box(stbl, stbl_size, "co64", &tables->stco_size);
+            tables->co64 = 1;
+        }
+        if (!tables->stsd || !tables->stts || !tables->stsz || !tables->stsc || !tables->stco ||
+            !tables->timescale) {
+            printf("mp4 video track sample tables incomplete\n");
+            return -1;
+        }
+        if ((edts = find_box(trak, trak_size, "edts", &edts_size)) &&
+            (elst = find_box(edts, edts_size, "elst", &elst_size)) &&
+            parse_edit_list(elst, elst_size, &tables->media_time) < 0) {
+            printf("mp4 edit list not supported\n");
+            return -1;
+        }
+        return 0;
+    }
+    printf("mp4 video track not found\n");
+    return -1;
+}
+
+
+/**
+ * 读取mpeg4描述符的长度
+ */
+static int read_descriptor_length(const uint8_t **p, const uint8_t *end) {
+    int length = 0, i;
+    for (i = 0; i < 4 && *p < end; ++i) {
+        uint8_t c = *(*p)++;
+        length = (length << 7) | (c & 0x7f);
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    return length;
+}
+
+
+/**
+ * 从esds中解析DecoderSpecificInfo作为extradata
+ */
+static int parse_esds(const uint8_t *esds, int64_t esds_size, AVCodecParameters *codecpar) {
+    const uint8_t *p = esds + 4, *end = esds + esds_size;
+    int tag, length, flags;
+    while (p + 2 <= end) {
+        tag = *p++;
+        length = read_descriptor_length(&p, end);
+        if (tag == 0x03) { // ES_Descriptor
+            if (p + 3 > end) {
+                return -1;
+            }
+            flags = p[2];
+            p += 3;
+            if (flags & 0x80) {
+                p += 2;
+            }
+            if (flags & 0x40 && p < end) {
+                p += 1 + *p;
+            }
+            if (flags & 0x20) {
+                p += 2;
+            }
+        } else if (tag == 0x04) { // DecoderConfigDescriptor
+            if (p + 13 > end) {
+                return -1;
+            }
+            if (p[0] >= 0x60 && p[0] <= 0x65) {
+                codecpar->codec_id = AV_CODEC_ID_MPEG2VIDEO;
+            } else if (p[0] == 0x6A) {
+                codecpar->codec_id = AV_CODEC_ID_MPEG1VIDEO;
+            } else if (p[0] == 0x6C) {
+                codecpar->codec_id = AV_CODEC_ID_MJPEG;
+            }
+            p += 13;
+        } else if (tag == 0x05) { // DecoderSpecificInfo
+            if (length <= 0 || p + length > end) {
+                return -1;
+            }
+            if (!(codecpar->extradata = av_mallocz(length + AV_INPUT_BUFFER_PADDING_SIZE))) {
+                return AVERROR(ENOMEM);
+            }
+            memcpy(codecpar->extradata, p, length);
+            codecpar->extradata_size = length;
+            return 0;
+        } else {
+            p += length;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * 由stsd第一个样本描述生成解码参数
+ * @param tables
+ * @param codecpar
+ * @return
+ */
+static int parse_sample_entry(const SampleTables *tables, AVCodecParameters *codecpar) {
+    const uint8_t *entry, *config = NULL;
+    int64_t entry_size, config_size = 0;
+    if (tables->stsd_size < 8 + 86) {
+        return -1;
+    }
+    entry = tables->stsd + 8;
+    entry_size = AV_RB32(entry);
+    if (entry_size < 86 || entry_size > tables->stsd_size - 8) {
+        return -1;
+    }
+    codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    codecpar->width = AV_RB16(entry + 32);
+    codecpar->height = AV_RB16(entry + 34);
+    codecpar->codec_tag = AV_RL32(entry + 4);
+    if (!memcmp(entry + 4, "avc1", 4) || !memcmp(entry + 4, "avc3", 4)) {
+        codecpar->codec_id = AV_CODEC_ID_H264;
+        config = find_box(entry + 86, entry_size - 86, "avcC", &config_size);
+    } else if (!memcmp(entry + 4, "hvc1", 4) || !memcmp(entry + 4, "hev1", 4)) {
+        codecpar->codec_id = AV_CODEC_ID_HEVC;
+        config = find_box(entry + 86, entry_size - 86, "hvcC", &config_size);
+    } else if (!memcmp(entry + 4, "mp4v", 4)) {
+        codecpar->codec_id = AV_CODEC_ID_MPEG4;
+        config = find_box(entry + 86, entry_size - 86, "esds", &config_size);
+        return config ? parse_esds(config, config_size, codecpar) : 0;
+    } else if (!memcmp(entry + 4, "jpeg", 4) || !memcmp(entry + 4, "mjpa", 4)) {
+        codecpar->codec_id = AV_CODEC_ID_MJPEG;
+        return 0;
+    } else {
+        printf("mp4 sample entry %.4s not supported\n", entry + 4);
+        return -1;
+    }
+    if (!config || config_size <= 0) {
+        printf("mp4 codec config box not found\n");
+        return -1;
+    }
+    if (!(codecpar->extradata = av_mallocz(config_size + AV_INPUT_BUFFER_PADDING_SIZE))) {
+        return AVERROR(ENOMEM);
+    }
+    memcpy(codecpar->extradata, config, config_size);
+    codecpar->extradata_size = (int) config_size;
+    return 0;
+}
+
+
+/**
+ * 检查full box表的条目数是否越界
+ * @return 条目数，越界返回-1
+ */
+static int64_t table_count(const uint8_t *table, int64_t table_size, int header, int entry_size) {
+    int64_t count;
+    if (!table || table_size < header) {
+        return -1;
+    }
+    count = AV_RB32(table + header - 4);
+    if (count > (table_size - header) / entry_size) {
+        return -1;
+    }
+    return count;
+}
+
+
+/**
+ * 定位样本的文件偏移、长度和时间戳
+ * @param tables
+ * @param sample 从0开始的样本序号
+ * @param offset
+ * @param size
+ * @param dts
+ * @param pts
+ * @return
+ */
+static int locate_sample(const SampleTables *tables, uint32_t sample, int64_t *offset, int *size,
+                         int64_t *dts, int64_t *pts) {
+    int64_t nb_chunks, nb_stsc, nb_stts, nb_ctts, nb_sizes, i, chunk = -1, before = 0, first_in_chunk = 0;
+    uint32_t uniform_size, spc, first, next_first, s;
+    nb_chunks = table_count(tables->stco, tables->stco_size, 8, tables->co64 ? 8 : 4);
+    nb_stsc = table_count(tables->stsc, tables->stsc_size, 8, 12);
+    nb_stts = table_count(tables->stts, tables->stts_size, 8, 8);
+    if (nb_chunks <= 0 || nb_stsc <= 0 || nb_stts < 0 || tables->stsz_size < 12) {
+        return -1;
+    }
+    uniform_size = AV_RB32(tables->stsz + 4);
+    nb_sizes = uniform_size ? 0 : table_count(tables->stsz, tables->stsz_size, 12, 4);
+    if (!uniform_size && (nb_sizes < 0 || sample >= nb_sizes)) {
+        return -1;
+    }
+    // stsc按chunk游程记录每个chunk的样本数
+    for (i = 0; i < nb_stsc && chunk < 0; ++i) {
+        first = AV_RB32(tables->stsc + 8 + i * 12);
+        spc = AV_RB32(tables->stsc + 8 + i * 12 + 4);
+        next_first = i + 1 < nb_stsc ? AV_RB32(tables->stsc + 8 + (i + 1) * 12) : (uint32_t) nb_chunks + 1;
+        if (!spc || !first || next_first < first) {
+            return -1;
+        }
+        if (sample < before + (int64_t) (next_first - first) * spc) {
+            chunk = first - 1 + (sample - before) / spc;
+            first_in_chunk = sample - (sample - before) % spc;
+        }
+        before += (int64_t) (next_first - first) * spc;
+    }
+    if (chunk < 0 || chunk >= nb_chunks) {
+        return -1;
+    }
+    *offset = tables->co64 ? (int64_t) AV_RB64(tables->stco + 8 + chunk * 8) : AV_RB32(tables->stco + 8 + chunk * 4);
+    for (s = first_in_chunk; s < sample; ++s) {
+        *offset += uniform_size ? uniform_size : AV_RB32(tables->stsz + 12 + s * 4);
+    }
+    *size = (int) (uniform_size ? uniform_size : AV_RB32(tables->stsz + 12 + sample * 4));
+    // stts累加样本时长得到dts，ctts为pts相对dts的偏移
+    *dts = 0;
+    before = 0;
+    for (i = 0; i < nb_stts; ++i) {
+        uint32_t count = AV_RB32(tables->stts + 8 + i * 8), delta = AV_RB32(tables->stts + 8 + i * 8 + 4);
+        if (sample < before + count) {
+            *dts += (int64_t) (sample - before) * delta;
+            break;
+        }
+        *dts += (int64_t) count * delta;
+        before += count;
+    }
+    *pts = *dts;
+    nb_ctts = table_count(tables->ctts, tables->ctts_size, 8, 8);
+    before = 0;
+    for (i = 0; i < nb_ctts; ++i) {
+        uint32_t count = AV_RB32(tables->ctts + 8 + i * 8);
+        if (sample < before + count) {
+            *pts += (int32_t) AV_RB32(tables->ctts + 8 + i * 8 + 4);
+            break;
+        }
+        before += count;
+    }
+    return 0;
+}
+
+
+/**
+ * 按stts把时间点映射为样本：dts不超过时间点的最后一个样本
+ * @param tables
+ * @param timestamp 以timescale为单位
+ * @return 从0开始的样本序号，没有样本时返回-1
+ */
+static int64_t find_sample_by_time(const SampleTables *tables, int64_t timestamp) {
+    int64_t nb_stts = table_count(tables->stts, tables->stts_size, 8, 8), i, sample = 0, dts = 0;
+    uint32_t count, delta;
+    for (i = 0; i < nb_stts; ++i) {
+        count = AV_RB32(tables->stts + 8 + i * 8);
+        delta = AV_RB32(tables->stts + 8 + i * 8 + 4);
+        if (count > 0 && delta > 0 && timestamp < dts + (int64_t) count * delta) {
+            return sample + (timestamp > dts ? (timestamp - dts) / delta : 0);
+        }
+        dts += (int64_t) count * delta;
+        sample += count;
+    }
+    return sample - 1; // 超过时长时取最后一个样本
+}
+
+
+/**
+ * 选择不晚于目标样本的最近一个同步样本，目标在第一个同步样本之前时取第一个，没有stss时所有样本都是同步样本
+ * @param tables
+ * @param sample 目标样本，从0开始
+ * @return 从0开始的样本序号
+ */
+static int64_t choose_sync_sample(const SampleTables *tables, int64_t sample) {
+    int64_t nb_sync = table_count(tables->stss, tables->stss_size, 8, 4), low = 0, high, middle;
+    uint32_t sync;
+    if (!tables->stss) {
+        return sample;
+    }
+    if (nb_sync <= 0) {
+        return -1;
+    }
+    // stss中的样本序号从1开始递增
+    high = nb_sync;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (AV_RB32(tables->stss + 8 + middle * 4) <= sample + 1) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    sync = AV_RB32(tables->stss + 8 + (low > 0 ? low - 1 : 0) * 4);
+    return sync > 0 ? (int64_t) sync - 1 : -1;
+}
+
+
+/**
+ * 按range请求读取远程mp4的moov和截图时间点之前最近的同步样本
+ * @param url
+ * @param position 截图时间点，单位ms，与demuxer相同从elst编辑的起点算起，<=0时取第一个同步样本
+ * @param io_options 打开avio的选项
+ * @param keyframe 返回的关键帧，使用free_mp4_keyframe释放
+ * @return 不支持的edit list也返回负数，由调用方回退到demuxer
+ */
+int fetch_mp4_keyframe(const char *url, int64_t position, AVDictionary **io_options, Mp4Keyframe **keyframe) {
+    RangeReader reader = {NULL, 0, 0};
+    SampleTables tables;
+    uint8_t *moov = NULL;
+    int64_t moov_size = 0, timestamp, sample, offset, dts, pts;
+    uint32_t delta;
+    int ret, size;
+    if (!(*keyframe = av_mallocz(sizeof(Mp4Keyframe)))) {
+        return AVERROR(ENOMEM);
+    }
+    // 首个请求只取文件头，避免打开时拉取整个文件
+    av_dict_set_int(io_options, "end_offset", MP4_FETCH_HEAD_SIZE, 0);
+    av_dict_set(io_options, "multiple_requests", "1", 0);
+    if ((ret = avio_open2(&reader.pb, url, AVIO_FLAG_READ | AVIO_FLAG_DIRECT, NULL, io_options)) < 0) {
+        printf("avio_open2 failed, %s\n", av_err2str(ret));
+        goto fail;
+    }
+    reader.size = avio_size(reader.pb);
+    if ((ret = read_moov(&reader, &moov, &moov_size)) < 0) {
+        goto fail;
+    }
+    if ((ret = find_video_tables(moov, moov_size, &tables)) < 0) {
+        goto fail;
+    }
+    if (!((*keyframe)->codecpar = avcodec_parameters_alloc()) || !((*keyframe)->packet = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((ret = parse_sample_entry(&tables, (*keyframe)->codecpar)) < 0) {
+        goto fail;
+    }
+    // 显示时间加上编辑的起点得到媒体时间
+    timestamp = av_rescale(FFMAX(position, 0), tables.timescale, 1000) + tables.media_time;
+    if ((sample = find_sample_by_time(&tables, timestamp)) < 0 || (sample = choose_sync_sample(&tables, sample)) < 0 ||
+        locate_sample(&tables, (uint32_t) sample, &offset, &size, &dts, &pts) < 0 || size <= 0) {
+        printf("mp4 sync sample not found\n");
+        ret = -1;
+        goto fail;
+    }
+    if ((ret = av_new_packet((*keyframe)->packet, size)) < 0) {
+        goto fail;
+    }
+    if ((ret = read_range(&reader, offset, (*keyframe)->packet->data, size)) < 0) {
+        goto fail;
+    }
+    (*keyframe)->packet->flags |= AV_PKT_FLAG_KEY;
+    (*keyframe)->packet->dts = dts - tables.media_time;
+    (*keyframe)->packet->pts = pts - tables.media_time;
+    (*keyframe)->time_base = (AVRational) {1, (int) tables.timescale};
+    delta = table_count(tables.stts, tables.stts_size, 8, 8) > 0 ? AV_RB32(tables.stts + 12) : 0;
+    (*keyframe)->framerate = delta ? (AVRational) {(int) tables.timescale, (int) delta} : (AVRational) {25, 1};
+    (*keyframe)->bytes_fetched = reader.bytes_fetched;
+    printf("mp4 keyframe fetched, sample:%"PRId64", offset:%"PRId64", size:%d, bytes:%"PRId64"\n",
+           sample, offset, size, reader.bytes_fetched);
+    av_free(moov);
+    avio_closep(&reader.pb);
+    return 0;
+    fail:
+    av_free(moov);
+    avio_closep(&reader.pb);
+    free_mp4_keyframe(keyframe);
+    return ret < 0 ? ret : -1;
+}
+
+
+void free_mp4_keyframe(Mp4Keyframe **keyframe) {
+    if (!*keyframe) {
+        return;
+    }
+    avcodec_parameters_free(&((*keyframe)->codecpar));
+    av_packet_free(&((*keyframe)->packet));
+    av_freep(keyframe);
+}
@@ -0,0 +1,19 @@
+#include <libavformat/avformat.h>
+
+#define MP4_FETCH_HEAD_SIZE 4096
+#define MP4_FETCH_MAX_MOOV_SIZE (64 * 1024 * 1024)
+
+/**
+ * 按range请求读取的mp4关键帧：视频轨的解码参数和一个同步样本
+ */
+typedef struct Mp4Keyframe {
+    AVCodecParameters *codecpar;
+    AVRational time_base;
+    AVRational framerate;
+    AVPacket *packet;
+    int64_t bytes_fetched;
+} Mp4Keyframe;
+
+int fetch_mp4_keyframe(const char *url, int64_t position, AVDictionary **io_options, Mp4Keyframe **keyframe);
+
+void free_mp4_keyframe(Mp4Keyframe **keyframe);
@@ -0,0 +1,223 @@
+//
+// 在解码前按NAL类型识别H.264/HEVC的随机访问点，不依赖demuxer设置的AV_PKT_FLAG_KEY
+//
+#include "nal.h"
+#include <libavutil/intreadwrite.h>
+
+#define H264_NAL_SEI 6
+#define H264_NAL_IDR 5
+#define HEVC_NAL_BLA_W_LP 16
+#define HEVC_NAL_CRA 21
+#define HEVC_NAL_RSV_IRAP_23 23
+#define HEVC_NAL_PREFIX_SEI 39
+#define SEI_RECOVERY_POINT 6
+
+/**
+ * 跳过防竞争字节的按位读取，只用于SEI开头的几个字段
+ */
+typedef struct BitReader {
+    const uint8_t *data;
+    int size;
+    int pos; // 字节位置
+    int bit;
+    int zeros; // 连续的0字节数
+} BitReader;
+
+
+static int read_bit(BitReader *reader) {
+    int value;
+    if (reader->bit == 0) {
+        if (reader->pos >= reader->size) {
+            return -1;
+        }
+        if (reader->zeros >= 2 && reader->data[reader->pos] == 3) {
+            reader->zeros = 0;
+            if (++reader->pos >= reader->size) {
+                return -1;
+            }
+        }
+        reader->zeros = reader->data[reader->pos] ? 0 : reader->zeros + 1;
+    }
+    value = (reader->data[reader->pos] >> (7 - reader->bit)) & 1;
+    if (++reader->bit == 8) {
+        reader->bit = 0;
+        reader->pos++;
+    }
+    return value;
+}
+
+
+/**
+ * 读取指数哥伦布编码的无符号数
+ * @param reader
+ * @return 数据不足时返回-1
+ */
+static int read_ue(BitReader *reader) {
+    int leading_zeros = 0, bit, value = 0, i;
+    while ((bit = read_bit(reader)) == 0) {
+        if (++leading_zeros > 30) {
+            return -1;
+        }
+    }
+    if (bit < 0) {
+        return -1;
+    }
+    for (i = 0; i < leading_zeros; ++i) {
+        if ((bit = read_bit(reader)) < 0) {
+            return -1;
+        }
+        value = (value << 1) | bit;
+    }
+    return (1 << leading_zeros) - 1 + value;
+}
+
+
+/**
+ * 在SEI NAL的payload中查找recovery point
+ * @param payload NAL头之后的数据
+ * @param size
+ * @param hevc HEVC的recovery_poc_cnt为有符号数
+ * @return recovery point之后需要丢弃的帧数，没有recovery point时返回-1
+ */
+static int parse_recovery_point(const uint8_t *payload, int size, int hevc) {
+    BitReader reader = {payload, size, 0, 0, 0};
+    int type, payload_size, byte, count, i;
+    while (reader.pos < size && payload[reader.pos] != 0x80) { // rbsp_trailing_bits
+        for (type = 0; (byte = reader.pos < size ? payload[reader.pos++] : -1) == 0xff; type += 255);
+        if (byte < 0) {
+            return -1;
+        }
+        type += byte;
+        for (payload_size = 0; (byte = reader.pos < size ? payload[reader.pos++] : -1) == 0xff; payload_size += 255);
+        if (byte < 0) {
+            return -1;
+        }
+        payload_size += byte;
+        if (type == SEI_RECOVERY_POINT) {
+            if ((count = read_ue(&reader)) < 0) {
+                return -1;
+            }
+            if (hevc) { // se(v)，负数表示recovery point在当前帧之前
+                count = (count & 1) ? (count + 1) / 2 : 0;
+            }
+            return count;
+        }
+        for (i = 0; i < payload_size && reader.pos < size; ++i) {
+            reader.pos++;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * 按NAL类型判断单个NAL的随机访问类型
+ * @param inspector
+ * @param nal 包含NAL头
+ * @param size
+ * @param recovery_frames
+ * @return RandomAccessType，非VCL且不是recovery point时返回RANDOM_ACCESS_UNKNOWN
+ */
+static int inspect_nal(const NalInspector *inspector, const uint8_t *nal, int size, int *recovery_frames) {
+    int type, count;
+    if (size < 2) {
+        return RANDOM_ACCESS_UNKNOWN;
+    }
+    if (inspector->codec_id == AV_CODEC_ID_H264) {
+        type = nal[0] & 0x1f;
+        if (type == H264_NAL_IDR) {
+            return RANDOM_ACCESS_CLEAN;
+        }
+        if (type == H264_NAL_SEI && (count = parse_recovery_point(nal + 1, size - 1, 0)) >= 0) {
+            *recovery_frames = count;
+            return count ? RANDOM_ACCESS_RECOVERY : RANDOM_ACCESS_CLEAN;
+        }
+        return type >= 1 && type <= 4 ? RANDOM_ACCESS_NONE : RANDOM_ACCESS_UNKNOWN;
+    }
+    type = (nal[0] >> 1) & 0x3f;
+    if (type >= HEVC_NAL_BLA_W_LP && type <= HEVC_NAL_RSV_IRAP_23) { // BLA/IDR/CRA
+        return RANDOM_ACCESS_CLEAN;
+    }
+    if (type == HEVC_NAL_PREFIX_SEI && size > 2 && (count = parse_recovery_point(nal + 2, size - 2, 1)) >= 0) {
+        *recovery_frames = count;
+        return count ? RANDOM_ACCESS_RECOVERY : RANDOM_ACCESS_CLEAN;
+    }
+    return type < HEVC_NAL_BLA_W_LP ? RANDOM_ACCESS_NONE : RANDOM_ACCESS_UNKNOWN;
+}
+
+
+/**
+ * 初始化码流检查器，avcC/hvcC的extradata确定NAL长度字段的字节数
+ * @param inspector
+ * @param codec_id
+ * @param extradata
+ * @param extradata_size
+ */
+void init_nal_inspector(NalInspector *inspector, enum AVCodecID codec_id, const uint8_t *extradata,
+                        int extradata_size) {
+    inspector->codec_id = codec_id;
+    inspector->nal_length_size = 0;
+    if (!extradata || extradata_size < 7 || extradata[0] != 1) { // Annex B的extradata以起始码开头
+        return;
+    }
+    if (codec_id == AV_CODEC_ID_H264) {
+        inspector->nal_length_size = (extradata[4] & 3) + 1;
+    } else if (codec_id == AV_CODEC_ID_HEVC && extradata_size >= 23) {
+        inspector->nal_length_size = (extradata[21] & 3) + 1;
+    }
+}
+
+
+/**
+ * 检查包中所有NAL，判断能否从该包开始解码
+ * @param inspector
+ * @param data
+ * @param size
+ * @param recovery_frames RANDOM_ACCESS_RECOVERY时返回需要丢弃的帧数
+ * @return RandomAccessType
+ */
+int inspect_random_access(const NalInspector *inspector, const uint8_t *data, int size, int *recovery_frames) {
+    const uint8_t *end = data + size, *nal, *next;
+    int64_t nal_size;
+    int type, result = RANDOM_ACCESS_UNKNOWN, i;
+    *recovery_frames = 0;
+    if (inspector->codec_id != AV_CODEC_ID_H264 && inspector->codec_id != AV_CODEC_ID_HEVC) {
+        return RANDOM_ACCESS_UNKNOWN;
+    }
+    // 包内Annex B起始码优先，部分AVCC流中也混有起始码
+    if (inspector->nal_length_size && !(size > 3 && AV_RB24(data) == 1) && !(size > 4 && AV_RB32(data) == 1)) {
+        while (end - data > inspector->nal_length_size) {
+            for (nal_size = 0, i = 0; i < inspector->nal_length_size; ++i) {
+                nal_size = (nal_size << 8) | data[i];
+            }
+            data += inspector->nal_length_size;
+            if (nal_size <= 0 || nal_size > end - data) {
+                break;
+            }
+            if ((type = inspect_nal(inspector, data, (int) nal_size, recovery_frames)) > RANDOM_ACCESS_NONE) {
+                return type;
+            }
+            result = FFMAX(result, type);
+            data += nal_size;
+        }
+        return result;
+    }
+    for (nal = data; nal + 3 <= end; nal = next) {
+        // 定位起始码之后的NAL头
+        while (nal + 3 <= end && AV_RB24(nal) != 1) {
+            nal++;
+        }
+        if ((nal += 3) >= end) {
+            break;
+        }
+        for (next = nal; next + 3 <= end && AV_RB24(next) != 1; next++);
+        if (next + 3 > end) {
+            next = end;
+        }
+        if ((type = inspect_nal(inspector, nal, (int) (next - nal), recovery_frames)) > RANDOM_ACCESS_NONE) {
+            return type;
+        }
+        result = FFMAX(result, type);
+    }
+    return result;
+}
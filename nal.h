@@ -0,0 +1,24 @@
+#include <libavcodec/avcodec.h>
+
+/**
+ * 包的随机访问类型
+ */
+enum RandomAccessType {
+    RANDOM_ACCESS_UNKNOWN = -1, // 不是H.264/HEVC或无法解析，由调用方参考AV_PKT_FLAG_KEY
+    RANDOM_ACCESS_NONE = 0, // 不能从该包开始解码
+    RANDOM_ACCESS_CLEAN, // IDR/CRA/BLA，或recovery_frame_cnt为0的recovery point，第一帧即为完整画面
+    RANDOM_ACCESS_RECOVERY, // recovery point SEI，recovery_frames帧之后才是完整画面
+};
+
+/**
+ * H.264/HEVC码流检查器，由extradata确定Annex B或AVCC/HVCC的NAL长度字段
+ */
+typedef struct NalInspector {
+    enum AVCodecID codec_id;
+    int nal_length_size; // 0为Annex B
+} NalInspector;
+
+void init_nal_inspector(NalInspector *inspector, enum AVCodecID codec_id, const uint8_t *extradata,
+                        int extradata_size);
+
+int inspect_random_access(const NalInspector *inspector, const uint8_t *data, int size, int *recovery_frames);
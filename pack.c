@@ -0,0 +1,361 @@
+//
+// 把大量截图追加写入少数大文件，避免每张截图一个文件的创建、打开和元数据开销
+//
+#include "pack.h"
+#include "diskcache.h"
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+/**
+ * key字符串的哈希，与磁盘缓存使用相同的FNV-1a
+ * @param key
+ * @return
+ */
+uint64_t pack_key(const char *key) {
+    return disk_cache_hash(0, key, strlen(key));
+}
+
+
+/**
+ * 写入完整的iovec，处理部分写入
+ * @param fd
+ * @param iov
+ * @param iovcnt
+ * @param offset
+ * @return
+ */
+static int pwritev_fully(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    ssize_t n;
+    while (iovcnt > 0) {
+        if ((n = pwritev(fd, iov, iovcnt, offset)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * 打开pack文件追加写入，文件已存在时从末尾继续
+ * @param path pack文件路径，索引文件为path.idx
+ * @return
+ */
+PackWriter *open_pack_writer(const char *path) {
+    char index_path[4096];
+    uint64_t magic = PACK_MAGIC;
+    struct stat st;
+    PackWriter *writer = (PackWriter *) calloc(1, sizeof(PackWriter));
+    if (!writer) {
+        return NULL;
+    }
+    writer->pack_fd = writer->index_fd = -1;
+    snprintf(index_path, sizeof(index_path), "%s%s", path, PACK_INDEX_SUFFIX);
+    if ((writer->pack_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+        (writer->index_fd = open(index_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0 ||
+        fstat(writer->pack_fd, &st) < 0) {
+        printf("open pack failed, %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    writer->offset = (uint64_t) st.st_size;
+    if (writer->offset == 0) {
+        if (pwrite(writer->pack_fd, &magic, sizeof(magic), 0) != sizeof(magic)) {
+            printf("write pack header failed, %s\n", strerror(errno));
+            goto fail;
+        }
+        writer->offset = sizeof(magic);
+    }
+    pthread_mutex_init(&(writer->mutex), NULL);
+    return writer;
+    fail:
+    if (writer->pack_fd >= 0) {
+        close(writer->pack_fd);
+    }
+    if (writer->index_fd >= 0) {
+        close(writer->index_fd);
+    }
+    free(writer);
+    return NULL;
+}
+
+
+/**
+ * 追加一张截图，先写数据再写索引，进程崩溃后索引不会指向未写完的数据
+ * 两次写入之间没有fsync，掉电时索引可能先于数据落盘，由读取时校验记录头和key发现；
+ * 需要持久化时在close_pack_writer同步之后才算写入完成
+ * @param writer
+ * @param key 截图的key，如原来的输出路径
+ * @param data
+ * @param size
+ * @param meta 可以为NULL
+ * @return
+ */
+int pack_writer_append(PackWriter *writer, const char *key, const uint8_t *data, int size,
+                       const PackEntryMeta *meta) {
+    PackRecordHeader header;
+    PackEntry entry;
+    struct iovec iov[3];
+    int ret;
+    memset(&entry, 0, sizeof(entry));
+    header.key = entry.key = pack_key(key);
+    header.length = entry.length = (uint32_t) size;
+    header.key_length = entry.key_length = (uint32_t) strlen(key);
+    if (meta) {
+        entry.width = meta->width;
+        entry.height = meta->height;
+        entry.timestamp = meta->timestamp;
+    }
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) key;
+    iov[1].iov_len = header.key_length;
+    iov[2].iov_base = (void *) data;
+    iov[2].iov_len = (size_t) size;
+    pthread_mutex_lock(&(writer->mutex));
+    entry.offset = writer->offset + sizeof(header) + header.key_length;
+    if ((ret = pwritev_fully(writer->pack_fd, iov, 3, (off_t) writer->offset)) == 0) {
+        writer->offset = entry.offset + size;
+        if (write(writer->index_fd, &entry, sizeof(entry)) != sizeof(entry)) {
+            ret = AVERROR(errno ? errno : EIO);
+        } else {
+            writer->nb_entries++;
+        }
+    }
+    pthread_mutex_unlock(&(writer->mutex));
+    if (ret < 0) {
+        printf("pack append failed, %s: %s\n", key, av_err2str(ret));
+    }
+    return ret;
+}
+
+
+/**
+ * 同步并关闭pack，一批截图只需在关闭时fdatasync一次
+ * @param writer
+ * @return
+ */
+int close_pack_writer(PackWriter **writer) {
+    int ret = 0;
+    if (!*writer) {
+        return 0;
+    }
+    if (fdatasync((*writer)->pack_fd) < 0 || fdatasync((*writer)->index_fd) < 0) {
+        ret = AVERROR(errno);
+    }
+    close((*writer)->pack_fd);
+    close((*writer)->index_fd);
+    pthread_mutex_destroy(&((*writer)->mutex));
+    free(*writer);
+    *writer = NULL;
+    return ret;
+}
+
+
+/**
+ * 按key的哈希排序，相同哈希按写入顺序，pack文件只追加，offset即写入顺序
+ */
+static int compare_pack_entry(const void *a, const void *b) {
+    const PackEntry *entry_a = (const PackEntry *) a, *entry_b = (const PackEntry *) b;
+    if (entry_a->key != entry_b->key) {
+        return entry_a->key < entry_b->key ? -1 : 1;
+    }
+    return entry_a->offset < entry_b->offset ? -1 : entry_a->offset > entry_b->offset;
+}
+
+
+/**
+ * 只读打开pack，读取并排序索引，忽略超出pack文件长度的索引项
+ * @param path
+ * @param map 非0时mmap整个pack文件，供map_pack_entry使用
+ * @return
+ */
+PackReader *open_pack_reader(const char *path, int map) {
+    char index_path[4096];
+    struct stat st;
+    int index_fd = -1, i, nb_entries;
+    ssize_t n;
+    PackReader *reader = (PackReader *) calloc(1, sizeof(PackReader));
+    if (!reader) {
+        return NULL;
+    }
+    snprintf(index_path, sizeof(index_path), "%s%s", path, PACK_INDEX_SUFFIX);
+    if ((reader->pack_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(reader->pack_fd, &st) < 0 ||
+        (index_fd = open(index_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        printf("open pack reader failed, %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    reader->pack_size = (uint64_t) st.st_size;
+    if (fstat(index_fd, &st) < 0) {
+        goto fail;
+    }
+    nb_entries = (int) (st.st_size / sizeof(PackEntry));
+    if (nb_entries > 0) {
+        if (!(reader->entries = (PackEntry *) av_malloc_array(nb_entries, sizeof(PackEntry)))) {
+            goto fail;
+        }
+        n = pread(index_fd, reader->entries, nb_entries * sizeof(PackEntry), 0);
+        nb_entries = n > 0 ? (int) (n / sizeof(PackEntry)) : 0;
+    }
+    // 写入中途崩溃时只保留数据完整的索引项
+    for (i = 0; i < nb_entries; ++i) {
+        PackEntry *entry = &(reader->entries[i]);
+        if (entry->offset + entry->length <= reader->pack_size) {
+            reader->entries[reader->nb_entries++] = *entry;
+        }
+    }
+    qsort(reader->entries, reader->nb_entries, sizeof(PackEntry), compare_pack_entry);
+    if (map && reader->pack_size > 0) {
+        reader->pack_map = mmap(NULL, reader->pack_size, PROT_READ, MAP_SHARED, reader->pack_fd, 0);
+        if (reader->pack_map == MAP_FAILED) {
+            printf("mmap pack failed, %s\n", strerror(errno));
+            reader->pack_map = NULL;
+            goto fail;
+        }
+    }
+    close(index_fd);
+    return reader;
+    fail:
+    if (index_fd >= 0) {
+        close(index_fd);
+    }
+    close_pack_reader(&reader);
+    return NULL;
+}
+
+
+/**
+ * 校验索引项在pack文件中的记录头和key字符串，排除哈希冲突和掉电后未落盘的记录
+ * @param reader
+ * @param entry
+ * @param key
+ * @param key_length
+ * @return 匹配时返回1
+ */
+static int match_pack_entry(const PackReader *reader, const PackEntry *entry, const char *key, size_t key_length) {
+    PackRecordHeader header;
+    uint8_t *record;
+    size_t record_size = sizeof(header) + key_length;
+    int match = 0;
+    if (entry->key_length != key_length || entry->offset < record_size) {
+        return 0;
+    }
+    if (reader->pack_map) {
+        record = (uint8_t *) reader->pack_map + entry->offset - record_size;
+    } else if (!(record = (uint8_t *) av_malloc(record_size)) ||
+               pread(reader->pack_fd, record, record_size, (off_t) (entry->offset - record_size)) !=
+               (ssize_t) record_size) {
+        av_free(record);
+        return 0;
+    }
+    memcpy(&header, record, sizeof(header));
+    match = header.key == entry->key && header.length == entry->length && header.key_length == key_length &&
+            !memcmp(record + sizeof(header), key, key_length);
+    if (!reader->pack_map) {
+        av_free(record);
+    }
+    return match;
+}
+
+
+/**
+ * 按key查找截图，比较pack中保存的key字符串，同一key多次写入时返回最后写入的
+ * @param reader
+ * @param key
+ * @return 找不到时返回NULL
+ */
+const PackEntry *find_pack_entry(const PackReader *reader, const char *key) {
+    uint64_t hash = pack_key(key);
+    size_t key_length = strlen(key);
+    int low = 0, high = reader->nb_entries, middle;
+    // 第一个哈希大于key的项，从它之前向前查找
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (reader->entries[middle].key <= hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (middle = low - 1; middle >= 0 && reader->entries[middle].key == hash; --middle) {
+        if (match_pack_entry(reader, &(reader->entries[middle]), key, key_length)) {
+            return &(reader->entries[middle]);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * pread读取一张截图
+ * @param reader
+ * @param entry
+ * @param buf 至少entry->length字节
+ * @return
+ */
+int read_pack_entry(const PackReader *reader, const PackEntry *entry, uint8_t *buf) {
+    uint32_t done = 0;
+    ssize_t n;
+    while (done < entry->length) {
+        n = pread(reader->pack_fd, buf + done, entry->length - done, (off_t) (entry->offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? AVERROR(errno) : AVERROR_EOF;
+        }
+        done += (uint32_t) n;
+    }
+    return 0;
+}
+
+
+/**
+ * 返回mmap中截图数据的指针，reader关闭前有效
+ * @param reader open_pack_reader时map非0
+ * @param entry
+ * @return
+ */
+const uint8_t *map_pack_entry(const PackReader *reader, const PackEntry *entry) {
+    if (!reader->pack_map) {
+        return NULL;
+    }
+    return reader->pack_map + entry->offset;
+}
+
+
+void close_pack_reader(PackReader **reader) {
+    if (!*reader) {
+        return;
+    }
+    if ((*reader)->pack_map) {
+        munmap((void *) (*reader)->pack_map, (*reader)->pack_size);
+    }
+    if ((*reader)->pack_fd >= 0) {
+        close((*reader)->pack_fd);
+    }
+    av_free((*reader)->entries);
+    free(*reader);
+    *reader = NULL;
+}
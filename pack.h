@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <pthread.h>
+
+#define PACK_MAGIC UINT64_C(0x314b434150544853) // "SHTPACK1"
+#define PACK_INDEX_SUFFIX ".idx"
+
+/**
+ * 截图的附加信息
+ */
+typedef struct PackEntryMeta {
+    int width;
+    int height;
+    int64_t timestamp; // 截图时间点，单位ms
+} PackEntryMeta;
+
+/**
+ * 索引文件中的一项，key为key字符串的哈希
+ * pack文件中的记录为PackRecordHeader、key字符串、图片数据，offset指向图片数据
+ */
+typedef struct PackEntry {
+    uint64_t key;
+    uint64_t offset;
+    uint32_t length;
+    int32_t width;
+    int32_t height;
+    uint32_t key_length;
+    int64_t timestamp;
+} PackEntry;
+
+typedef struct PackRecordHeader {
+    uint64_t key;
+    uint32_t length;
+    uint32_t key_length;
+} PackRecordHeader;
+
+/**
+ * 顺序追加写入的pack文件和索引文件，多线程共用时由mutex串行
+ */
+typedef struct PackWriter {
+    int pack_fd;
+    int index_fd;
+    uint64_t offset;
+    int nb_entries;
+    pthread_mutex_t mutex;
+} PackWriter;
+
+/**
+ * 只读打开的pack，索引按key的哈希和写入顺序排序后二分查找，pack文件mmap后可以直接引用单张图片
+ */
+typedef struct PackReader {
+    int pack_fd;
+    uint64_t pack_size;
+    const uint8_t *pack_map;
+    PackEntry *entries;
+    int nb_entries;
+} PackReader;
+
+uint64_t pack_key(const char *key);
+
+PackWriter *open_pack_writer(const char *path);
+
+int pack_writer_append(PackWriter *writer, const char *key, const uint8_t *data, int size,
+                       const PackEntryMeta *meta);
+
+int close_pack_writer(PackWriter **writer);
+
+PackReader *open_pack_reader(const char *path, int map);
+
+const PackEntry *find_pack_entry(const PackReader *reader, const char *key);
+
+int read_pack_entry(const PackReader *reader, const PackEntry *entry, uint8_t *buf);
+
+const uint8_t *map_pack_entry(const PackReader *reader, const PackEntry *entry);
+
+void close_pack_reader(PackReader **reader);
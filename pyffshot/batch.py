@@ -0,0 +1,258 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+import array
+import fcntl
+import os
+import struct
+import threading
+
+from .shot import shot_outputs
+
+# 决定截图结果的输出字段，作为合并请求的key
+OUTPUT_KEYS = ("image_codec_name", "width", "height", "level", "format_name")
+
+
+def output_key(output):
+    """
+    输出规格的key，输出目标(output/fd/write)不影响编码结果
+    """
+    return tuple((name, output.get(name)) for name in OUTPUT_KEYS)
+
+
+def shot_key(url, position, outputs):
+    """
+    一次截图请求的key: (url, 时间点, 输出规格)
+    """
+    return url, position, tuple(output_key(output) for output in outputs)
+
+
+# linux/fiemap.h: _IOWR('f', 11, struct fiemap)
+FS_IOC_FIEMAP = 0xC020660B
+FIEMAP_FLAG_SYNC = 0x1
+_FIEMAP_HEADER = struct.Struct("=QQIIII")
+_FIEMAP_EXTENT = struct.Struct("=QQQQQI12x")
+
+
+def first_extent(fd):
+    """
+    用FIEMAP取文件第一个extent的物理偏移
+    :return: 物理偏移(字节)，文件系统不支持或文件没有extent时返回None
+    """
+    # python2的ioctl不接受bytearray作为可写的buffer
+    buf = array.array("B", bytearray(_FIEMAP_HEADER.size + _FIEMAP_EXTENT.size))
+    _FIEMAP_HEADER.pack_into(buf, 0, 0, 0xFFFFFFFFFFFFFFFF, FIEMAP_FLAG_SYNC, 0, 1, 0)
+    try:
+        fcntl.ioctl(fd, FS_IOC_FIEMAP, buf)
+    except (IOError, OSError):
+        return None
+    if _FIEMAP_HEADER.unpack_from(buf, 0)[3] < 1:
+        return None
+    return _FIEMAP_EXTENT.unpack_from(buf, _FIEMAP_HEADER.size)[1]
+
+
+def local_path(url):
+    """
+    url对应的本地文件路径，其他协议返回None
+    """
+    if url.startswith("file:"):
+        return url[5:]
+    return None if "://" in url else url
+
+
+def locality_key(url):
+    """
+    按物理位置排序的key: (设备, 第一个extent的物理偏移或inode, 路径)
+    不支持FIEMAP时退化为inode顺序，非本地文件的设备为None
+    """
+    path = local_path(url)
+    if path is None:
+        return None, 0, url
+    try:
+        fd = os.open(path, os.O_RDONLY)
+    except OSError:
+        return None, 0, url
+    try:
+        st = os.fstat(fd)
+        offset = first_extent(fd)
+    finally:
+        os.close(fd)
+    return st.st_dev, offset if offset is not None else st.st_ino, path
+
+
+class _Call(object):
+    """
+    一个进行中的请求
+    """
+
+    def __init__(self):
+        self.event = threading.Event()
+        self.result = None
+        self.error = None
+        self.waiters = 0
+
+
+class SingleFlight(object):
+    """
+    合并并发的相同请求：同一key同时只执行一次，等待中的调用共享结果
+    """
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._calls = {}
+
+    def do(self, key, fn, *args, **kwargs):
+        """
+        执行fn或等待进行中的相同请求
+        :return: (结果, 是否与其他调用共享)
+        """
+        with self._lock:
+            call = self._calls.get(key)
+            if call is not None:
+                call.waiters += 1
+                leader = False
+            else:
+                call = self._calls[key] = _Call()
+                leader = True
+        if not leader:
+            call.event.wait()
+            if call.error is not None:
+                raise call.error
+            return call.result, True
+        try:
+            call.result = fn(*args, **kwargs)
+        except Exception as e:
+            call.error = e
+        finally:
+            # 先移除再唤醒，之后到达的请求重新执行而不是拿到旧结果
+            with self._lock:
+                del self._calls[key]
+            call.event.set()
+        if call.error is not None:
+            raise call.error
+        return call.result, call.waiters > 0
+
+    def inflight(self):
+        with self._lock:
+            return len(self._calls)
+
+
+class BatchShooter(object):
+    """
+    截图服务层：截图结果以bytes返回，相同(url, position, 输出规格)的并发请求只打开一次输入
+    """
+
+    def __init__(self, timeout=5000, cache=None, **shot_options):
+        """
+        :param timeout: 单次截图期限，单位ms
+        :param cache: cache.ShotCache，为None时不缓存结果
+        :param shot_options: 传给shot_outputs的其他参数，如fast_decode、range_fetch、degrade_percent
+        """
+        self.timeout = timeout
+        self.cache = cache
+        self.shot_options = shot_options
+        self._flight = SingleFlight()
+        self._lock = threading.Lock()
+        self.requests = 0
+        self.shared = 0
+
+    def shot(self, url, outputs, position=0):
+        """
+        截图并返回每路输出的编码数据
+        :param url: 视频url
+        :param outputs: 输出规格dict列表，见shot_outputs，output/fd/write被忽略
+        :param position: 截图时间点，单位ms
+        :return: 与outputs对应的bytes列表，截图失败时返回None
+        """
+        key = shot_key(url, position, outputs)
+        if self.cache is not None:
+            result = self.cache.get(key)
+            if result is not None:
+                return result
+        result, shared = self._flight.do(key, self._shot, url, outputs, position)
+        with self._lock:
+            self.requests += 1
+            if shared:
+                self.shared += 1
+        return result
+
+    def shot_batch(self, requests, workers=4, readers_per_device=1, locality=True):
+        """
+        批量截图，本地文件按物理位置顺序读取，同一设备同时只有readers_per_device个读者，
+        机械盘归档批量截图时吞吐受顺序读而不是寻道限制
+        :param requests: (url, outputs, positions)列表，positions为截图时间点(ms)列表
+        :param workers: 工作线程数，不同设备和远程url并行
+        :param readers_per_device: 每个设备同时读取的文件数上限，<=0时不限制
+        :param locality: 为False时按原顺序执行，仍限制每个设备的读者数
+        :return: 与requests对应的列表，每项为{position: shot的结果}，请求抛出异常时为该异常，不影响其他请求
+        """
+        results = [None] * len(requests)
+        keys = [locality_key(request[0]) for request in requests]
+        order = range(len(requests))
+        if locality:
+            # 远程url(设备为None)排在本地文件之后，保持原顺序
+            order = sorted(order, key=lambda i: (keys[i][0] is None, keys[i][0] or 0, keys[i][1], keys[i][2]))
+        rank = dict((i, n) for n, i in enumerate(order))
+        queues = {}
+        devices = []
+        for i in order:
+            device = keys[i][0]
+            if device not in queues:
+                queues[device] = []
+                devices.append(device)
+            queues[device].append(i)
+        active = dict((device, 0) for device in devices)
+        cond = threading.Condition()
+
+        def next_request():
+            # 按order取有空闲读者名额的设备上最靠前的请求，全部完成时返回None
+            with cond:
+                while True:
+                    if not any(queues[device] for device in devices):
+                        return None
+                    ready = [device for device in devices if queues[device] and (
+                        device is None or readers_per_device <= 0 or active[device] < readers_per_device)]
+                    if ready:
+                        device = min(ready, key=lambda device: rank[queues[device][0]])
+                        active[device] += 1
+                        return device, queues[device].pop(0)
+                    cond.wait()
+
+        def run():
+            while True:
+                item = next_request()
+                if item is None:
+                    return
+                device, i = item
+                url, outputs, positions = requests[i]
+                try:
+                    # 按时间点递增截图，文件内的seek偏移也随之递增
+                    results[i] = dict((position, self.shot(url, outputs, position)) for position in sorted(positions))
+                except Exception as e:
+                    results[i] = e
+                finally:
+                    with cond:
+                        active[device] -= 1
+                        cond.notify_all()
+
+        threads = [threading.Thread(target=run) for _ in range(max(1, min(workers, len(requests))))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        return results
+
+    def _shot(self, url, outputs, position):
+        chunks = [[] for _ in outputs]
+        specs = []
+        for i, output in enumerate(outputs):
+            spec = dict((name, output[name]) for name in OUTPUT_KEYS if output.get(name) is not None)
+            spec["write"] = chunks[i].append
+            specs.append(spec)
+        timeout = 0 if url.startswith("rtmp") else self.timeout
+        if shot_outputs(url, specs, timeout=timeout, position=position, **self.shot_options) != 0:
+            return None
+        result = [b"".join(chunk) for chunk in chunks]
+        # 只由执行截图的调用写入缓存
+        if self.cache is not None:
+            self.cache.put(shot_key(url, position, outputs), result)
+        return result
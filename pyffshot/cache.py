@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+import threading
+import time
+from collections import OrderedDict
+
+# 直播源的协议前缀，截图结果只短时间有效
+LIVE_PREFIXES = ("rtsp://", "rtmp://", "udp://", "rtp://", "srt://")
+
+
+def is_live_url(url):
+    return url.startswith(LIVE_PREFIXES) or ".m3u8" in url
+
+
+class ShotCache(object):
+    """
+    截图编码结果的LRU缓存，按条目数和总字节数限制，直播和点播源使用不同的TTL
+    """
+
+    def __init__(self, max_bytes=64 * 1024 * 1024, max_entries=10000, live_ttl=0.2, vod_ttl=3600):
+        """
+        :param max_bytes: 缓存数据的总字节数上限
+        :param max_entries: 缓存条目数上限
+        :param live_ttl: 直播源结果的有效期，单位s
+        :param vod_ttl: 点播源结果的有效期，单位s
+        """
+        self.max_bytes = max_bytes
+        self.max_entries = max_entries
+        self.live_ttl = live_ttl
+        self.vod_ttl = vod_ttl
+        self._lock = threading.Lock()
+        self._entries = OrderedDict()  # key -> (过期时间, 数据, 字节数)
+        self.bytes = 0
+        self.hits = 0
+        self.misses = 0
+        self.evictions = 0
+
+    def get(self, key):
+        """
+        :param key: batch.shot_key生成的key
+        :return: 未过期的结果，没有时返回None
+        """
+        with self._lock:
+            entry = self._entries.get(key)
+            if entry is None or entry[0] < time.time():
+                if entry is not None:
+                    self._remove(key)
+                self.misses += 1
+                return None
+            # 移到队尾，队首为最久未使用
+            del self._entries[key]
+            self._entries[key] = entry
+            self.hits += 1
+            return entry[1]
+
+    def put(self, key, result, ttl=None):
+        """
+        :param key: batch.shot_key生成的key，key[0]为url
+        :param result: 每路输出的bytes列表
+        :param ttl: 有效期，单位s，为None时按url区分直播和点播
+        """
+        size = sum(len(data) for data in result)
+        if size > self.max_bytes:
+            return
+        if ttl is None:
+            ttl = self.live_ttl if is_live_url(key[0]) else self.vod_ttl
+        with self._lock:
+            if key in self._entries:
+                self._remove(key)
+            self._entries[key] = (time.time() + ttl, result, size)
+            self.bytes += size
+            while self.bytes > self.max_bytes or len(self._entries) > self.max_entries:
+                self._remove(next(iter(self._entries)))
+                self.evictions += 1
+
+    def _remove(self, key):
+        entry = self._entries.pop(key)
+        self.bytes -= entry[2]
+
+    def clear(self):
+        with self._lock:
+            self._entries.clear()
+            self.bytes = 0
+
+    def stats(self):
+        with self._lock:
+            return {"entries": len(self._entries), "bytes": self.bytes, "hits": self.hits, "misses": self.misses,
+                    "evictions": self.evictions}
@@ -1,6 +1,7 @@
 #!/usr/bin/env python
 # -*- coding: utf-8 -*-
-from ctypes import cdll
+from ctypes import cdll, byref, cast, memmove, string_at, pointer, CFUNCTYPE, POINTER, Structure, \
+    c_char, c_char_p, c_int, c_int32, c_int64, c_uint32, c_uint64, c_ubyte, c_void_p, create_string_buffer
 import os
 import time
 import sys
@@ -14,6 +15,18 @@ cdll.LoadLibrary(__path + "/lib/libavfilter.so")
 cdll.LoadLibrary(__path + "/lib/libavdevice.so")
 __libshot = cdll.LoadLibrary(__path + "/lib/libshot.so")
 
+
+def _function(name, restype=c_int, argtypes=None):
+    """
+    调用时才从libshot.so取函数并设置签名，libshot.so缺少某个函数时只影响对应的接口
+    """
+    function = getattr(__libshot, name)
+    function.restype = restype
+    if argtypes is not None:
+        function.argtypes = argtypes
+    return function
+
+
 def shot(url, output, image_codec_name="mjpeg", timeout=5000):
     """
     从指定的url视频中截取第一个关键帧画面
@@ -26,6 +39,541 @@ def shot(url, output, image_codec_name="mjpeg", timeout=5000):
     timeout = 0 if url.startswith("rtmp") else timeout
     return __libshot.shot(url, image_codec_name, output, timeout)
 
+WRITE_CALLBACK = CFUNCTYPE(c_int, c_void_p, POINTER(c_ubyte), c_int)
+
+
+class OutputSpec(Structure):
+    _fields_ = [
+        ("codec_name", c_char_p),
+        ("output", c_char_p),
+        ("width", c_int),
+        ("height", c_int),
+        ("level", c_int),
+        ("fd", c_int),
+        ("write_cb", WRITE_CALLBACK),
+        ("opaque", c_void_p),
+        ("format_name", c_char_p),
+        ("avio_buffer_size", c_int),
+        ("pack", c_void_p),
+    ]
+
+
+class PackEntry(Structure):
+    _fields_ = [
+        ("key", c_uint64),
+        ("offset", c_uint64),
+        ("length", c_uint32),
+        ("width", c_int32),
+        ("height", c_int32),
+        ("key_length", c_uint32),
+        ("timestamp", c_int64),
+    ]
+
+
+def _write_callback(write):
+    """
+    将python的write(data)包装为C写回调
+    """
+    def callback(opaque, buf, buf_size):
+        try:
+            write(string_at(buf, buf_size))
+        except Exception:
+            return -1
+        return buf_size
+    return WRITE_CALLBACK(callback)
+
+
+READ_CALLBACK = CFUNCTYPE(c_int, c_void_p, POINTER(c_ubyte), c_int)
+SEEK_CALLBACK = CFUNCTYPE(c_int64, c_void_p, c_int64, c_int)
+AVSEEK_SIZE = 0x10000
+
+
+class InputSpec(Structure):
+    _fields_ = [
+        ("buffer", c_void_p),
+        ("buffer_size", c_int64),
+        ("read_cb", READ_CALLBACK),
+        ("seek_cb", SEEK_CALLBACK),
+        ("opaque", c_void_p),
+        ("format_name", c_char_p),
+        ("avio_buffer_size", c_int),
+        ("fd", c_int),
+        ("read_timeout", c_int),
+        ("probe_size", c_int64),
+        ("stream_select", c_int),
+        ("stream_index", c_int),
+        ("program_id", c_int),
+        ("local_io", c_int),
+        ("http_pool", c_void_p),
+    ]
+
+
+SHOT_FLAG_FAST_DECODE = 0x0001
+SHOT_FLAG_MP4_RANGE_FETCH = 0x0002
+
+STREAM_SELECT_FIRST = 0
+STREAM_SELECT_BEST = 1
+STREAM_SELECT_INDEX = 2
+STREAM_SELECT_PROGRAM = 3
+STREAM_SELECT_LARGEST = 4
+
+SEEK_MODE_AUTO = 0
+SEEK_MODE_INDEX = 1
+SEEK_MODE_FRAME = 2
+SEEK_MODE_TS_BISECT = 3
+
+DURABILITY_NONE = 0
+DURABILITY_FDATASYNC = 1
+DURABILITY_GROUP_COMMIT = 2
+
+
+class ShotStats(Structure):
+    _fields_ = [
+        ("skipped_packets", c_int),
+        ("rejected_frames", c_int),
+        ("decode_errors", c_int),
+        ("elapsed", c_int),
+        ("degraded", c_int),
+    ]
+
+
+class ShotOptions(Structure):
+    _fields_ = [
+        ("timeout", c_int),
+        ("flags", c_int),
+        ("input", InputSpec),
+        ("position", c_int64),
+        ("seek_mode", c_int),
+        ("stats", POINTER(ShotStats)),
+        ("degrade_percent", c_int),
+        ("degrade_frames", c_int),
+        ("disk_cache", c_void_p),
+        ("durability", c_int),
+        ("commit_group", c_void_p),
+    ]
+
+
+def _buffer_address(data):
+    """
+    返回bytes、bytearray、memoryview等对象底层内存的(地址, 长度, 需保持引用的对象)，尽量不复制数据
+    """
+    if isinstance(data, bytes):
+        return cast(c_char_p(data), c_void_p).value, len(data), data
+    view = memoryview(data)
+    # python2的memoryview没有nbytes和obj，ctypes也只能从bytearray等旧buffer接口的对象取地址
+    nbytes = view.nbytes if hasattr(view, 'nbytes') else len(view.tobytes())
+    if not view.readonly:
+        try:
+            array = (c_char * nbytes).from_buffer(data)
+            return cast(array, c_void_p).value, nbytes, array
+        except (TypeError, ValueError):
+            pass
+    obj = getattr(view, 'obj', None)
+    if isinstance(obj, bytes) and nbytes == len(obj):
+        return cast(c_char_p(obj), c_void_p).value, len(obj), obj
+    # 只读且为切片的buffer无法安全取得地址，退化为复制
+    copied = view.tobytes()
+    return cast(c_char_p(copied), c_void_p).value, len(copied), copied
+
+
+def _read_callback(read):
+    """
+    将python的read(size) -> bytes包装为C读回调，返回空bytes表示结束
+    """
+    def callback(opaque, buf, buf_size):
+        try:
+            data = read(buf_size)
+        except Exception:
+            return -1
+        if not data:
+            return 0
+        memmove(buf, data, len(data))
+        return len(data)
+    return READ_CALLBACK(callback)
+
+
+def _seek_callback(seek, size=None):
+    """
+    将python的seek(offset, whence) -> position包装为C seek回调
+    """
+    def callback(opaque, offset, whence):
+        try:
+            if whence == AVSEEK_SIZE:
+                return size() if size else -1
+            return seek(offset, whence)
+        except Exception:
+            return -1
+    return SEEK_CALLBACK(callback)
+
+
+def _set_input(options, data=None, read=None, seek=None, size=None, input_format=None, avio_buffer_size=0,
+               input_fd=None, read_timeout=0, probe_size=0):
+    """
+    设置ShotOptions的输入来源，返回调用期间需保持引用的对象
+    """
+    keep = None
+    if input_fd is not None:
+        options.input.fd = input_fd
+        options.input.read_timeout = read_timeout
+    elif data is not None:
+        address, length, keep = _buffer_address(data)
+        options.input.buffer = address
+        options.input.buffer_size = length
+    elif read is not None:
+        options.input.read_cb = _read_callback(read)
+        if seek is not None:
+            options.input.seek_cb = _seek_callback(seek, size)
+    options.input.format_name = input_format
+    options.input.avio_buffer_size = avio_buffer_size
+    options.input.probe_size = probe_size
+    return keep
+
+
+def open_disk_cache(cache_dir, nb_slots=0):
+    """
+    打开磁盘截图缓存，多个进程可以同时打开同一目录
+    :param cache_dir: 缓存目录，需已存在
+    :param nb_slots: 新建索引的槽数，为0时取默认值
+    :return: 缓存句柄，失败时返回None
+    """
+    return _function("open_disk_cache", c_void_p, [c_char_p, c_int64])(cache_dir, nb_slots)
+
+
+def close_disk_cache(cache):
+    """
+    关闭open_disk_cache返回的磁盘缓存
+    """
+    handle = c_void_p(cache)
+    __libshot.close_disk_cache(byref(handle))
+
+
+def create_commit_group():
+    """
+    创建提交组，durability=DURABILITY_GROUP_COMMIT的截图输出在flush_commit_group时一起rename和落盘
+    :return: 句柄，失败时返回None
+    """
+    return _function("create_commit_group", c_void_p)()
+
+
+def flush_commit_group(group):
+    """
+    提交组内所有等待的输出文件
+    :return: 提交失败的文件数
+    """
+    return _function("flush_commit_group", c_int, [c_void_p])(group)
+
+
+def free_commit_group(group):
+    """
+    提交剩余文件并释放提交组
+    :return: 提交失败的文件数
+    """
+    handle = c_void_p(group)
+    return __libshot.free_commit_group(byref(handle))
+
+
+def create_http_pool(max_per_host=8, idle_timeout=30000, timeout=10000, verify_peer=True):
+    """
+    创建进程内共享的HTTP keep-alive连接池，同一origin的截图复用TCP连接和TLS会话
+    :param max_per_host: 每个scheme://host:port的最大连接数
+    :param idle_timeout: 空闲连接保留时间，单位ms
+    :param timeout: 连接、读写和等待空闲连接的超时，单位ms
+    :param verify_peer: 校验https证书和主机名
+    :return: 句柄，失败或libshot.so构建时未开启HTTP_POOL时返回None，此时http(s) url由ffmpeg读取
+    """
+    create = _function("create_http_pool", c_void_p)
+    return create(max_per_host, idle_timeout, timeout, 1 if verify_peer else 0)
+
+
+def free_http_pool(pool):
+    """
+    关闭空闲连接并释放连接池，需在使用它的截图都结束后调用
+    """
+    handle = c_void_p(pool)
+    __libshot.free_http_pool(byref(handle))
+
+
+def open_pack_writer(path):
+    """
+    打开pack文件追加写入截图，输出dict的pack指定该句柄时output作为pack中的key
+    :param path: pack文件路径，索引文件为path.idx
+    :return: 句柄，失败时返回None
+    """
+    return _function("open_pack_writer", c_void_p)(path)
+
+
+def close_pack_writer(writer):
+    """
+    同步并关闭pack，一批截图只在关闭时fdatasync一次
+    """
+    handle = c_void_p(writer)
+    return __libshot.close_pack_writer(byref(handle))
+
+
+def read_pack(path, keys):
+    """
+    从pack中读取截图
+    :param path: pack文件路径
+    :param keys: key列表
+    :return: dict: key -> (bytes, width, height, timestamp)，不存在的key不返回
+    """
+    reader = c_void_p(_function("open_pack_reader", c_void_p)(path, 0))
+    if not reader.value:
+        return None
+    find_pack_entry = _function("find_pack_entry", POINTER(PackEntry), [c_void_p, c_char_p])
+    read_pack_entry = _function("read_pack_entry", c_int, [c_void_p, POINTER(PackEntry), c_char_p])
+    result = {}
+    for key in keys:
+        entry = find_pack_entry(reader, key)
+        if not entry:
+            continue
+        buf = create_string_buffer(entry.contents.length)
+        if read_pack_entry(reader, entry, buf) == 0:
+            result[key] = (buf.raw, entry.contents.width, entry.contents.height, entry.contents.timestamp)
+    __libshot.close_pack_reader(byref(reader))
+    return result
+
+
+def _output_specs(outputs):
+    """
+    由输出dict列表构造OutputSpec数组
+    """
+    specs = (OutputSpec * len(outputs))()
+    for i, output in enumerate(outputs):
+        specs[i].codec_name = output.get("image_codec_name", "mjpeg")
+        specs[i].output = output.get("output")
+        specs[i].width = output.get("width", 0)
+        specs[i].height = output.get("height", 0)
+        specs[i].level = output.get("level", 0)
+        specs[i].fd = output.get("fd", 0)
+        if output.get("write"):
+            specs[i].write_cb = _write_callback(output["write"])
+        specs[i].format_name = output.get("format_name")
+        specs[i].avio_buffer_size = output.get("avio_buffer_size", 0)
+        specs[i].pack = output.get("pack")
+    return specs
+
+
+def shot_outputs(url, outputs, timeout=5000, fast_decode=False, data=None, read=None, seek=None, size=None,
+                 input_format=None, avio_buffer_size=0, input_fd=None, read_timeout=0, probe_size=0,
+                 range_fetch=False, position=0, seek_mode=SEEK_MODE_AUTO, stream_select=STREAM_SELECT_FIRST,
+                 stream_index=0, program_id=0, stats=None, degrade_percent=0, degrade_frames=0,
+                 disk_cache=None, durability=DURABILITY_NONE, commit_group=None, local_io=False,
+                 http_pool=None):
+    """
+    从指定的url视频中截取第一个关键帧画面，一次解码输出多种尺寸、格式的截图
+    :param url: 视频url，可以为本地文件地址，也可以为网络url
+    :param outputs: 输出列表，每项为dict: output, image_codec_name(默认mjpeg), width, height, level,
+                    fd, write, format_name, avio_buffer_size；
+                    width/height只指定一个时按原比例缩放，都不指定时保持原尺寸；
+                    level>0时为金字塔输出(1/2^level)，由上一级2x2均值下采样得到，忽略width/height；
+                    指定fd(>0)或write(data)回调时直接写出而不写output文件，format_name默认image2pipe；
+                    指定pack(open_pack_writer)时追加写入pack，output作为key
+    :param timeout: 连接超时设定，不支持rtmp协议, 单位ms
+    :param fast_decode: 跳过loop filter和非参考帧idct，以少量画质换取解码速度
+    :param data: 从内存读取视频数据，支持bytes、bytearray、memoryview，可写buffer和bytes不复制；此时url可为None
+    :param read: 从回调read(size) -> bytes读取视频数据，返回空bytes表示结束
+    :param seek: read的seek回调seek(offset, whence) -> position，为None时输入不可seek
+    :param size: read输入的总长度回调size() -> int
+    :param input_format: 输入格式名称，用于无法探测格式的输入
+    :param avio_buffer_size: 读取内存数据、回调或fd时的avio缓冲大小
+    :param input_fd: 从不可seek的管道、socket fd读取视频数据，mp4的moov在mdat之后时立即失败
+    :param read_timeout: input_fd等待数据的超时，单位ms
+    :param probe_size: 探测格式时最多读取、缓冲的字节数
+    :param range_fetch: 远程mp4只按range请求读取moov和截图时间点之前最近的同步样本，失败时回退为完整打开
+    :param position: 截图时间点，单位ms，截取该时间点之前最近的关键帧；为0时截取第一个关键帧
+    :param seek_mode: SEEK_MODE_AUTO先按容器索引(mkv Cues、flv keyframes)直接跳到关键帧位置，
+                      无索引的ts文件按字节位置二分查找时间戳，最后回退av_seek_frame
+    :param stream_select: 截图视频流的选择方式，STREAM_SELECT_BEST按av_find_best_stream，
+                          STREAM_SELECT_INDEX取stream_index，STREAM_SELECT_PROGRAM取program_id中分辨率最高的视频流，
+                          STREAM_SELECT_LARGEST取分辨率最高的视频流
+    :param stream_index: STREAM_SELECT_INDEX时的流序号
+    :param program_id: STREAM_SELECT_PROGRAM时的节目号
+    :param stats: 传入dict时写入截图统计: skipped_packets, rejected_frames, decode_errors, elapsed(ms), degraded
+    :param degrade_percent: 超过timeout的该百分比仍没有关键帧时解码非关键帧并做错误隐藏，输出的画面标记为degraded
+    :param degrade_frames: 降级解码该帧数(约一个intra refresh周期)后输出，为0时到timeout才输出最近的画面
+    :param disk_cache: open_disk_cache返回的磁盘缓存，本地文件和内存输入的图片输出全部命中时不打开输入
+    :param durability: 文件输出先写临时文件再rename，DURABILITY_FDATASYNC时每个文件fdatasync并fsync目录，
+                       DURABILITY_GROUP_COMMIT时rename推迟到flush_commit_group(commit_group)
+    :param commit_group: create_commit_group返回的提交组，未指定时DURABILITY_GROUP_COMMIT按DURABILITY_FDATASYNC处理
+    :param local_io: 本地文件由mmap顺序读取，seek后由io_uring批量读取，适合批量截图；
+                     此时avio_buffer_size为单次读取大小，NVMe上可设为1MB以上
+    :param http_pool: create_http_pool返回的连接池，http(s) url按Range分段读取并复用连接，连接池不可用时回退ffmpeg的http
+    :return:
+    """
+    options = ShotOptions()
+    options.timeout = 0 if url and url.startswith("rtmp") else timeout
+    options.flags = SHOT_FLAG_FAST_DECODE if fast_decode else 0
+    if range_fetch:
+        options.flags |= SHOT_FLAG_MP4_RANGE_FETCH
+    options.position = position
+    options.input.stream_select = stream_select
+    options.input.stream_index = stream_index
+    options.input.program_id = program_id
+    options.input.local_io = 1 if local_io else 0
+    options.input.http_pool = http_pool
+    options.seek_mode = seek_mode
+    options.degrade_percent = degrade_percent
+    options.degrade_frames = degrade_frames
+    options.disk_cache = disk_cache
+    options.durability = durability
+    options.commit_group = commit_group
+    keep = _set_input(options, data, read, seek, size, input_format, avio_buffer_size, input_fd, read_timeout,
+                      probe_size)
+    shot_stats = ShotStats()
+    options.stats = pointer(shot_stats)
+    specs = _output_specs(outputs)
+    ret = __libshot.shot_outputs(url, specs, len(outputs), byref(options))
+    del keep
+    if stats is not None:
+        for name, _ in ShotStats._fields_:
+            stats[name] = getattr(shot_stats, name)
+    return ret
+
+
+def shot_programs(url, outputs, timeout=5000, fast_decode=False, input_format=None, probe_size=0):
+    """
+    一次解复用为多节目ts等输入的每个节目截取第一个关键帧
+    :param url: 视频url
+    :param outputs: 同shot_outputs，只支持文件输出，output中的%d替换为节目号，没有%d时追加_节目号
+    :param timeout: 连接和截图的超时，单位ms
+    :param fast_decode: 跳过loop filter和非参考帧idct
+    :param input_format: 输入格式名称
+    :param probe_size: 探测格式时最多读取的字节数，节目较多时需适当增大
+    :return: 截图成功的节目数，失败时返回-1
+    """
+    options = ShotOptions()
+    options.timeout = timeout
+    options.flags = SHOT_FLAG_FAST_DECODE if fast_decode else 0
+    _set_input(options, input_format=input_format, probe_size=probe_size)
+    specs = _output_specs(outputs)
+    return __libshot.shot_programs(url, specs, len(outputs), byref(options))
+
+
+# 会话引用的input_format需在会话关闭前保持有效
+_live_session_inputs = {}
+
+
+def open_live_session(url, max_duration=30000, max_bytes=64 * 1024 * 1024, timeout=5000, input_format=None,
+                      probe_size=0, stream_select=STREAM_SELECT_FIRST, stream_index=0, program_id=0):
+    """
+    打开直播源常驻会话，后台持续解复用视频流和一路音频流到环形缓冲，断线后自动重连
+    重连后的流参数不变时保留缓冲，剪辑跨过断线的间隔；流参数变化时清空缓冲，之前的内容不能再导出
+    :param url: 直播源url
+    :param max_duration: 环形缓冲保留的时长，单位ms
+    :param max_bytes: 环形缓冲的字节数上限
+    :param timeout: 连接和读取的超时，单位ms
+    其他参数同shot_outputs
+    :return: 会话句柄，失败时返回None
+    """
+    options = ShotOptions()
+    options.timeout = 0 if url.startswith("rtmp") else timeout
+    options.input.stream_select = stream_select
+    options.input.stream_index = stream_index
+    options.input.program_id = program_id
+    _set_input(options, input_format=input_format, probe_size=probe_size)
+    open_session = _function("open_live_session", c_void_p, [c_char_p, POINTER(ShotOptions), c_int64, c_int64])
+    session = open_session(url, byref(options), max_duration, max_bytes)
+    if session:
+        _live_session_inputs[session] = input_format
+    return session
+
+
+def close_live_session(session):
+    """
+    停止会话的读线程并释放缓冲
+    """
+    handle = c_void_p(session)
+    __libshot.close_live_session(byref(handle))
+    _live_session_inputs.pop(session, None)
+
+
+def export_clip(session, output, duration=15000, format_name=None):
+    """
+    把会话缓冲中最近duration的内容从关键帧开始stream copy导出为mp4、ts等剪辑，不转码
+    :param session: open_live_session返回的会话
+    :param output: 输出文件，先写临时文件再rename
+    :param duration: 剪辑时长，单位ms，<=0时导出整个缓冲
+    :param format_name: 封装格式，为None时按output扩展名确定
+    :return: 0为成功
+    """
+    export = _function("export_live_clip", c_int, [c_void_p, c_char_p, c_char_p, c_int64])
+    return export(session, output, format_name, duration)
+
+
+def live_shot(session, outputs, fast_decode=False):
+    """
+    解码会话缓冲中最近的关键帧截图，不需要重新连接和等待关键帧
+    :param session: open_live_session返回的会话
+    :param outputs: 同shot_outputs
+    :return: 0为成功
+    """
+    options = ShotOptions()
+    options.flags = SHOT_FLAG_FAST_DECODE if fast_decode else 0
+    specs = _output_specs(outputs)
+    return __libshot.live_session_shot(c_void_p(session), specs, len(outputs), byref(options))
+
+
+def capture(url, timeout=5000, position=0, seek_mode=SEEK_MODE_AUTO, input_format=None, probe_size=0,
+            stream_select=STREAM_SELECT_FIRST, stream_index=0, program_id=0, local_io=False, http_pool=None,
+            stats=None):
+    """
+    抓取模式：只解复用到第一个随机访问点，返回解码参数、从随机访问点开始的视频包和时间信息的序列化数据，
+    不解码，由render在其他进程或机器上解码输出
+    :param url: 视频url
+    :param timeout: 连接和抓取的超时，单位ms
+    :param position: 截图时间点，单位ms
+    :param stats: 传入dict时写入skipped_packets和elapsed(ms)
+    其他参数同shot_outputs
+    :return: bytes，失败时返回None
+    """
+    options = ShotOptions()
+    options.timeout = 0 if url and url.startswith("rtmp") else timeout
+    options.position = position
+    options.seek_mode = seek_mode
+    options.input.stream_select = stream_select
+    options.input.stream_index = stream_index
+    options.input.program_id = program_id
+    options.input.local_io = 1 if local_io else 0
+    options.input.http_pool = http_pool
+    _set_input(options, input_format=input_format, probe_size=probe_size)
+    shot_stats = ShotStats()
+    options.stats = pointer(shot_stats)
+    blob = c_void_p()
+    size = c_int()
+    if __libshot.shot_capture_blob(url, byref(options), byref(blob), byref(size)) < 0:
+        return None
+    try:
+        data = string_at(blob, size.value)
+    finally:
+        __libshot.free_capture_blob(byref(blob))
+    if stats is not None:
+        stats["skipped_packets"] = shot_stats.skipped_packets
+        stats["elapsed"] = shot_stats.elapsed
+    return data
+
+
+def render(data, outputs, fast_decode=False, durability=DURABILITY_NONE, commit_group=None, stats=None):
+    """
+    渲染模式：解码capture返回的数据并按outputs编码输出，不访问输入
+    :param data: capture返回的bytes
+    :param outputs: 同shot_outputs
+    :param stats: 传入dict时写入rejected_frames, decode_errors, elapsed(ms)等
+    :return: 0为成功
+    """
+    options = ShotOptions()
+    options.flags = SHOT_FLAG_FAST_DECODE if fast_decode else 0
+    options.durability = durability
+    options.commit_group = commit_group
+    shot_stats = ShotStats()
+    options.stats = pointer(shot_stats)
+    specs = _output_specs(outputs)
+    ret = __libshot.shot_render_blob(data, len(data), specs, len(outputs), byref(options))
+    if stats is not None:
+        for name, _ in ShotStats._fields_:
+            stats[name] = getattr(shot_stats, name)
+    return ret
+
 if __name__ == "__main__":
     if len(sys.argv) < 3:
         print "Usage:\n\tpython shot.py URL IMAGE_PATH\n"
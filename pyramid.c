@@ -0,0 +1,175 @@
+//
+// 逐级2x2均值下采样生成缩略图金字塔，每一级由上一级生成，避免每种尺寸都从原图缩放
+//
+#include "pyramid.h"
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+/**
+ * 是否为可直接按平面做2x2均值的8bit planar yuv格式
+ * @param pix_fmt
+ * @return
+ */
+bool is_pyramid_pix_fmt(enum AVPixelFormat pix_fmt) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    int i;
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL |
+                        AV_PIX_FMT_FLAG_BITSTREAM))) {
+        return false;
+    }
+    for (i = 0; i < desc->nb_components; ++i) {
+        if (desc->comp[i].depth != 8 || desc->comp[i].step != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * 计算金字塔第level级的尺寸，每级宽高减半并向上取整
+ * @param width 原图宽
+ * @param height 原图高
+ * @param level
+ * @param level_width
+ * @param level_height
+ */
+void get_pyramid_size(int width, int height, int level, int *level_width, int *level_height) {
+    *level_width = -((-width) >> level);
+    *level_height = -((-height) >> level);
+}
+
+
+/**
+ * 两行源像素做2x2均值得到一行目标像素，奇数宽度时最后一列重复边缘像素
+ * @param r0 源第一行
+ * @param r1 源第二行
+ * @param dst 目标行
+ * @param dst_w 目标宽
+ * @param src_w 源宽
+ */
+static void box_2x2_row(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int dst_w, int src_w) {
+    int x = 0, x0, x1;
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0x00ff), two = _mm_set1_epi16(2);
+    for (; x + 16 <= dst_w && 2 * x + 32 <= src_w; x += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *) (r0 + 2 * x));
+        __m128i a1 = _mm_loadu_si128((const __m128i *) (r0 + 2 * x + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *) (r1 + 2 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (r1 + 2 * x + 16));
+        // 相邻两个像素横向相加，结果为16bit
+        __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, mask), _mm_srli_epi16(a0, 8)),
+                                   _mm_add_epi16(_mm_and_si128(b0, mask), _mm_srli_epi16(b0, 8)));
+        __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, mask), _mm_srli_epi16(a1, 8)),
+                                   _mm_add_epi16(_mm_and_si128(b1, mask), _mm_srli_epi16(b1, 8)));
+        s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+        s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(s0, s1));
+    }
+#endif
+    for (; x < dst_w; ++x) {
+        x0 = 2 * x;
+        x1 = FFMIN(x0 + 1, src_w - 1);
+        dst[x] = (uint8_t) ((r0[x0] + r0[x1] + r1[x0] + r1[x1] + 2) >> 2);
+    }
+}
+
+
+/**
+ * 对一个平面做2x2均值下采样
+ */
+static void box_2x2_plane(const uint8_t *src, int src_linesize, int src_w, int src_h,
+                          uint8_t *dst, int dst_linesize, int dst_w, int dst_h) {
+    int y, y1;
+    for (y = 0; y < dst_h; ++y) {
+        y1 = FFMIN(2 * y + 1, src_h - 1);
+        box_2x2_row(src + 2 * y * src_linesize, src + y1 * src_linesize, dst + y * dst_linesize, dst_w, src_w);
+    }
+}
+
+
+/**
+ * 将一帧宽高各缩小一半
+ * @param src 源帧，需为is_pyramid_pix_fmt支持的格式
+ * @param dst 返回的新帧
+ * @return
+ */
+int downscale_frame_2x2(const AVFrame *src, AVFrame **dst) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->format);
+    int ret, plane, nb_planes = 0, i;
+    if (!is_pyramid_pix_fmt(src->format)) {
+        printf("downscale_frame_2x2 unsupported pix_fmt %s\n", av_get_pix_fmt_name(src->format));
+        return -1;
+    }
+    *dst = av_frame_alloc();
+    if (!*dst) {
+        printf("av_frame_alloc failed\n");
+        return -1;
+    }
+    (*dst)->format = src->format;
+    get_pyramid_size(src->width, src->height, 1, &((*dst)->width), &((*dst)->height));
+    if ((ret = av_frame_get_buffer(*dst, 32)) < 0) {
+        printf("av_frame_get_buffer failed, %s\n", av_err2str(ret));
+        av_frame_free(dst);
+        return ret;
+    }
+    if ((ret = av_frame_copy_props(*dst, src)) < 0) {
+        printf("av_frame_copy_props failed, %s\n", av_err2str(ret));
+        av_frame_free(dst);
+        return ret;
+    }
+    for (i = 0; i < desc->nb_components; ++i) {
+        nb_planes = FFMAX(nb_planes, desc->comp[i].plane + 1);
+    }
+    for (plane = 0; plane < nb_planes; ++plane) {
+        // 色度平面按抽样比例计算尺寸，alpha平面与亮度相同
+        int chroma = (plane == 1 || plane == 2);
+        int w_shift = chroma ? desc->log2_chroma_w : 0, h_shift = chroma ? desc->log2_chroma_h : 0;
+        box_2x2_plane(src->data[plane], src->linesize[plane],
+                      AV_CEIL_RSHIFT(src->width, w_shift), AV_CEIL_RSHIFT(src->height, h_shift),
+                      (*dst)->data[plane], (*dst)->linesize[plane],
+                      AV_CEIL_RSHIFT((*dst)->width, w_shift), AV_CEIL_RSHIFT((*dst)->height, h_shift));
+    }
+    return 0;
+}
+
+
+/**
+ * 由原图逐级生成金字塔，levels[0]引用原图，levels[i]由levels[i-1]生成
+ * @param base 原图
+ * @param nb_levels 级数，包含第0级
+ * @param levels 返回的各级帧，使用free_frame_pyramid释放
+ * @return
+ */
+int build_frame_pyramid(AVFrame *base, int nb_levels, AVFrame **levels) {
+    int i;
+    for (i = 0; i < nb_levels; ++i) {
+        levels[i] = NULL;
+    }
+    levels[0] = av_frame_clone(base);
+    if (!levels[0]) {
+        printf("av_frame_clone failed\n");
+        return -1;
+    }
+    for (i = 1; i < nb_levels; ++i) {
+        if (downscale_frame_2x2(levels[i - 1], &levels[i]) < 0) {
+            free_frame_pyramid(levels, nb_levels);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void free_frame_pyramid(AVFrame **levels, int nb_levels) {
+    int i;
+    for (i = 0; i < nb_levels; ++i) {
+        av_frame_free(&levels[i]);
+    }
+}
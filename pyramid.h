@@ -0,0 +1,15 @@
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <stdbool.h>
+
+#define MAX_PYRAMID_LEVEL 8
+
+bool is_pyramid_pix_fmt(enum AVPixelFormat pix_fmt);
+
+void get_pyramid_size(int width, int height, int level, int *level_width, int *level_height);
+
+int downscale_frame_2x2(const AVFrame *src, AVFrame **dst);
+
+int build_frame_pyramid(AVFrame *base, int nb_levels, AVFrame **levels);
+
+void free_frame_pyramid(AVFrame **levels, int nb_levels);
@@ -0,0 +1,315 @@
+#include "seek.h"
+#include <string.h>
+#include <libavutil/intreadwrite.h>
+
+#define TS_SYNC_BYTE 0x47
+#define TS_PTS_MASK ((INT64_C(1) << 33) - 1)
+
+/**
+ * 二分查找时读取的TS数据
+ */
+typedef struct TsReader {
+    AVIOContext *pb;
+    int pid;
+    int packet_size;
+    int sync_offset; // 同步字节在包内的偏移，m2ts为4
+    uint8_t *buf;
+} TsReader;
+
+/**
+ * 一个视频PES的起始包
+ */
+typedef struct TsPesStart {
+    int64_t pos;
+    int64_t timestamp;
+    int random_access;
+} TsPesStart;
+
+
+/**
+ * demuxer是否只按文件位置顺序读取tag，可以直接seek到索引的字节位置继续读取
+ * matroska、mov等demuxer在seek时还要重置内部状态，只能经由av_seek_frame按索引时间跳转
+ * @param format_ctx
+ * @return
+ */
+static int is_byte_seekable_demuxer(const AVFormatContext *format_ctx) {
+    return !strcmp(format_ctx->iformat->name, "flv");
+}
+
+
+/**
+ * 按libavformat的AVIndexEntry表跳到目标时间之前最近的关键帧
+ * matroska的Cues、flv onMetaData的keyframes.filepositions在打开时都已由demuxer加入索引表
+ * @param format_ctx
+ * @param stream_index
+ * @param timestamp 以流的time_base为单位
+ * @return 没有可用索引时返回AVERROR(ENOENT)
+ */
+int seek_by_index(AVFormatContext *format_ctx, int stream_index, int64_t timestamp) {
+    AVStream *stream = format_ctx->streams[stream_index];
+    AVIndexEntry *entry;
+    int index, ret;
+    if (stream->nb_index_entries <= 0 || (format_ctx->flags & AVFMT_FLAG_IGNIDX)) {
+        return AVERROR(ENOENT);
+    }
+    // 索引可能只包含探测时读到的部分，目标超出最后一项时无法确定最近的关键帧，交给av_seek_frame处理
+    if (timestamp > stream->index_entries[stream->nb_index_entries - 1].timestamp) {
+        return AVERROR(ENOENT);
+    }
+    index = av_index_search_timestamp(stream, timestamp, AVSEEK_FLAG_BACKWARD);
+    if (index < 0) {
+        return AVERROR(ENOENT);
+    }
+    entry = &(stream->index_entries[index]);
+    if (is_byte_seekable_demuxer(format_ctx) && format_ctx->pb && entry->pos >= 0) {
+        avformat_flush(format_ctx);
+        if ((ret = avio_seek(format_ctx->pb, entry->pos, SEEK_SET)) < 0) {
+            printf("avio_seek failed, %s\n", av_err2str(ret));
+            return ret;
+        }
+    } else if ((ret = av_seek_frame(format_ctx, stream_index, entry->timestamp, AVSEEK_FLAG_BACKWARD)) < 0) {
+        printf("av_seek_frame failed, %s\n", av_err2str(ret));
+        return ret;
+    }
+    printf("seek by index, entry:%d/%d, timestamp:%"PRId64", pos:%"PRId64"\n",
+           index, stream->nb_index_entries, entry->timestamp, entry->pos);
+    return 0;
+}
+
+
+/**
+ * 由av_seek_frame跳到目标时间之前最近的关键帧
+ * @param format_ctx
+ * @param stream_index
+ * @param timestamp 以流的time_base为单位
+ * @return
+ */
+int seek_by_frame(AVFormatContext *format_ctx, int stream_index, int64_t timestamp) {
+    int ret;
+    if ((ret = av_seek_frame(format_ctx, stream_index, timestamp, AVSEEK_FLAG_BACKWARD)) < 0) {
+        printf("av_seek_frame failed, %s\n", av_err2str(ret));
+    }
+    return ret;
+}
+
+
+/**
+ * 在buf中找到连续3个包都对齐的同步字节，确定包长和同步位置
+ * @param buf
+ * @param size
+ * @param packet_size 返回188/192/204
+ * @return 同步字节的偏移，找不到时返回-1
+ */
+static int ts_resync(const uint8_t *buf, int size, int *packet_size) {
+    static const int sizes[] = {TS_PACKET_SIZE, TS_PACKET_SIZE + 4, TS_PACKET_SIZE + 16};
+    int i, j;
+    for (i = 0; i < size; ++i) {
+        if (buf[i] != TS_SYNC_BYTE) {
+            continue;
+        }
+        for (j = 0; j < 3; ++j) {
+            if (i + 2 * sizes[j] < size && buf[i + sizes[j]] == TS_SYNC_BYTE &&
+                buf[i + 2 * sizes[j]] == TS_SYNC_BYTE) {
+                *packet_size = sizes[j];
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * 解析一个TS包，是目标PID上PES的起始包时取出DTS(没有时为PTS)和random_access_indicator
+ * @param p 同步字节处
+ * @param pid
+ * @param pes 返回的PES起始信息
+ * @return 是PES起始包且带时间戳时返回1
+ */
+static int ts_parse_packet(const uint8_t *p, int pid, TsPesStart *pes) {
+    int afc, offset = 4, flags;
+    const uint8_t *pes_header;
+    if (((p[1] & 0x1f) << 8 | p[2]) != pid || !(p[1] & 0x40)) {
+        return 0;
+    }
+    afc = (p[3] >> 4) & 3;
+    pes->random_access = 0;
+    if (afc & 2) {
+        pes->random_access = p[4] > 0 && (p[5] & 0x40);
+        offset += 1 + p[4];
+    }
+    if (!(afc & 1) || offset + 19 > TS_PACKET_SIZE) {
+        return 0;
+    }
+    pes_header = p + offset;
+    if (AV_RB24(pes_header) != 1) {
+        return 0;
+    }
+    flags = pes_header[7] >> 6;
+    if (!(flags & 2)) {
+        return 0;
+    }
+    pes_header += (flags == 3) ? 14 : 9; // 有DTS时取DTS，保证随文件位置单调
+    pes->timestamp = (int64_t) (pes_header[0] & 0x0e) << 29 | (AV_RB16(pes_header + 1) >> 1) << 15 |
+                     AV_RB16(pes_header + 3) >> 1;
+    return 1;
+}
+
+
+/**
+ * 从pos开始向后读取，找到目标PID上第一个(或第一个随机访问点的)PES起始包
+ * @param reader
+ * @param pos
+ * @param limit 最多读取的字节数
+ * @param random_access 只查找带random_access_indicator的包
+ * @param pes 返回的PES起始信息
+ * @return 找不到时返回AVERROR(ENOENT)
+ */
+static int ts_find_pes(TsReader *reader, int64_t pos, int64_t limit, int random_access, TsPesStart *pes) {
+    int64_t end = pos + limit;
+    int ret, size, offset, packet_size;
+    while (pos < end) {
+        if ((ret = avio_seek(reader->pb, pos, SEEK_SET)) < 0) {
+            return ret;
+        }
+        if ((size = avio_read(reader->pb, reader->buf, TS_SEEK_READ_SIZE)) <= 0) {
+            return AVERROR(ENOENT);
+        }
+        if ((offset = ts_resync(reader->buf, size, &packet_size)) < 0) {
+            pos += size;
+            continue;
+        }
+        for (; offset + TS_PACKET_SIZE <= size; offset += reader->packet_size) {
+            if (reader->buf[offset] != TS_SYNC_BYTE) { // 丢包后重新同步
+                break;
+            }
+            if (ts_parse_packet(reader->buf + offset, reader->pid, pes) &&
+                (!random_access || pes->random_access)) {
+                pes->pos = pos + offset - reader->sync_offset;
+                return 0;
+            }
+        }
+        pos += FFMAX(offset, 1);
+    }
+    return AVERROR(ENOENT);
+}
+
+
+/**
+ * 无索引的大MPEG-TS文件按字节位置二分查找视频PES的时间戳，再向后扫描到随机访问点
+ * 只读取O(log n)块数据，不经过demuxer
+ * @param format_ctx
+ * @param stream_index
+ * @param timestamp 以流的time_base(90kHz)为单位
+ * @return 不是可seek的TS文件时返回AVERROR(ENOENT)
+ */
+int seek_by_ts_bisect(AVFormatContext *format_ctx, int stream_index, int64_t timestamp) {
+    AVStream *stream = format_ctx->streams[stream_index];
+    TsReader reader = {format_ctx->pb, stream->id, TS_PACKET_SIZE, 0, NULL};
+    TsPesStart pes, before, after;
+    int64_t low, high, mid, first, start, target, size, step;
+    int ret, reads = 0;
+    if (strcmp(format_ctx->iformat->name, "mpegts") || !format_ctx->pb ||
+        !(format_ctx->pb->seekable & AVIO_SEEKABLE_NORMAL) || (size = avio_size(format_ctx->pb)) <= 0) {
+        return AVERROR(ENOENT);
+    }
+    if (!(reader.buf = av_malloc(TS_SEEK_READ_SIZE))) {
+        return AVERROR(ENOMEM);
+    }
+    // 确定包长，m2ts的同步字节前有4字节时间码
+    if ((ret = avio_seek(reader.pb, 0, SEEK_SET)) < 0 ||
+        (ret = avio_read(reader.pb, reader.buf, TS_SEEK_READ_SIZE)) <= 0 ||
+        ts_resync(reader.buf, ret, &reader.packet_size) < 0) {
+        ret = AVERROR(ENOENT);
+        goto end;
+    }
+    reader.sync_offset = reader.packet_size == TS_PACKET_SIZE + 4 ? 4 : 0;
+    if ((ret = ts_find_pes(&reader, 0, TS_SEEK_PROBE_SIZE, 0, &pes)) < 0) {
+        goto end;
+    }
+    // 以第一个PES为基准计算相对时间，处理33位时间戳回绕
+    start = pes.timestamp;
+    target = (timestamp - start) & TS_PTS_MASK;
+    low = first = pes.pos;
+    high = size;
+    while (high - low > TS_SEEK_WINDOW_SIZE) {
+        mid = low + (high - low) / 2;
+        mid -= mid % reader.packet_size;
+        ++reads;
+        if (ts_find_pes(&reader, mid, FFMIN(TS_SEEK_PROBE_SIZE, high - mid), 0, &pes) < 0 ||
+            pes.pos >= high) {
+            high = mid;
+        } else if (((pes.timestamp - start) & TS_PTS_MASK) <= target) {
+            low = pes.pos;
+        } else {
+            high = mid;
+        }
+    }
+    // 从low向后扫描随机访问点，取目标之前最后一个
+    // low只保证PES不晚于目标，目标所在gop的随机访问点可能在low之前，没有找到时成倍向前扩大扫描起点
+    before.pos = after.pos = -1;
+    for (step = TS_SEEK_WINDOW_SIZE; before.pos < 0; step *= 2) {
+        for (mid = low; ts_find_pes(&reader, mid, TS_SEEK_PROBE_SIZE, 1, &pes) == 0;
+             mid = pes.pos + reader.packet_size) {
+            if (((pes.timestamp - start) & TS_PTS_MASK) > target) {
+                after = after.pos < 0 ? pes : after;
+                break;
+            }
+            before = pes;
+        }
+        if (low <= first) {
+            break;
+        }
+        low = FFMAX(first, low - step);
+        ++reads;
+    }
+    // 目标在第一个随机访问点之前时取之后的第一个
+    if (before.pos < 0 && (before = after).pos < 0) {
+        ret = AVERROR(ENOENT);
+        goto end;
+    }
+    avformat_flush(format_ctx);
+    if ((ret = avio_seek(format_ctx->pb, before.pos, SEEK_SET)) < 0) {
+        printf("avio_seek failed, %s\n", av_err2str(ret));
+        goto end;
+    }
+    printf("seek by ts bisect, reads:%d, timestamp:%"PRId64", pos:%"PRId64"\n", reads, before.timestamp, before.pos);
+    ret = 0;
+    end:
+    av_free(reader.buf);
+    return ret;
+}
+
+
+/**
+ * 按seek方式跳到截图时间点之前最近的关键帧
+ * @param format_ctx
+ * @param stream_index 视频流
+ * @param position 截图时间点，单位ms
+ * @param seek_mode SeekMode
+ * @return
+ */
+int seek_input(AVFormatContext *format_ctx, int stream_index, int64_t position, int seek_mode) {
+    AVStream *stream = format_ctx->streams[stream_index];
+    int64_t timestamp = av_rescale_q(position, (AVRational) {1, 1000}, stream->time_base);
+    int ret;
+    if (stream->start_time != AV_NOPTS_VALUE) {
+        timestamp += stream->start_time;
+    }
+    switch (seek_mode) {
+        case SEEK_MODE_INDEX:
+            return seek_by_index(format_ctx, stream_index, timestamp);
+        case SEEK_MODE_FRAME:
+            return seek_by_frame(format_ctx, stream_index, timestamp);
+        case SEEK_MODE_TS_BISECT:
+            return seek_by_ts_bisect(format_ctx, stream_index, timestamp);
+        default:
+            if ((ret = seek_by_index(format_ctx, stream_index, timestamp)) != AVERROR(ENOENT)) {
+                return ret;
+            }
+            if ((ret = seek_by_ts_bisect(format_ctx, stream_index, timestamp)) != AVERROR(ENOENT)) {
+                return ret;
+            }
+            return seek_by_frame(format_ctx, stream_index, timestamp);
+    }
+}
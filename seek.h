@@ -0,0 +1,25 @@
+#include <libavformat/avformat.h>
+
+#define TS_PACKET_SIZE 188
+#define TS_SEEK_READ_SIZE (TS_PACKET_SIZE * 512)
+#define TS_SEEK_PROBE_SIZE (1024 * 1024) // 每次二分探测最多读取的字节数
+#define TS_SEEK_WINDOW_SIZE (256 * 1024) // 二分区间小于该值时改为向后扫描
+
+/**
+ * 按时间截图时的seek方式
+ * SEEK_MODE_AUTO依次尝试容器索引、TS二分查找，最后回退av_seek_frame
+ */
+typedef enum SeekMode {
+    SEEK_MODE_AUTO = 0,
+    SEEK_MODE_INDEX,
+    SEEK_MODE_FRAME,
+    SEEK_MODE_TS_BISECT,
+} SeekMode;
+
+int seek_input(AVFormatContext *format_ctx, int stream_index, int64_t position, int seek_mode);
+
+int seek_by_index(AVFormatContext *format_ctx, int stream_index, int64_t timestamp);
+
+int seek_by_ts_bisect(AVFormatContext *format_ctx, int stream_index, int64_t timestamp);
+
+int seek_by_frame(AVFormatContext *format_ctx, int stream_index, int64_t timestamp);
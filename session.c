@@ -0,0 +1,592 @@
+//
+// 直播源常驻会话：持续解复用到环形缓冲，按需截图和导出最近一段时间的剪辑
+//
+#include "session.h"
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/**
+ * 追加一个包，容量不足时加倍
+ * @param ring
+ * @param packet 引用被转移到缓冲中
+ * @param time
+ * @return
+ */
+static int push_packet_ring(PacketRing *ring, AVPacket *packet, int64_t time) {
+    PacketRingEntry *entries;
+    int i, capacity;
+    if (ring->count == ring->capacity) {
+        capacity = ring->capacity ? ring->capacity * 2 : 1024;
+        if (!(entries = (PacketRingEntry *) av_malloc_array(capacity, sizeof(PacketRingEntry)))) {
+            return AVERROR(ENOMEM);
+        }
+        for (i = 0; i < ring->count; ++i) {
+            entries[i] = ring->entries[(ring->head + i) % ring->capacity];
+        }
+        av_free(ring->entries);
+        ring->entries = entries;
+        ring->capacity = capacity;
+        ring->head = 0;
+    }
+    entries = &(ring->entries[(ring->head + ring->count) % ring->capacity]);
+    if (!(entries->packet = av_packet_alloc())) {
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(entries->packet, packet);
+    entries->time = time;
+    ring->bytes += entries->packet->size;
+    ring->count++;
+    return 0;
+}
+
+
+static PacketRingEntry *packet_ring_at(PacketRing *ring, int index) {
+    return &(ring->entries[(ring->head + index) % ring->capacity]);
+}
+
+
+static void pop_packet_ring(PacketRing *ring) {
+    PacketRingEntry *entry = packet_ring_at(ring, 0);
+    ring->bytes -= entry->packet->size;
+    av_packet_free(&(entry->packet));
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+}
+
+
+/**
+ * 淘汰超过时长或字节数上限的最旧的包
+ * @param ring
+ * @param max_duration 单位ms
+ * @param max_bytes
+ */
+static void trim_packet_ring(PacketRing *ring, int64_t max_duration, int64_t max_bytes) {
+    int64_t newest;
+    if (ring->count == 0) {
+        return;
+    }
+    newest = packet_ring_at(ring, ring->count - 1)->time;
+    while (ring->count > 1 &&
+           (ring->bytes > max_bytes || newest - packet_ring_at(ring, 0)->time > max_duration * 1000)) {
+        pop_packet_ring(ring);
+    }
+}
+
+
+static void clear_packet_ring(PacketRing *ring) {
+    while (ring->count > 0) {
+        pop_packet_ring(ring);
+    }
+}
+
+
+static void free_stream_parameters(LiveSession *session) {
+    int i;
+    for (i = 0; i < session->nb_streams; ++i) {
+        avcodec_parameters_free(&(session->codecpars[i]));
+    }
+    av_freep(&(session->codecpars));
+    av_freep(&(session->time_bases));
+    session->nb_streams = 0;
+}
+
+
+static int interrupt_live_session(void *opaque) {
+    return __atomic_load_n(&(((LiveSession *) opaque)->stop), __ATOMIC_RELAXED);
+}
+
+
+/**
+ * 重连后的流是否与会话当前的流相同，相同时缓冲中旧连接的包可以与新连接的包一起解码和封装
+ * @param session
+ * @param iformat_ctx 新连接
+ * @param video_stream_index
+ * @return
+ */
+static int is_same_streams(const LiveSession *session, const AVFormatContext *iformat_ctx, int video_stream_index) {
+    const AVCodecParameters *old_par, *new_par;
+    unsigned int i;
+    if (session->nb_streams != (int) iformat_ctx->nb_streams || session->video_stream_index != video_stream_index) {
+        return 0;
+    }
+    for (i = 0; i < iformat_ctx->nb_streams; ++i) {
+        old_par = session->codecpars[i];
+        new_par = iformat_ctx->streams[i]->codecpar;
+        if (!old_par != (iformat_ctx->streams[i]->discard == AVDISCARD_ALL)) {
+            return 0;
+        }
+        if (old_par && (old_par->codec_id != new_par->codec_id || old_par->width != new_par->width ||
+                        old_par->height != new_par->height || old_par->sample_rate != new_par->sample_rate ||
+                        old_par->channels != new_par->channels ||
+                        av_cmp_q(session->time_bases[i], iformat_ctx->streams[i]->time_base) ||
+                        old_par->extradata_size != new_par->extradata_size ||
+                        (old_par->extradata_size > 0 &&
+                         memcmp(old_par->extradata, new_par->extradata, (size_t) old_par->extradata_size)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * 打开输入，保留选中的视频流和最佳音频流
+ * 重连后的流与之前相同时保留环形缓冲中的包，否则替换会话的流参数并清空环形缓冲
+ * @param session
+ * @return 0为新的流，1为保留了之前的流和缓冲，失败返回负数
+ */
+static int open_live_input(LiveSession *session) {
+    AVFormatContext *iformat_ctx;
+    AVDictionary *format_options = NULL;
+    AVCodecParameters **codecpars = NULL;
+    AVRational *time_bases = NULL;
+    unsigned int i;
+    int video_stream_index, audio_stream_index, ret = -1;
+    if (!(iformat_ctx = avformat_alloc_context())) {
+        return AVERROR(ENOMEM);
+    }
+    iformat_ctx->interrupt_callback.callback = interrupt_live_session;
+    iformat_ctx->interrupt_callback.opaque = session;
+    if (session->options.timeout > 0) {
+        av_dict_set_int(&format_options, "stimeout", session->options.timeout * 1000, 0);
+    }
+    if (session->options.input.probe_size > 0) {
+        av_dict_set_int(&format_options, "probesize", session->options.input.probe_size, 0);
+    }
+    // 剪辑需要音频，rtsp同时SETUP音频轨
+    av_dict_set(&format_options, "allowed_media_types", "video+audio", 0);
+    if (open_iformat_context(session->url, &(session->options.input), &iformat_ctx, &format_options,
+                             &video_stream_index) < 0) {
+        printf("open live input failed: %s\n", session->url);
+        goto end;
+    }
+    // 只在demuxer中丢弃视频流和最佳音频流之外的流
+    audio_stream_index = av_find_best_stream(iformat_ctx, AVMEDIA_TYPE_AUDIO, -1, video_stream_index, NULL, 0);
+    if (audio_stream_index >= 0) {
+        iformat_ctx->streams[audio_stream_index]->discard = AVDISCARD_DEFAULT;
+    }
+    pthread_mutex_lock(&(session->mutex));
+    if (is_same_streams(session, iformat_ctx, video_stream_index)) {
+        pthread_mutex_unlock(&(session->mutex));
+        session->iformat_ctx = iformat_ctx;
+        iformat_ctx = NULL;
+        ret = 1;
+        goto end;
+    }
+    pthread_mutex_unlock(&(session->mutex));
+    codecpars = (AVCodecParameters **) av_mallocz_array(iformat_ctx->nb_streams, sizeof(AVCodecParameters *));
+    time_bases = (AVRational *) av_mallocz_array(iformat_ctx->nb_streams, sizeof(AVRational));
+    if (!codecpars || !time_bases) {
+        goto end;
+    }
+    for (i = 0; i < iformat_ctx->nb_streams; ++i) {
+        if (iformat_ctx->streams[i]->discard == AVDISCARD_ALL) {
+            continue;
+        }
+        if (!(codecpars[i] = avcodec_parameters_alloc()) ||
+            avcodec_parameters_copy(codecpars[i], iformat_ctx->streams[i]->codecpar) < 0) {
+            goto end;
+        }
+        time_bases[i] = iformat_ctx->streams[i]->time_base;
+    }
+    pthread_mutex_lock(&(session->mutex));
+    clear_packet_ring(&(session->ring));
+    free_stream_parameters(session);
+    session->codecpars = codecpars;
+    session->time_bases = time_bases;
+    session->nb_streams = (int) iformat_ctx->nb_streams;
+    session->video_stream_index = video_stream_index;
+    session->framerate = av_guess_frame_rate(iformat_ctx, iformat_ctx->streams[video_stream_index], NULL);
+    pthread_mutex_unlock(&(session->mutex));
+    session->iformat_ctx = iformat_ctx;
+    codecpars = NULL;
+    time_bases = NULL;
+    iformat_ctx = NULL;
+    ret = 0;
+    end:
+    if (codecpars) {
+        for (i = 0; iformat_ctx && i < iformat_ctx->nb_streams; ++i) {
+            avcodec_parameters_free(&(codecpars[i]));
+        }
+        av_free(codecpars);
+    }
+    av_free(time_bases);
+    close_iformat_context(&iformat_ctx);
+    av_dict_free(&format_options);
+    return ret;
+}
+
+
+/**
+ * 读线程：持续解复用到环形缓冲，出错后关闭输入，间隔LIVE_SESSION_RECONNECT_DELAY重连
+ * 保留缓冲的重连从新连接的第一个视频关键帧开始，时间戳平移到缓冲中最后一个包之后
+ */
+static void *read_live_session(void *arg) {
+    LiveSession *session = (LiveSession *) arg;
+    AVPacket packet;
+    AVRational time_base;
+    int64_t time = 0, last_time = 0, offset = 0, delta, *stream_times = NULL;
+    int ret, i, resync = 0;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    while (!interrupt_live_session(session)) {
+        if (!session->iformat_ctx) {
+            if ((ret = open_live_input(session)) < 0) {
+                for (i = 0; i < LIVE_SESSION_RECONNECT_DELAY / 100 && !interrupt_live_session(session); ++i) {
+                    av_usleep(100000);
+                }
+                continue;
+            }
+            resync = ret > 0 && stream_times;
+            if (!resync) {
+                offset = 0;
+                av_freep(&stream_times);
+                if (!(stream_times = (int64_t *) av_malloc_array(session->nb_streams, sizeof(int64_t)))) {
+                    close_iformat_context(&(session->iformat_ctx));
+                    continue;
+                }
+                for (i = 0; i < session->nb_streams; ++i) {
+                    stream_times[i] = INT64_MIN;
+                }
+            }
+        }
+        if ((ret = av_read_frame(session->iformat_ctx, &packet)) < 0) {
+            if (ret == AVERROR(EAGAIN)) {
+                av_usleep(10000);
+                continue;
+            }
+            if (!interrupt_live_session(session)) {
+                printf("live session read failed, %s, reconnect: %s\n", av_err2str(ret), session->url);
+                session->reconnects++;
+            }
+            close_iformat_context(&(session->iformat_ctx));
+            continue;
+        }
+        if (packet.stream_index >= session->nb_streams || !session->codecpars[packet.stream_index] ||
+            (resync && (packet.stream_index != session->video_stream_index || !(packet.flags & AV_PKT_FLAG_KEY)))) {
+            av_packet_unref(&packet);
+            continue;
+        }
+        time_base = session->time_bases[packet.stream_index];
+        if (packet.dts != AV_NOPTS_VALUE) {
+            time = av_rescale_q(packet.dts, time_base, AV_TIME_BASE_Q) + offset;
+        } else if (packet.pts != AV_NOPTS_VALUE) {
+            time = av_rescale_q(packet.pts, time_base, AV_TIME_BASE_Q) + offset;
+        } else {
+            time = last_time;
+        }
+        if (resync) { // 新连接的时间戳从上一个包之后一帧继续
+            delta = last_time - time + (session->framerate.num > 0 ?
+                                        av_rescale(AV_TIME_BASE, session->framerate.den, session->framerate.num) :
+                                        AV_TIME_BASE / 25);
+            offset += delta;
+            time += delta;
+            resync = 0;
+        }
+        // 重连时与旧连接重叠的包无法按dts递增封装
+        if (packet.dts != AV_NOPTS_VALUE && time <= stream_times[packet.stream_index]) {
+            av_packet_unref(&packet);
+            continue;
+        }
+        stream_times[packet.stream_index] = time;
+        last_time = time;
+        if (offset) {
+            delta = av_rescale_q(offset, AV_TIME_BASE_Q, time_base);
+            packet.pts = packet.pts != AV_NOPTS_VALUE ? packet.pts + delta : AV_NOPTS_VALUE;
+            packet.dts = packet.dts != AV_NOPTS_VALUE ? packet.dts + delta : AV_NOPTS_VALUE;
+        }
+        pthread_mutex_lock(&(session->mutex));
+        if (push_packet_ring(&(session->ring), &packet, time) < 0) {
+            printf("push packet ring failed\n");
+        }
+        trim_packet_ring(&(session->ring), session->max_duration, session->max_bytes);
+        pthread_mutex_unlock(&(session->mutex));
+        av_packet_unref(&packet);
+    }
+    av_free(stream_times);
+    close_iformat_context(&(session->iformat_ctx));
+    return NULL;
+}
+
+
+/**
+ * 打开直播源会话并启动读线程，输入第一次打开失败时仍在后台重试
+ * @param url
+ * @param options 使用timeout和input，input中的指针需在会话关闭前保持有效
+ * @param max_duration 环形缓冲保留的时长，单位ms，<=0时使用默认值
+ * @param max_bytes 环形缓冲的字节数上限，<=0时使用默认值
+ * @return 失败返回NULL
+ */
+LiveSession *open_live_session(const char *url, const ShotOptions *options, int64_t max_duration,
+                               int64_t max_bytes) {
+    LiveSession *session = (LiveSession *) av_mallocz(sizeof(LiveSession));
+    if (!session) {
+        return NULL;
+    }
+    if (!(session->url = av_strdup(url))) {
+        av_free(session);
+        return NULL;
+    }
+    session->options = *options;
+    session->options.stats = NULL;
+    session->max_duration = max_duration > 0 ? max_duration : LIVE_SESSION_DEFAULT_DURATION;
+    session->max_bytes = max_bytes > 0 ? max_bytes : LIVE_SESSION_DEFAULT_BYTES;
+    session->video_stream_index = -1;
+    pthread_mutex_init(&(session->mutex), NULL);
+    if (pthread_create(&(session->thread), NULL, read_live_session, session) != 0) {
+        printf("pthread_create failed\n");
+        pthread_mutex_destroy(&(session->mutex));
+        av_free(session->url);
+        av_free(session);
+        return NULL;
+    }
+    return session;
+}
+
+
+/**
+ * 停止读线程并释放缓冲
+ * @param session
+ */
+void close_live_session(LiveSession **session) {
+    if (!*session) {
+        return;
+    }
+    __atomic_store_n(&((*session)->stop), 1, __ATOMIC_RELAXED);
+    pthread_join((*session)->thread, NULL);
+    clear_packet_ring(&((*session)->ring));
+    av_freep(&((*session)->ring.entries));
+    free_stream_parameters(*session);
+    pthread_mutex_destroy(&((*session)->mutex));
+    av_freep(&((*session)->url));
+    av_freep(session);
+}
+
+
+/**
+ * 在缓冲中查找剪辑的起始关键帧，需持有mutex
+ * 优先取时间窗口开始之前最近的关键帧，使剪辑覆盖完整时长，没有时取窗口内第一个关键帧
+ * @param session
+ * @param duration 单位ms，<=0时从缓冲中最旧的关键帧开始
+ * @return 起始位置，没有关键帧时返回-1
+ */
+static int find_clip_start(LiveSession *session, int64_t duration) {
+    PacketRing *ring = &(session->ring);
+    PacketRingEntry *entry;
+    int64_t window_start;
+    int i, before = -1;
+    if (ring->count == 0) {
+        return -1;
+    }
+    window_start = duration > 0 ? packet_ring_at(ring, ring->count - 1)->time - duration * 1000 : INT64_MIN;
+    for (i = 0; i < ring->count; ++i) {
+        entry = packet_ring_at(ring, i);
+        if (entry->packet->stream_index != session->video_stream_index || !(entry->packet->flags & AV_PKT_FLAG_KEY)) {
+            continue;
+        }
+        if (entry->time <= window_start) {
+            before = i;
+        } else {
+            return before >= 0 ? before : i;
+        }
+    }
+    return before;
+}
+
+
+/**
+ * 把缓冲中最近duration的包从关键帧开始stream copy封装为mp4、ts等文件，不转码
+ * 时间戳平移到从0开始，输出先写临时文件，完成后rename
+ * @param session
+ * @param output
+ * @param format_name 封装格式，为NULL时按output扩展名确定
+ * @param duration 剪辑时长，单位ms，<=0时导出整个缓冲
+ * @return
+ */
+int export_live_clip(LiveSession *session, const char *output, const char *format_name, int64_t duration) {
+    AVOutputFormat *oformat;
+    AVFormatContext *oformat_ctx = NULL;
+    AVCodecParameters **codecpars = NULL;
+    AVRational *time_bases = NULL;
+    AVPacket **packets = NULL, *packet;
+    AVStream *stream;
+    char *temp_output = NULL;
+    int *stream_map = NULL, nb_streams = 0, nb_packets = 0, start, i, ret = -1, close_ret, copied = 1;
+    int64_t start_time = 0;
+    if (!(oformat = av_guess_format(format_name, output, NULL))) {
+        printf("av_guess_format failed, %s\n", output);
+        return -1;
+    }
+    // 持有锁时只复制包的引用和流参数
+    pthread_mutex_lock(&(session->mutex));
+    if ((start = find_clip_start(session, duration)) < 0) {
+        pthread_mutex_unlock(&(session->mutex));
+        printf("no keyframe in live session buffer: %s\n", session->url);
+        return AVERROR(EAGAIN);
+    }
+    start_time = packet_ring_at(&(session->ring), start)->time;
+    nb_streams = session->nb_streams;
+    codecpars = (AVCodecParameters **) av_mallocz_array(nb_streams, sizeof(AVCodecParameters *));
+    time_bases = (AVRational *) av_mallocz_array(nb_streams, sizeof(AVRational));
+    packets = (AVPacket **) av_mallocz_array(session->ring.count - start, sizeof(AVPacket *));
+    for (i = 0; codecpars && time_bases && i < nb_streams; ++i) {
+        time_bases[i] = session->time_bases[i];
+        if (session->codecpars[i] && (!(codecpars[i] = avcodec_parameters_alloc()) ||
+                                      avcodec_parameters_copy(codecpars[i], session->codecpars[i]) < 0)) {
+            copied = 0;
+            break;
+        }
+    }
+    for (i = start; packets && i < session->ring.count; ++i) {
+        PacketRingEntry *entry = packet_ring_at(&(session->ring), i);
+        if (entry->time < start_time) { // 起始关键帧之前的音频
+            continue;
+        }
+        if (!(packets[nb_packets] = av_packet_clone(entry->packet))) {
+            copied = 0;
+            break;
+        }
+        nb_packets++;
+    }
+    pthread_mutex_unlock(&(session->mutex));
+    if (!codecpars || !time_bases || !packets || !copied || nb_packets == 0) {
+        printf("copy live session packets failed\n");
+        goto end;
+    }
+
+    if (!(temp_output = make_temp_path(output))) {
+        goto end;
+    }
+    if ((ret = avformat_alloc_output_context2(&oformat_ctx, oformat, NULL, temp_output)) < 0) {
+        printf("avformat_alloc_output_context2 failed, %s\n", av_err2str(ret));
+        goto end;
+    }
+    if (!(stream_map = (int *) av_malloc_array(nb_streams, sizeof(int)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < nb_streams; ++i) {
+        stream_map[i] = -1;
+        if (!codecpars[i]) {
+            continue;
+        }
+        if (!(stream = avformat_new_stream(oformat_ctx, NULL)) ||
+            (ret = avcodec_parameters_copy(stream->codecpar, codecpars[i])) < 0) {
+            printf("add clip stream failed\n");
+            ret = ret < 0 ? ret : AVERROR(ENOMEM);
+            goto end;
+        }
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = time_bases[i];
+        stream_map[i] = stream->index;
+    }
+    if (!(oformat->flags & AVFMT_NOFILE) && (ret = avio_open(&(oformat_ctx->pb), temp_output, AVIO_FLAG_WRITE)) < 0) {
+        printf("avio_open failed, %s\n", av_err2str(ret));
+        goto end;
+    }
+    if ((ret = avformat_write_header(oformat_ctx, NULL)) < 0) {
+        printf("avformat_write_header failed, %s\n", av_err2str(ret));
+        goto end;
+    }
+    for (i = 0; i < nb_packets; ++i) {
+        packet = packets[i];
+        if (packet->stream_index >= nb_streams || stream_map[packet->stream_index] < 0) {
+            continue;
+        }
+        AVRational time_base = time_bases[packet->stream_index];
+        int64_t offset = av_rescale_q(start_time, AV_TIME_BASE_Q, time_base);
+        if (packet->pts != AV_NOPTS_VALUE) {
+            packet->pts -= offset;
+        }
+        if (packet->dts != AV_NOPTS_VALUE) {
+            packet->dts -= offset;
+        }
+        packet->stream_index = stream_map[packet->stream_index];
+        av_packet_rescale_ts(packet, time_base, oformat_ctx->streams[packet->stream_index]->time_base);
+        packet->pos = -1;
+        if ((ret = av_interleaved_write_frame(oformat_ctx, packet)) < 0) {
+            printf("av_interleaved_write_frame failed, %s\n", av_err2str(ret));
+            goto end;
+        }
+    }
+    if ((ret = av_write_trailer(oformat_ctx)) < 0) {
+        printf("av_write_trailer failed, %s\n", av_err2str(ret));
+        goto end;
+    }
+    // 写满磁盘等错误在flush或close时才出现，失败的临时文件不提交
+    if (oformat_ctx->pb) {
+        avio_flush(oformat_ctx->pb);
+        ret = oformat_ctx->pb->error;
+        if ((close_ret = avio_closep(&(oformat_ctx->pb))) < 0 && ret >= 0) {
+            ret = close_ret;
+        }
+        if (ret < 0) {
+            printf("write clip failed, %s: %s\n", output, av_err2str(ret));
+            goto end;
+        }
+    }
+    ret = commit_output_file(temp_output, output, DURABILITY_NONE, NULL);
+    temp_output = NULL;
+    end:
+    if (oformat_ctx) {
+        if (!(oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&(oformat_ctx->pb));
+        }
+        avformat_free_context(oformat_ctx);
+    }
+    abort_output_file(&temp_output);
+    for (i = 0; packets && i < nb_packets; ++i) {
+        av_packet_free(&(packets[i]));
+    }
+    for (i = 0; codecpars && i < nb_streams; ++i) {
+        avcodec_parameters_free(&(codecpars[i]));
+    }
+    av_free(packets);
+    av_free(codecpars);
+    av_free(time_bases);
+    av_free(stream_map);
+    return ret < 0 ? ret : 0;
+}
+
+
+/**
+ * 解码缓冲中最近的视频关键帧截图，不需要等待新的关键帧
+ * @param session
+ * @param specs
+ * @param nb_specs
+ * @param options 同render_shot_capture
+ * @return 缓冲中还没有关键帧时返回AVERROR(EAGAIN)
+ */
+int live_session_shot(LiveSession *session, const OutputSpec *specs, int nb_specs, const ShotOptions *options) {
+    ShotCapture *capture = NULL;
+    PacketRingEntry *entry;
+    int i, ret = AVERROR(EAGAIN);
+    pthread_mutex_lock(&(session->mutex));
+    for (i = session->ring.count - 1; i >= 0; --i) {
+        entry = packet_ring_at(&(session->ring), i);
+        if (entry->packet->stream_index == session->video_stream_index && (entry->packet->flags & AV_PKT_FLAG_KEY)) {
+            break;
+        }
+    }
+    if (i >= 0 && (capture = alloc_shot_capture(session->codecpars[session->video_stream_index]))) {
+        capture->time_base = session->time_bases[session->video_stream_index];
+        capture->framerate = session->framerate;
+        capture->random_access = RANDOM_ACCESS_CLEAN;
+        ret = add_shot_capture_packet(capture, entry->packet);
+    }
+    pthread_mutex_unlock(&(session->mutex));
+    if (ret < 0) {
+        if (ret == AVERROR(EAGAIN)) {
+            printf("no keyframe in live session buffer: %s\n", session->url);
+        }
+        free_shot_capture(&capture);
+        return ret;
+    }
+    ret = render_shot_capture(capture, specs, nb_specs, options);
+    free_shot_capture(&capture);
+    return ret;
+}
@@ -0,0 +1,56 @@
+#include "shot.h"
+
+#define LIVE_SESSION_DEFAULT_DURATION 30000 // 环形缓冲保留的时长，单位ms
+#define LIVE_SESSION_DEFAULT_BYTES (64 * 1024 * 1024)
+#define LIVE_SESSION_RECONNECT_DELAY 1000 // 断线后重连的间隔，单位ms
+
+/**
+ * 环形缓冲中的一个包，time为AV_TIME_BASE单位的dts(没有时为pts)
+ */
+typedef struct PacketRingEntry {
+    AVPacket *packet;
+    int64_t time;
+} PacketRingEntry;
+
+/**
+ * 解复用后的包的环形缓冲，按时长和字节数淘汰最旧的包
+ */
+typedef struct PacketRing {
+    PacketRingEntry *entries;
+    int capacity;
+    int head; // 最旧的包
+    int count;
+    int64_t bytes;
+} PacketRing;
+
+/**
+ * 直播源的常驻会话：后台线程持续解复用视频流和一路音频流到环形缓冲，断线后自动重连
+ * 截图直接解码缓冲中最近的关键帧，剪辑从关键帧开始stream copy封装，都不需要重新打开输入
+ * 重连后的流参数不变时保留缓冲，新连接的包从关键帧开始、时间戳接在缓冲之后；流参数变化时清空缓冲
+ */
+typedef struct LiveSession {
+    char *url;
+    ShotOptions options;
+    AVFormatContext *iformat_ctx; // 只由读线程访问
+    int video_stream_index;
+    AVCodecParameters **codecpars; // 当前连接各流的参数，重连时替换
+    AVRational *time_bases;
+    AVRational framerate;
+    int nb_streams;
+    PacketRing ring;
+    int64_t max_duration;
+    int64_t max_bytes;
+    int stop;
+    int64_t reconnects;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+} LiveSession;
+
+LiveSession *open_live_session(const char *url, const ShotOptions *options, int64_t max_duration,
+                               int64_t max_bytes);
+
+void close_live_session(LiveSession **session);
+
+int export_live_clip(LiveSession *session, const char *output, const char *format_name, int64_t duration);
+
+int live_session_shot(LiveSession *session, const OutputSpec *specs, int nb_specs, const ShotOptions *options);
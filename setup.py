@@ -1,3 +1,4 @@
+# 打包前先在仓库根目录执行make构建pyffshot/lib/libshot.so，FFmpeg动态库放在pyffshot/lib
 from setuptools import setup
 setup(
     name='pyffshot',
@@ -1,5 +1,10 @@
 #include "shot.h"
 #include <time.h>
+#include <string.h>
+#include <libavutil/bprint.h>
+#include <libavutil/time.h>
+#include "mp4_fetch.h"
+#include <sys/stat.h>
 
 /**
  * 从视频中获取第一个关键帧作为视频截图
@@ -9,183 +14,1049 @@
  * @return
  */
 int shot(const char *url, const char *codec_name, const char *output, int timeout) {
-    ShotContext *shot_ctx = open_shot_context(url, codec_name, output, timeout);
+    OutputSpec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.codec_name = codec_name;
+    spec.output = output;
+    ShotOptions options;
+    init_shot_options(&options);
+    options.timeout = timeout;
+    return shot_outputs(url, &spec, 1, &options);
+}
+
+
+static int shot_mp4_keyframe(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options);
+
+static int find_program_video_stream(AVFormatContext *format_ctx, const AVProgram *program);
+
+static int packet_random_access(const NalInspector *inspector, const AVPacket *packet, int *recovery_frames);
+
+static void report_shot_stats(const ShotContext *shot_ctx, int64_t start, int ret, ShotStats *stats);
+
+static int shot_from_disk_cache(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options);
+
+static void set_shot_cache(ShotContext *shot_ctx, const char *url, const ShotOptions *options);
+
+
+/**
+ * 初始化截图选项为默认值
+ * @param options
+ */
+void init_shot_options(ShotOptions *options) {
+    memset(options, 0, sizeof(*options));
+}
+
+
+/**
+ * 从视频中获取第一个关键帧，一次解码后按多路输出规格分别缩放、编码
+ * @param url
+ * @param specs 输出规格数组
+ * @param nb_specs 输出规格数
+ * @param options 截图选项
+ * @return
+ */
+int shot_outputs(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options) {
+    int64_t start = av_gettime_relative();
+    int ret = -1;
+    bool muxed = false;
+    if (options->disk_cache && shot_from_disk_cache(url, specs, nb_specs, options) == 0) {
+        return 0;
+    }
+    if ((options->flags & SHOT_FLAG_MP4_RANGE_FETCH) && url && !options->input.buffer && !options->input.read_cb &&
+        options->input.fd <= 0) {
+        if (shot_mp4_keyframe(url, specs, nb_specs, options) == 0) {
+            return 0;
+        }
+        printf("mp4 range fetch failed, fallback to demuxer: %s\n", url);
+    }
+    ShotContext *shot_ctx = open_shot_context(url, specs, nb_specs, options);
     if (shot_ctx == NULL) {
         printf("open shot context error\n");
         return -1;
     }
+    set_shot_cache(shot_ctx, url, options);
+    if (options->position > 0) {
+        if (seek_input(shot_ctx->iformat_ctx, shot_ctx->video_stream_index, options->position,
+                       options->seek_mode) < 0) {
+            printf("seek_input failed, position: %"PRId64"\n", options->position);
+            goto end;
+        }
+    }
     AVPacket packet;
     av_init_packet(&packet);
     packet.data = NULL;
     packet.size = 0;
-    long last = (long) time(NULL), now;
+    int64_t degrade_deadline = (int64_t) options->timeout * options->degrade_percent / 100;
+    shot_ctx->degrade_frames = options->degrade_frames;
     while (av_read_frame(shot_ctx->iformat_ctx, &packet) >= 0) {
-        if (packet.stream_index == shot_ctx->video_stream_index) {
+        if (degrade_deadline > 0 && !shot_ctx->degraded && !shot_ctx->random_access &&
+            (av_gettime_relative() - start) / 1000 >= degrade_deadline) {
+            enter_degraded_mode(shot_ctx);
+        }
+        if (packet.stream_index == shot_ctx->video_stream_index && gate_packet(shot_ctx, &packet)) {
             av_packet_rescale_ts(&packet,
                                  shot_ctx->iformat_ctx->streams[packet.stream_index]->time_base,
                                  shot_ctx->decodec_ctx->time_base);
 
             transcode_packet(shot_ctx, &packet);
-            if (!is_empty_queue(shot_ctx->packets)) {
-                mux_oformat_packets(shot_ctx);
-                av_packet_unref(&packet);
-                close_shot_context(shot_ctx);
-                return 0;
+            if (is_outputs_ready(shot_ctx)) {
+                ret = mux_oformat_packets(shot_ctx);
+                muxed = true;
+                break;
             }
         }
         av_packet_unref(&packet);
-        now = (long) time(NULL);
-        if ((now - last) * 1000 >= timeout) {
-            printf("shot expire timeout: %s\n", url);
+        // 截图期限从调用开始计算，timeout<=0时不限制
+        if (options->timeout > 0 && (av_gettime_relative() - start) / 1000 >= options->timeout) {
+            printf("shot expire timeout: %s\n", url ? url : "custom input");
             break;
         }
-        last = now;
     }
     av_packet_unref(&packet);
+    // 期限内没有完整画面时输出降级的最佳画面
+    if (!muxed && shot_ctx->degraded && output_degraded_frame(shot_ctx) == 0 && is_outputs_ready(shot_ctx)) {
+        ret = mux_oformat_packets(shot_ctx);
+    }
+    end:
+    report_shot_stats(shot_ctx, start, ret, options->stats);
     close_shot_context(shot_ctx);
-    return -1;
+    return ret;
 }
 
 
 /**
- * 打开截图上下文
+ * 输出并返回截图的统计：跳过的包、拒绝的损坏帧、解码错误和耗时
+ * @param shot_ctx
+ * @param start 开始时间，av_gettime_relative
+ * @param ret 截图结果
+ * @param stats 非NULL时写入统计
+ */
+static void report_shot_stats(const ShotContext *shot_ctx, int64_t start, int ret, ShotStats *stats) {
+    int elapsed = (int) ((av_gettime_relative() - start) / 1000);
+    if (shot_ctx->rejected_frames > 0 || shot_ctx->decode_errors > 0 || shot_ctx->degraded_output || ret < 0) {
+        printf("shot %s, skipped packets:%d, rejected frames:%d, decode errors:%d, elapsed:%dms\n",
+               ret < 0 ? "failed" : shot_ctx->degraded_output ? "degraded" : "done", shot_ctx->skipped_packets,
+               shot_ctx->rejected_frames, shot_ctx->decode_errors, elapsed);
+    }
+    if (stats) {
+        stats->skipped_packets = shot_ctx->skipped_packets;
+        stats->rejected_frames = shot_ctx->rejected_frames;
+        stats->decode_errors = shot_ctx->decode_errors;
+        stats->elapsed = elapsed;
+        stats->degraded = shot_ctx->degraded_output;
+    }
+}
+
+
+/**
+ * 计算一路输出的磁盘缓存key：输入内容标识、截图选项和输出规格
+ * 本地文件以路径、大小和修改时间标识，内存输入以大小和全部数据标识，其他输入和非图片格式不缓存
  * @param url
- * @param codec_name
+ * @param options
+ * @param spec
+ * @param key 不可缓存时hash为0
+ * @return 不可缓存时返回0
+ */
+static int shot_cache_key(const char *url, const ShotOptions *options, const OutputSpec *spec, DiskCacheKey *key) {
+    const char *format_name = spec->format_name;
+    AVOutputFormat *oformat;
+    struct stat st;
+    int values[7];
+    memset(key, 0, sizeof(*key));
+    if (!format_name && (spec->fd > 0 || spec->write_cb || spec->pack)) {
+        format_name = "image2pipe";
+    }
+    // 只有单图片的muxer输出与编码包的数据相同
+    oformat = av_guess_format(format_name, spec->pack ? NULL : spec->output, NULL);
+    if (!oformat || (strcmp(oformat->name, "image2") && strcmp(oformat->name, "image2pipe"))) {
+        return 0;
+    }
+    if (options->input.buffer) {
+        disk_cache_key_update(key, &(options->input.buffer_size), sizeof(int64_t));
+        disk_cache_key_update(key, options->input.buffer, (size_t) options->input.buffer_size);
+    } else if (url && !options->input.read_cb && options->input.fd <= 0 && stat(url, &st) == 0 &&
+               S_ISREG(st.st_mode)) {
+        disk_cache_key_update(key, url, strlen(url));
+        disk_cache_key_update(key, &(st.st_size), sizeof(st.st_size));
+        disk_cache_key_update(key, &(st.st_mtim), sizeof(st.st_mtim));
+    } else {
+        return 0;
+    }
+    values[0] = options->flags & SHOT_FLAG_FAST_DECODE;
+    values[1] = options->seek_mode;
+    values[2] = options->input.stream_select;
+    values[3] = options->input.stream_index;
+    values[4] = options->input.program_id;
+    values[5] = spec->width;
+    values[6] = spec->height;
+    disk_cache_key_update(key, &(options->position), sizeof(options->position));
+    disk_cache_key_update(key, values, sizeof(values));
+    disk_cache_key_update(key, &(spec->level), sizeof(spec->level));
+    disk_cache_key_update(key, spec->codec_name, strlen(spec->codec_name));
+    key->hash = key->hash ? key->hash : 1;
+    return 1;
+}
+
+
+/**
+ * 把缓存的编码数据写到输出的文件、fd、回调或pack
+ * @param spec
+ * @param data
+ * @param size
+ * @param options 文件输出的持久化方式
+ * @return
+ */
+static int write_cached_output(const OutputSpec *spec, const uint8_t *data, int size, const ShotOptions *options) {
+    AVIOContext *pb = NULL;
+    char *temp_output;
+    int ret, close_ret;
+    if (spec->pack) {
+        return pack_writer_append(spec->pack, spec->output, data, size, NULL);
+    }
+    if (spec->fd > 0 || spec->write_cb) {
+        if (!(pb = open_write_avio(spec->fd, spec->write_cb, spec->opaque, spec->avio_buffer_size))) {
+            return -1;
+        }
+        avio_write(pb, data, size);
+        avio_flush(pb);
+        ret = pb->error;
+        close_custom_avio(&pb);
+        return ret;
+    }
+    if (!(temp_output = make_temp_path(spec->output))) {
+        return -1;
+    }
+    if ((ret = avio_open(&pb, temp_output, AVIO_FLAG_WRITE)) < 0) {
+        printf("avio_open failed, %s\n", av_err2str(ret));
+        abort_output_file(&temp_output);
+        return ret;
+    }
+    // 缓冲中的数据在flush时才写出，写入错误在flush或close时出现
+    avio_write(pb, data, size);
+    avio_flush(pb);
+    ret = pb->error;
+    if ((close_ret = avio_closep(&pb)) < 0 && ret >= 0) {
+        ret = close_ret;
+    }
+    if (ret < 0) {
+        printf("write output failed, %s: %s\n", spec->output, av_err2str(ret));
+        abort_output_file(&temp_output);
+        return ret;
+    }
+    return commit_output_file(temp_output, spec->output, options->durability, options->commit_group);
+}
+
+
+/**
+ * 所有输出都命中磁盘缓存时直接写出，不打开输入
+ * @param url
+ * @param specs
+ * @param nb_specs
+ * @param options
+ * @return 全部命中并写出时返回0
+ */
+static int shot_from_disk_cache(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options) {
+    uint8_t **data = (uint8_t **) calloc(nb_specs, sizeof(uint8_t *));
+    int *sizes = (int *) calloc(nb_specs, sizeof(int));
+    int i, ret = -1;
+    DiskCacheKey key;
+    if (!data || !sizes) {
+        goto end;
+    }
+    for (i = 0; i < nb_specs; ++i) {
+        if (!shot_cache_key(url, options, &specs[i], &key) ||
+            disk_cache_get(options->disk_cache, &key, &data[i], &sizes[i]) < 0) {
+            goto end;
+        }
+    }
+    for (i = 0, ret = 0; i < nb_specs && ret >= 0; ++i) {
+        ret = write_cached_output(&specs[i], data[i], sizes[i], options);
+    }
+    if (ret >= 0) {
+        printf("disk cache hit: %s\n", url ? url : "buffer input");
+    }
+    end:
+    for (i = 0; data && i < nb_specs; ++i) {
+        av_free(data[i]);
+    }
+    free(data);
+    free(sizes);
+    return ret < 0 ? -1 : 0;
+}
+
+
+/**
+ * 截图成功后由mux_oformat_packets把编码数据写入磁盘缓存
+ * @param shot_ctx
+ * @param url
+ * @param options
+ */
+static void set_shot_cache(ShotContext *shot_ctx, const char *url, const ShotOptions *options) {
+    int i;
+    if (!(shot_ctx->disk_cache = options->disk_cache)) {
+        return;
+    }
+    for (i = 0; i < shot_ctx->nb_outputs; ++i) {
+        shot_cache_key(url, options, &(shot_ctx->outputs[i].spec), &(shot_ctx->outputs[i].cache_key));
+    }
+}
+
+
+/**
+ * 把输出路径中的%d替换为节目号
  * @param output
+ * @param program_id
+ * @return 需av_free的路径
+ */
+static char *format_program_output(const char *output, int program_id) {
+    AVBPrint bprint;
+    char *result = NULL;
+    const char *p = strstr(output, "%d");
+    av_bprint_init(&bprint, 0, AV_BPRINT_SIZE_UNLIMITED);
+    if (p) {
+        av_bprintf(&bprint, "%.*s%d%s", (int) (p - output), output, program_id, p + 2);
+    } else {
+        av_bprintf(&bprint, "%s_%d", output, program_id);
+    }
+    av_bprint_finalize(&bprint, &result);
+    return result;
+}
+
+
+/**
+ * 一次解复用为每个节目(program)的最佳视频流截取第一个关键帧
+ * 输出只支持文件，output中的%d替换为节目号，没有%d时追加_节目号
+ * @param url
+ * @param specs 每个节目共用的输出规格
+ * @param nb_specs
+ * @param options 不支持position
+ * @return 截图成功的节目数，失败时返回-1
+ */
+int shot_programs(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options) {
+    AVFormatContext *iformat_ctx = NULL;
+    AVDictionary *format_options = NULL;
+    ShotContext **programs = NULL;
+    OutputSpec *program_specs = NULL;
+    char **paths = NULL;
+    AVPacket packet;
+    int i, j, video_stream_index, nb_programs = 0, nb_ready = 0, nb_written = 0, ret = -1;
+    int64_t start = av_gettime_relative();
+    for (i = 0; i < nb_specs; ++i) {
+        if (!specs[i].output || specs[i].fd > 0 || specs[i].write_cb) {
+            printf("shot_programs only supports file outputs\n");
+            return -1;
+        }
+    }
+    if (options->timeout > 0) {
+        av_dict_set_int(&format_options, "stimeout", options->timeout * 1000, 0);
+    }
+    if (options->input.probe_size > 0) {
+        av_dict_set_int(&format_options, "probesize", options->input.probe_size, 0);
+    }
+    if (open_iformat_context(url, &(options->input), &iformat_ctx, &format_options, &video_stream_index) < 0) {
+        printf("open_iformat_context failed\n");
+        goto end;
+    }
+    if (iformat_ctx->nb_programs <= 0) {
+        printf("no program found\n");
+        goto end;
+    }
+    if (!(programs = (ShotContext **) calloc(iformat_ctx->nb_programs, sizeof(ShotContext *))) ||
+        !(program_specs = (OutputSpec *) calloc(nb_specs, sizeof(OutputSpec))) ||
+        !(paths = (char **) calloc(iformat_ctx->nb_programs * nb_specs, sizeof(char *)))) {
+        printf("alloc programs failed, %s\n", av_err2str(AVERROR(ENOMEM)));
+        goto end;
+    }
+    iformat_ctx->streams[video_stream_index]->discard = AVDISCARD_ALL;
+    for (i = 0; i < (int) iformat_ctx->nb_programs; ++i) {
+        AVProgram *program = iformat_ctx->programs[i];
+        ShotContext *shot_ctx;
+        if ((video_stream_index = find_program_video_stream(iformat_ctx, program)) < 0 ||
+            iformat_ctx->streams[video_stream_index]->discard == AVDISCARD_DEFAULT) { // 多个节目共用同一视频流
+            continue;
+        }
+        if (!(shot_ctx = programs[nb_programs] = (ShotContext *) calloc(1, sizeof(ShotContext)))) {
+            printf("alloc shot context failed, %s\n", av_err2str(AVERROR(ENOMEM)));
+            goto end;
+        }
+        nb_programs++;
+        shot_ctx->url = (char *) url;
+        shot_ctx->video_stream_index = video_stream_index;
+        if (open_decodec_context(iformat_ctx, video_stream_index, specs, nb_specs, options->flags,
+                                 &(shot_ctx->decodec_ctx)) < 0) {
+            printf("open deocodec context failed, program: %d\n", program->id);
+            goto end;
+        }
+        for (j = 0; j < nb_specs; ++j) {
+            program_specs[j] = specs[j];
+            program_specs[j].output = paths[(nb_programs - 1) * nb_specs + j] =
+                    format_program_output(specs[j].output, program->id);
+        }
+        shot_ctx->durability = options->durability;
+        shot_ctx->commit_group = options->commit_group;
+        if (open_shot_outputs(shot_ctx, program_specs, nb_specs) < 0) {
+            goto end;
+        }
+        iformat_ctx->streams[video_stream_index]->discard = AVDISCARD_DEFAULT;
+    }
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    while (nb_ready < nb_programs && av_read_frame(iformat_ctx, &packet) >= 0) {
+        for (i = 0; i < nb_programs; ++i) {
+            ShotContext *shot_ctx = programs[i];
+            if (packet.stream_index != shot_ctx->video_stream_index) {
+                continue;
+            }
+            if (!gate_packet(shot_ctx, &packet)) {
+                break;
+            }
+            av_packet_rescale_ts(&packet, iformat_ctx->streams[packet.stream_index]->time_base,
+                                 shot_ctx->decodec_ctx->time_base);
+            transcode_packet(shot_ctx, &packet);
+            if (is_outputs_ready(shot_ctx)) {
+                // 已截图的节目不再解复用，写出失败的节目不计入
+                iformat_ctx->streams[shot_ctx->video_stream_index]->discard = AVDISCARD_ALL;
+                nb_ready++;
+                nb_written += mux_oformat_packets(shot_ctx) >= 0;
+            }
+            break;
+        }
+        av_packet_unref(&packet);
+        if (options->timeout > 0 && (av_gettime_relative() - start) / 1000 >= options->timeout) {
+            printf("shot expire timeout: %s\n", url ? url : "custom input");
+            break;
+        }
+    }
+    av_packet_unref(&packet);
+    ret = nb_written > 0 ? nb_written : -1;
+    end:
+    for (i = 0; i < nb_programs; ++i) {
+        close_shot_context(programs[i]);
+    }
+    for (i = 0; paths && i < nb_programs * nb_specs; ++i) {
+        av_free(paths[i]);
+    }
+    free(paths);
+    free(programs);
+    free(program_specs);
+    close_iformat_context(&iformat_ctx);
+    av_dict_free(&format_options);
+    return ret;
+}
+
+
+/**
+ * 打开截图上下文
+ * @param url
+ * @param specs
+ * @param nb_specs
+ * @param options
  * @return
  */
-ShotContext *open_shot_context(const char *url, const char *codec_name, const char *output, int timeout) {
-    ShotContext *shot_ctx = (ShotContext *) malloc(sizeof(ShotContext));
-    shot_ctx->iformat_ctx = NULL;
-    shot_ctx->encodec_ctx= NULL;
-    shot_ctx->filter_ctx = NULL;
-    shot_ctx->decodec_ctx = NULL;
-    shot_ctx->oformat_ctx = NULL;
-    shot_ctx->packets = NULL;
-    shot_ctx->filtered_frames = NULL;
-    shot_ctx->frames=NULL;
-    shot_ctx->options = NULL;
+ShotContext *open_shot_context(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options) {
+    if (nb_specs <= 0) {
+        printf("no output spec\n");
+        return NULL;
+    }
+    ShotContext *shot_ctx = (ShotContext *) calloc(1, sizeof(ShotContext));
     if (shot_ctx == NULL) {
-        printf("av_mallocz_array failed\n");
+        printf("calloc ShotContext failed\n");
         return NULL;
     }
-    shot_ctx->codec_name = codec_name;
-    shot_ctx->url = url;
+    shot_ctx->url = (char *) url;
     shot_ctx->options = NULL;
-    if (timeout > 0) {
-        av_dict_set_int(&(shot_ctx->options), "stimeout", timeout * 1000, 0);
+    if (options->timeout > 0) {
+        av_dict_set_int(&(shot_ctx->options), "stimeout", options->timeout * 1000, 0);
+    }
+    if (options->input.probe_size > 0) { // 限定探测读取的数据量，不可seek的输入据此缓冲
+        av_dict_set_int(&(shot_ctx->options), "probesize", options->input.probe_size, 0);
     }// 打开input AVFormatContext
     int video_stream_index;
     AVFormatContext *iformat_ctx = NULL;
-    if (open_iformat_context(url, &iformat_ctx, &(shot_ctx->options), &video_stream_index) < 0) {
+    int ret = open_iformat_context(shot_ctx->url, &(options->input), &iformat_ctx, &(shot_ctx->options),
+                                   &video_stream_index);
+    shot_ctx->iformat_ctx = iformat_ctx;
+    if (ret < 0) {
         printf("open_iformat_context failed\n");
         close_shot_context(shot_ctx);
         return NULL;
     }
-    shot_ctx->iformat_ctx = iformat_ctx;
     shot_ctx->video_stream_index = video_stream_index;
     // 打开解码 AVCodecContext
     AVCodecContext *decodec_ctx = NULL;
-    if (open_decodec_context(iformat_ctx, video_stream_index, &decodec_ctx) < 0) {
+    if (open_decodec_context(iformat_ctx, video_stream_index, specs, nb_specs, options->flags, &decodec_ctx) < 0) {
         printf("open deocodec context failed\n");
         close_shot_context(shot_ctx);
         return NULL;
     }
     shot_ctx->decodec_ctx = decodec_ctx;
+    shot_ctx->durability = options->durability;
+    shot_ctx->commit_group = options->commit_group;
 
-
-    // 打开编码AVCodecContext
-    AVCodecContext *encodec_ctx = NULL;
-    if (open_encodec_context(shot_ctx->codec_name, decodec_ctx, &encodec_ctx) < 0) {
-        printf("open encodec context failed\n");
+    if (open_shot_outputs(shot_ctx, specs, nb_specs) < 0) {
         close_shot_context(shot_ctx);
         return NULL;
     }
-    shot_ctx->encodec_ctx = encodec_ctx;
+
+    return shot_ctx;
+}
 
 
+/**
+ * 在已打开解码上下文的截图上下文上打开编码、过滤和输出
+ * @param shot_ctx
+ * @param specs
+ * @param nb_specs
+ * @return 失败时由调用方close_shot_context
+ */
+int open_shot_outputs(ShotContext *shot_ctx, const OutputSpec *specs, int nb_specs) {
+    int i;
+    AVCodecContext *decodec_ctx = shot_ctx->decodec_ctx;
+    init_nal_inspector(&(shot_ctx->nal_inspector), decodec_ctx->codec_id, decodec_ctx->extradata,
+                       decodec_ctx->extradata_size);
+    shot_ctx->frames = create_queue();
+    shot_ctx->outputs = (OutputContext *) calloc(nb_specs, sizeof(OutputContext));
+    if (!shot_ctx->outputs) {
+        printf("calloc OutputContext failed\n");
+        return -1;
+    }
+    shot_ctx->nb_outputs = nb_specs;
+
+    // 打开每一路输出的编码AVCodecContext
+    for (i = 0; i < nb_specs; ++i) {
+        OutputContext *output_ctx = &(shot_ctx->outputs[i]);
+        output_ctx->spec = specs[i];
+        output_ctx->filtered_frames = create_queue();
+        output_ctx->packets = create_queue();
+        if (output_ctx->spec.level > MAX_PYRAMID_LEVEL) {
+            printf("pyramid level %d exceeds %d\n", output_ctx->spec.level, MAX_PYRAMID_LEVEL);
+            return -1;
+        }
+        if (open_encodec_context(&(output_ctx->spec), decodec_ctx, &(output_ctx->encodec_ctx)) < 0) {
+            printf("open encodec context failed, output: %s\n",
+                   output_ctx->spec.output ? output_ctx->spec.output : "pipe");
+            return -1;
+        }
+    }
+
     FilterContext *filter_ctx = NULL;
-    if (open_filter_context(decodec_ctx, encodec_ctx, &filter_ctx,
-                            decodec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? "null" : "anull") < 0) {
+    int ret = open_filter_context(decodec_ctx, shot_ctx->outputs, shot_ctx->nb_outputs, &filter_ctx);
+    shot_ctx->filter_ctx = filter_ctx;
+    if (ret < 0) {
         printf("open_filter_context failed\n");
-        close_shot_context(shot_ctx);
-        return NULL;
+        return -1;
     }
-    shot_ctx->filter_ctx = filter_ctx;
 
-    AVFormatContext *oformat_ctx = NULL;
-    if (open_oformat_context(output, encodec_ctx, &oformat_ctx) < 0) {
-        printf("open_oformat_context failed\n ");
+    for (i = 0; i < nb_specs; ++i) {
+        OutputContext *output_ctx = &(shot_ctx->outputs[i]);
+        if (output_ctx->spec.pack) { // 追加写入pack文件，不需要muxer
+            if (!output_ctx->spec.output) {
+                printf("pack output requires a key\n");
+                return -1;
+            }
+            continue;
+        }
+        // 文件输出先写同目录的临时文件，截图成功后再rename
+        if (output_ctx->spec.output && output_ctx->spec.fd <= 0 && !output_ctx->spec.write_cb &&
+            !(output_ctx->temp_output = make_temp_path(output_ctx->spec.output))) {
+            return -1;
+        }
+        if (open_oformat_context(&(output_ctx->spec), output_ctx->encodec_ctx, output_ctx->temp_output,
+                                 &(output_ctx->oformat_ctx)) < 0) {
+            printf("open_oformat_context failed\n ");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * 远程mp4按range请求只读取moov和截图时间点之前最近的同步样本并截图，不经过demuxer
+ * @param url
+ * @param specs
+ * @param nb_specs
+ * @param options
+ * @return
+ */
+static int shot_mp4_keyframe(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options) {
+    Mp4Keyframe *keyframe = NULL;
+    AVDictionary *io_options = NULL;
+    ShotContext *shot_ctx = NULL;
+    int ret = -1;
+    if (options->timeout > 0) {
+        av_dict_set_int(&io_options, "rw_timeout", options->timeout * 1000, 0);
+    }
+    if (fetch_mp4_keyframe(url, options->position, &io_options, &keyframe) < 0) {
+        goto end;
+    }
+    if (!(shot_ctx = (ShotContext *) calloc(1, sizeof(ShotContext)))) {
+        printf("calloc ShotContext failed\n");
+        goto end;
+    }
+    shot_ctx->url = (char *) url;
+    if (open_decodec_context_from_parameters(keyframe->codecpar, keyframe->framerate, specs, nb_specs,
+                                             options->flags, &(shot_ctx->decodec_ctx)) < 0) {
+        printf("open deocodec context failed\n");
+        goto end;
+    }
+    shot_ctx->durability = options->durability;
+    shot_ctx->commit_group = options->commit_group;
+    if (open_shot_outputs(shot_ctx, specs, nb_specs) < 0) {
+        goto end;
+    }
+    set_shot_cache(shot_ctx, url, options);
+    av_packet_rescale_ts(keyframe->packet, keyframe->time_base, shot_ctx->decodec_ctx->time_base);
+    transcode_packet(shot_ctx, keyframe->packet);
+    if (!is_outputs_ready(shot_ctx)) { // 有解码延迟的解码器需要flush才输出唯一的一帧
+        transcode_packet(shot_ctx, NULL);
+    }
+    if (is_outputs_ready(shot_ctx)) {
+        ret = mux_oformat_packets(shot_ctx);
+    }
+    end:
+    if (shot_ctx) {
         close_shot_context(shot_ctx);
-        return NULL;
     }
-    shot_ctx->oformat_ctx = oformat_ctx;
+    free_mp4_keyframe(&keyframe);
+    av_dict_free(&io_options);
+    return ret;
+}
 
-    shot_ctx->frames = create_queue();
-    shot_ctx->filtered_frames = create_queue();
-    shot_ctx->packets = create_queue();
 
-    return shot_ctx;
+/**
+ * 抓取模式：只解复用到第一个随机访问点，取出解码所需的包，不打开解码器
+ * 随机访问点为recovery point时继续抓取recovery_frames个包，最多SHOT_CAPTURE_MAX_PACKETS个
+ * @param url
+ * @param options 使用timeout、input、position和seek_mode，stats中写入skipped_packets和elapsed
+ * @param capture 返回的抓取结果，需free_shot_capture
+ * @return
+ */
+int capture_shot(const char *url, const ShotOptions *options, ShotCapture **capture) {
+    int64_t start = av_gettime_relative();
+    AVFormatContext *iformat_ctx = NULL;
+    AVDictionary *format_options = NULL;
+    NalInspector inspector;
+    AVStream *stream;
+    AVPacket packet;
+    int video_stream_index, ret = -1, type, recovery_frames = 0, nb_needed = 0;
+    *capture = NULL;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    if (options->timeout > 0) {
+        av_dict_set_int(&format_options, "stimeout", options->timeout * 1000, 0);
+    }
+    if (options->input.probe_size > 0) {
+        av_dict_set_int(&format_options, "probesize", options->input.probe_size, 0);
+    }
+    if (open_iformat_context(url, &(options->input), &iformat_ctx, &format_options, &video_stream_index) < 0) {
+        printf("open_iformat_context failed\n");
+        goto end;
+    }
+    stream = iformat_ctx->streams[video_stream_index];
+    if (options->position > 0 &&
+        seek_input(iformat_ctx, video_stream_index, options->position, options->seek_mode) < 0) {
+        printf("seek_input failed, position: %"PRId64"\n", options->position);
+        goto end;
+    }
+    if (!(*capture = alloc_shot_capture(stream->codecpar))) {
+        goto end;
+    }
+    (*capture)->time_base = stream->time_base;
+    (*capture)->framerate = av_guess_frame_rate(iformat_ctx, stream, NULL);
+    (*capture)->start_time = stream->start_time;
+    (*capture)->position = options->position;
+    init_nal_inspector(&inspector, stream->codecpar->codec_id, stream->codecpar->extradata,
+                       stream->codecpar->extradata_size);
+    while (av_read_frame(iformat_ctx, &packet) >= 0) {
+        if (options->timeout > 0 && (av_gettime_relative() - start) / 1000 >= options->timeout) {
+            printf("capture timeout: %s\n", url);
+            break;
+        }
+        if (packet.stream_index != video_stream_index) {
+            av_packet_unref(&packet);
+            continue;
+        }
+        if ((*capture)->nb_packets == 0) {
+            if ((type = packet_random_access(&inspector, &packet, &recovery_frames)) == RANDOM_ACCESS_NONE) {
+                (*capture)->skipped_packets++;
+                av_packet_unref(&packet);
+                continue;
+            }
+            (*capture)->random_access = type;
+            (*capture)->recovery_frames = type == RANDOM_ACCESS_RECOVERY ? recovery_frames : 0;
+            nb_needed = 1 + FFMIN((*capture)->recovery_frames, SHOT_CAPTURE_MAX_PACKETS);
+        }
+        if (add_shot_capture_packet(*capture, &packet) < 0) {
+            break;
+        }
+        av_packet_unref(&packet);
+        if ((*capture)->nb_packets >= nb_needed) {
+            ret = 0;
+            break;
+        }
+    }
+    end:
+    av_packet_unref(&packet);
+    if (*capture) {
+        (*capture)->elapsed = (int) ((av_gettime_relative() - start) / 1000);
+        if (options->stats) {
+            memset(options->stats, 0, sizeof(ShotStats));
+            options->stats->skipped_packets = (*capture)->skipped_packets;
+            options->stats->elapsed = (*capture)->elapsed;
+        }
+    }
+    if (ret < 0) {
+        free_shot_capture(capture);
+    }
+    close_iformat_context(&iformat_ctx);
+    av_dict_free(&format_options);
+    return ret;
+}
+
+
+/**
+ * 渲染模式：解码capture_shot抓取的包并按多路输出规格编码，不需要访问输入
+ * @param capture
+ * @param specs
+ * @param nb_specs
+ * @param options 使用flags、durability、commit_group和stats
+ * @return
+ */
+int render_shot_capture(const ShotCapture *capture, const OutputSpec *specs, int nb_specs,
+                        const ShotOptions *options) {
+    int64_t start = av_gettime_relative();
+    ShotContext *shot_ctx;
+    AVPacket *packet;
+    int ret = -1, i;
+    if (nb_specs <= 0 || capture->nb_packets <= 0) {
+        printf("no output spec or captured packet\n");
+        return -1;
+    }
+    if (!(shot_ctx = (ShotContext *) calloc(1, sizeof(ShotContext)))) {
+        printf("calloc ShotContext failed\n");
+        return -1;
+    }
+    if (open_decodec_context_from_parameters(capture->codecpar, capture->framerate, specs, nb_specs,
+                                             options->flags, &(shot_ctx->decodec_ctx)) < 0) {
+        printf("open deocodec context failed\n");
+        goto end;
+    }
+    shot_ctx->durability = options->durability;
+    shot_ctx->commit_group = options->commit_group;
+    if (open_shot_outputs(shot_ctx, specs, nb_specs) < 0) {
+        goto end;
+    }
+    // 抓取端已经从随机访问点开始，这里只需丢弃recovery point之后的不完整帧
+    shot_ctx->random_access = capture->random_access;
+    shot_ctx->recovery_frames = capture->recovery_frames;
+    shot_ctx->skipped_packets = capture->skipped_packets;
+    for (i = 0; i < capture->nb_packets && !is_outputs_ready(shot_ctx); ++i) {
+        if (!(packet = av_packet_clone(capture->packets[i]))) {
+            printf("av_packet_clone failed\n");
+            goto end;
+        }
+        av_packet_rescale_ts(packet, capture->time_base, shot_ctx->decodec_ctx->time_base);
+        transcode_packet(shot_ctx, packet);
+        av_packet_free(&packet);
+    }
+    if (!is_outputs_ready(shot_ctx)) { // 有解码延迟的解码器需要flush才输出
+        transcode_packet(shot_ctx, NULL);
+    }
+    if (is_outputs_ready(shot_ctx)) {
+        ret = mux_oformat_packets(shot_ctx);
+    }
+    end:
+    report_shot_stats(shot_ctx, start, ret, options->stats);
+    close_shot_context(shot_ctx);
+    return ret;
+}
+
+
+/**
+ * capture_shot并序列化，供只做网络IO的进程使用
+ * @param url
+ * @param options
+ * @param blob 返回的数据，需free_capture_blob
+ * @param size
+ * @return
+ */
+int shot_capture_blob(const char *url, const ShotOptions *options, uint8_t **blob, int *size) {
+    ShotCapture *capture = NULL;
+    int ret;
+    *blob = NULL;
+    if ((ret = capture_shot(url, options, &capture)) < 0) {
+        return ret;
+    }
+    ret = serialize_shot_capture(capture, blob, size);
+    free_shot_capture(&capture);
+    return ret;
+}
+
+
+/**
+ * 解析shot_capture_blob的数据并渲染
+ * @param blob
+ * @param size
+ * @param specs
+ * @param nb_specs
+ * @param options
+ * @return
+ */
+int shot_render_blob(const uint8_t *blob, int size, const OutputSpec *specs, int nb_specs,
+                     const ShotOptions *options) {
+    ShotCapture *capture = NULL;
+    int ret;
+    if ((ret = parse_shot_capture(blob, size, &capture)) < 0) {
+        return ret;
+    }
+    ret = render_shot_capture(capture, specs, nb_specs, options);
+    free_shot_capture(&capture);
+    return ret;
+}
+
+
+void free_capture_blob(uint8_t **blob) {
+    av_freep(blob);
+}
+
+
+/**
+ * 释放一路输出
+ * @param output_ctx
+ */
+static void close_output_context(OutputContext *output_ctx) {
+    if (output_ctx->oformat_ctx) {
+        if (output_ctx->oformat_ctx->flags & AVFMT_FLAG_CUSTOM_IO) {
+            close_custom_avio(&(output_ctx->oformat_ctx->pb));
+        } else if (!(output_ctx->oformat_ctx->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&(output_ctx->oformat_ctx->pb));
+        }
+        avformat_free_context(output_ctx->oformat_ctx);
+    }
+    // 未提交的临时文件是不完整的输出
+    abort_output_file(&(output_ctx->temp_output));
+    if (output_ctx->encodec_ctx) {
+        avcodec_free_context(&(output_ctx->encodec_ctx));
+    }
+    if (output_ctx->filtered_frames) {
+        while (!is_empty_queue(output_ctx->filtered_frames)) {
+            AVFrame *frame = pop_queue(output_ctx->filtered_frames);
+            av_frame_free(&frame);
+        }
+        destroy_queue(output_ctx->filtered_frames);
+    }
+    if (output_ctx->packets) {
+        while (!is_empty_queue(output_ctx->packets)) {
+            AVPacket *packet = pop_queue(output_ctx->packets);
+            av_packet_free(&packet);
+        }
+        destroy_queue(output_ctx->packets);
+    }
 }
 
 void close_shot_context(ShotContext *shot_ctx) {
-    if (shot_ctx->oformat_ctx) {
-        if (!(shot_ctx->oformat_ctx->oformat->flags & AVFMT_NOFILE)) {
-            avio_closep(&(shot_ctx->oformat_ctx->pb));
+    int i;
+    if (shot_ctx->outputs) {
+        for (i = 0; i < shot_ctx->nb_outputs; ++i) {
+            close_output_context(&(shot_ctx->outputs[i]));
         }
-        avformat_free_context(shot_ctx->oformat_ctx);
+        free(shot_ctx->outputs);
     }
     if (shot_ctx->decodec_ctx) {
         avcodec_free_context(&(shot_ctx->decodec_ctx));
     }
-    if (shot_ctx->encodec_ctx) {
-        avcodec_free_context(&(shot_ctx->encodec_ctx));
-    }
     if (shot_ctx->filter_ctx) {
         if (shot_ctx->filter_ctx->filter_graph) {
             avfilter_graph_free(&(shot_ctx->filter_ctx->filter_graph));
         }
+        free(shot_ctx->filter_ctx->buffersink_ctxs);
         free(shot_ctx->filter_ctx);
     }
     if (shot_ctx->iformat_ctx) {
-        avformat_close_input(&(shot_ctx->iformat_ctx));
+        close_iformat_context(&(shot_ctx->iformat_ctx));
     }
     if (shot_ctx->frames) {
         while (!is_empty_queue(shot_ctx->frames)) {
-            av_frame_free(pop_queue(shot_ctx->frames));
+            AVFrame *frame = pop_queue(shot_ctx->frames);
+            av_frame_free(&frame);
         }
         destroy_queue(shot_ctx->frames);
     }
-    if (shot_ctx->filtered_frames) {
-        while (!is_empty_queue(shot_ctx->filtered_frames)) {
-            av_frame_free(pop_queue(shot_ctx->filtered_frames));
-        }
-        destroy_queue(shot_ctx->filtered_frames);
-    }
-    if (shot_ctx->packets) {
-        while (!is_empty_queue(shot_ctx->packets)) {
-            av_packet_free(pop_queue(shot_ctx->packets));
-        }
-        destroy_queue(shot_ctx->packets);
-    }
     if (shot_ctx->options) {
         av_dict_free(&(shot_ctx->options));
     }
+    av_frame_free(&(shot_ctx->degraded_frame));
     free(shot_ctx);
 }
 
 
 /**
- * 打开input AVFormatContext，并定位video stream
+ * 指定local_io时本地文件输入的路径，url带有其他协议时返回NULL
  * @param filename
+ * @param input
+ * @return
+ */
+static const char *local_input_path(const char *filename, const InputSpec *input) {
+    if (!input->local_io || !filename || input->buffer || input->read_cb || input->fd > 0) {
+        return NULL;
+    }
+    if (!strncmp(filename, "file:", 5)) {
+        return filename + 5;
+    }
+    return strstr(filename, "://") ? NULL : filename;
+}
+
+
+/**
+ * 按输入规格打开自定义读取的AVIOContext，未指定内存数据、读回调、fd、本地文件io或http连接池时返回NULL
+ * @param filename
+ * @param input
+ * @return
+ */
+static AVIOContext *open_input_avio(const char *filename, const InputSpec *input) {
+    const char *path;
+    if (input->buffer) {
+        return open_buffer_read_avio(input->buffer, input->buffer_size, input->avio_buffer_size);
+    }
+    if (input->read_cb) {
+        return open_callback_read_avio(input->read_cb, input->seek_cb, input->opaque, input->avio_buffer_size);
+    }
+    if (input->fd > 0) {
+        return open_fd_read_avio(input->fd, input->read_timeout, input->avio_buffer_size);
+    }
+    if ((path = local_input_path(filename, input))) {
+        return open_local_file_avio(path, input->avio_buffer_size);
+    }
+    if (input->http_pool && filename && (!strncmp(filename, "http://", 7) || !strncmp(filename, "https://", 8))) {
+        return open_http_pool_avio(input->http_pool, filename, input->avio_buffer_size);
+    }
+    return NULL;
+}
+
+
+/**
+ * 在给定的流中选择分辨率最大的视频流，跳过封面图片
+ * @param format_ctx
+ * @param stream_indexes 候选流序号，为NULL时候选所有流
+ * @param nb_indexes 候选流个数
+ * @return 没有视频流时返回负数
+ */
+static int find_largest_video_stream(AVFormatContext *format_ctx, const unsigned int *stream_indexes,
+                                     unsigned int nb_indexes) {
+    unsigned int i, index;
+    int j = -1;
+    for (i = 0; i < nb_indexes; ++i) {
+        AVCodecParameters *codecpar;
+        if ((index = stream_indexes ? stream_indexes[i] : i) >= format_ctx->nb_streams) {
+            continue;
+        }
+        codecpar = format_ctx->streams[index]->codecpar;
+        if (codecpar->codec_type != AVMEDIA_TYPE_VIDEO ||
+            (format_ctx->streams[index]->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+            continue;
+        }
+        if (j < 0 || (int64_t) codecpar->width * codecpar->height >
+                     (int64_t) format_ctx->streams[j]->codecpar->width * format_ctx->streams[j]->codecpar->height) {
+            j = (int) index;
+        }
+    }
+    return j;
+}
+
+
+/**
+ * 在节目包含的流中选择视频流，规则同STREAM_SELECT_LARGEST
  * @param format_ctx
+ * @param program
+ * @return 节目内没有视频流时返回负数
+ */
+static int find_program_video_stream(AVFormatContext *format_ctx, const AVProgram *program) {
+    return find_largest_video_stream(format_ctx, program->stream_index, program->nb_stream_indexes);
+}
+
+
+/**
+ * 按选择方式确定截图的视频流
+ * @param format_ctx 已探测流信息的输入
+ * @param input stream_select为StreamSelect
+ * @return 视频流序号，找不到时返回负数
+ */
+static int choose_video_stream(AVFormatContext *format_ctx, const InputSpec *input) {
+    int i;
+    switch (input->stream_select) {
+        case STREAM_SELECT_BEST:
+            return av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        case STREAM_SELECT_INDEX:
+            if (input->stream_index < 0 || input->stream_index >= (int) format_ctx->nb_streams ||
+                format_ctx->streams[input->stream_index]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+                printf("stream %d is not a video stream\n", input->stream_index);
+                return -1;
+            }
+            return input->stream_index;
+        case STREAM_SELECT_PROGRAM:
+            for (i = 0; i < (int) format_ctx->nb_programs; ++i) {
+                if (format_ctx->programs[i]->id == input->program_id) {
+                    return find_program_video_stream(format_ctx, format_ctx->programs[i]);
+                }
+            }
+            printf("program %d not found\n", input->program_id);
+            return -1;
+        case STREAM_SELECT_LARGEST:
+            return find_largest_video_stream(format_ctx, NULL, format_ctx->nb_streams);
+        default:
+            for (i = 0; i < (int) format_ctx->nb_streams; ++i) {
+                if (format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+                    return i;
+                }
+            }
+            return -1;
+    }
+}
+
+
+/**
+ * 打开input AVFormatContext，并定位video stream
+ * @param filename 输入url，使用内存数据或读回调时仅用于探测格式，可为NULL
+ * @param input 输入规格
+ * @param format_ctx 可以传入预先分配、设置了interrupt_callback的AVFormatContext
+ * @param options
  * @param video_stream
  * @return
  */
-int open_iformat_context(char *filename, AVFormatContext **format_ctx, AVDictionary **options, int *video_stream) {
-    int ret;
-    if ((ret = avformat_open_input(format_ctx, filename, NULL, options)) < 0) {
+int open_iformat_context(const char *filename, const InputSpec *input, AVFormatContext **format_ctx,
+                         AVDictionary **options, int *video_stream) {
+    int ret, i;
+    AVInputFormat *iformat = NULL;
+    AVIOContext *pb = NULL;
+    if (input->format_name && !(iformat = av_find_input_format(input->format_name))) {
+        printf("av_find_input_format failed, %s\n", input->format_name);
+        return -1;
+    }
+    // http连接池打开失败时回退ffmpeg的http协议
+    pb = open_input_avio(filename, input);
+    if (!pb && (input->buffer || input->read_cb || input->fd > 0 || local_input_path(filename, input))) {
+        printf("open_input_avio failed\n");
+        return -1;
+    }
+    if (pb) {
+        if (!*format_ctx && !(*format_ctx = avformat_alloc_context())) {
+            printf("avformat_alloc_context failed\n");
+            close_custom_avio(&pb);
+            return -1;
+        }
+        (*format_ctx)->pb = pb;
+        (*format_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    // rtsp只SETUP视频轨，不拉取音频等其他轨的数据，调用方在options中指定时不覆盖
+    if (filename && !strncmp(filename, "rtsp://", 7)) {
+        av_dict_set(options, "allowed_media_types", "video", AV_DICT_DONT_OVERWRITE);
+    }
+    if ((ret = avformat_open_input(format_ctx, filename ? filename : "", iformat, options)) < 0) {
         printf("avformat_open_input failed, %s\n", av_err2str(ret));
+        close_custom_avio(&pb);
         return ret;
     }
     if ((ret = avformat_find_stream_info(*format_ctx, NULL)) < 0) {
@@ -193,34 +1064,103 @@ int open_iformat_context(char *filename, AVFormatContext **format_ctx, AVDiction
         return ret;
     }
 
-    int video_stream_index = -1, i = 0;
-    for (i = 0; i < (*format_ctx)->nb_streams; ++i) {
-        if ((*format_ctx)->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            video_stream_index = i;
-            break;
-        }
-    }
-    if (video_stream_index < 0 || video_stream_index > (*format_ctx)->nb_streams) {
+    int video_stream_index = choose_video_stream(*format_ctx, input);
+    if (video_stream_index < 0) {
         printf("no video stream found\n");
         return -1;
     }
+    // 只解复用选中的视频流，其他流的包在demuxer中直接丢弃
+    for (i = 0; i < (int) (*format_ctx)->nb_streams; ++i) {
+        (*format_ctx)->streams[i]->discard = i == video_stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
     *video_stream = video_stream_index;
 
     return 0;
 }
 
 
+/**
+ * 关闭input AVFormatContext，同时释放自定义的AVIOContext
+ * @param format_ctx
+ */
+void close_iformat_context(AVFormatContext **format_ctx) {
+    AVIOContext *pb = NULL;
+    if (!*format_ctx) {
+        return;
+    }
+    if ((*format_ctx)->flags & AVFMT_FLAG_CUSTOM_IO) {
+        pb = (*format_ctx)->pb;
+    }
+    avformat_close_input(format_ctx);
+    close_custom_avio(&pb);
+}
+
+
+/**
+ * 根据请求的输出尺寸选择解码器lowres级数，保证每一路输出都不需要放大
+ * @param codec 解码器
+ * @param decodec_ctx 未打开的解码上下文，宽高为原始尺寸
+ * @param specs
+ * @param nb_specs
+ * @return
+ */
+static int choose_lowres(const AVCodec *codec, AVCodecContext *decodec_ctx, const OutputSpec *specs, int nb_specs) {
+    int lowres = codec->max_lowres, i, width, height;
+    if (decodec_ctx->codec_type != AVMEDIA_TYPE_VIDEO || decodec_ctx->width <= 0 || decodec_ctx->height <= 0) {
+        return 0;
+    }
+    for (i = 0; i < nb_specs && lowres > 0; ++i) {
+        if (specs[i].level > 0) { // 金字塔输出剩余的级数由下采样补足
+            lowres = FFMIN(lowres, specs[i].level);
+            continue;
+        }
+        get_output_size(&specs[i], decodec_ctx, &width, &height);
+        while (lowres > 0 && (AV_CEIL_RSHIFT(decodec_ctx->width, lowres) < width ||
+                              AV_CEIL_RSHIFT(decodec_ctx->height, lowres) < height)) {
+            lowres--;
+        }
+    }
+    return lowres;
+}
+
+
 /**
  * 打开解码上下文
- * @param codec_id 解码器id
+ * @param format_ctx
+ * @param stream_index
+ * @param specs 输出规格，用于选择lowres
+ * @param nb_specs
+ * @param flags SHOT_FLAG_*
+ * @param decodec_ctx 返回的解码上下文
+ * @return
+ */
+int open_decodec_context(AVFormatContext *format_ctx, int stream_index, const OutputSpec *specs, int nb_specs,
+                         int flags, AVCodecContext **decodec_ctx) {
+    AVStream *stream = format_ctx->streams[stream_index];
+    AVRational framerate = {0, 1};
+    if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        framerate = av_guess_frame_rate(format_ctx, stream, NULL);
+    }
+    return open_decodec_context_from_parameters(stream->codecpar, framerate, specs, nb_specs, flags, decodec_ctx);
+}
+
+
+/**
+ * 由解码参数打开解码上下文，不依赖AVFormatContext
  * @param codecpar 解码参数
+ * @param framerate 视频帧率，决定解码上下文的time_base
+ * @param specs 输出规格，用于选择lowres
+ * @param nb_specs
+ * @param flags SHOT_FLAG_*
  * @param decodec_ctx 返回的解码上下文
  * @return
  */
-int open_decodec_context(AVFormatContext *format_ctx, int stream_index, AVCodecContext **decodec_ctx) {
+int open_decodec_context_from_parameters(const AVCodecParameters *codecpar, AVRational framerate,
+                                         const OutputSpec *specs, int nb_specs, int flags,
+                                         AVCodecContext **decodec_ctx) {
     AVCodec *codec = NULL;
     int ret;
-    codec = avcodec_find_decoder(format_ctx->streams[stream_index]->codecpar->codec_id);
+    codec = avcodec_find_decoder(codecpar->codec_id);
     if (!codec) {
         printf("avcodec_find_decoder failed\n");
         return -1;
@@ -229,12 +1169,19 @@ int open_decodec_context(AVFormatContext *format_ctx, int stream_index, AVCodecC
         printf("avcodec_alloc_context3 failed\n");
         return -1;
     }
-    if ((ret = avcodec_parameters_to_context(*decodec_ctx, format_ctx->streams[stream_index]->codecpar)) < 0) {
+    if ((ret = avcodec_parameters_to_context(*decodec_ctx, codecpar)) < 0) {
         printf("avcodec_parameters_to_context failed, %s\n", av_err2str(ret));
         return -1;
     }
     if ((*decodec_ctx)->codec_type == AVMEDIA_TYPE_VIDEO) {
-        (*decodec_ctx)->framerate = av_guess_frame_rate(format_ctx, format_ctx->streams[stream_index], NULL);
+        (*decodec_ctx)->framerate = framerate;
+        // 支持lowres的解码器(mjpeg、mpeg4等)直接按缩小的分辨率解码，avcodec_open2后宽高为缩小后的尺寸
+        (*decodec_ctx)->lowres = choose_lowres(codec, *decodec_ctx, specs, nb_specs);
+        if (flags & SHOT_FLAG_FAST_DECODE) {
+            (*decodec_ctx)->skip_loop_filter = AVDISCARD_ALL;
+            (*decodec_ctx)->skip_idct = AVDISCARD_NONREF;
+            (*decodec_ctx)->flags2 |= AV_CODEC_FLAG2_FAST;
+        }
     }
     if ((ret = avcodec_open2(*decodec_ctx, codec, NULL)) < 0) {
         printf("avcodec_open2 failed, %s\n", av_err2str(ret));
@@ -247,17 +1194,109 @@ int open_decodec_context(AVFormatContext *format_ctx, int stream_index, AVCodecC
 }
 
 
+/**
+ * 是否为full range的yuvj像素格式
+ * @param pix_fmt
+ * @return
+ */
+static bool is_jpeg_pix_fmt(enum AVPixelFormat pix_fmt) {
+    return pix_fmt == AV_PIX_FMT_YUVJ420P || pix_fmt == AV_PIX_FMT_YUVJ422P ||
+           pix_fmt == AV_PIX_FMT_YUVJ444P || pix_fmt == AV_PIX_FMT_YUVJ440P ||
+           pix_fmt == AV_PIX_FMT_YUVJ411P;
+}
+
+
+/**
+ * 选择与解码输出最匹配的编码像素格式，编码器直接支持解码格式时不做像素转换
+ * @param codec 编码器
+ * @param decodec_ctx 解码上下文
+ * @return
+ */
+enum AVPixelFormat choose_encodec_pix_fmt(const AVCodec *codec, const AVCodecContext *decodec_ctx) {
+    const enum AVPixelFormat *p;
+    if (!codec->pix_fmts) {
+        return decodec_ctx->pix_fmt;
+    }
+    if (decodec_ctx->pix_fmt == AV_PIX_FMT_NONE) {
+        return codec->pix_fmts[0];
+    }
+    for (p = codec->pix_fmts; *p != AV_PIX_FMT_NONE; ++p) {
+        if (*p == decodec_ctx->pix_fmt) {
+            return *p;
+        }
+    }
+    return avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, decodec_ctx->pix_fmt, 0, NULL);
+}
+
+
+/**
+ * 选择编码器支持的第一个可做金字塔下采样的像素格式
+ * @param codec
+ * @return
+ */
+static enum AVPixelFormat choose_pyramid_pix_fmt(const AVCodec *codec) {
+    const enum AVPixelFormat *p;
+    if (!codec->pix_fmts) {
+        return AV_PIX_FMT_YUV420P;
+    }
+    for (p = codec->pix_fmts; *p != AV_PIX_FMT_NONE; ++p) {
+        if (is_pyramid_pix_fmt(*p)) {
+            return *p;
+        }
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+
+/**
+ * 计算输出图片尺寸，只指定宽或高时按原显示比例缩放，金字塔输出为原图的1/2^level
+ * @param spec 输出规格
+ * @param decodec_ctx 解码上下文
+ * @param width 返回的宽
+ * @param height 返回的高
+ */
+void get_output_size(const OutputSpec *spec, AVCodecContext *decodec_ctx, int *width, int *height) {
+    double display_width = decodec_ctx->width;
+    AVRational sar = decodec_ctx->sample_aspect_ratio;
+    if (sar.num > 0 && sar.den > 0) {
+        display_width = display_width * sar.num / sar.den;
+    }
+    if (spec->level > 0) {
+        get_pyramid_size(decodec_ctx->width, decodec_ctx->height, spec->level - decodec_ctx->lowres, width, height);
+        return;
+    }
+    if (spec->width <= 0 && spec->height <= 0) {
+        *width = decodec_ctx->width;
+        *height = decodec_ctx->height;
+        return;
+    }
+    if (spec->width > 0 && spec->height > 0) {
+        *width = spec->width;
+        *height = spec->height;
+    } else if (spec->width > 0) {
+        *width = spec->width;
+        *height = (int) (spec->width * decodec_ctx->height / display_width + 0.5);
+    } else {
+        *height = spec->height;
+        *width = (int) (spec->height * display_width / decodec_ctx->height + 0.5);
+    }
+    // yuv420p等色度抽样格式需要偶数宽高
+    *width = FFMAX(2, *width & ~1);
+    *height = FFMAX(2, *height & ~1);
+}
+
+
 /**
  * 打开编码上下文
- * @param codec_id 编解码器id
- * @param codecpar 编码参数
+ * @param spec 输出规格
+ * @param decodec_ctx 解码上下文
  * @param encodec_ctx 返回的编码上下文
  * @return
  */
-int open_encodec_context(const char *codec_name, AVCodecContext *decodec_ctx, AVCodecContext **encodec_ctx) {
+int open_encodec_context(const OutputSpec *spec, AVCodecContext *decodec_ctx, AVCodecContext **encodec_ctx) {
     AVCodec *codec = NULL;
     int ret;
-    codec = avcodec_find_encoder_by_name(codec_name);
+    codec = avcodec_find_encoder_by_name(spec->codec_name);
     if (!codec) {
         printf("avcodec_find_encoder failed\n");
         return -1;
@@ -267,13 +1306,28 @@ int open_encodec_context(const char *codec_name, AVCodecContext *decodec_ctx, AV
         return -1;
     }
     if ((*encodec_ctx)->codec_type == AVMEDIA_TYPE_VIDEO) { // 设置视频编码参数
-        (*encodec_ctx)->width = decodec_ctx->width;
-        (*encodec_ctx)->height = decodec_ctx->height;
+        get_output_size(spec, decodec_ctx, &((*encodec_ctx)->width), &((*encodec_ctx)->height));
         (*encodec_ctx)->sample_aspect_ratio = decodec_ctx->sample_aspect_ratio;
-        if (codec->pix_fmts) {
-            (*encodec_ctx)->pix_fmt = codec->pix_fmts[0];
-        } else {
-            (*encodec_ctx)->pix_fmt = decodec_ctx->pix_fmt;
+        if (decodec_ctx->sample_aspect_ratio.num > 0) { // 与scale filter保持一致的显示比例
+            (*encodec_ctx)->sample_aspect_ratio = av_mul_q(decodec_ctx->sample_aspect_ratio,
+                                                           (AVRational) {
+                                                                   (*encodec_ctx)->height * decodec_ctx->width,
+                                                                   (*encodec_ctx)->width * decodec_ctx->height});
+        }
+        (*encodec_ctx)->pix_fmt = choose_encodec_pix_fmt(codec, decodec_ctx);
+        if (spec->level > 0 && !is_pyramid_pix_fmt((*encodec_ctx)->pix_fmt)) {
+            (*encodec_ctx)->pix_fmt = choose_pyramid_pix_fmt(codec);
+            if ((*encodec_ctx)->pix_fmt == AV_PIX_FMT_NONE) {
+                printf("no planar yuv pix_fmt for pyramid output\n");
+                return -1;
+            }
+        }
+        (*encodec_ctx)->color_range = decodec_ctx->color_range;
+        if (is_jpeg_pix_fmt((*encodec_ctx)->pix_fmt)) {
+            (*encodec_ctx)->color_range = AVCOL_RANGE_JPEG;
+        } else if (codec->id == AV_CODEC_ID_MJPEG && (*encodec_ctx)->color_range != AVCOL_RANGE_JPEG) {
+            // mjpeg直接编码limited range的yuv需要放宽标准限制，range信息写入color_range
+            (*encodec_ctx)->strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;
         }
         (*encodec_ctx)->time_base = av_inv_q(decodec_ctx->framerate);
     } else if ((*encodec_ctx)->codec_type == AVMEDIA_TYPE_AUDIO) { // 设置音频编码参数
@@ -283,8 +1337,104 @@ int open_encodec_context(const char *codec_name, AVCodecContext *decodec_ctx, AV
         (*encodec_ctx)->sample_fmt = codec->sample_fmts[0];
         (*encodec_ctx)->time_base = (AVRational) {1, decodec_ctx->sample_rate};
     }
-    if ((ret = avcodec_open2(*encodec_ctx, codec, NULL)) < 0) {
-        printf("avcodec_open2 failed, %s\n", av_err2str(ret));
+    if ((ret = avcodec_open2(*encodec_ctx, codec, NULL)) < 0) {
+        printf("avcodec_open2 failed, %s\n", av_err2str(ret));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * 生成一入多出的filter描述: [in]split=N[s0][s1]...;[s0]scale=w:h[out0];...
+ * 单路输出且尺寸不变时只用null，不引入额外的缩放；金字塔输出共用一路原尺寸的[pyramid]
+ * @param decodec_ctx
+ * @param outputs
+ * @param nb_outputs
+ * @return av_malloc的filter描述，失败返回NULL
+ */
+static char *build_filter_spec(AVCodecContext *decodec_ctx, OutputContext *outputs, int nb_outputs) {
+    AVBPrint bp;
+    int i, branch = 0, nb_branches = 0, pyramid = 0, video = decodec_ctx->codec_type == AVMEDIA_TYPE_VIDEO;
+    char *spec = NULL;
+    for (i = 0; i < nb_outputs; ++i) {
+        if (outputs[i].spec.level > 0) {
+            pyramid = 1;
+        } else {
+            nb_branches++;
+        }
+    }
+    nb_branches += pyramid;
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    if (nb_branches > 1) {
+        av_bprintf(&bp, "[in]%s=%d", video ? "split" : "asplit", nb_branches);
+        for (i = 0; i < nb_branches; ++i) {
+            av_bprintf(&bp, "[s%d]", i);
+        }
+    }
+    for (i = 0; i <= nb_outputs; ++i) {
+        if (i < nb_outputs && outputs[i].spec.level > 0) {
+            continue;
+        }
+        if (i == nb_outputs && !pyramid) {
+            break;
+        }
+        if (nb_branches > 1) {
+            av_bprintf(&bp, ";[s%d]", branch);
+        } else {
+            av_bprintf(&bp, "[in]");
+        }
+        branch++;
+        if (i == nb_outputs) {
+            av_bprintf(&bp, "null[pyramid]");
+            break;
+        }
+        AVCodecContext *encodec_ctx = outputs[i].encodec_ctx;
+        if (video && (encodec_ctx->width != decodec_ctx->width || encodec_ctx->height != decodec_ctx->height)) {
+            av_bprintf(&bp, "scale=%d:%d", encodec_ctx->width, encodec_ctx->height);
+        } else {
+            av_bprintf(&bp, video ? "null" : "anull");
+        }
+        av_bprintf(&bp, "[out%d]", i);
+    }
+    if (!av_bprint_is_complete(&bp)) {
+        av_bprint_finalize(&bp, NULL);
+        return NULL;
+    }
+    av_bprint_finalize(&bp, &spec);
+    return spec;
+}
+
+
+/**
+ * 创建一个buffersink并加入inputs链表
+ * @param filter_graph
+ * @param buffersink
+ * @param name
+ * @param inputs
+ * @param buffersink_ctx
+ * @return
+ */
+static int create_buffersink(AVFilterGraph *filter_graph, const AVFilter *buffersink, const char *name,
+                             AVFilterInOut **inputs, AVFilterContext **buffersink_ctx) {
+    int ret;
+    AVFilterInOut *input = avfilter_inout_alloc();
+    if (!input) {
+        printf("avfilter_inout_alloc failed\n");
+        return -1;
+    }
+    input->next = *inputs;
+    *inputs = input;
+    ret = avfilter_graph_create_filter(buffersink_ctx, buffersink, name, NULL, NULL, filter_graph);
+    if (ret < 0) {
+        printf("avfilter_graph_create_filter failed, %s\n", av_err2str(ret));
+        return ret;
+    }
+    input->name = av_strdup(name);
+    input->filter_ctx = *buffersink_ctx;
+    input->pad_idx = 0;
+    if (!input->name) {
+        printf("av_strdup failed\n");
         return -1;
     }
     return 0;
@@ -292,26 +1442,72 @@ int open_encodec_context(const char *codec_name, AVCodecContext *decodec_ctx, AV
 
 
 /**
- * 打开音视频帧过滤上下文
+ * 设置buffersink接受的输出格式
+ * @param decodec_ctx
+ * @param encodec_ctx
+ * @param buffersink_ctx
+ * @return
+ */
+static int set_buffersink_formats(AVCodecContext *decodec_ctx, AVCodecContext *encodec_ctx,
+                                  AVFilterContext *buffersink_ctx) {
+    int ret;
+    if (decodec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        ret = av_opt_set_bin(buffersink_ctx, "pix_fmts", (uint8_t * ) & encodec_ctx->pix_fmt,
+                             sizeof(encodec_ctx->pix_fmt), AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            printf("av_op_set_bin set pix_fmts failed, %s\n", av_err2str(ret));
+            return ret;
+        }
+    } else {
+        ret = av_opt_set_bin(buffersink_ctx, "sample_fmts", (uint8_t * ) & decodec_ctx->sample_fmt,
+                             sizeof(decodec_ctx->sample_fmt), AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            printf("av_op_set_bin set pix_fmts failed, %s\n", av_err2str(ret));
+            return ret;
+        }
+        ret = av_opt_set_bin(buffersink_ctx, "channel_layouts", (uint8_t * ) & decodec_ctx->channel_layout,
+                             sizeof(decodec_ctx->channel_layout), AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            printf("av_op_set_bin set channel_layouts failed, %s\n", av_err2str(ret));
+            return ret;
+        }
+        ret = av_opt_set_bin(buffersink_ctx, "sample_rates", (uint8_t * ) & decodec_ctx->sample_rate,
+                             sizeof(decodec_ctx->sample_rate), AV_OPT_SEARCH_CHILDREN);
+        if (ret < 0) {
+            printf("av_op_set_bin set sample_rates failed, %s\n", av_err2str(ret));
+            return ret;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * 打开音视频帧过滤上下文，解码帧经split分发到每一路输出的buffersink
  * @param decodec_ctx
+ * @param outputs 输出上下文数组，encodec_ctx需已打开
+ * @param nb_outputs
  * @param filter_ctx
  * @return
  */
-int open_filter_context(AVCodecContext *decodec_ctx, AVCodecContext *encodec_ctx, FilterContext **filter_ctx,
-                        const char *filter_spec) {
+int open_filter_context(AVCodecContext *decodec_ctx, OutputContext *outputs, int nb_outputs,
+                        FilterContext **filter_ctx) {
     const AVFilter *buffersrc, *buffersink;
-    AVFilterContext *buffersrc_ctx = NULL, *buffersink_ctx = NULL;
-    AVFilterInOut *outputs = avfilter_inout_alloc(), *inputs = avfilter_inout_alloc();
+    AVFilterContext *buffersrc_ctx = NULL, **buffersink_ctxs = NULL, *pyramid_sink_ctx = NULL;
+    AVCodecContext *pyramid_encodec_ctx = NULL;
+    AVFilterInOut *outputs_inout = avfilter_inout_alloc(), *inputs = NULL;
     AVFilterGraph *filter_graph = NULL;
-    int ret = 0;
-    char args[512];
-    if (!outputs || !inputs) {
+    char *filter_spec = NULL;
+    int ret = 0, i, nb_pyramid_levels = 0;
+    char args[512], name[32];
+    if (!outputs_inout) {
         printf("avfilter_inout_alloc failed\n");
         ret = -1;
         goto end;
     }
-    *filter_ctx = (FilterContext *) malloc(sizeof(**filter_ctx));
-    if (!*filter_ctx) {
+    *filter_ctx = (FilterContext *) calloc(1, sizeof(**filter_ctx));
+    buffersink_ctxs = (AVFilterContext **) calloc(nb_outputs, sizeof(AVFilterContext *));
+    if (!*filter_ctx || !buffersink_ctxs) {
         printf("malloc FilterContext failed\n");
         ret = -1;
         goto end;
@@ -350,57 +1546,55 @@ int open_filter_context(AVCodecContext *decodec_ctx, AVCodecContext *encodec_ctx
         printf("avfilter_graph_create_filter failed, %s\n", av_err2str(ret));
         goto end;
     }
-    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph);
-    if (ret < 0) {
-        printf("avfilter_graph_create_filter failed, %s\n", av_err2str(ret));
+    outputs_inout->name = av_strdup("in");
+    outputs_inout->filter_ctx = buffersrc_ctx;
+    outputs_inout->pad_idx = 0;
+    outputs_inout->next = NULL;
+    if (!outputs_inout->name) {
+        printf("av_strdup failed\n");
+        ret = -1;
         goto end;
     }
-    if (decodec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-        ret = av_opt_set_bin(buffersink_ctx, "pix_fmts", (uint8_t * ) & encodec_ctx->pix_fmt,
-                             sizeof(encodec_ctx->pix_fmt), AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            printf("av_op_set_bin set pix_fmts failed, %s\n", av_err2str(ret));
+
+    // 每一路非金字塔输出一个buffersink，金字塔输出共用一个原尺寸的buffersink
+    for (i = 0; i < nb_outputs; ++i) {
+        if (outputs[i].spec.level > 0) {
+            if (!pyramid_encodec_ctx) {
+                pyramid_encodec_ctx = outputs[i].encodec_ctx;
+            } else if (pyramid_encodec_ctx->pix_fmt != outputs[i].encodec_ctx->pix_fmt) {
+                printf("pyramid outputs must share one pix_fmt\n");
+                ret = -1;
+                goto end;
+            }
+            nb_pyramid_levels = FFMAX(nb_pyramid_levels, outputs[i].spec.level - decodec_ctx->lowres + 1);
+            continue;
+        }
+        snprintf(name, sizeof(name), "out%d", i);
+        if ((ret = create_buffersink(filter_graph, buffersink, name, &inputs, &buffersink_ctxs[i])) < 0) {
             goto end;
         }
-    } else {
-        ret = av_opt_set_bin(buffersink_ctx, "sample_fmts", (uint8_t * ) & decodec_ctx->sample_fmt,
-                             sizeof(decodec_ctx->sample_fmt), AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            printf("av_op_set_bin set pix_fmts failed, %s\n", av_err2str(ret));
+        if ((ret = set_buffersink_formats(decodec_ctx, outputs[i].encodec_ctx, buffersink_ctxs[i])) < 0) {
             goto end;
         }
-        ret = av_opt_set_bin(buffersink_ctx, "channel_layouts", (uint8_t * ) & decodec_ctx->channel_layout,
-                             sizeof(decodec_ctx->channel_layout), AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            printf("av_op_set_bin set channel_layouts failed, %s\n", av_err2str(ret));
+    }
+    if (pyramid_encodec_ctx) {
+        if ((ret = create_buffersink(filter_graph, buffersink, "pyramid", &inputs, &pyramid_sink_ctx)) < 0) {
             goto end;
         }
-        ret = av_opt_set_bin(buffersink_ctx, "sample_rates", (uint8_t * ) & decodec_ctx->sample_rate,
-                             sizeof(decodec_ctx->sample_rate), AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            printf("av_op_set_bin set sample_rates failed, %s\n", av_err2str(ret));
+        if ((ret = set_buffersink_formats(decodec_ctx, pyramid_encodec_ctx, pyramid_sink_ctx)) < 0) {
             goto end;
         }
     }
 
-    outputs->name = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx;
-    outputs->pad_idx = 0;
-    outputs->next = NULL;
-
-    inputs->name = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
-    inputs->pad_idx = 0;
-    inputs->next = NULL;
-
-    if (!outputs->name || !inputs->name) {
-        printf("av_strdup failed\n");
+    filter_spec = build_filter_spec(decodec_ctx, outputs, nb_outputs);
+    if (!filter_spec) {
+        printf("build_filter_spec failed\n");
         ret = -1;
         goto end;
     }
-    ret = avfilter_graph_parse_ptr(filter_graph, filter_spec, &inputs, &outputs, NULL);
+    ret = avfilter_graph_parse_ptr(filter_graph, filter_spec, &inputs, &outputs_inout, NULL);
     if (ret < 0) {
-        printf("avfilter_graph_parse_ptr failed\n");
+        printf("avfilter_graph_parse_ptr failed, %s\n", filter_spec);
         goto end;
     }
     ret = avfilter_graph_config(filter_graph, NULL);
@@ -409,29 +1603,54 @@ int open_filter_context(AVCodecContext *decodec_ctx, AVCodecContext *encodec_ctx
         goto end;
     }
 
-    (*filter_ctx)->buffersrc_ctx = buffersrc_ctx;
-    (*filter_ctx)->buffersink_ctx = buffersink_ctx;
-    (*filter_ctx)->filter_graph = filter_graph;
     end:
+    if (*filter_ctx) {
+        (*filter_ctx)->buffersrc_ctx = buffersrc_ctx;
+        (*filter_ctx)->buffersink_ctxs = buffersink_ctxs;
+        (*filter_ctx)->nb_buffersinks = nb_outputs;
+        (*filter_ctx)->pyramid_sink_ctx = pyramid_sink_ctx;
+        (*filter_ctx)->nb_pyramid_levels = nb_pyramid_levels;
+        (*filter_ctx)->filter_graph = filter_graph;
+    } else {
+        free(buffersink_ctxs);
+        avfilter_graph_free(&filter_graph);
+    }
+    av_free(filter_spec);
     avfilter_inout_free(&inputs);
-    avfilter_inout_free(&outputs);
+    avfilter_inout_free(&outputs_inout);
 
     return ret;
 }
 
 /**
- * 打开输出文件的AVFormatContext，并初始化相应的AVStream
- * @param filename 输出文件名
- * @param nb_streams 流数
- * @param shot_ctx 流转码上下文数组
+ * 打开输出的AVFormatContext，并初始化相应的AVStream
+ * 输出规格指定fd或write_cb时通过自定义AVIOContext直接写出，不落地文件
+ * @param spec 输出规格
+ * @param encodec_ctx 编码上下文
+ * @param temp_output 非NULL时按spec->output确定格式，实际写入该临时文件
  * @param format_ctx 返回的AVFormatContext
  * @return
  */
-int open_oformat_context(const char *filename, AVCodecContext *encodec_ctx,
+int open_oformat_context(const OutputSpec *spec, AVCodecContext *encodec_ctx, const char *temp_output,
                          AVFormatContext **format_ctx) {
     AVStream *stream;
+    AVOutputFormat *oformat = NULL;
     int ret;
-    avformat_alloc_output_context2(format_ctx, NULL, NULL, filename);
+    bool custom_io = spec->fd > 0 || spec->write_cb;
+    const char *filename = temp_output ? temp_output : spec->output, *format_name = spec->format_name;
+    if (custom_io && !format_name) {
+        format_name = "image2pipe";
+    }
+    if (!custom_io && !filename) {
+        printf("output has neither path, fd nor write callback\n");
+        return -1;
+    }
+    // 临时文件的扩展名无法确定格式
+    if (temp_output && !(oformat = av_guess_format(format_name, spec->output, NULL))) {
+        printf("av_guess_format failed, %s\n", spec->output);
+        return -1;
+    }
+    avformat_alloc_output_context2(format_ctx, oformat, format_name, filename);
     if (!(*format_ctx)) {
         printf("avformat_alloc_context2 failed\n");
         return -1;
@@ -450,8 +1669,15 @@ int open_oformat_context(const char *filename, AVCodecContext *encodec_ctx,
         encodec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
     stream->time_base = encodec_ctx->time_base;
-    av_dump_format(*format_ctx, 0, filename, 1);
-    if (!((*format_ctx)->oformat->flags & AVFMT_NOFILE)) {
+    av_dump_format(*format_ctx, 0, filename ? filename : format_name, 1);
+    if (custom_io) {
+        (*format_ctx)->pb = open_write_avio(spec->fd, spec->write_cb, spec->opaque, spec->avio_buffer_size);
+        if (!(*format_ctx)->pb) {
+            printf("open_write_avio failed\n");
+            return -1;
+        }
+        (*format_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    } else if (!((*format_ctx)->oformat->flags & AVFMT_NOFILE)) {
         ret = avio_open(&(*format_ctx)->pb, filename, AVIO_FLAG_WRITE);
         if (ret < 0) {
             printf("avio_open failed, %s\n", av_err2str(ret));
@@ -470,35 +1696,123 @@ int open_oformat_context(const char *filename, AVCodecContext *encodec_ctx,
 /**
  * 转码一帧
  * @param shot_ctx
- * @param packet
+ * @param packet 为NULL时flush解码器
  * @return
  */
 int transcode_packet(ShotContext *shot_ctx, AVPacket *packet) {
-    if (shot_ctx->decodec_ctx &&
-        shot_ctx->encodec_ctx) {
+    int stream_index = packet ? packet->stream_index : shot_ctx->video_stream_index;
+    if (shot_ctx->decodec_ctx && shot_ctx->outputs) {
         if (decode_packet(shot_ctx, packet) < 0) {
-            printf("stream-%d transcode a packet failed\n", packet->stream_index);
+            printf("stream-%d transcode a packet failed\n", stream_index);
             return -1;
         }
-        AVFrame *frame;
-        while (!is_empty_queue(shot_ctx->frames)) {
-            frame = (AVFrame *) pop_queue(shot_ctx->frames);
-            if (filter_packet(shot_ctx, frame) < 0) {
-                printf("stream-%d filter_packet failed\n", packet->stream_index);
-                return -1;
-            }
-        }
-        while (!is_empty_queue(shot_ctx->filtered_frames)) {
-            if (encode_packet(shot_ctx, (AVFrame *) pop_queue(shot_ctx->filtered_frames)) < 0) {
-                printf("stream-%d encode_packet failed\n", packet->stream_index);
-                return -1;
-            }
-        }
+        return transcode_frames(shot_ctx);
     }
     return -1;
 }
 
 
+/**
+ * 过滤、编码已解码的帧
+ * @param shot_ctx
+ * @return
+ */
+int transcode_frames(ShotContext *shot_ctx) {
+    AVFrame *frame;
+    while (!is_empty_queue(shot_ctx->frames)) {
+        frame = (AVFrame *) pop_queue(shot_ctx->frames);
+        if (filter_packet(shot_ctx, frame) < 0) {
+            printf("stream-%d filter_packet failed\n", shot_ctx->video_stream_index);
+            return -1;
+        }
+    }
+    if (encode_outputs(shot_ctx) < 0) {
+        printf("stream-%d encode_packet failed\n", shot_ctx->video_stream_index);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * 超过降级期限仍没有完整画面时，开始解码非关键帧并由解码器做错误隐藏
+ * 适用于GOP很长或只有intra refresh、没有IDR的源
+ * @param shot_ctx
+ */
+void enter_degraded_mode(ShotContext *shot_ctx) {
+    printf("no clean picture before degrade deadline, decode with error concealment, skipped packets:%d\n",
+           shot_ctx->skipped_packets);
+    shot_ctx->degraded = true;
+    shot_ctx->recovery_frames = 0;
+    // 输出缺少参考帧的画面而不是丢弃
+    shot_ctx->decodec_ctx->flags |= AV_CODEC_FLAG_OUTPUT_CORRUPT;
+    shot_ctx->decodec_ctx->flags2 |= AV_CODEC_FLAG2_SHOW_ALL;
+    if (!shot_ctx->decodec_ctx->error_concealment) {
+        shot_ctx->decodec_ctx->error_concealment = FF_EC_GUESS_MVS | FF_EC_DEBLOCK;
+    }
+}
+
+
+/**
+ * 输出降级模式下最近解码的不完整画面
+ * @param shot_ctx
+ * @return 没有可输出的画面时返回-1
+ */
+int output_degraded_frame(ShotContext *shot_ctx) {
+    if (!shot_ctx->degraded_frame) {
+        return -1;
+    }
+    printf("output degraded frame after %d frames\n", shot_ctx->degraded_frames);
+    push_queue(shot_ctx->frames, shot_ctx->degraded_frame);
+    shot_ctx->degraded_frame = NULL;
+    shot_ctx->degraded_output = true;
+    return transcode_frames(shot_ctx);
+}
+
+
+/**
+ * 包的随机访问类型，H.264/HEVC按NAL类型识别，其他编码参考demuxer的AV_PKT_FLAG_KEY
+ * @param inspector
+ * @param packet
+ * @param recovery_frames
+ * @return RandomAccessType，不会返回RANDOM_ACCESS_UNKNOWN
+ */
+static int packet_random_access(const NalInspector *inspector, const AVPacket *packet, int *recovery_frames) {
+    int type = inspect_random_access(inspector, packet->data, packet->size, recovery_frames);
+    if (type == RANDOM_ACCESS_UNKNOWN) {
+        type = (packet->flags & AV_PKT_FLAG_KEY) ? RANDOM_ACCESS_CLEAN : RANDOM_ACCESS_NONE;
+    }
+    return type;
+}
+
+
+/**
+ * 在解码前丢弃随机访问点之前无法完整解码的包
+ * H.264/HEVC按NAL类型识别IDR/CRA/BLA和recovery point SEI，其他编码参考demuxer的AV_PKT_FLAG_KEY
+ * @param shot_ctx
+ * @param packet
+ * @return 需要解码时返回1
+ */
+int gate_packet(ShotContext *shot_ctx, AVPacket *packet) {
+    int type, recovery_frames = 0;
+    if (shot_ctx->random_access || shot_ctx->degraded) {
+        return 1;
+    }
+    type = packet_random_access(&(shot_ctx->nal_inspector), packet, &recovery_frames);
+    if (type == RANDOM_ACCESS_NONE) {
+        shot_ctx->skipped_packets++;
+        return 0;
+    }
+    shot_ctx->random_access = type;
+    shot_ctx->recovery_frames = recovery_frames;
+    if (shot_ctx->skipped_packets > 0 || type == RANDOM_ACCESS_RECOVERY) {
+        printf("random access %s after %d skipped packets, recovery frames: %d\n",
+               type == RANDOM_ACCESS_CLEAN ? "clean" : "recovery", shot_ctx->skipped_packets, recovery_frames);
+    }
+    return 1;
+}
+
+
 /**
  * 解码一帧
  * @param shot_ctx
@@ -509,6 +1823,7 @@ int decode_packet(ShotContext *shot_ctx, AVPacket *packet) {
     int ret;
     if ((ret = avcodec_send_packet(shot_ctx->decodec_ctx, packet)) < 0) {
         printf("avcodec_send_packet failed, %s\n", av_err2str(ret));
+        shot_ctx->decode_errors++;
 
         return ret;
     }
@@ -525,8 +1840,29 @@ int decode_packet(ShotContext *shot_ctx, AVPacket *packet) {
             return 0;
         } else if (ret < 0) {
             printf("avcodec_receive_frame failed, %s\n", av_err2str(ret));
+            shot_ctx->decode_errors++;
             av_frame_free(&frame);
             return ret;
+        } else if (shot_ctx->recovery_frames > 0) { // recovery point之后的帧在参考帧恢复前不完整
+            shot_ctx->recovery_frames--;
+            av_frame_free(&frame);
+        } else if (shot_ctx->degraded && (frame->decode_error_flags || (frame->flags & AV_FRAME_FLAG_CORRUPT))) {
+            // 降级模式保留最近的画面，intra refresh经过degrade_frames帧后画面基本完整
+            frame->pts = frame->best_effort_timestamp;
+            av_frame_free(&(shot_ctx->degraded_frame));
+            shot_ctx->degraded_frame = frame;
+            if (++shot_ctx->degraded_frames >= shot_ctx->degrade_frames && shot_ctx->degrade_frames > 0) {
+                push_queue(shot_ctx->frames, shot_ctx->degraded_frame);
+                shot_ctx->degraded_frame = NULL;
+                shot_ctx->degraded_output = true;
+            }
+        } else if (frame->decode_error_flags || (frame->flags & AV_FRAME_FLAG_CORRUPT)) {
+            // 损坏或缺少参考帧的画面不输出，等待下一个随机访问点重新开始
+            printf("reject corrupt frame, pts:%"PRId64", decode error flags:%d\n",
+                   frame->best_effort_timestamp, frame->decode_error_flags);
+            shot_ctx->rejected_frames++;
+            shot_ctx->random_access = RANDOM_ACCESS_NONE;
+            av_frame_free(&frame);
         } else {
             frame->pts = frame->best_effort_timestamp;
             push_queue(shot_ctx->frames, frame);
@@ -537,13 +1873,63 @@ int decode_packet(ShotContext *shot_ctx, AVPacket *packet) {
 
 
 /**
- * 过滤一帧
+ * 从金字塔buffersink取出原尺寸帧，逐级下采样后分发到各金字塔输出
+ * @param shot_ctx
+ * @return
+ */
+static int filter_pyramid(ShotContext *shot_ctx) {
+    int ret, i;
+    AVFrame *levels[MAX_PYRAMID_LEVEL + 1];
+    int nb_levels = shot_ctx->filter_ctx->nb_pyramid_levels;
+    while (true) {
+        AVFrame *base = av_frame_alloc();
+        if (!base) {
+            printf("av_frame_alloc failed\n");
+            return -1;
+        }
+        ret = av_buffersink_get_frame(shot_ctx->filter_ctx->pyramid_sink_ctx, base);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            av_frame_free(&base);
+            return 0;
+        } else if (ret < 0) {
+            printf("av_buffersink_get_frame failed, %s\n", av_err2str(ret));
+            av_frame_free(&base);
+            return ret;
+        }
+        base->pict_type = AV_PICTURE_TYPE_NONE;
+        ret = build_frame_pyramid(base, nb_levels, levels);
+        av_frame_free(&base);
+        if (ret < 0) {
+            printf("build_frame_pyramid failed\n");
+            return ret;
+        }
+        for (i = 0; i < shot_ctx->nb_outputs; ++i) {
+            // lowres解码已缩小的级数不再重复下采样
+            int level = shot_ctx->outputs[i].spec.level - shot_ctx->decodec_ctx->lowres;
+            if (shot_ctx->outputs[i].spec.level <= 0) {
+                continue;
+            }
+            AVFrame *level_frame = av_frame_clone(levels[level]);
+            if (!level_frame) {
+                printf("av_frame_clone failed\n");
+                free_frame_pyramid(levels, nb_levels);
+                return -1;
+            }
+            push_queue(shot_ctx->outputs[i].filtered_frames, level_frame);
+        }
+        free_frame_pyramid(levels, nb_levels);
+    }
+}
+
+
+/**
+ * 过滤一帧，结果分发到每一路输出的filtered_frames
  * @param shot_ctx
  * @param frame
  * @return
  */
 int filter_packet(ShotContext *shot_ctx, AVFrame *frame) {
-    int ret;
+    int ret, i;
     AVFrame *filtered_frame = NULL;
     if (!shot_ctx->filter_ctx) {
         ret = -1;
@@ -554,27 +1940,35 @@ int filter_packet(ShotContext *shot_ctx, AVFrame *frame) {
         printf("av_buffersrc_add_frame_flags failed, %s\n", av_err2str(ret));
         goto end;
     }
-    while (true) {
-        filtered_frame = av_frame_alloc();
-        if (!filtered_frame) {
-            printf("av_frame_alloc failed\n");
-            ret = -1;
-            goto end;
+    for (i = 0; i < shot_ctx->filter_ctx->nb_buffersinks; ++i) {
+        if (!shot_ctx->filter_ctx->buffersink_ctxs[i]) {
+            continue;
         }
-        ret = av_buffersink_get_frame(shot_ctx->filter_ctx->buffersink_ctx, filtered_frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            ret = 0;
-            av_frame_free(&filtered_frame);
-            goto end;
-        } else if (ret < 0) {
-            printf("av_buffersink_get_frame failed, %s\n", av_err2str(ret));
-            av_frame_free(&filtered_frame);
-            goto end;
-        } else {
-            filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
-            push_queue(shot_ctx->filtered_frames, filtered_frame);
+        while (true) {
+            filtered_frame = av_frame_alloc();
+            if (!filtered_frame) {
+                printf("av_frame_alloc failed\n");
+                ret = -1;
+                goto end;
+            }
+            ret = av_buffersink_get_frame(shot_ctx->filter_ctx->buffersink_ctxs[i], filtered_frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                ret = 0;
+                av_frame_free(&filtered_frame);
+                break;
+            } else if (ret < 0) {
+                printf("av_buffersink_get_frame failed, %s\n", av_err2str(ret));
+                av_frame_free(&filtered_frame);
+                goto end;
+            } else {
+                filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+                push_queue(shot_ctx->outputs[i].filtered_frames, filtered_frame);
+            }
         }
     }
+    if (shot_ctx->filter_ctx->pyramid_sink_ctx) {
+        ret = filter_pyramid(shot_ctx);
+    }
     end:
     av_frame_free(&frame);
     return ret;
@@ -582,14 +1976,89 @@ int filter_packet(ShotContext *shot_ctx, AVFrame *frame) {
 
 
 /**
- * 编码一帧
+ * 编码一路输出中所有已过滤的帧
+ * @param output_ctx
+ * @return
+ */
+static int encode_output(OutputContext *output_ctx) {
+    while (!is_empty_queue(output_ctx->filtered_frames)) {
+        if (encode_packet(output_ctx, (AVFrame *) pop_queue(output_ctx->filtered_frames)) < 0) {
+            printf("encode_packet failed, output: %s\n",
+                   output_ctx->spec.output ? output_ctx->spec.output : "pipe");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+typedef struct EncodeTask {
+    OutputContext *output_ctx;
+    int ret;
+} EncodeTask;
+
+static void *encode_output_thread(void *arg) {
+    EncodeTask *task = (EncodeTask *) arg;
+    task->ret = encode_output(task->output_ctx);
+    return NULL;
+}
+
+
+/**
+ * 编码所有输出，多路输出时每一路在独立线程中并行编码
  * @param shot_ctx
+ * @return
+ */
+int encode_outputs(ShotContext *shot_ctx) {
+    int i, ret = 0;
+    if (shot_ctx->nb_outputs == 1) {
+        return encode_output(&(shot_ctx->outputs[0]));
+    }
+    EncodeTask *tasks = (EncodeTask *) calloc(shot_ctx->nb_outputs, sizeof(EncodeTask));
+    pthread_t *threads = (pthread_t *) calloc(shot_ctx->nb_outputs, sizeof(pthread_t));
+    bool *started = (bool *) calloc(shot_ctx->nb_outputs, sizeof(bool));
+    if (!tasks || !threads || !started) {
+        printf("calloc EncodeTask failed\n");
+        free(tasks);
+        free(threads);
+        free(started);
+        return -1;
+    }
+    for (i = 0; i < shot_ctx->nb_outputs; ++i) {
+        tasks[i].output_ctx = &(shot_ctx->outputs[i]);
+        if (is_empty_queue(tasks[i].output_ctx->filtered_frames)) {
+            continue;
+        }
+        if (pthread_create(&threads[i], NULL, encode_output_thread, &tasks[i]) == 0) {
+            started[i] = true;
+        } else { // 线程创建失败时退化为当前线程编码
+            tasks[i].ret = encode_output(tasks[i].output_ctx);
+        }
+    }
+    for (i = 0; i < shot_ctx->nb_outputs; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (tasks[i].ret < 0) {
+            ret = tasks[i].ret;
+        }
+    }
+    free(tasks);
+    free(threads);
+    free(started);
+    return ret;
+}
+
+
+/**
+ * 编码一帧
+ * @param output_ctx
  * @param frame
  * @return
  */
-int encode_packet(ShotContext *shot_ctx, AVFrame *frame) {
+int encode_packet(OutputContext *output_ctx, AVFrame *frame) {
     int ret;
-    if ((ret = avcodec_send_frame(shot_ctx->encodec_ctx, frame)) < 0) {
+    if ((ret = avcodec_send_frame(output_ctx->encodec_ctx, frame)) < 0) {
         printf("avodec_send_frame failed, %s\n", av_err2str(ret));
         goto end;
     }
@@ -604,7 +2073,7 @@ int encode_packet(ShotContext *shot_ctx, AVFrame *frame) {
         av_init_packet(packet);
         packet->data = NULL;
         packet->size = 0;
-        ret = avcodec_receive_packet(shot_ctx->encodec_ctx, packet);
+        ret = avcodec_receive_packet(output_ctx->encodec_ctx, packet);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
             ret = 0;
             av_packet_free(&packet);
@@ -614,7 +2083,7 @@ int encode_packet(ShotContext *shot_ctx, AVFrame *frame) {
             av_packet_free(&packet);
             goto end;
         } else {
-            push_queue(shot_ctx->packets, packet);
+            push_queue(output_ctx->packets, packet);
         }
     }
     end:
@@ -623,23 +2092,125 @@ int encode_packet(ShotContext *shot_ctx, AVFrame *frame) {
 }
 
 
-void mux_oformat_packets(ShotContext *shot_ctx) {
-    int ret;
-    AVPacket *packet = NULL;
-    while (!is_empty_queue(shot_ctx->packets)) {
-        packet = (AVPacket *) pop_queue(shot_ctx->packets);
+/**
+ * 刷新输出并检查写入错误，文件输出关闭临时文件后按持久化方式rename到输出路径
+ * 写满磁盘等错误可能在flush或close时才出现，失败时删除临时文件
+ * @param shot_ctx
+ * @param output_ctx
+ * @param size 写入的编码数据大小，用于检查自己打开文件的muxer(如image2)的输出
+ * @return
+ */
+static int commit_output(ShotContext *shot_ctx, OutputContext *output_ctx, int size) {
+    AVFormatContext *oformat_ctx = output_ctx->oformat_ctx;
+    char *temp_output = output_ctx->temp_output;
+    struct stat st;
+    int ret = 0, close_ret;
+    if (oformat_ctx->pb) {
+        avio_flush(oformat_ctx->pb);
+        ret = oformat_ctx->pb->error;
+    }
+    if (!temp_output) { // fd和写回调输出
+        if (ret < 0) {
+            printf("write output failed, %s\n", av_err2str(ret));
+        }
+        return ret;
+    }
+    if (!(oformat_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if ((close_ret = avio_closep(&(oformat_ctx->pb))) < 0 && ret >= 0) {
+            ret = close_ret;
+        }
+    } else if (stat(temp_output, &st) < 0 || st.st_size < size) { // muxer不返回关闭文件时的错误
+        ret = AVERROR(EIO);
+    }
+    if (ret < 0) {
+        printf("write output failed, %s: %s\n", output_ctx->spec.output, av_err2str(ret));
+        abort_output_file(&(output_ctx->temp_output));
+        return ret;
+    }
+    output_ctx->temp_output = NULL;
+    if ((ret = commit_output_file(temp_output, output_ctx->spec.output, shot_ctx->durability,
+                                  shot_ctx->commit_group)) < 0) {
+        printf("commit output failed: %s\n", output_ctx->spec.output);
+    }
+    return ret;
+}
+
+
+/**
+ * 是否每一路输出都已编码出图片
+ * @param shot_ctx
+ * @return
+ */
+bool is_outputs_ready(ShotContext *shot_ctx) {
+    int i;
+    for (i = 0; i < shot_ctx->nb_outputs; ++i) {
+        if (is_empty_queue(shot_ctx->outputs[i].packets)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * 写出每一路输出的编码包
+ * @param shot_ctx
+ * @return 任一路写入或提交失败时返回错误
+ */
+int mux_oformat_packets(ShotContext *shot_ctx) {
+    int ret, result = 0, i, size;
+    bool cacheable;
+    AVPacket *packet = NULL, *cache_packet = NULL;
+    for (i = 0; i < shot_ctx->nb_outputs; ++i) {
+        OutputContext *output_ctx = &(shot_ctx->outputs[i]);
+        if (is_empty_queue(output_ctx->packets)) {
+            continue;
+        }
+        packet = (AVPacket *) pop_queue(output_ctx->packets);
+        // 降级的画面不缓存，输出写入并提交成功后才写入缓存
+        cacheable = shot_ctx->disk_cache && output_ctx->cache_key.hash && !shot_ctx->degraded_output;
+        if (output_ctx->spec.pack) {
+            PackEntryMeta meta = {output_ctx->encodec_ctx->width, output_ctx->encodec_ctx->height,
+                                  packet->pts == AV_NOPTS_VALUE ? 0 :
+                                  av_rescale_q(packet->pts, output_ctx->encodec_ctx->time_base,
+                                               (AVRational) {1, 1000})};
+            if ((ret = pack_writer_append(output_ctx->spec.pack, output_ctx->spec.output, packet->data,
+                                          packet->size, &meta)) < 0) {
+                result = ret;
+            } else if (cacheable) {
+                disk_cache_put(shot_ctx->disk_cache, &(output_ctx->cache_key), packet->data, packet->size);
+            }
+            av_packet_free(&packet);
+            continue;
+        }
 
         packet->stream_index = 0;
         av_packet_rescale_ts(packet,
-                             shot_ctx->encodec_ctx->time_base,
-                             shot_ctx->decodec_ctx->time_base);
-        printf("Packet dts:%d, pts:%d, duration:%d, size:%d\n", packet->dts, packet->pts, packet->duration,
-               packet->size);
-        ret = av_interleaved_write_frame(shot_ctx->oformat_ctx, packet);
-        av_write_trailer(shot_ctx->oformat_ctx);
+                             output_ctx->encodec_ctx->time_base,
+                             output_ctx->oformat_ctx->streams[0]->time_base);
+        printf("Packet dts:%"PRId64", pts:%"PRId64", duration:%"PRId64", size:%d\n", packet->dts, packet->pts,
+               packet->duration, packet->size);
+        size = packet->size;
+        // muxer取走packet的数据，缓存引用同一份数据，分配失败时只是不缓存
+        cache_packet = cacheable ? av_packet_clone(packet) : NULL;
+        ret = av_interleaved_write_frame(output_ctx->oformat_ctx, packet);
         av_packet_free(&packet);
-        return;
+        if (ret < 0) {
+            printf("av_interleaved_write_frame failed, %s\n", av_err2str(ret));
+        } else if ((ret = av_write_trailer(output_ctx->oformat_ctx)) < 0) {
+            printf("av_write_trailer failed, %s\n", av_err2str(ret));
+        } else {
+            ret = commit_output(shot_ctx, output_ctx, size);
+        }
+        if (ret < 0) {
+            abort_output_file(&(output_ctx->temp_output));
+            result = ret;
+        } else if (cache_packet) {
+            disk_cache_put(shot_ctx->disk_cache, &(output_ctx->cache_key), cache_packet->data, cache_packet->size);
+        }
+        av_packet_free(&cache_packet);
     }
+    return result;
 }
 
 /**
@@ -2,54 +2,234 @@
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/opt.h>
+#include <pthread.h>
 #include "queue.h"
+#include "pyramid.h"
+#include "custom_io.h"
+#include "seek.h"
+#include "nal.h"
+#include "diskcache.h"
+#include "pack.h"
+#include "commit.h"
+#include "capture.h"
 
 typedef struct FilterContext {
     AVFilterContext *buffersrc_ctx;
-    AVFilterContext *buffersink_ctx;
+    AVFilterContext **buffersink_ctxs;
+    int nb_buffersinks;
+    AVFilterContext *pyramid_sink_ctx;
+    int nb_pyramid_levels;
     AVFilterGraph *filter_graph;
 } FilterContext;
 
 
+/**
+ * 一路截图输出的描述
+ * width/height都<=0时保持原尺寸，只指定其中一个时按原比例缩放
+ * level>0时为金字塔输出，由原图逐级2x2均值下采样到1/2^level，忽略width/height
+ * fd>0或write_cb非空时直接写入fd/回调，不写output文件，format_name默认为image2pipe
+ * pack非空时把编码数据追加到pack文件，output作为pack中的key
+ */
+typedef struct OutputSpec {
+    const char *codec_name;
+    const char *output;
+    int width;
+    int height;
+    int level;
+    int fd;
+    ShotWriteCallback write_cb;
+    void *opaque;
+    const char *format_name;
+    int avio_buffer_size;
+    PackWriter *pack;
+} OutputSpec;
+
+
+/**
+ * 截图视频流的选择方式
+ */
+typedef enum StreamSelect {
+    STREAM_SELECT_FIRST = 0, // 第一个视频流
+    STREAM_SELECT_BEST, // av_find_best_stream
+    STREAM_SELECT_INDEX, // 指定stream_index
+    STREAM_SELECT_PROGRAM, // 指定program_id中分辨率最高的视频流，忽略封面图
+    STREAM_SELECT_LARGEST, // 分辨率最高的视频流，忽略封面图
+} StreamSelect;
+
+
+/**
+ * 输入来源，buffer非空时读取内存数据，read_cb非空时由回调读取，fd>0时读取不可seek的管道/socket，
+ * 都未指定时按url打开
+ * format_name用于无法按url探测格式的输入，probe_size限定探测时读取、缓冲的字节数
+ * stream_select(StreamSelect)选择截图的视频流，其他流在demuxer中丢弃
+ * local_io非0时本地文件由mmap/io_uring读取，avio_buffer_size同时决定单次读取的大小
+ * http_pool非NULL时http(s) url通过连接池读取，复用同一origin的连接和TLS会话
+ */
+typedef struct InputSpec {
+    const uint8_t *buffer;
+    int64_t buffer_size;
+    ShotReadCallback read_cb;
+    ShotSeekCallback seek_cb;
+    void *opaque;
+    const char *format_name;
+    int avio_buffer_size;
+    int fd;
+    int read_timeout;
+    int64_t probe_size;
+    int stream_select;
+    int stream_index;
+    int program_id;
+    int local_io;
+    HttpPool *http_pool;
+} InputSpec;
+
+
+#define SHOT_FLAG_FAST_DECODE 0x0001 // 跳过loop filter和非参考帧idct，以少量画质换取解码速度
+#define SHOT_FLAG_MP4_RANGE_FETCH 0x0002 // 远程mp4只按range请求读取moov和截图时间点之前最近的同步样本，失败时回退demuxer
+
+/**
+ * 截图统计
+ */
+typedef struct ShotStats {
+    int skipped_packets; // 随机访问点之前跳过的包
+    int rejected_frames; // 损坏而被拒绝的帧
+    int decode_errors;
+    int elapsed; // 耗时，单位ms
+    int degraded; // 输出的是降级模式下不完整的画面
+} ShotStats;
+
+
+/**
+ * 截图选项
+ * timeout为整个截图的期限(ms)，<=0时不限制
+ * position>0时截取该时间点(ms)之前最近的关键帧，按seek_mode(SeekMode)选择seek方式
+ * stats非NULL时写入截图统计
+ * degrade_percent>0时，超过timeout的该百分比仍没有随机访问点则解码非关键帧，
+ * 降级解码degrade_frames帧后(为0时到期限时)输出最近的画面
+ * disk_cache非NULL时先查找磁盘缓存，全部命中则不打开输入，截图成功后写入缓存
+ * 文件输出先写临时文件再rename，durability(Durability)为DURABILITY_GROUP_COMMIT时rename推迟到commit_group提交
+ */
+typedef struct ShotOptions {
+    int timeout;
+    int flags;
+    InputSpec input;
+    int64_t position;
+    int seek_mode;
+    ShotStats *stats;
+    int degrade_percent;
+    int degrade_frames;
+    DiskCache *disk_cache;
+    int durability;
+    CommitGroup *commit_group;
+} ShotOptions;
+
+
+typedef struct OutputContext {
+    OutputSpec spec;
+    AVCodecContext *encodec_ctx;
+    AVFormatContext *oformat_ctx;
+    Queue *filtered_frames;
+    Queue *packets;
+    DiskCacheKey cache_key; // 磁盘缓存key，hash为0时不缓存
+    char *temp_output; // 未提交的临时文件
+} OutputContext;
+
+
 typedef struct ShotContext {
     AVFormatContext *iformat_ctx;
-    AVFormatContext *oformat_ctx;
     AVCodecContext *decodec_ctx;
-    AVCodecContext *encodec_ctx;
     FilterContext *filter_ctx;
+    OutputContext *outputs;
+    int nb_outputs;
     char *url;
-    char *codec_name;
     int video_stream_index;
     Queue *frames;
-    Queue *filtered_frames;
-    Queue *packets;
     AVDictionary *options;
+    NalInspector nal_inspector;
+    int random_access; // RandomAccessType，遇到随机访问点之前不解码
+    int recovery_frames; // recovery point之后还需丢弃的帧数
+    int skipped_packets;
+    int rejected_frames;
+    int decode_errors;
+    bool degraded; // 已进入降级解码
+    bool degraded_output;
+    AVFrame *degraded_frame; // 降级模式下最近的不完整画面
+    int degraded_frames;
+    int degrade_frames;
+    DiskCache *disk_cache;
+    int durability;
+    CommitGroup *commit_group;
 } ShotContext;
 
 int shot(const char *url, const char *codec_name, const char *output, int timeout);
 
-ShotContext *open_shot_context(const char *url, const char *codec_name, const char *output, int timeout);
+void init_shot_options(ShotOptions *options);
+
+int shot_outputs(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options);
+
+int shot_programs(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options);
+
+int capture_shot(const char *url, const ShotOptions *options, ShotCapture **capture);
+
+int render_shot_capture(const ShotCapture *capture, const OutputSpec *specs, int nb_specs,
+                        const ShotOptions *options);
+
+int shot_capture_blob(const char *url, const ShotOptions *options, uint8_t **blob, int *size);
+
+int shot_render_blob(const uint8_t *blob, int size, const OutputSpec *specs, int nb_specs,
+                     const ShotOptions *options);
+
+void free_capture_blob(uint8_t **blob);
+
+ShotContext *open_shot_context(const char *url, const OutputSpec *specs, int nb_specs, const ShotOptions *options);
+
+int open_shot_outputs(ShotContext *shot_ctx, const OutputSpec *specs, int nb_specs);
 
 void close_shot_context(ShotContext *shot_ctx);
 
-int open_iformat_context(char *filename, AVFormatContext **format_ctx, AVDictionary **options, int *video_stream_index);
+int open_iformat_context(const char *filename, const InputSpec *input, AVFormatContext **format_ctx,
+                         AVDictionary **options, int *video_stream_index);
+
+void close_iformat_context(AVFormatContext **format_ctx);
+
+int open_oformat_context(const OutputSpec *spec, AVCodecContext *encodec_ctx, const char *temp_output,
+                         AVFormatContext **format_ctx);
+
 
-int open_oformat_context(const char *filename, AVCodecContext *encodec_ctx, AVFormatContext **format_ctx);
+int open_decodec_context(AVFormatContext *format_ctx, int stream_index, const OutputSpec *specs, int nb_specs,
+                         int flags, AVCodecContext **codec_ctx);
 
+int open_decodec_context_from_parameters(const AVCodecParameters *codecpar, AVRational framerate,
+                                         const OutputSpec *specs, int nb_specs, int flags,
+                                         AVCodecContext **codec_ctx);
 
-int open_decodec_context(AVFormatContext *format_ctx, int stream_index, AVCodecContext **codec_ctx);
+enum AVPixelFormat choose_encodec_pix_fmt(const AVCodec *codec, const AVCodecContext *decodec_ctx);
 
-int open_encodec_context(const char *codec_name, AVCodecContext *decodec_ctx, AVCodecContext **codec_ctx);
+void get_output_size(const OutputSpec *spec, AVCodecContext *decodec_ctx, int *width, int *height);
 
-int open_filter_context(AVCodecContext *decodec_ctx, AVCodecContext *encodec_ctx, FilterContext **filter_ctx,
-                        const char *filter_spec);
+int open_encodec_context(const OutputSpec *spec, AVCodecContext *decodec_ctx, AVCodecContext **codec_ctx);
+
+int open_filter_context(AVCodecContext *decodec_ctx, OutputContext *outputs, int nb_outputs,
+                        FilterContext **filter_ctx);
 
 int transcode_packet(ShotContext *transcode_ctx, AVPacket *packet);
 
+int transcode_frames(ShotContext *shot_ctx);
+
+void enter_degraded_mode(ShotContext *shot_ctx);
+
+int output_degraded_frame(ShotContext *shot_ctx);
+
+int gate_packet(ShotContext *shot_ctx, AVPacket *packet);
+
 int decode_packet(ShotContext *transcode_ctx, AVPacket *packet);
 
 int filter_packet(ShotContext *transcode_ctx, AVFrame *frame);
 
-int encode_packet(ShotContext *transcode_ctx, AVFrame *frame);
+int encode_outputs(ShotContext *transcode_ctx);
+
+int encode_packet(OutputContext *output_ctx, AVFrame *frame);
+
+bool is_outputs_ready(ShotContext *transcode_ctx);
 
-void mux_oformat_packets(ShotContext *transcode_ctx);
\ No newline at end of file
+int mux_oformat_packets(ShotContext *transcode_ctx);
\ No newline at end of file
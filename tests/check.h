@@ -0,0 +1,24 @@
+//
+// 单元测试的断言，失败时打印位置并计数，main返回是否有失败
+//
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+    long long actual_value = (long long) (actual), expected_value = (long long) (expected); \
+    if (actual_value != expected_value) { \
+        printf("%s:%d: CHECK_EQ(%s, %s) failed, %lld != %lld\n", __FILE__, __LINE__, #actual, #expected, \
+               actual_value, expected_value); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define TEST_RESULT() (test_failures ? (printf("%d checks failed\n", test_failures), 1) : 0)
@@ -0,0 +1,54 @@
+#!/bin/sh
+# 编译并运行单元测试：sh tests/run_tests.sh
+# FFMPEG_INCLUDE、FFMPEG_LIB为FFmpeg 4.0的头文件和动态库目录，默认为include和pyffshot/lib
+# PYTHON为运行python测试的解释器，python2和python3都支持
+# HTTP_POOL=0时不编译依赖OpenSSL的http连接池测试
+cd "$(dirname "$0")/.." || exit 1
+CC=${CC:-gcc}
+PYTHON=${PYTHON:-python}
+HTTP_POOL=${HTTP_POOL:-1}
+FFMPEG_INCLUDE=${FFMPEG_INCLUDE:-include}
+FFMPEG_LIB=$(cd "${FFMPEG_LIB:-pyffshot/lib}" && pwd) || exit 1
+BUILD=tests/build
+failed=0
+mkdir -p $BUILD
+
+# 参数：测试名、被测源文件、链接库，在build目录下运行，测试创建的文件也在其中
+run_c_test() {
+    if ! $CC -std=gnu99 -Wall -g -I"$FFMPEG_INCLUDE" -o $BUILD/$1 tests/$1.c $2 -L"$FFMPEG_LIB" $3; then
+        echo "FAIL $1 (build)"
+        failed=1
+    elif (cd $BUILD && LD_LIBRARY_PATH="$FFMPEG_LIB:$LD_LIBRARY_PATH" ./$1); then
+        echo "PASS $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+}
+
+# 参数：测试名，unittest测试文件
+run_py_test() {
+    if $PYTHON tests/$1.py; then
+        echo "PASS $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+}
+
+run_c_test test_nal "nal.c" ""
+run_c_test test_seek_index "seek.c" "-lavformat -lavcodec -lavutil"
+run_c_test test_seek "seek.c" "-lavformat -lavcodec -lavutil"
+run_c_test test_capture "capture.c custom_io.c httppool.c" "-lavformat -lavcodec -lavutil -lpthread"
+run_c_test test_pack "pack.c diskcache.c" "-lavutil -lpthread"
+run_c_test test_diskcache "diskcache.c" "-lavutil"
+run_c_test test_mp4_fetch "mp4_fetch.c" "-lavformat -lavcodec -lavutil"
+run_c_test test_commit "commit.c" "-lavutil -lpthread"
+run_c_test test_session "commit.c capture.c custom_io.c httppool.c" "-lavformat -lavcodec -lavutil -lpthread"
+if [ "$HTTP_POOL" = 1 ]; then
+    run_c_test test_httppool "" "-lavformat -lavcodec -lavutil -lssl -lcrypto -lpthread"
+fi
+run_py_test test_cache
+run_py_test test_batch
+
+exit $failed
@@ -0,0 +1,302 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# batch.py：请求key、相同请求的合并、截图结果缓存、按物理位置的批量截图
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import time
+import types
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+# pyffshot.shot加载libshot.so，用不依赖FFmpeg的实现代替
+fake_shot = types.ModuleType("pyffshot.shot")
+fake_shot.shot_outputs = None
+sys.modules["pyffshot.shot"] = fake_shot
+
+from pyffshot import batch  # noqa: E402
+from pyffshot.cache import ShotCache  # noqa: E402
+
+WAIT_TIMEOUT = 5
+
+
+def wait_until(condition):
+    deadline = time.time() + WAIT_TIMEOUT
+    while not condition():
+        if time.time() > deadline:
+            raise AssertionError("timed out")
+        time.sleep(0.001)
+
+
+class FakeShot(object):
+    """
+    shot_outputs的替代：每路输出写入url、时间点和编码器名，url包含fail时失败，包含raise时抛出异常
+    """
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.calls = []
+        self.gate = None
+        self.delay = 0
+        self.active = 0
+        self.max_active = 0
+
+    def __call__(self, url, specs, timeout=0, position=0, **kwargs):
+        with self.lock:
+            self.calls.append((url, position))
+            self.active += 1
+            self.max_active = max(self.max_active, self.active)
+        if self.gate is not None:
+            self.gate.wait(WAIT_TIMEOUT)
+        time.sleep(self.delay)
+        with self.lock:
+            self.active -= 1
+        if "fail" in url:
+            return -1
+        if "raise" in url:
+            raise ValueError(url)
+        for spec in specs:
+            data = ("%s@%d:%s" % (url, position, spec.get("image_codec_name"))).encode("utf-8")
+            spec["write"](data[:4])
+            spec["write"](data[4:])
+        return 0
+
+
+def expected(url, position, codec):
+    return ("%s@%d:%s" % (url, position, codec)).encode("utf-8")
+
+
+class ShotKeyTest(unittest.TestCase):
+
+    def test_output_target_ignored(self):
+        outputs = [{"image_codec_name": "mjpeg", "width": 320, "output": "a.jpg"}]
+        same = [{"image_codec_name": "mjpeg", "width": 320, "fd": 3, "write": len}]
+        other = [{"image_codec_name": "mjpeg", "width": 640, "output": "a.jpg"}]
+        self.assertEqual(batch.shot_key("a.mp4", 0, outputs), batch.shot_key("a.mp4", 0, same))
+        self.assertNotEqual(batch.shot_key("a.mp4", 0, outputs), batch.shot_key("a.mp4", 0, other))
+        self.assertNotEqual(batch.shot_key("a.mp4", 0, outputs), batch.shot_key("a.mp4", 1000, outputs))
+        self.assertNotEqual(batch.shot_key("a.mp4", 0, outputs), batch.shot_key("b.mp4", 0, outputs))
+        self.assertNotEqual(batch.shot_key("a.mp4", 0, outputs), batch.shot_key("a.mp4", 0, outputs * 2))
+
+
+class SingleFlightTest(unittest.TestCase):
+
+    def run_concurrent(self, flight, fn, nb_waiters):
+        """
+        leader执行fn期间另外nb_waiters个相同请求到达，返回每个调用的结果或异常
+        """
+        gate = threading.Event()
+        outcomes = []
+        lock = threading.Lock()
+
+        def blocked():
+            gate.wait(WAIT_TIMEOUT)
+            return fn()
+
+        def call():
+            try:
+                outcome = flight.do("key", blocked)
+            except Exception as e:
+                outcome = e
+            with lock:
+                outcomes.append(outcome)
+
+        threads = [threading.Thread(target=call)]
+        threads[0].start()
+        wait_until(lambda: "key" in flight._calls)
+        for _ in range(nb_waiters):
+            threads.append(threading.Thread(target=call))
+            threads[-1].start()
+        wait_until(lambda: flight._calls["key"].waiters == nb_waiters)
+        gate.set()
+        for thread in threads:
+            thread.join(WAIT_TIMEOUT)
+        self.assertEqual(flight.inflight(), 0)
+        return outcomes
+
+    def test_merge(self):
+        flight = batch.SingleFlight()
+        count = [0]
+
+        def fn():
+            count[0] += 1
+            return "result"
+
+        outcomes = self.run_concurrent(flight, fn, 3)
+        self.assertEqual(count[0], 1)
+        self.assertEqual(outcomes, [("result", True)] * 4)
+
+    def test_error(self):
+        flight = batch.SingleFlight()
+
+        def fn():
+            raise ValueError("shot failed")
+
+        outcomes = self.run_concurrent(flight, fn, 2)
+        self.assertEqual(len(outcomes), 3)
+        for outcome in outcomes:
+            self.assertIsInstance(outcome, ValueError)
+
+    def test_rerun_after_done(self):
+        flight = batch.SingleFlight()
+        count = [0]
+
+        def fn():
+            count[0] += 1
+            return count[0]
+
+        self.assertEqual(flight.do("key", fn), (1, False))
+        self.assertEqual(flight.do("key", fn), (2, False))
+        self.assertEqual(flight.do("other", fn), (3, False))
+        self.assertEqual(flight.inflight(), 0)
+
+
+class BatchShooterTest(unittest.TestCase):
+
+    def setUp(self):
+        self.fake = FakeShot()
+        self._shot_outputs = batch.shot_outputs
+        batch.shot_outputs = self.fake
+
+    def tearDown(self):
+        batch.shot_outputs = self._shot_outputs
+
+    def test_shot(self):
+        shooter = batch.BatchShooter()
+        outputs = [{"image_codec_name": "mjpeg"}, {"image_codec_name": "png", "output": "ignored.png"}]
+        self.assertEqual(shooter.shot("a.mp4", outputs, 2000),
+                         [expected("a.mp4", 2000, "mjpeg"), expected("a.mp4", 2000, "png")])
+        self.assertIsNone(shooter.shot("fail.mp4", outputs))
+        self.assertEqual(shooter.requests, 2)
+        self.assertEqual(shooter.shared, 0)
+
+    def test_concurrent_shared(self):
+        shooter = batch.BatchShooter()
+        outputs = [{"image_codec_name": "mjpeg"}]
+        results = []
+        self.fake.gate = threading.Event()
+        threads = [threading.Thread(target=lambda: results.append(shooter.shot("a.mp4", outputs, 1000)))
+                   for _ in range(4)]
+        threads[0].start()
+        wait_until(lambda: len(self.fake.calls) == 1)
+        for thread in threads[1:]:
+            thread.start()
+        wait_until(lambda: shooter._flight._calls[batch.shot_key("a.mp4", 1000, outputs)].waiters == 3)
+        self.fake.gate.set()
+        for thread in threads:
+            thread.join(WAIT_TIMEOUT)
+        self.assertEqual(self.fake.calls, [("a.mp4", 1000)])
+        self.assertEqual(results, [[expected("a.mp4", 1000, "mjpeg")]] * 4)
+        self.assertEqual(shooter.requests, 4)
+        self.assertEqual(shooter.shared, 4)
+
+    def test_cache(self):
+        cache = ShotCache()
+        shooter = batch.BatchShooter(cache=cache)
+        outputs = [{"image_codec_name": "mjpeg", "output": "a.jpg"}]
+        first = shooter.shot("a.mp4", outputs, 1000)
+        # 输出目标不同，编码结果相同
+        second = shooter.shot("a.mp4", [{"image_codec_name": "mjpeg", "output": "b.jpg"}], 1000)
+        self.assertEqual(first, [expected("a.mp4", 1000, "mjpeg")])
+        self.assertEqual(second, first)
+        self.assertEqual(self.fake.calls, [("a.mp4", 1000)])
+        self.assertEqual(cache.stats()["hits"], 1)
+        shooter.shot("a.mp4", outputs, 2000)
+        self.assertEqual(len(self.fake.calls), 2)
+        # 失败的结果不缓存
+        self.assertIsNone(shooter.shot("fail.mp4", outputs))
+        self.assertIsNone(shooter.shot("fail.mp4", outputs))
+        self.assertEqual(len(self.fake.calls), 4)
+        self.assertEqual(cache.stats()["entries"], 2)
+
+
+
+class ShotBatchTest(unittest.TestCase):
+
+    def setUp(self):
+        self.fake = FakeShot()
+        self._shot_outputs = batch.shot_outputs
+        batch.shot_outputs = self.fake
+        self.dir = tempfile.mkdtemp()
+        self.paths = []
+        for i in range(6):
+            self.paths.append(os.path.join(self.dir, "%d.mp4" % i))
+            with open(self.paths[-1], "wb") as f:
+                f.write(b"x" * (4096 * (i + 1)))
+
+    def tearDown(self):
+        batch.shot_outputs = self._shot_outputs
+        shutil.rmtree(self.dir)
+
+    def test_local_path(self):
+        self.assertEqual(batch.local_path("file:/data/a.mp4"), "/data/a.mp4")
+        self.assertEqual(batch.local_path("/data/a.mp4"), "/data/a.mp4")
+        self.assertIsNone(batch.local_path("http://cdn/a.mp4"))
+        self.assertIsNone(batch.local_path("rtsp://camera/stream"))
+
+    def test_locality_key(self):
+        st = os.stat(self.paths[0])
+        key = batch.locality_key("file:" + self.paths[0])
+        self.assertEqual(key[0], st.st_dev)
+        self.assertEqual(key[2], self.paths[0])
+        self.assertEqual(batch.locality_key("http://cdn/a.mp4"), (None, 0, "http://cdn/a.mp4"))
+        missing = os.path.join(self.dir, "missing.mp4")
+        self.assertEqual(batch.locality_key(missing), (None, 0, missing))
+
+    def test_results_in_request_order(self):
+        outputs = [{"image_codec_name": "mjpeg"}]
+        urls = ["http://cdn/a.mp4", self.paths[3], self.paths[0], "rtsp://camera/1", "file:" + self.paths[5]]
+        requests = [(url, outputs, [3000, 1000, 2000 + i]) for i, url in enumerate(urls)]
+        results = batch.BatchShooter().shot_batch(requests, workers=3)
+        self.assertEqual(len(results), len(requests))
+        for i, url in enumerate(urls):
+            self.assertEqual(results[i], dict((position, [expected(url, position, "mjpeg")])
+                                              for position in (3000, 1000, 2000 + i)))
+        # 同一文件内按时间点递增截图
+        for i, url in enumerate(urls):
+            self.assertEqual([position for call_url, position in self.fake.calls if call_url == url],
+                             sorted([3000, 1000, 2000 + i]))
+
+    def test_locality_order(self):
+        outputs = [{"image_codec_name": "mjpeg"}]
+        urls = ["http://cdn/a.mp4", self.paths[4], self.paths[1], "http://cdn/b.mp4", self.paths[2]]
+        requests = [(url, outputs, [0]) for url in urls]
+        batch.BatchShooter().shot_batch(requests, workers=1)
+        local = sorted(urls[1:3] + urls[4:], key=batch.locality_key)
+        self.assertEqual([url for url, _ in self.fake.calls], local + ["http://cdn/a.mp4", "http://cdn/b.mp4"])
+        del self.fake.calls[:]
+        batch.BatchShooter().shot_batch(requests, workers=1, locality=False)
+        self.assertEqual([url for url, _ in self.fake.calls], urls)
+
+    def test_request_error(self):
+        outputs = [{"image_codec_name": "mjpeg"}]
+        urls = ["http://cdn/a.mp4", "http://cdn/raise.mp4", self.paths[0], "http://cdn/fail.mp4"]
+        requests = [(url, outputs, [0, 1000]) for url in urls]
+        results = batch.BatchShooter().shot_batch(requests, workers=1)
+        # 抛出异常的请求不中断工作线程，后面的请求照常执行
+        self.assertIsInstance(results[1], ValueError)
+        self.assertEqual(results[0], {0: [expected(urls[0], 0, "mjpeg")], 1000: [expected(urls[0], 1000, "mjpeg")]})
+        self.assertEqual(results[2], {0: [expected(urls[2], 0, "mjpeg")], 1000: [expected(urls[2], 1000, "mjpeg")]})
+        self.assertEqual(results[3], {0: None, 1000: None})
+
+    def test_readers_per_device(self):
+        outputs = [{"image_codec_name": "mjpeg"}]
+        requests = [(path, outputs, [0, 1000]) for path in self.paths]
+        self.fake.delay = 0.02
+        for readers in (1, 2):
+            self.fake.max_active = 0
+            results = batch.BatchShooter().shot_batch(requests, workers=4, readers_per_device=readers)
+            self.assertEqual(self.fake.max_active, readers)
+            self.assertEqual([sorted(result) for result in results], [[0, 1000]] * len(self.paths))
+        # 远程url不限制
+        self.fake.max_active = 0
+        requests = [("http://cdn/%d.mp4" % i, outputs, [0]) for i in range(4)]
+        batch.BatchShooter().shot_batch(requests, workers=4, readers_per_device=1)
+        self.assertGreater(self.fake.max_active, 1)
+
+
+if __name__ == "__main__":
+    unittest.main()
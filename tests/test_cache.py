@@ -0,0 +1,124 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# cache.py：LRU淘汰、直播和点播的TTL、统计
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+from pyffshot import cache  # noqa: E402
+
+
+class FakeClock(object):
+    """
+    替换cache模块中的time，由测试控制当前时间
+    """
+
+    def __init__(self):
+        self.now = 1000.0
+
+    def time(self):
+        return self.now
+
+
+def key(url, n=0):
+    return url, n
+
+
+class ShotCacheTest(unittest.TestCase):
+
+    def setUp(self):
+        self.clock = FakeClock()
+        self._time = cache.time
+        cache.time = self.clock
+
+    def tearDown(self):
+        cache.time = self._time
+
+    def test_get_put(self):
+        shot_cache = cache.ShotCache()
+        self.assertIsNone(shot_cache.get(key("a.mp4")))
+        shot_cache.put(key("a.mp4"), [b"jpeg", b"png"])
+        self.assertEqual(shot_cache.get(key("a.mp4")), [b"jpeg", b"png"])
+        self.assertIsNone(shot_cache.get(key("a.mp4", 1)))
+        self.assertEqual(shot_cache.stats(), {"entries": 1, "bytes": 7, "hits": 1, "misses": 2, "evictions": 0})
+
+    def test_replace_key(self):
+        shot_cache = cache.ShotCache()
+        shot_cache.put(key("a.mp4"), [b"x" * 100])
+        shot_cache.put(key("a.mp4"), [b"y" * 30])
+        self.assertEqual(shot_cache.get(key("a.mp4")), [b"y" * 30])
+        self.assertEqual(shot_cache.bytes, 30)
+        self.assertEqual(shot_cache.stats()["entries"], 1)
+
+    def test_lru_entries(self):
+        shot_cache = cache.ShotCache(max_entries=3)
+        for i in range(3):
+            shot_cache.put(key("a.mp4", i), [b"x"])
+        # 访问0之后，最久未使用的是1
+        shot_cache.get(key("a.mp4", 0))
+        shot_cache.put(key("a.mp4", 3), [b"x"])
+        self.assertIsNone(shot_cache.get(key("a.mp4", 1)))
+        for i in (0, 2, 3):
+            self.assertEqual(shot_cache.get(key("a.mp4", i)), [b"x"])
+        self.assertEqual(shot_cache.stats()["evictions"], 1)
+
+    def test_lru_bytes(self):
+        shot_cache = cache.ShotCache(max_bytes=100)
+        shot_cache.put(key("a.mp4", 0), [b"x" * 40])
+        shot_cache.put(key("a.mp4", 1), [b"x" * 40])
+        # 按所有输出的总字节数计算，恰好等于上限时不淘汰
+        shot_cache.put(key("a.mp4", 2), [b"x" * 10, b"y" * 10])
+        self.assertEqual(shot_cache.bytes, 100)
+        self.assertEqual(shot_cache.evictions, 0)
+        shot_cache.put(key("a.mp4", 3), [b"x" * 31, b"y" * 30])
+        self.assertIsNone(shot_cache.get(key("a.mp4", 0)))
+        self.assertIsNone(shot_cache.get(key("a.mp4", 1)))
+        self.assertEqual(shot_cache.get(key("a.mp4", 2)), [b"x" * 10, b"y" * 10])
+        self.assertEqual(shot_cache.get(key("a.mp4", 3)), [b"x" * 31, b"y" * 30])
+        self.assertEqual(shot_cache.bytes, 81)
+        self.assertEqual(shot_cache.evictions, 2)
+
+    def test_oversized_result(self):
+        shot_cache = cache.ShotCache(max_bytes=100)
+        shot_cache.put(key("a.mp4", 0), [b"x" * 10])
+        shot_cache.put(key("a.mp4", 1), [b"x" * 101])
+        self.assertIsNone(shot_cache.get(key("a.mp4", 1)))
+        # 不因为放不下的结果淘汰已有条目
+        self.assertEqual(shot_cache.get(key("a.mp4", 0)), [b"x" * 10])
+        self.assertEqual(shot_cache.evictions, 0)
+
+    def test_live_and_vod_ttl(self):
+        self.assertTrue(cache.is_live_url("rtsp://camera/stream"))
+        self.assertTrue(cache.is_live_url("http://cdn/live/index.m3u8?token=1"))
+        self.assertFalse(cache.is_live_url("http://cdn/vod/a.mp4"))
+        self.assertFalse(cache.is_live_url("/data/a.flv"))
+        shot_cache = cache.ShotCache(live_ttl=0.2, vod_ttl=3600)
+        shot_cache.put(key("rtmp://server/live"), [b"live"])
+        shot_cache.put(key("http://cdn/vod/a.mp4"), [b"vod"])
+        shot_cache.put(key("http://cdn/vod/b.mp4"), [b"short"], ttl=10)
+        self.clock.now += 0.1
+        self.assertEqual(shot_cache.get(key("rtmp://server/live")), [b"live"])
+        self.clock.now += 0.2
+        self.assertIsNone(shot_cache.get(key("rtmp://server/live")))
+        self.assertEqual(shot_cache.get(key("http://cdn/vod/a.mp4")), [b"vod"])
+        self.clock.now += 10
+        self.assertIsNone(shot_cache.get(key("http://cdn/vod/b.mp4")))
+        self.clock.now += 3600
+        self.assertIsNone(shot_cache.get(key("http://cdn/vod/a.mp4")))
+        # 过期条目在读取时移除
+        self.assertEqual(shot_cache.stats()["entries"], 0)
+        self.assertEqual(shot_cache.bytes, 0)
+
+    def test_clear(self):
+        shot_cache = cache.ShotCache()
+        shot_cache.put(key("a.mp4"), [b"x" * 10])
+        shot_cache.clear()
+        self.assertIsNone(shot_cache.get(key("a.mp4")))
+        self.assertEqual(shot_cache.stats()["entries"], 0)
+        self.assertEqual(shot_cache.bytes, 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
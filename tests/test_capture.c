@@ -0,0 +1,199 @@
+//
+// capture.c：抓取结果序列化后解析的往返，以及截断、错误magic和越界长度的拒绝
+//
+#include "check.h"
+#include "../capture.h"
+#include "../nal.h"
+#include <libavutil/intreadwrite.h>
+
+
+static ShotCapture *create_capture(int extradata_size, int nb_packets) {
+    AVCodecParameters *par = avcodec_parameters_alloc();
+    ShotCapture *capture;
+    AVPacket *packet = av_packet_alloc();
+    int i, j;
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id = AV_CODEC_ID_H264;
+    par->codec_tag = MKTAG('a', 'v', 'c', '1');
+    par->format = AV_PIX_FMT_YUV420P;
+    par->width = 1280;
+    par->height = 720;
+    par->profile = FF_PROFILE_H264_HIGH;
+    par->level = 31;
+    par->bit_rate = INT64_C(5000000000);
+    par->bits_per_coded_sample = 24;
+    par->bits_per_raw_sample = 8;
+    par->sample_aspect_ratio = (AVRational) {4, 3};
+    par->field_order = AV_FIELD_TT;
+    par->color_range = AVCOL_RANGE_MPEG;
+    par->color_primaries = AVCOL_PRI_BT709;
+    par->color_trc = AVCOL_TRC_BT709;
+    par->color_space = AVCOL_SPC_BT709;
+    par->chroma_location = AVCHROMA_LOC_LEFT;
+    par->video_delay = 2;
+    if (extradata_size > 0) {
+        par->extradata = (uint8_t *) av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        par->extradata_size = extradata_size;
+        for (i = 0; i < extradata_size; ++i) {
+            par->extradata[i] = (uint8_t) (i * 7 + 1);
+        }
+    }
+    capture = alloc_shot_capture(par);
+    avcodec_parameters_free(&par);
+    capture->time_base = (AVRational) {1, 90000};
+    capture->framerate = (AVRational) {30000, 1001};
+    capture->start_time = -3003;
+    capture->position = 65000;
+    capture->random_access = RANDOM_ACCESS_RECOVERY;
+    capture->recovery_frames = 3;
+    capture->skipped_packets = 17;
+    capture->elapsed = 42;
+    for (i = 0; i < nb_packets; ++i) {
+        av_new_packet(packet, 100 + i * 333);
+        for (j = 0; j < packet->size; ++j) {
+            packet->data[j] = (uint8_t) (i + j);
+        }
+        packet->pts = i == 1 ? AV_NOPTS_VALUE : 6006 + i * 3003;
+        packet->dts = 3003 + i * 3003;
+        packet->duration = 3003;
+        packet->flags = i == 0 ? AV_PKT_FLAG_KEY : 0;
+        add_shot_capture_packet(capture, packet);
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    return capture;
+}
+
+
+static void check_same_capture(const ShotCapture *a, const ShotCapture *b) {
+    const AVCodecParameters *x = a->codecpar, *y = b->codecpar;
+    int i;
+    CHECK_EQ(y->codec_type, x->codec_type);
+    CHECK_EQ(y->codec_id, x->codec_id);
+    CHECK_EQ(y->codec_tag, x->codec_tag);
+    CHECK_EQ(y->format, x->format);
+    CHECK_EQ(y->width, x->width);
+    CHECK_EQ(y->height, x->height);
+    CHECK_EQ(y->profile, x->profile);
+    CHECK_EQ(y->level, x->level);
+    CHECK_EQ(y->bit_rate, x->bit_rate);
+    CHECK_EQ(y->bits_per_coded_sample, x->bits_per_coded_sample);
+    CHECK_EQ(y->bits_per_raw_sample, x->bits_per_raw_sample);
+    CHECK_EQ(av_cmp_q(y->sample_aspect_ratio, x->sample_aspect_ratio), 0);
+    CHECK_EQ(y->field_order, x->field_order);
+    CHECK_EQ(y->color_range, x->color_range);
+    CHECK_EQ(y->color_primaries, x->color_primaries);
+    CHECK_EQ(y->color_trc, x->color_trc);
+    CHECK_EQ(y->color_space, x->color_space);
+    CHECK_EQ(y->chroma_location, x->chroma_location);
+    CHECK_EQ(y->video_delay, x->video_delay);
+    CHECK_EQ(y->extradata_size, x->extradata_size);
+    CHECK(!x->extradata_size || !memcmp(y->extradata, x->extradata, x->extradata_size));
+    CHECK_EQ(av_cmp_q(b->time_base, a->time_base), 0);
+    CHECK_EQ(av_cmp_q(b->framerate, a->framerate), 0);
+    CHECK_EQ(b->start_time, a->start_time);
+    CHECK_EQ(b->position, a->position);
+    CHECK_EQ(b->random_access, a->random_access);
+    CHECK_EQ(b->recovery_frames, a->recovery_frames);
+    CHECK_EQ(b->skipped_packets, a->skipped_packets);
+    CHECK_EQ(b->elapsed, a->elapsed);
+    CHECK_EQ(b->nb_packets, a->nb_packets);
+    for (i = 0; i < a->nb_packets && i < b->nb_packets; ++i) {
+        CHECK_EQ(b->packets[i]->pts, a->packets[i]->pts);
+        CHECK_EQ(b->packets[i]->dts, a->packets[i]->dts);
+        CHECK_EQ(b->packets[i]->duration, a->packets[i]->duration);
+        CHECK_EQ(b->packets[i]->flags, a->packets[i]->flags);
+        CHECK_EQ(b->packets[i]->size, a->packets[i]->size);
+        CHECK(b->packets[i]->size == a->packets[i]->size &&
+              !memcmp(b->packets[i]->data, a->packets[i]->data, a->packets[i]->size));
+    }
+}
+
+
+static void test_round_trip(int extradata_size, int nb_packets) {
+    ShotCapture *capture = create_capture(extradata_size, nb_packets), *parsed = NULL;
+    uint8_t *blob = NULL;
+    int size = 0;
+    CHECK_EQ(serialize_shot_capture(capture, &blob, &size), 0);
+    CHECK_EQ(parse_shot_capture(blob, size, &parsed), 0);
+    CHECK(parsed != NULL);
+    if (parsed) {
+        check_same_capture(capture, parsed);
+    }
+    free_shot_capture(&parsed);
+    free_shot_capture(&capture);
+    av_free(blob);
+}
+
+
+static void test_truncated(void) {
+    ShotCapture *capture = create_capture(40, 3), *parsed;
+    uint8_t *blob = NULL;
+    int size = 0, length, accepted = 0;
+    serialize_shot_capture(capture, &blob, &size);
+    for (length = 0; length < size; ++length) {
+        parsed = (ShotCapture *) blob; // 失败时应置为NULL
+        if (parse_shot_capture(blob, length, &parsed) >= 0 || parsed) {
+            printf("truncated blob accepted, length %d/%d\n", length, size);
+            accepted++;
+        }
+        free_shot_capture(&parsed);
+    }
+    CHECK_EQ(accepted, 0);
+    free_shot_capture(&capture);
+    av_free(blob);
+}
+
+
+static void test_invalid(void) {
+    ShotCapture *capture = create_capture(8, 1), *parsed;
+    uint8_t *blob = NULL, *copy;
+    // magic、版本、8个int、bit_rate、2个int、sample_aspect_ratio、7个int之后为extradata_size
+    int size = 0, extradata_size_offset = 8 + 8 * 4 + 8 + 2 * 4 + 8 + 7 * 4;
+    // 8字节extradata之后为time_base、framerate、start_time、position和4个int
+    int nb_packets_offset = extradata_size_offset + 4 + 8 + 8 + 8 + 8 + 8 + 4 * 4;
+    serialize_shot_capture(capture, &blob, &size);
+    copy = (uint8_t *) av_malloc(size + 4);
+    // magic
+    memcpy(copy, blob, size);
+    copy[0] ^= 0xff;
+    CHECK_EQ(parse_shot_capture(copy, size, &parsed), AVERROR_INVALIDDATA);
+    CHECK(parsed == NULL);
+    // 版本
+    memcpy(copy, blob, size);
+    copy[7] = SHOT_CAPTURE_VERSION + 1;
+    CHECK_EQ(parse_shot_capture(copy, size, &parsed), AVERROR_INVALIDDATA);
+    // extradata长度超出数据大小
+    memcpy(copy, blob, size);
+    CHECK_EQ(AV_RB32(copy + extradata_size_offset), 8);
+    AV_WB32(copy + extradata_size_offset, 0x7fffffff);
+    CHECK_EQ(parse_shot_capture(copy, size, &parsed), AVERROR_INVALIDDATA);
+    // 包数超出上限
+    memcpy(copy, blob, size);
+    CHECK_EQ(AV_RB32(copy + nb_packets_offset), 1);
+    AV_WB32(copy + nb_packets_offset, SHOT_CAPTURE_MAX_PACKETS + 2);
+    CHECK_EQ(parse_shot_capture(copy, size, &parsed), AVERROR_INVALIDDATA);
+    // 包大小超出数据大小
+    memcpy(copy, blob, size);
+    AV_WB32(copy + size - capture->packets[0]->size - 4, 0x7fffffff);
+    CHECK_EQ(parse_shot_capture(copy, size, &parsed), AVERROR_INVALIDDATA);
+    // 末尾多余的数据被忽略
+    memcpy(copy, blob, size);
+    memset(copy + size, 0xee, 4);
+    CHECK_EQ(parse_shot_capture(copy, size + 4, &parsed), 0);
+    CHECK(parsed && parsed->nb_packets == 1);
+    free_shot_capture(&parsed);
+    free_shot_capture(&capture);
+    av_free(copy);
+    av_free(blob);
+}
+
+
+int main(void) {
+    test_round_trip(40, 5);
+    test_round_trip(0, 1);
+    test_round_trip(3, SHOT_CAPTURE_MAX_PACKETS + 1);
+    test_truncated();
+    test_invalid();
+    return TEST_RESULT();
+}
@@ -0,0 +1,222 @@
+//
+// commit.c：临时文件写完后rename，各持久化方式和提交组的批量提交、失败的文件和多线程排队
+//
+#include "check.h"
+#include "../commit.h"
+#include <libavutil/mem.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COMMIT_DIR "test_commit.d"
+#define NB_THREADS 4
+#define FILES_PER_THREAD 50
+
+
+static void write_file(const char *path, const char *content) {
+    FILE *file = fopen(path, "wb");
+    CHECK(file != NULL);
+    if (file) {
+        fputs(content, file);
+        fclose(file);
+    }
+}
+
+
+/**
+ * @return 文件内容与content一致时返回1
+ */
+static int file_matches(const char *path, const char *content) {
+    char buf[256];
+    size_t size;
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+    size = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+    return size == strlen(content) && !memcmp(buf, content, size);
+}
+
+
+static int exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+
+/**
+ * 写出path的临时文件，返回make_temp_path的结果
+ */
+static char *write_temp(const char *path, const char *content) {
+    char *temp_path = make_temp_path(path);
+    CHECK(temp_path != NULL);
+    if (temp_path) {
+        write_file(temp_path, content);
+    }
+    return temp_path;
+}
+
+
+static void remove_dir(const char *dir) {
+    char command[256];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    CHECK_EQ(system(command), 0);
+}
+
+
+static void test_temp_path(void) {
+    char *first = make_temp_path("shots/a.jpg"), *second = make_temp_path("shots/a.jpg");
+    CHECK(first != NULL && second != NULL);
+    if (first && second) {
+        // 与目标在同一目录，同一进程内不重复
+        CHECK(!strncmp(first, "shots/a.jpg.", 12));
+        CHECK(!strcmp(first + strlen(first) - 4, ".tmp"));
+        CHECK(strcmp(first, second));
+    }
+    av_free(first);
+    av_free(second);
+}
+
+
+static void test_commit_file(void) {
+    int durabilities[] = {DURABILITY_NONE, DURABILITY_FDATASYNC, DURABILITY_GROUP_COMMIT}, i;
+    char path[64], *temp_path;
+    remove_dir(COMMIT_DIR);
+    mkdir(COMMIT_DIR, 0755);
+    for (i = 0; i < 3; ++i) {
+        // 未指定提交组的DURABILITY_GROUP_COMMIT立即提交
+        snprintf(path, sizeof(path), COMMIT_DIR "/%d.jpg", i);
+        write_file(path, "old");
+        temp_path = write_temp(path, "new");
+        CHECK_EQ(commit_output_file(av_strdup(temp_path), path, durabilities[i], NULL), 0);
+        CHECK(file_matches(path, "new"));
+        CHECK(!exists(temp_path));
+        av_free(temp_path);
+    }
+    // 临时文件不存在时目标保持不变
+    snprintf(path, sizeof(path), COMMIT_DIR "/0.jpg");
+    CHECK(commit_output_file(make_temp_path(path), path, DURABILITY_FDATASYNC, NULL) < 0);
+    CHECK(file_matches(path, "new"));
+    temp_path = write_temp(path, "partial");
+    abort_output_file(&temp_path);
+    CHECK(temp_path == NULL);
+    CHECK(file_matches(path, "new"));
+    abort_output_file(&temp_path);
+    remove_dir(COMMIT_DIR);
+}
+
+
+static void test_group(void) {
+    CommitGroup *group = create_commit_group();
+    char path[64], *temp_paths[6];
+    int i;
+    CHECK(group != NULL);
+    if (!group) {
+        return;
+    }
+    remove_dir(COMMIT_DIR);
+    mkdir(COMMIT_DIR, 0755);
+    mkdir(COMMIT_DIR "/a", 0755);
+    mkdir(COMMIT_DIR "/b", 0755);
+    CHECK_EQ(flush_commit_group(group), 0);
+    for (i = 0; i < 6; ++i) {
+        snprintf(path, sizeof(path), COMMIT_DIR "/%s/%d.jpg", i % 2 ? "a" : "b", i);
+        temp_paths[i] = write_temp(path, path);
+        CHECK_EQ(commit_output_file(av_strdup(temp_paths[i]), path, DURABILITY_GROUP_COMMIT, group), 0);
+    }
+    // flush之前只有临时文件
+    CHECK_EQ(group->nb_files, 6);
+    CHECK(!exists(COMMIT_DIR "/a/1.jpg"));
+    CHECK(exists(temp_paths[1]));
+    // 临时文件丢失的只计为失败，其他文件照常提交
+    unlink(temp_paths[4]);
+    CHECK_EQ(flush_commit_group(group), 1);
+    CHECK_EQ(group->nb_files, 0);
+    for (i = 0; i < 6; ++i) {
+        snprintf(path, sizeof(path), COMMIT_DIR "/%s/%d.jpg", i % 2 ? "a" : "b", i);
+        CHECK_EQ(file_matches(path, path), i != 4);
+        CHECK(!exists(temp_paths[i]));
+        av_free(temp_paths[i]);
+    }
+    // 释放时提交剩余的文件
+    temp_paths[0] = write_temp(COMMIT_DIR "/last.jpg", "last");
+    CHECK_EQ(commit_output_file(av_strdup(temp_paths[0]), COMMIT_DIR "/last.jpg", DURABILITY_GROUP_COMMIT, group),
+             0);
+    CHECK_EQ(free_commit_group(&group), 0);
+    CHECK(group == NULL);
+    CHECK(file_matches(COMMIT_DIR "/last.jpg", "last"));
+    CHECK(!exists(temp_paths[0]));
+    av_free(temp_paths[0]);
+    CHECK_EQ(free_commit_group(&group), 0);
+    remove_dir(COMMIT_DIR);
+}
+
+
+typedef struct WorkerArgs {
+    CommitGroup *group;
+    int index;
+    int failed;
+} WorkerArgs;
+
+
+static void *commit_files(void *arg) {
+    WorkerArgs *args = (WorkerArgs *) arg;
+    char path[64], *temp_path;
+    int i;
+    for (i = 0; i < FILES_PER_THREAD; ++i) {
+        snprintf(path, sizeof(path), COMMIT_DIR "/%d-%d.jpg", args->index, i);
+        temp_path = make_temp_path(path);
+        write_file(temp_path, path);
+        args->failed += commit_output_file(temp_path, path, DURABILITY_GROUP_COMMIT, args->group) < 0;
+        if (i % 10 == 9) {
+            args->failed += flush_commit_group(args->group);
+        }
+    }
+    return NULL;
+}
+
+
+static void test_threads(void) {
+    CommitGroup *group = create_commit_group();
+    WorkerArgs args[NB_THREADS];
+    pthread_t threads[NB_THREADS];
+    char path[64];
+    int i, j, failed = 0, mismatches = 0;
+    CHECK(group != NULL);
+    if (!group) {
+        return;
+    }
+    remove_dir(COMMIT_DIR);
+    mkdir(COMMIT_DIR, 0755);
+    for (i = 0; i < NB_THREADS; ++i) {
+        args[i].group = group;
+        args[i].index = i;
+        args[i].failed = 0;
+        pthread_create(&threads[i], NULL, commit_files, &args[i]);
+    }
+    for (i = 0; i < NB_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        failed += args[i].failed;
+    }
+    failed += free_commit_group(&group);
+    CHECK_EQ(failed, 0);
+    for (i = 0; i < NB_THREADS; ++i) {
+        for (j = 0; j < FILES_PER_THREAD; ++j) {
+            snprintf(path, sizeof(path), COMMIT_DIR "/%d-%d.jpg", i, j);
+            mismatches += !file_matches(path, path);
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    remove_dir(COMMIT_DIR);
+}
+
+
+int main(void) {
+    test_temp_path();
+    test_commit_file();
+    test_group();
+    test_threads();
+    return TEST_RESULT();
+}
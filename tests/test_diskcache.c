@@ -0,0 +1,214 @@
+//
+// diskcache.c：写入后读取、重复key、key冲突、索引满、重新打开和多进程并发写入
+//
+#include "check.h"
+#include "../diskcache.h"
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CACHE_DIR "test_diskcache.d"
+#define NB_PROCESSES 4
+#define KEYS_PER_PROCESS 200
+
+
+static DiskCacheKey make_key(const char *name, int i) {
+    DiskCacheKey key = {0, 0};
+    disk_cache_key_update(&key, name, strlen(name));
+    disk_cache_key_update(&key, &i, sizeof(i));
+    return key;
+}
+
+
+static int fill_data(uint8_t *data, int seed) {
+    int size = 1 + (seed * 104729) % 20000, i;
+    for (i = 0; i < size; ++i) {
+        data[i] = (uint8_t) (seed * 13 + i);
+    }
+    return size;
+}
+
+
+static void put(DiskCache *cache, const DiskCacheKey *key, int seed) {
+    uint8_t data[20000];
+    CHECK_EQ(disk_cache_put(cache, key, data, fill_data(data, seed)), 0);
+}
+
+
+/**
+ * @return 数据与seed一致时返回1
+ */
+static int get_matches(DiskCache *cache, const DiskCacheKey *key, int seed) {
+    uint8_t expected[20000], *data = NULL;
+    int size = -1, expected_size = fill_data(expected, seed), match;
+    if (disk_cache_get(cache, key, &data, &size) < 0) {
+        return 0;
+    }
+    match = size == expected_size && !memcmp(data, expected, size);
+    av_free(data);
+    return match;
+}
+
+
+static void remove_cache(void) {
+    unlink(CACHE_DIR "/index");
+    unlink(CACHE_DIR "/data");
+    rmdir(CACHE_DIR);
+}
+
+
+static DiskCache *create_cache(uint64_t nb_slots) {
+    remove_cache();
+    mkdir(CACHE_DIR, 0755);
+    return open_disk_cache(CACHE_DIR, nb_slots);
+}
+
+
+static void test_put_get(void) {
+    DiskCache *cache = create_cache(4096);
+    DiskCacheKey key, other;
+    uint8_t *data = NULL;
+    int i, size, mismatches = 0;
+    CHECK(cache != NULL);
+    if (!cache) {
+        return;
+    }
+    for (i = 0; i < 1000; ++i) {
+        key = make_key("video", i);
+        put(cache, &key, i);
+    }
+    // 相同key再次写入，读取最新的
+    key = make_key("video", 7);
+    put(cache, &key, 5000);
+    put(cache, &key, 5001);
+    for (i = 0; i < 1000; ++i) {
+        key = make_key("video", i);
+        mismatches += !get_matches(cache, &key, i == 7 ? 5001 : i);
+    }
+    CHECK_EQ(mismatches, 0);
+    key = make_key("missing", 0);
+    CHECK_EQ(disk_cache_get(cache, &key, &data, &size), AVERROR(ENOENT));
+    // hash相同而check不同的另一个key未命中，写入后覆盖该槽
+    key = make_key("video", 3);
+    other = key;
+    other.check ^= 1;
+    CHECK_EQ(disk_cache_get(cache, &other, &data, &size), AVERROR(ENOENT));
+    put(cache, &other, 6000);
+    CHECK(get_matches(cache, &other, 6000));
+    CHECK(!get_matches(cache, &key, 3));
+    CHECK_EQ(disk_cache_put(cache, &key, data, 0), AVERROR(EINVAL));
+    CHECK_EQ(disk_cache_put(cache, &key, data, DISK_CACHE_MAX_ENTRY_SIZE + 1), AVERROR(EINVAL));
+    close_disk_cache(&cache);
+    // 重新打开时以已有索引为准
+    cache = open_disk_cache(CACHE_DIR, 16);
+    CHECK(cache != NULL);
+    if (!cache) {
+        return;
+    }
+    CHECK_EQ(cache->nb_slots, 4096);
+    key = make_key("video", 999);
+    CHECK(get_matches(cache, &key, 999));
+    close_disk_cache(&cache);
+}
+
+
+static void test_index_full(void) {
+    DiskCache *cache = create_cache(16);
+    DiskCacheKey key;
+    uint8_t data[1] = {0};
+    int i;
+    CHECK(cache != NULL);
+    if (!cache) {
+        return;
+    }
+    // 所有key落在同一个槽，线性探测占满索引
+    for (i = 0; i < 16; ++i) {
+        key.hash = 3 + (uint64_t) i * 16;
+        key.check = (uint64_t) i;
+        put(cache, &key, i);
+    }
+    key.hash = 3 + 16 * 16;
+    CHECK_EQ(disk_cache_put(cache, &key, data, 1), AVERROR(ENOSPC));
+    for (i = 0; i < 16; ++i) {
+        key.hash = 3 + (uint64_t) i * 16;
+        key.check = (uint64_t) i;
+        CHECK(get_matches(cache, &key, i));
+    }
+    close_disk_cache(&cache);
+}
+
+
+static void test_damaged_data(void) {
+    DiskCache *cache = create_cache(64);
+    DiskCacheKey key = make_key("video", 1);
+    uint8_t *data = NULL;
+    int size;
+    CHECK(cache != NULL);
+    if (!cache) {
+        return;
+    }
+    put(cache, &key, 1);
+    // 索引指向的数据丢失
+    CHECK_EQ(truncate(CACHE_DIR "/data", 8 + 10), 0);
+    CHECK_EQ(disk_cache_get(cache, &key, &data, &size), AVERROR(ENOENT));
+    put(cache, &key, 2);
+    CHECK(get_matches(cache, &key, 2));
+    close_disk_cache(&cache);
+}
+
+
+static void test_processes(void) {
+    DiskCache *cache = create_cache(8192);
+    DiskCacheKey key;
+    pid_t pids[NB_PROCESSES];
+    int i, j, status, failed = 0, mismatches = 0;
+    char name[16];
+    if (cache) {
+        close_disk_cache(&cache);
+    }
+    for (i = 0; i < NB_PROCESSES; ++i) {
+        if ((pids[i] = fork()) == 0) {
+            cache = open_disk_cache(CACHE_DIR, 0);
+            snprintf(name, sizeof(name), "process%d", i);
+            for (j = 0; cache && j < KEYS_PER_PROCESS; ++j) {
+                key = make_key(name, j);
+                put(cache, &key, i * KEYS_PER_PROCESS + j);
+            }
+            close_disk_cache(&cache);
+            _exit(cache == NULL && test_failures == 0 ? 0 : 1);
+        }
+    }
+    for (i = 0; i < NB_PROCESSES; ++i) {
+        waitpid(pids[i], &status, 0);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    CHECK_EQ(failed, 0);
+    cache = open_disk_cache(CACHE_DIR, 0);
+    CHECK(cache != NULL);
+    if (!cache) {
+        return;
+    }
+    for (i = 0; i < NB_PROCESSES; ++i) {
+        snprintf(name, sizeof(name), "process%d", i);
+        for (j = 0; j < KEYS_PER_PROCESS; ++j) {
+            key = make_key(name, j);
+            mismatches += !get_matches(cache, &key, i * KEYS_PER_PROCESS + j);
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    close_disk_cache(&cache);
+}
+
+
+int main(void) {
+    test_put_get();
+    test_index_full();
+    test_damaged_data();
+    test_processes();
+    remove_cache();
+    return TEST_RESULT();
+}
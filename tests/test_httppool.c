@@ -0,0 +1,122 @@
+//
+// httppool.c：响应头的状态、长度、Range和连接保持的解析，重定向Location按请求url解析
+//
+#define CONFIG_HTTP_POOL 1
+#include "check.h"
+#include "../httppool.c"
+
+#define HEADER_SIZE 1024
+
+
+/**
+ * 解析header的副本
+ * @param location 不为NULL时返回Location，需av_free
+ */
+static int parse(const char *header, HttpResponse *response, char **location) {
+    char buf[HEADER_SIZE];
+    snprintf(buf, sizeof(buf), "%s", header);
+    memset(response, 0, sizeof(*response));
+    return parse_response_header(buf, response, location);
+}
+
+
+static void test_range_response(void) {
+    HttpResponse response;
+    CHECK_EQ(parse("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 1000-1099/5000\r\n"
+                   "Content-Length: 100\r\nContent-Type: video/mp4\r\n\r\n", &response, NULL), 0);
+    CHECK_EQ(response.status, 206);
+    CHECK_EQ(response.content_length, 100);
+    CHECK_EQ(response.range_start, 1000);
+    CHECK_EQ(response.total_size, 5000);
+    CHECK_EQ(response.remaining, 100);
+    CHECK_EQ(response.keep_alive, 1);
+    // 总长度未知
+    CHECK_EQ(parse("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-99/*\r\nContent-Length: 100\r\n\r\n",
+                   &response, NULL), 0);
+    CHECK_EQ(response.range_start, 0);
+    CHECK_EQ(response.total_size, -1);
+    // 服务端忽略Range返回整个文件
+    CHECK_EQ(parse("HTTP/1.1 200 OK\r\nContent-Length: 4096\r\n\r\n", &response, NULL), 0);
+    CHECK_EQ(response.status, 200);
+    CHECK_EQ(response.range_start, 0);
+    CHECK_EQ(response.total_size, 4096);
+    // 头名不区分大小写，值前可以有空白，没有冒号的行忽略
+    CHECK_EQ(parse("HTTP/1.1 206 Partial Content\r\ncontent-range:\tbytes 7-8/9\r\nbogus line\r\n"
+                   "CONTENT-LENGTH:   2\r\n\r\n", &response, NULL), 0);
+    CHECK_EQ(response.content_length, 2);
+    CHECK_EQ(response.range_start, 7);
+    CHECK_EQ(response.total_size, 9);
+}
+
+
+static void test_keep_alive(void) {
+    HttpResponse response;
+    CHECK_EQ(parse("HTTP/1.0 200 OK\r\nContent-Length: 10\r\n\r\n", &response, NULL), 0);
+    CHECK_EQ(response.keep_alive, 0);
+    CHECK_EQ(parse("HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 10\r\n\r\n", &response, NULL), 0);
+    CHECK_EQ(response.keep_alive, 1);
+    CHECK_EQ(parse("HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 10\r\n\r\n", &response, NULL), 0);
+    CHECK_EQ(response.keep_alive, 0);
+    // 没有长度时响应体读到连接关闭，连接不能复用
+    CHECK_EQ(parse("HTTP/1.1 200 OK\r\nContent-Type: video/mp4\r\n\r\n", &response, NULL), 0);
+    CHECK_EQ(response.content_length, -1);
+    CHECK_EQ(response.remaining, INT64_MAX);
+    CHECK_EQ(response.keep_alive, 0);
+    CHECK_EQ(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n", &response, NULL),
+             AVERROR_PATCHWELCOME);
+    CHECK_EQ(response.keep_alive, 0);
+    CHECK_EQ(parse("ICY 200 OK\r\n\r\n", &response, NULL), AVERROR_INVALIDDATA);
+    CHECK_EQ(parse("", &response, NULL), AVERROR_INVALIDDATA);
+}
+
+
+static void test_location(void) {
+    HttpResponse response;
+    char *location = NULL;
+    CHECK_EQ(parse("HTTP/1.1 302 Found\r\nLocation: http://cdn.example.com/a.mp4\r\nContent-Length: 0\r\n\r\n",
+                   &response, &location), 0);
+    CHECK_EQ(response.status, 302);
+    CHECK(location && !strcmp(location, "http://cdn.example.com/a.mp4"));
+    // 多个Location取最后一个
+    CHECK_EQ(parse("HTTP/1.1 301 Moved Permanently\r\nLocation: /first.mp4\r\nlocation:  /second.mp4\r\n\r\n",
+                   &response, &location), 0);
+    CHECK(location && !strcmp(location, "/second.mp4"));
+    av_freep(&location);
+    CHECK_EQ(parse("HTTP/1.1 302 Found\r\nLocation: /a.mp4\r\n\r\n", &response, NULL), 0);
+}
+
+
+/**
+ * @return 解析结果与expected一致时返回1
+ */
+static int resolves_to(const char *base, const char *location, const char *expected) {
+    char *url = resolve_location(base, location);
+    int match = url && !strcmp(url, expected);
+    if (!match) {
+        printf("resolve %s from %s: %s, expected %s\n", location, base, url ? url : "NULL", expected);
+    }
+    av_free(url);
+    return match;
+}
+
+
+static void test_resolve_location(void) {
+    CHECK(resolves_to("http://origin/a/b.mp4", "https://cdn.example.com/x.mp4?sig=1",
+                      "https://cdn.example.com/x.mp4?sig=1"));
+    CHECK(resolves_to("https://origin:8443/a/b.mp4", "//cdn.example.com/x.mp4", "https://cdn.example.com/x.mp4"));
+    CHECK(resolves_to("http://origin:8080/a/b.mp4?t=1", "/c/d.mp4", "http://origin:8080/c/d.mp4"));
+    CHECK(resolves_to("http://origin/a/b.mp4", "/c/d.mp4", "http://origin/c/d.mp4"));
+    // 相对路径按请求路径的目录解析，查询串中的'/'不算目录
+    CHECK(resolves_to("http://origin/a/b/c.mp4?t=1/2", "d.mp4?t=3", "http://origin/a/b/d.mp4?t=3"));
+    CHECK(resolves_to("https://origin:8443/a/b.mp4", "c.mp4", "https://origin:8443/a/c.mp4"));
+    CHECK(resolves_to("http://origin", "c.mp4", "http://origin/c.mp4"));
+}
+
+
+int main(void) {
+    test_range_response();
+    test_keep_alive();
+    test_location();
+    test_resolve_location();
+    return TEST_RESULT();
+}
@@ -0,0 +1,549 @@
+//
+// mp4_fetch.c：本地HTTP服务提供内存中生成的mp4，检查按range读取的关键帧和实际传输的字节数
+//
+#include "check.h"
+#include "../mp4_fetch.h"
+#include <libavutil/intreadwrite.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TIMESCALE 90000
+#define GOP 12
+#define SLOW_SAMPLES 100 // 前100个样本时长3600，之后1800
+#define CTTS_OFFSET 7200
+
+/**
+ * 视频轨的edts：单个编辑跳过ctts引入的延迟，空编辑在前的编辑列表不支持
+ */
+enum EditList {
+    EDIT_LIST_NONE,
+    EDIT_LIST_SINGLE,
+    EDIT_LIST_SINGLE_64,
+    EDIT_LIST_EMPTY_FIRST,
+};
+
+/**
+ * 生成的mp4和其中视频样本的位置
+ */
+typedef struct Mp4File {
+    uint8_t *data;
+    int size;
+    int capacity;
+    int nb_samples;
+    int64_t *offsets;
+    int *sizes;
+    int64_t *dts;
+    int64_t moov_size;
+    int edit_list;
+    int64_t media_time;
+} Mp4File;
+
+static const uint8_t avcc[] = {1, 0x64, 0, 0x1f, 0xff, 0xe1, 0, 4, 0x67, 0x64, 0, 0x1f,
+                               1, 0, 4, 0x68, 0xee, 0x3c, 0x80};
+
+static int64_t *bytes_served;
+
+
+static void put_bytes(Mp4File *mp4, const void *data, int size) {
+    if (mp4->size + size > mp4->capacity) {
+        mp4->capacity = (mp4->size + size) * 2;
+        mp4->data = (uint8_t *) av_realloc(mp4->data, mp4->capacity);
+    }
+    memcpy(mp4->data + mp4->size, data, size);
+    mp4->size += size;
+}
+
+
+static void put_be16(Mp4File *mp4, int value) {
+    uint8_t buf[2];
+    AV_WB16(buf, value);
+    put_bytes(mp4, buf, 2);
+}
+
+
+static void put_be32(Mp4File *mp4, uint32_t value) {
+    uint8_t buf[4];
+    AV_WB32(buf, value);
+    put_bytes(mp4, buf, 4);
+}
+
+
+static void put_zeros(Mp4File *mp4, int size) {
+    uint8_t zeros[64] = {0};
+    put_bytes(mp4, zeros, size);
+}
+
+
+/**
+ * 开始一个box，返回box起始位置，由end_box回填长度
+ */
+static int start_box(Mp4File *mp4, const char *type) {
+    int start = mp4->size;
+    put_be32(mp4, 0);
+    put_bytes(mp4, type, 4);
+    return start;
+}
+
+
+static void end_box(Mp4File *mp4, int start) {
+    AV_WB32(mp4->data + start, mp4->size - start);
+}
+
+
+static void put_handler(Mp4File *mp4, const char *handler) {
+    int hdlr = start_box(mp4, "hdlr");
+    put_zeros(mp4, 8);
+    put_bytes(mp4, handler, 4);
+    put_zeros(mp4, 13);
+    end_box(mp4, hdlr);
+}
+
+
+/**
+ * 写入一项elst编辑，version 1时segment_duration和media_time为64位
+ */
+static void put_edit(Mp4File *mp4, int version, uint32_t duration, int32_t media_time) {
+    if (version == 1) {
+        put_be32(mp4, 0);
+        put_be32(mp4, duration);
+        put_be32(mp4, media_time < 0 ? UINT32_MAX : 0);
+    } else {
+        put_be32(mp4, duration);
+    }
+    put_be32(mp4, (uint32_t) media_time);
+    put_be32(mp4, 0x10000);
+}
+
+
+static void put_edit_list(Mp4File *mp4) {
+    int edts, elst, version = mp4->edit_list == EDIT_LIST_SINGLE_64;
+    if (mp4->edit_list == EDIT_LIST_NONE) {
+        return;
+    }
+    edts = start_box(mp4, "edts");
+    elst = start_box(mp4, "elst");
+    put_be32(mp4, version << 24);
+    if (mp4->edit_list == EDIT_LIST_EMPTY_FIRST) {
+        put_be32(mp4, 2);
+        put_edit(mp4, version, 3600, -1);
+    } else {
+        put_be32(mp4, 1);
+    }
+    put_edit(mp4, version, 0, CTTS_OFFSET);
+    end_box(mp4, elst);
+    end_box(mp4, edts);
+}
+
+
+/**
+ * 视频轨的样本属于哪个chunk：前10个chunk每个3个样本，之后每个5个样本
+ */
+static int samples_in_chunk(int chunk) {
+    return chunk < 10 ? 3 : 5;
+}
+
+
+static void put_video_trak(Mp4File *mp4, int co64, const int64_t *chunk_offsets, int nb_chunks) {
+    int trak, mdia, mdhd, minf, stbl, stsd, entry, box, i;
+    trak = start_box(mp4, "trak");
+    put_edit_list(mp4);
+    mdia = start_box(mp4, "mdia");
+    mdhd = start_box(mp4, "mdhd");
+    put_zeros(mp4, 12);
+    put_be32(mp4, TIMESCALE);
+    put_zeros(mp4, 8);
+    end_box(mp4, mdhd);
+    put_handler(mp4, "vide");
+    minf = start_box(mp4, "minf");
+    stbl = start_box(mp4, "stbl");
+    stsd = start_box(mp4, "stsd");
+    put_be32(mp4, 0);
+    put_be32(mp4, 1);
+    entry = start_box(mp4, "avc1");
+    put_zeros(mp4, 6);
+    put_be16(mp4, 1);
+    put_zeros(mp4, 16);
+    put_be16(mp4, 1280);
+    put_be16(mp4, 720);
+    put_zeros(mp4, 50);
+    box = start_box(mp4, "avcC");
+    put_bytes(mp4, avcc, sizeof(avcc));
+    end_box(mp4, box);
+    end_box(mp4, entry);
+    end_box(mp4, stsd);
+    box = start_box(mp4, "stts");
+    put_be32(mp4, 0);
+    put_be32(mp4, 2);
+    put_be32(mp4, SLOW_SAMPLES);
+    put_be32(mp4, 3600);
+    put_be32(mp4, mp4->nb_samples - SLOW_SAMPLES);
+    put_be32(mp4, 1800);
+    end_box(mp4, box);
+    box = start_box(mp4, "ctts");
+    put_be32(mp4, 0);
+    put_be32(mp4, 1);
+    put_be32(mp4, mp4->nb_samples);
+    put_be32(mp4, CTTS_OFFSET);
+    end_box(mp4, box);
+    box = start_box(mp4, "stss");
+    put_be32(mp4, 0);
+    put_be32(mp4, (mp4->nb_samples + GOP - 1) / GOP);
+    for (i = 0; i < mp4->nb_samples; i += GOP) {
+        put_be32(mp4, i + 1);
+    }
+    end_box(mp4, box);
+    box = start_box(mp4, "stsz");
+    put_be32(mp4, 0);
+    put_be32(mp4, 0);
+    put_be32(mp4, mp4->nb_samples);
+    for (i = 0; i < mp4->nb_samples; ++i) {
+        put_be32(mp4, mp4->sizes[i]);
+    }
+    end_box(mp4, box);
+    box = start_box(mp4, "stsc");
+    put_be32(mp4, 0);
+    put_be32(mp4, 2);
+    put_be32(mp4, 1);
+    put_be32(mp4, samples_in_chunk(0));
+    put_be32(mp4, 1);
+    put_be32(mp4, 11);
+    put_be32(mp4, samples_in_chunk(10));
+    put_be32(mp4, 1);
+    end_box(mp4, box);
+    box = start_box(mp4, co64 ? "co64" : "stco");
+    put_be32(mp4, 0);
+    put_be32(mp4, nb_chunks);
+    for (i = 0; i < nb_chunks; ++i) {
+        if (co64) {
+            put_be32(mp4, (uint32_t) (chunk_offsets[i] >> 32));
+        }
+        put_be32(mp4, (uint32_t) chunk_offsets[i]);
+    }
+    end_box(mp4, box);
+    end_box(mp4, stbl);
+    end_box(mp4, minf);
+    end_box(mp4, mdia);
+    end_box(mp4, trak);
+}
+
+
+/**
+ * 写入moov：一个音频轨和一个视频轨
+ */
+static void put_moov(Mp4File *mp4, int co64, const int64_t *chunk_offsets, int nb_chunks) {
+    int moov = start_box(mp4, "moov"), trak, mdia;
+    trak = start_box(mp4, "trak");
+    mdia = start_box(mp4, "mdia");
+    put_handler(mp4, "soun");
+    end_box(mp4, mdia);
+    end_box(mp4, trak);
+    put_video_trak(mp4, co64, chunk_offsets, nb_chunks);
+    end_box(mp4, moov);
+    mp4->moov_size = mp4->size - moov;
+}
+
+
+static int count_chunks(int nb_samples) {
+    int chunks = 0, samples = 0;
+    while (samples < nb_samples) {
+        samples += samples_in_chunk(chunks++);
+    }
+    return chunks;
+}
+
+
+/**
+ * 生成mp4：ftyp、moov和mdat，chunk之间夹有音频数据
+ * @param mp4
+ * @param nb_samples 视频样本数，为samples_in_chunk的整数倍
+ * @param moov_first moov在mdat之前
+ * @param co64 使用co64代替stco
+ * @param edit_list EditList
+ */
+static void build_mp4(Mp4File *mp4, int nb_samples, int moov_first, int co64, int edit_list) {
+    int nb_chunks = count_chunks(nb_samples), chunk, sample = 0, i, j, mdat, moov_start = 0;
+    int64_t *chunk_offsets = (int64_t *) av_malloc_array(nb_chunks, sizeof(int64_t)), dts = 0;
+    uint8_t payload[8192];
+    memset(mp4, 0, sizeof(*mp4));
+    mp4->nb_samples = nb_samples;
+    mp4->edit_list = edit_list;
+    mp4->media_time = edit_list == EDIT_LIST_NONE ? 0 : CTTS_OFFSET;
+    mp4->offsets = (int64_t *) av_malloc_array(nb_samples, sizeof(int64_t));
+    mp4->sizes = (int *) av_malloc_array(nb_samples, sizeof(int));
+    mp4->dts = (int64_t *) av_malloc_array(nb_samples, sizeof(int64_t));
+    for (i = 0; i < nb_samples; ++i) {
+        mp4->sizes[i] = i % GOP == 0 ? 6000 + i : 700 + (i * 37) % 1500;
+        mp4->dts[i] = dts;
+        dts += i < SLOW_SAMPLES ? 3600 : 1800;
+    }
+    put_be32(mp4, 16);
+    put_bytes(mp4, "ftypisom", 8);
+    put_be32(mp4, 0);
+    if (moov_first) {
+        // 先写入占位的moov确定mdat的位置
+        moov_start = mp4->size;
+        memset(chunk_offsets, 0, nb_chunks * sizeof(int64_t));
+        put_moov(mp4, co64, chunk_offsets, nb_chunks);
+    }
+    mdat = start_box(mp4, "mdat");
+    for (chunk = 0; chunk < nb_chunks; ++chunk) {
+        put_zeros(mp4, 17 + chunk % 5); // 音频
+        chunk_offsets[chunk] = mp4->size;
+        for (i = 0; i < samples_in_chunk(chunk); ++i, ++sample) {
+            for (j = 0; j < mp4->sizes[sample]; ++j) {
+                payload[j] = (uint8_t) (sample * 7 + j);
+            }
+            mp4->offsets[sample] = mp4->size;
+            put_bytes(mp4, payload, mp4->sizes[sample]);
+        }
+    }
+    end_box(mp4, mdat);
+    if (moov_first) {
+        i = mp4->size;
+        mp4->size = moov_start;
+        put_moov(mp4, co64, chunk_offsets, nb_chunks);
+        mp4->size = i;
+    } else {
+        put_moov(mp4, co64, chunk_offsets, nb_chunks);
+    }
+    av_free(chunk_offsets);
+}
+
+
+static void free_mp4(Mp4File *mp4) {
+    av_freep(&(mp4->data));
+    av_freep(&(mp4->offsets));
+    av_freep(&(mp4->sizes));
+    av_freep(&(mp4->dts));
+}
+
+
+static int write_all(int fd, const void *data, int64_t size) {
+    const uint8_t *p = (const uint8_t *) data;
+    ssize_t n;
+    while (size > 0) {
+        if ((n = write(fd, p, (size_t) size)) <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * 处理一个连接上的多个请求，支持Range: bytes=start-[end]
+ */
+static void serve_connection(int fd, const Mp4File *mp4) {
+    char request[4096], header[256], *end, *range;
+    int length = 0, n, header_size;
+    int64_t start, last;
+    request[0] = 0;
+    while (1) {
+        while (!(end = strstr(request, "\r\n\r\n"))) {
+            if (length >= (int) sizeof(request) - 1 || (n = (int) read(fd, request + length,
+                                                                        sizeof(request) - 1 - length)) <= 0) {
+                return;
+            }
+            length += n;
+            request[length] = 0;
+        }
+        start = 0;
+        last = mp4->size - 1;
+        if ((range = strstr(request, "Range: bytes="))) {
+            start = strtoll(range + 13, &range, 10);
+            if (range[1] >= '0' && range[1] <= '9') {
+                last = FFMIN(strtoll(range + 1, NULL, 10), last);
+            }
+        }
+        if (start >= mp4->size) {
+            header_size = snprintf(header, sizeof(header), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                                           "Content-Length: 0\r\n\r\n");
+            last = start - 1;
+        } else {
+            header_size = snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\n"
+                                                           "Content-Range: bytes %"PRId64"-%"PRId64"/%d\r\n"
+                                                           "Content-Length: %"PRId64"\r\n\r\n",
+                                   start, last, mp4->size, last - start + 1);
+        }
+        // 发送前计数，客户端收到数据时计数已完成
+        __atomic_add_fetch(bytes_served, last - start + 1, __ATOMIC_SEQ_CST);
+        if (write_all(fd, header, header_size) < 0 ||
+            write_all(fd, mp4->data + start, last - start + 1) < 0) {
+            return;
+        }
+        end += 4;
+        length -= (int) (end - request);
+        memmove(request, end, length + 1);
+    }
+}
+
+
+/**
+ * 在子进程中运行HTTP服务，每个连接一个进程
+ * @return 服务进程pid
+ */
+static pid_t start_server(const Mp4File *mp4, int *port) {
+    struct sockaddr_in addr;
+    socklen_t addr_size = sizeof(addr);
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0), fd;
+    pid_t pid;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(server_fd, 16) < 0 ||
+        getsockname(server_fd, (struct sockaddr *) &addr, &addr_size) < 0) {
+        perror("start http server");
+        exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+    if ((pid = fork()) == 0) {
+        signal(SIGCHLD, SIG_IGN);
+        while ((fd = accept(server_fd, NULL, NULL)) >= 0) {
+            if (fork() == 0) {
+                close(server_fd);
+                serve_connection(fd, mp4);
+                _exit(0);
+            }
+            close(fd);
+        }
+        _exit(0);
+    }
+    close(server_fd);
+    return pid;
+}
+
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+
+/**
+ * 时间点之前最近的同步样本，时间点在第一个样本之前时为第一个样本，时间点从编辑的起点算起
+ */
+static int expected_sample(const Mp4File *mp4, int64_t position) {
+    int64_t timestamp = FFMAX(position, 0) * (TIMESCALE / 1000) + mp4->media_time;
+    int sample = 0, i;
+    for (i = 0; i < mp4->nb_samples; ++i) {
+        if (mp4->dts[i] <= timestamp) {
+            sample = i;
+        }
+    }
+    return sample - sample % GOP;
+}
+
+
+/**
+ * 对一组时间点读取关键帧并与生成的样本比较
+ * @return 不符合的时间点数
+ */
+static int check_fetch(const Mp4File *mp4, int port, const int64_t *positions, int nb_positions) {
+    Mp4Keyframe *keyframe = NULL;
+    AVDictionary *options = NULL;
+    char url[64];
+    int i, sample, mismatches = 0;
+    int64_t served;
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/video.mp4", port);
+    for (i = 0; i < nb_positions; ++i) {
+        sample = expected_sample(mp4, positions[i]);
+        __atomic_store_n(bytes_served, 0, __ATOMIC_SEQ_CST);
+        if (fetch_mp4_keyframe(url, positions[i], &options, &keyframe) < 0) {
+            printf("fetch position %"PRId64" failed\n", positions[i]);
+            mismatches++;
+            av_dict_free(&options);
+            continue;
+        }
+        av_dict_free(&options);
+        served = __atomic_load_n(bytes_served, __ATOMIC_SEQ_CST);
+        CHECK_EQ(keyframe->codecpar->codec_id, AV_CODEC_ID_H264);
+        CHECK_EQ(keyframe->codecpar->width, 1280);
+        CHECK_EQ(keyframe->codecpar->height, 720);
+        CHECK(keyframe->codecpar->extradata_size == sizeof(avcc) &&
+              !memcmp(keyframe->codecpar->extradata, avcc, sizeof(avcc)));
+        CHECK_EQ(keyframe->time_base.den, TIMESCALE);
+        CHECK_EQ(keyframe->framerate.num * 3600, keyframe->framerate.den * TIMESCALE);
+        CHECK(keyframe->packet->flags & AV_PKT_FLAG_KEY);
+        // 只传输文件头、moov和一个样本
+        CHECK_EQ(served, keyframe->bytes_fetched);
+        CHECK(served <= MP4_FETCH_HEAD_SIZE + mp4->moov_size + 16 + mp4->sizes[sample] + 64);
+        if (keyframe->packet->size != mp4->sizes[sample] ||
+            keyframe->packet->dts != mp4->dts[sample] - mp4->media_time ||
+            keyframe->packet->pts != mp4->dts[sample] + CTTS_OFFSET - mp4->media_time ||
+            memcmp(keyframe->packet->data, mp4->data + mp4->offsets[sample], mp4->sizes[sample])) {
+            printf("position %"PRId64": expected sample %d, got size %d dts %"PRId64"\n",
+                   positions[i], sample, keyframe->packet->size, keyframe->packet->dts);
+            mismatches++;
+        }
+        free_mp4_keyframe(&keyframe);
+    }
+    return mismatches;
+}
+
+
+static void test_fetch(int nb_samples, int moov_first, int co64, int edit_list) {
+    // 跨越两段stts，包括第一个和最后一个样本之后的时间点
+    static const int64_t positions[] = {0, -5, 39, 40, 479, 480, 3999, 4000, 4070, 5555, 7000, 1000000};
+    Mp4File mp4;
+    pid_t pid;
+    int port;
+    build_mp4(&mp4, nb_samples, moov_first, co64, edit_list);
+    pid = start_server(&mp4, &port);
+    CHECK_EQ(check_fetch(&mp4, port, positions, FF_ARRAY_ELEMS(positions)), 0);
+    stop_server(pid);
+    free_mp4(&mp4);
+}
+
+
+/**
+ * 不能按range读取的文件返回错误，由调用方回退到demuxer
+ */
+static void check_unsupported(Mp4File *mp4) {
+    Mp4Keyframe *keyframe = NULL;
+    AVDictionary *options = NULL;
+    char url[64];
+    pid_t pid;
+    int port;
+    pid = start_server(mp4, &port);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/video.mp4", port);
+    CHECK(fetch_mp4_keyframe(url, 0, &options, &keyframe) < 0);
+    CHECK(keyframe == NULL);
+    av_dict_free(&options);
+    stop_server(pid);
+    free_mp4(mp4);
+}
+
+
+static void test_unsupported(void) {
+    Mp4File mp4;
+    build_mp4(&mp4, 130, 0, 0, EDIT_LIST_NONE);
+    memcpy(mp4.data + 4, "wide", 4);
+    check_unsupported(&mp4);
+    build_mp4(&mp4, 130, 1, 0, EDIT_LIST_EMPTY_FIRST);
+    check_unsupported(&mp4);
+}
+
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+    bytes_served = (int64_t *) mmap(NULL, sizeof(int64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    avformat_network_init();
+    test_fetch(400, 0, 0, EDIT_LIST_NONE);
+    test_fetch(400, 1, 0, EDIT_LIST_NONE);
+    test_fetch(130, 1, 1, EDIT_LIST_NONE);
+    test_fetch(1000, 0, 1, EDIT_LIST_NONE);
+    test_fetch(400, 1, 0, EDIT_LIST_SINGLE);
+    test_fetch(400, 0, 1, EDIT_LIST_SINGLE_64);
+    test_unsupported();
+    avformat_network_deinit();
+    return TEST_RESULT();
+}
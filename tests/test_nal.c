@@ -0,0 +1,119 @@
+//
+// nal.c：Annex B和AVCC/HVCC码流中随机访问点的识别，包括SEI recovery point和防竞争字节
+//
+#include "check.h"
+#include "../nal.h"
+
+#define INSPECT(inspector, data, recovery_frames) \
+    inspect_random_access(inspector, data, (int) sizeof(data), recovery_frames)
+
+
+static void test_h264_annexb(void) {
+    static const uint8_t idr[] = {0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1f, 0, 0, 1, 0x68, 0xee, 0x3c,
+                                  0, 0, 1, 0x65, 0x88, 0x84, 0x00};
+    static const uint8_t slice[] = {0, 0, 0, 1, 0x09, 0x30, 0, 0, 1, 0x41, 0x9a, 0x02};
+    static const uint8_t parameter_sets[] = {0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1f, 0, 0, 1, 0x68, 0xee};
+    // recovery_frame_cnt=3，其后是非IDR slice
+    static const uint8_t recovery[] = {0, 0, 1, 0x06, 0x06, 0x02, 0x24, 0x20, 0x80, 0, 0, 1, 0x41, 0x9a};
+    // recovery_frame_cnt=0，第一帧即为完整画面
+    static const uint8_t recovery_clean[] = {0, 0, 1, 0x06, 0x06, 0x01, 0xc4, 0x80, 0, 0, 1, 0x41, 0x9a};
+    // recovery_frame_cnt=65535，ue(v)的16个前导0之间插入了防竞争字节
+    static const uint8_t emulation[] = {0, 0, 1, 0x06, 0x06, 0x05, 0x00, 0x00, 0x03, 0x80, 0x00, 0x44, 0x80,
+                                        0, 0, 1, 0x41, 0x9a};
+    // 其他类型的SEI之后才是recovery point
+    static const uint8_t sei_list[] = {0, 0, 1, 0x06, 0x05, 0x02, 0xaa, 0xbb, 0x06, 0x02, 0x24, 0x20, 0x80,
+                                       0, 0, 1, 0x41, 0x9a};
+    // SEI在payload中间截断
+    static const uint8_t truncated[] = {0, 0, 1, 0x06, 0x06};
+    NalInspector inspector;
+    int recovery_frames = -1;
+    init_nal_inspector(&inspector, AV_CODEC_ID_H264, NULL, 0);
+    CHECK_EQ(inspector.nal_length_size, 0);
+    CHECK_EQ(INSPECT(&inspector, idr, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    CHECK_EQ(recovery_frames, 0);
+    CHECK_EQ(INSPECT(&inspector, slice, &recovery_frames), RANDOM_ACCESS_NONE);
+    CHECK_EQ(INSPECT(&inspector, parameter_sets, &recovery_frames), RANDOM_ACCESS_UNKNOWN);
+    CHECK_EQ(INSPECT(&inspector, recovery, &recovery_frames), RANDOM_ACCESS_RECOVERY);
+    CHECK_EQ(recovery_frames, 3);
+    CHECK_EQ(INSPECT(&inspector, recovery_clean, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    CHECK_EQ(recovery_frames, 0);
+    CHECK_EQ(INSPECT(&inspector, emulation, &recovery_frames), RANDOM_ACCESS_RECOVERY);
+    CHECK_EQ(recovery_frames, 65535);
+    CHECK_EQ(INSPECT(&inspector, sei_list, &recovery_frames), RANDOM_ACCESS_RECOVERY);
+    CHECK_EQ(recovery_frames, 3);
+    CHECK_EQ(INSPECT(&inspector, truncated, &recovery_frames), RANDOM_ACCESS_UNKNOWN);
+}
+
+
+static void test_h264_avcc(void) {
+    static const uint8_t avcc4[] = {0x01, 0x64, 0x00, 0x1f, 0xff, 0xe1, 0x00, 0x04, 0x67, 0x64, 0x00, 0x1f};
+    static const uint8_t avcc2[] = {0x01, 0x64, 0x00, 0x1f, 0xfd, 0xe1, 0x00, 0x04, 0x67, 0x64, 0x00, 0x1f};
+    static const uint8_t idr[] = {0, 0, 0, 2, 0x09, 0x10, 0, 0, 0, 4, 0x65, 0x88, 0x84, 0x00};
+    static const uint8_t recovery[] = {0, 0, 0, 6, 0x06, 0x06, 0x02, 0x24, 0x20, 0x80, 0, 0, 0, 3, 0x41, 0x9a, 0x02};
+    static const uint8_t slice2[] = {0, 3, 0x41, 0x9a, 0x02, 0, 2, 0x01, 0x9b};
+    // 长度字段超出包大小时停止解析
+    static const uint8_t overflow[] = {0, 0, 0, 9, 0x65, 0x88};
+    // AVCC流中混有Annex B起始码
+    static const uint8_t annexb[] = {0, 0, 0, 1, 0x65, 0x88, 0x84};
+    NalInspector inspector;
+    int recovery_frames;
+    init_nal_inspector(&inspector, AV_CODEC_ID_H264, avcc4, sizeof(avcc4));
+    CHECK_EQ(inspector.nal_length_size, 4);
+    CHECK_EQ(INSPECT(&inspector, idr, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    CHECK_EQ(INSPECT(&inspector, recovery, &recovery_frames), RANDOM_ACCESS_RECOVERY);
+    CHECK_EQ(recovery_frames, 3);
+    CHECK_EQ(INSPECT(&inspector, overflow, &recovery_frames), RANDOM_ACCESS_UNKNOWN);
+    CHECK_EQ(INSPECT(&inspector, annexb, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    init_nal_inspector(&inspector, AV_CODEC_ID_H264, avcc2, sizeof(avcc2));
+    CHECK_EQ(inspector.nal_length_size, 2);
+    CHECK_EQ(INSPECT(&inspector, slice2, &recovery_frames), RANDOM_ACCESS_NONE);
+}
+
+
+static void test_hevc(void) {
+    static const uint8_t cra[] = {0, 0, 0, 1, 0x40, 0x01, 0x0c, 0, 0, 1, 0x2a, 0x01, 0xaf};
+    static const uint8_t idr[] = {0, 0, 1, 0x26, 0x01, 0xaf};
+    static const uint8_t trail[] = {0, 0, 1, 0x02, 0x01, 0xd0};
+    // recovery_poc_cnt=2
+    static const uint8_t recovery[] = {0, 0, 1, 0x4e, 0x01, 0x06, 0x01, 0x25, 0x80, 0, 0, 1, 0x02, 0x01, 0xd0};
+    // recovery_poc_cnt=-1，recovery point在当前帧之前
+    static const uint8_t recovery_negative[] = {0, 0, 1, 0x4e, 0x01, 0x06, 0x01, 0x74, 0x80,
+                                                0, 0, 1, 0x02, 0x01, 0xd0};
+    static const uint8_t hvcc_packet[] = {0, 0, 0, 3, 0x2a, 0x01, 0xaf};
+    uint8_t hvcc[23] = {0x01};
+    NalInspector inspector;
+    int recovery_frames;
+    init_nal_inspector(&inspector, AV_CODEC_ID_HEVC, NULL, 0);
+    CHECK_EQ(INSPECT(&inspector, cra, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    CHECK_EQ(INSPECT(&inspector, idr, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    CHECK_EQ(INSPECT(&inspector, trail, &recovery_frames), RANDOM_ACCESS_NONE);
+    CHECK_EQ(INSPECT(&inspector, recovery, &recovery_frames), RANDOM_ACCESS_RECOVERY);
+    CHECK_EQ(recovery_frames, 2);
+    CHECK_EQ(INSPECT(&inspector, recovery_negative, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    CHECK_EQ(recovery_frames, 0);
+    hvcc[21] = 0x03;
+    init_nal_inspector(&inspector, AV_CODEC_ID_HEVC, hvcc, sizeof(hvcc));
+    CHECK_EQ(inspector.nal_length_size, 4);
+    CHECK_EQ(INSPECT(&inspector, hvcc_packet, &recovery_frames), RANDOM_ACCESS_CLEAN);
+    // hvcC不足23字节时按Annex B处理
+    init_nal_inspector(&inspector, AV_CODEC_ID_HEVC, hvcc, 22);
+    CHECK_EQ(inspector.nal_length_size, 0);
+}
+
+
+static void test_other_codec(void) {
+    static const uint8_t data[] = {0, 0, 1, 0x65, 0x88};
+    NalInspector inspector;
+    int recovery_frames;
+    init_nal_inspector(&inspector, AV_CODEC_ID_MPEG4, NULL, 0);
+    CHECK_EQ(INSPECT(&inspector, data, &recovery_frames), RANDOM_ACCESS_UNKNOWN);
+}
+
+
+int main(void) {
+    test_h264_annexb();
+    test_h264_avcc();
+    test_hevc();
+    test_other_codec();
+    return TEST_RESULT();
+}
@@ -0,0 +1,190 @@
+//
+// pack.c：追加写入后按key查找，包括重复key、续写、哈希冲突、崩溃和掉电后残缺的记录
+//
+#include "check.h"
+#include "../pack.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PACK_PATH "test_pack.pack"
+#define NB_KEYS 300
+
+
+static int fill_data(uint8_t *data, int seed) {
+    int size = 1 + (seed * 7919) % 5000, i;
+    for (i = 0; i < size; ++i) {
+        data[i] = (uint8_t) (seed + i * 31);
+    }
+    return size;
+}
+
+
+static void make_key(char *key, size_t size, int i) {
+    snprintf(key, size, "/data/shots/%d/%d.jpg", i % 7, i);
+}
+
+
+/**
+ * 检查key对应的截图数据，map和pread两种读取方式
+ */
+static void check_entry(const PackReader *reader, const char *key, int seed) {
+    uint8_t expected[5000], buf[5000];
+    int size = fill_data(expected, seed);
+    const PackEntry *entry = find_pack_entry(reader, key);
+    CHECK(entry != NULL);
+    if (!entry) {
+        printf("key not found: %s\n", key);
+        return;
+    }
+    CHECK_EQ(entry->length, size);
+    CHECK_EQ(entry->width, seed % 1920);
+    CHECK_EQ(entry->height, seed % 1080);
+    CHECK_EQ(entry->timestamp, seed * INT64_C(1000));
+    if (entry->length != (uint32_t) size) {
+        return;
+    }
+    if (reader->pack_map) {
+        CHECK(!memcmp(map_pack_entry(reader, entry), expected, size));
+    }
+    CHECK_EQ(read_pack_entry(reader, entry, buf), 0);
+    CHECK(!memcmp(buf, expected, size));
+}
+
+
+static void append(PackWriter *writer, const char *key, int seed) {
+    uint8_t data[5000];
+    PackEntryMeta meta = {seed % 1920, seed % 1080, seed * INT64_C(1000)};
+    CHECK_EQ(pack_writer_append(writer, key, data, fill_data(data, seed), &meta), 0);
+}
+
+
+static void remove_pack(void) {
+    unlink(PACK_PATH);
+    unlink(PACK_PATH PACK_INDEX_SUFFIX);
+}
+
+
+static void test_append_find(void) {
+    PackWriter *writer;
+    PackReader *reader;
+    char key[64];
+    int i, map;
+    remove_pack();
+    writer = open_pack_writer(PACK_PATH);
+    for (i = 0; i < NB_KEYS; ++i) {
+        make_key(key, sizeof(key), i);
+        append(writer, key, i);
+    }
+    // 重复key，查找时返回最后写入的
+    append(writer, "dup", 1001);
+    append(writer, "dup", 1002);
+    append(writer, "dup", 1003);
+    CHECK_EQ(close_pack_writer(&writer), 0);
+    // 续写已有的pack
+    writer = open_pack_writer(PACK_PATH);
+    append(writer, "dup", 1004);
+    append(writer, "late", 1005);
+    CHECK_EQ(close_pack_writer(&writer), 0);
+    for (map = 0; map <= 1; ++map) {
+        reader = open_pack_reader(PACK_PATH, map);
+        CHECK(reader != NULL);
+        if (!reader) {
+            continue;
+        }
+        CHECK_EQ(reader->nb_entries, NB_KEYS + 5);
+        for (i = 0; i < NB_KEYS; ++i) {
+            make_key(key, sizeof(key), i);
+            check_entry(reader, key, i);
+        }
+        check_entry(reader, "dup", 1004);
+        check_entry(reader, "late", 1005);
+        CHECK(find_pack_entry(reader, "missing") == NULL);
+        CHECK(find_pack_entry(reader, "") == NULL);
+        close_pack_reader(&reader);
+    }
+}
+
+
+/**
+ * 直接写入一条记录和索引项，记录头和索引项的key可以与key字符串不一致
+ */
+static void append_raw(const char *key, uint64_t hash, const uint8_t *data, uint32_t length, int write_record) {
+    PackRecordHeader header = {hash, length, (uint32_t) strlen(key)};
+    PackEntry entry;
+    int pack_fd = open(PACK_PATH, O_WRONLY), index_fd = open(PACK_PATH PACK_INDEX_SUFFIX, O_WRONLY | O_APPEND);
+    off_t offset = lseek(pack_fd, 0, SEEK_END);
+    memset(&entry, 0, sizeof(entry));
+    entry.key = hash;
+    entry.offset = (uint64_t) offset + sizeof(header) + header.key_length;
+    entry.length = length;
+    entry.key_length = header.key_length;
+    if (write_record) {
+        CHECK_EQ(pwrite(pack_fd, &header, sizeof(header), offset), sizeof(header));
+        CHECK_EQ(pwrite(pack_fd, key, header.key_length, offset + sizeof(header)), header.key_length);
+        CHECK_EQ(pwrite(pack_fd, data, length, (off_t) entry.offset), length);
+    } else { // 掉电后索引已落盘、数据仍为空洞
+        CHECK_EQ(ftruncate(pack_fd, (off_t) (entry.offset + length)), 0);
+    }
+    CHECK_EQ(write(index_fd, &entry, sizeof(entry)), sizeof(entry));
+    close(pack_fd);
+    close(index_fd);
+}
+
+
+static void test_collision_and_damage(void) {
+    static const uint8_t data[16] = {1, 2, 3};
+    PackWriter *writer;
+    PackReader *reader;
+    int index_fd, map;
+    remove_pack();
+    writer = open_pack_writer(PACK_PATH);
+    append(writer, "victim", 7);
+    append(writer, "other", 8);
+    CHECK_EQ(close_pack_writer(&writer), 0);
+    // 与victim哈希冲突的另一个key，较新但不应返回
+    append_raw("imposter", pack_key("victim"), data, sizeof(data), 1);
+    append_raw("victi_", pack_key("victim"), data, sizeof(data), 1);
+    // 掉电后只有索引的记录
+    append_raw("other", pack_key("other"), data, sizeof(data), 0);
+    // 崩溃时写了一半的索引项
+    index_fd = open(PACK_PATH PACK_INDEX_SUFFIX, O_WRONLY | O_APPEND);
+    CHECK_EQ(write(index_fd, data, 10), 10);
+    close(index_fd);
+    for (map = 0; map <= 1; ++map) {
+        reader = open_pack_reader(PACK_PATH, map);
+        CHECK(reader != NULL);
+        if (!reader) {
+            continue;
+        }
+        check_entry(reader, "victim", 7);
+        check_entry(reader, "other", 8);
+        close_pack_reader(&reader);
+    }
+    // 数据未写完时索引项超出pack长度，被忽略
+    remove_pack();
+    writer = open_pack_writer(PACK_PATH);
+    append(writer, "first", 9);
+    append(writer, "second", 10);
+    CHECK_EQ(close_pack_writer(&writer), 0);
+    CHECK_EQ(truncate(PACK_PATH, 8 + sizeof(PackRecordHeader) + 5 + fill_data((uint8_t[5000]) {0}, 9) + 20), 0);
+    reader = open_pack_reader(PACK_PATH, 1);
+    CHECK(reader != NULL);
+    if (reader) {
+        CHECK_EQ(reader->nb_entries, 1);
+        check_entry(reader, "first", 9);
+        CHECK(find_pack_entry(reader, "second") == NULL);
+        close_pack_reader(&reader);
+    }
+    remove_pack();
+    CHECK(open_pack_reader(PACK_PATH, 0) == NULL);
+}
+
+
+int main(void) {
+    test_append_find();
+    test_collision_and_damage();
+    remove_pack();
+    return TEST_RESULT();
+}
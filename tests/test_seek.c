@@ -0,0 +1,305 @@
+//
+// seek.c：无索引MPEG-TS的二分seek，包括188/192/204包长、文件开头的垃圾数据、丢包后的重新同步和时间戳回绕
+//
+#include "check.h"
+#include "../seek.h"
+
+#define VIDEO_PID 0x100
+#define AUDIO_PID 0x101
+#define FRAME_DURATION 3600 // 25fps，90kHz
+#define TIMESTAMP_MASK ((INT64_C(1) << 33) - 1)
+
+/**
+ * 生成的TS数据和其中每个视频PES起始包的位置
+ */
+typedef struct TsFile {
+    uint8_t *data;
+    int size;
+    int unit_size; // 188/192/204
+    int cc;
+    int nb_frames;
+    int64_t *positions; // 包含m2ts时间码的包起始位置
+    int64_t *dts; // 未回绕
+    int *random_access;
+} TsFile;
+
+/**
+ * 内存中的可seek输入
+ */
+typedef struct MemoryInput {
+    const uint8_t *data;
+    int64_t size;
+    int64_t pos;
+} MemoryInput;
+
+static uint32_t random_state = 1;
+
+
+static uint8_t random_byte(void) {
+    random_state = random_state * 1103515245 + 12345;
+    return (uint8_t) (random_state >> 16);
+}
+
+
+static void write_timestamp(uint8_t *p, int prefix, int64_t timestamp) {
+    timestamp &= TIMESTAMP_MASK;
+    p[0] = (uint8_t) (prefix << 4 | ((timestamp >> 29) & 0x0e) | 1);
+    p[1] = (uint8_t) (timestamp >> 22);
+    p[2] = (uint8_t) ((timestamp >> 14) | 1);
+    p[3] = (uint8_t) (timestamp >> 7);
+    p[4] = (uint8_t) (timestamp << 1 | 1);
+}
+
+
+/**
+ * 追加一个TS包，负载为随机数据
+ * @param ts
+ * @param pid
+ * @param random_access 写入random_access_indicator
+ * @param pts 大于等于0时为PES起始包
+ * @param dts 大于等于0时PES头同时写入PTS和DTS
+ */
+static void put_packet(TsFile *ts, int pid, int random_access, int64_t pts, int64_t dts) {
+    uint8_t *p = ts->data + ts->size + (ts->unit_size == 192 ? 4 : 0), *pes;
+    int i, offset = 4;
+    for (i = 0; i < ts->unit_size; ++i) {
+        ts->data[ts->size + i] = random_byte();
+    }
+    p[0] = 0x47;
+    p[1] = (uint8_t) ((pts >= 0 ? 0x40 : 0) | pid >> 8);
+    p[2] = (uint8_t) pid;
+    p[3] = (uint8_t) ((random_access ? 0x30 : 0x10) | (ts->cc++ & 0x0f));
+    if (random_access) {
+        p[4] = 7;
+        p[5] = 0x40;
+        memset(p + 6, 0xff, 6);
+        offset = 12;
+    }
+    if (pts >= 0) {
+        pes = p + offset;
+        pes[0] = 0;
+        pes[1] = 0;
+        pes[2] = 1;
+        pes[3] = pid == VIDEO_PID ? 0xe0 : 0xc0;
+        pes[4] = pes[5] = 0;
+        pes[6] = 0x80;
+        pes[7] = dts >= 0 ? 0xc0 : 0x80;
+        pes[8] = dts >= 0 ? 10 : 5;
+        write_timestamp(pes + 9, dts >= 0 ? 3 : 2, pts);
+        if (dts >= 0) {
+            write_timestamp(pes + 14, 1, dts);
+        }
+    }
+    ts->size += ts->unit_size;
+}
+
+
+/**
+ * 生成TS数据：每帧一个视频PES起始包、frame_packets个视频负载包和一个音频PES
+ * @param ts
+ * @param unit_size
+ * @param start_dts 第一帧的DTS
+ * @param nb_frames
+ * @param gop 每gop帧一个随机访问点
+ * @param frame_packets
+ * @param garbage 文件开头的垃圾字节数
+ * @param corrupt_frame 该帧的第一个负载包被截断，模拟丢包，为负数时不截断
+ */
+static void build_ts(TsFile *ts, int unit_size, int64_t start_dts, int nb_frames, int gop, int frame_packets,
+                     int garbage, int corrupt_frame) {
+    int i, j;
+    memset(ts, 0, sizeof(*ts));
+    ts->unit_size = unit_size;
+    ts->nb_frames = nb_frames;
+    ts->data = (uint8_t *) av_malloc((size_t) garbage + (size_t) nb_frames * (frame_packets + 2) * unit_size);
+    ts->positions = (int64_t *) av_malloc_array(nb_frames, sizeof(int64_t));
+    ts->dts = (int64_t *) av_malloc_array(nb_frames, sizeof(int64_t));
+    ts->random_access = (int *) av_malloc_array(nb_frames, sizeof(int));
+    memset(ts->data, 0, garbage);
+    ts->size = garbage;
+    for (i = 0; i < nb_frames; ++i) {
+        ts->positions[i] = ts->size;
+        ts->dts[i] = start_dts + (int64_t) i * FRAME_DURATION;
+        ts->random_access[i] = i % gop == 0;
+        put_packet(ts, VIDEO_PID, ts->random_access[i], ts->dts[i] + 2 * FRAME_DURATION, ts->dts[i]);
+        for (j = 0; j < frame_packets; ++j) {
+            put_packet(ts, VIDEO_PID, 0, -1, -1);
+            if (i == corrupt_frame && j == 0) {
+                ts->size -= 37;
+            }
+        }
+        put_packet(ts, AUDIO_PID, 0, ts->dts[i], -1);
+    }
+}
+
+
+static void free_ts(TsFile *ts) {
+    av_freep(&(ts->data));
+    av_freep(&(ts->positions));
+    av_freep(&(ts->dts));
+    av_freep(&(ts->random_access));
+}
+
+
+/**
+ * 目标时间之前最后一个随机访问点的位置，没有时为第一个随机访问点
+ */
+static int64_t expected_position(const TsFile *ts, int64_t timestamp) {
+    int64_t position = -1;
+    int i;
+    for (i = 0; i < ts->nb_frames; ++i) {
+        if (ts->random_access[i] && (ts->dts[i] <= timestamp || position < 0)) {
+            position = ts->positions[i];
+        }
+    }
+    return position;
+}
+
+
+static int read_memory(void *opaque, uint8_t *buf, int size) {
+    MemoryInput *input = (MemoryInput *) opaque;
+    int64_t left = input->size - input->pos;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+    size = (int) FFMIN(size, left);
+    memcpy(buf, input->data + input->pos, size);
+    input->pos += size;
+    return size;
+}
+
+
+static int64_t seek_memory(void *opaque, int64_t offset, int whence) {
+    MemoryInput *input = (MemoryInput *) opaque;
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        return input->size;
+    }
+    if (whence == SEEK_CUR) {
+        offset += input->pos;
+    } else if (whence == SEEK_END) {
+        offset += input->size;
+    }
+    if (offset < 0 || offset > input->size) {
+        return AVERROR(EINVAL);
+    }
+    return input->pos = offset;
+}
+
+
+/**
+ * 只有iformat、pb和一个视频流的输入，不经过探测
+ */
+static AVFormatContext *open_memory_input(MemoryInput *input, const char *format_name, int pid) {
+    AVFormatContext *format_ctx = avformat_alloc_context();
+    uint8_t *buffer = (uint8_t *) av_malloc(32768);
+    AVStream *stream;
+    format_ctx->iformat = av_find_input_format(format_name);
+    format_ctx->pb = avio_alloc_context(buffer, 32768, 0, input, read_memory, NULL, seek_memory);
+    stream = avformat_new_stream(format_ctx, NULL);
+    stream->id = pid;
+    stream->time_base = (AVRational) {1, 90000};
+    return format_ctx;
+}
+
+
+static void close_memory_input(AVFormatContext **format_ctx) {
+    av_freep(&((*format_ctx)->pb->buffer));
+    avio_context_free(&((*format_ctx)->pb));
+    avformat_free_context(*format_ctx);
+    *format_ctx = NULL;
+}
+
+
+/**
+ * 对一组目标时间做二分seek，检查落在目标之前最后一个随机访问点
+ * @return 不符合的目标数
+ */
+static int check_bisect(const TsFile *ts, int64_t start_dts, int64_t step) {
+    MemoryInput input = {ts->data, ts->size, 0};
+    AVFormatContext *format_ctx;
+    int64_t target, end = start_dts + (int64_t) (ts->nb_frames + 50) * FRAME_DURATION, position;
+    int mismatches = 0, ret;
+    for (target = start_dts; target < end; target += step) {
+        format_ctx = open_memory_input(&input, "mpegts", VIDEO_PID);
+        ret = seek_by_ts_bisect(format_ctx, 0, target);
+        position = avio_tell(format_ctx->pb);
+        if (ret < 0 || position != expected_position(ts, target)) {
+            printf("unit %d, target %"PRId64": ret %d, position %"PRId64", expected %"PRId64"\n",
+                   ts->unit_size, target, ret, position, expected_position(ts, target));
+            mismatches++;
+        }
+        close_memory_input(&format_ctx);
+    }
+    return mismatches;
+}
+
+
+static void test_packet_sizes(void) {
+    static const int unit_sizes[] = {188, 192, 204};
+    TsFile ts;
+    int i;
+    for (i = 0; i < 3; ++i) {
+        build_ts(&ts, unit_sizes[i], 900000, 1500, 50, 6, 1000 + i, -1);
+        CHECK_EQ(check_bisect(&ts, 900000, 90000 / 3 + 7), 0);
+        free_ts(&ts);
+    }
+}
+
+
+static void test_resync_after_loss(void) {
+    TsFile ts;
+    build_ts(&ts, 188, 0, 1500, 50, 6, 77, 701);
+    CHECK_EQ(check_bisect(&ts, 0, 90000 / 3 + 7), 0);
+    free_ts(&ts);
+}
+
+
+static void test_timestamp_wrap(void) {
+    int64_t start_dts = TIMESTAMP_MASK + 1 - 20 * 90000; // 20s后回绕
+    TsFile ts;
+    build_ts(&ts, 188, start_dts, 1500, 50, 6, 0, -1);
+    CHECK_EQ(check_bisect(&ts, start_dts, 90000 / 3 + 7), 0);
+    free_ts(&ts);
+}
+
+
+static void test_large_gop(void) {
+    TsFile ts;
+    // 一个gop约1MB，大于二分结束时的区间
+    build_ts(&ts, 188, 0, 1500, 250, 20, 0, -1);
+    CHECK_EQ(check_bisect(&ts, 0, 90000 + 11), 0);
+    free_ts(&ts);
+}
+
+
+static void test_not_applicable(void) {
+    TsFile ts;
+    MemoryInput input;
+    AVFormatContext *format_ctx;
+    build_ts(&ts, 188, 0, 100, 25, 2, 0, -1);
+    input = (MemoryInput) {ts.data, ts.size, 0};
+    format_ctx = open_memory_input(&input, "flv", VIDEO_PID);
+    CHECK_EQ(seek_by_ts_bisect(format_ctx, 0, 90000), AVERROR(ENOENT));
+    close_memory_input(&format_ctx);
+    // 没有该PID的PES
+    format_ctx = open_memory_input(&input, "mpegts", 0x1ff);
+    CHECK_EQ(seek_by_ts_bisect(format_ctx, 0, 90000), AVERROR(ENOENT));
+    close_memory_input(&format_ctx);
+    // 没有同步字节
+    memset(ts.data, 0, ts.size);
+    format_ctx = open_memory_input(&input, "mpegts", VIDEO_PID);
+    CHECK_EQ(seek_by_ts_bisect(format_ctx, 0, 90000), AVERROR(ENOENT));
+    close_memory_input(&format_ctx);
+    free_ts(&ts);
+}
+
+
+int main(void) {
+    test_packet_sizes();
+    test_resync_after_loss();
+    test_timestamp_wrap();
+    test_large_gop();
+    test_not_applicable();
+    return TEST_RESULT();
+}
@@ -0,0 +1,152 @@
+//
+// seek.c：按demuxer索引表seek，flv直接跳到索引的字节位置，其他demuxer经由av_seek_frame，索引不可用时返回ENOENT
+//
+#include "check.h"
+#include "../seek.h"
+#include <string.h>
+
+#define INPUT_SIZE (4 * 1024 * 1024)
+#define NB_ENTRIES 200
+#define KEYFRAME_INTERVAL 4 // 每4项中有一项为关键帧
+#define ENTRY_DURATION 1000
+
+/**
+ * 内存中的可seek输入
+ */
+typedef struct MemoryInput {
+    const uint8_t *data;
+    int64_t size;
+    int64_t pos;
+} MemoryInput;
+
+
+static int read_memory(void *opaque, uint8_t *buf, int size) {
+    MemoryInput *input = (MemoryInput *) opaque;
+    int64_t left = input->size - input->pos;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+    size = (int) FFMIN(size, left);
+    memcpy(buf, input->data + input->pos, size);
+    input->pos += size;
+    return size;
+}
+
+
+static int64_t seek_memory(void *opaque, int64_t offset, int whence) {
+    MemoryInput *input = (MemoryInput *) opaque;
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        return input->size;
+    }
+    if (whence == SEEK_CUR) {
+        offset += input->pos;
+    } else if (whence == SEEK_END) {
+        offset += input->size;
+    }
+    if (offset < 0 || offset > input->size) {
+        return AVERROR(EINVAL);
+    }
+    return input->pos = offset;
+}
+
+
+static int64_t entry_pos(int i) {
+    return 13 + (int64_t) i * 9973;
+}
+
+
+/**
+ * 只有iformat、pb和一个带索引表的视频流的输入，不经过探测
+ * @param nb_entries 索引项数，第一项的时间戳为ENTRY_DURATION
+ */
+static AVFormatContext *open_indexed_input(MemoryInput *input, const char *format_name, int nb_entries) {
+    AVFormatContext *format_ctx = avformat_alloc_context();
+    uint8_t *buffer = (uint8_t *) av_malloc(32768);
+    AVStream *stream;
+    int i;
+    format_ctx->iformat = av_find_input_format(format_name);
+    format_ctx->pb = avio_alloc_context(buffer, 32768, 0, input, read_memory, NULL, seek_memory);
+    stream = avformat_new_stream(format_ctx, NULL);
+    stream->time_base = (AVRational) {1, 1000};
+    for (i = 0; i < nb_entries; ++i) {
+        av_add_index_entry(stream, entry_pos(i), (int64_t) (i + 1) * ENTRY_DURATION, 100, 0,
+                           i % KEYFRAME_INTERVAL == 0 ? AVINDEX_KEYFRAME : 0);
+    }
+    return format_ctx;
+}
+
+
+static void close_indexed_input(AVFormatContext **format_ctx) {
+    av_freep(&((*format_ctx)->pb->buffer));
+    avio_context_free(&((*format_ctx)->pb));
+    avformat_free_context(*format_ctx);
+    *format_ctx = NULL;
+}
+
+
+/**
+ * 目标时间之前最近的关键帧索引项的位置
+ */
+static int64_t expected_pos(int64_t timestamp) {
+    int i = (int) (timestamp / ENTRY_DURATION) - 1;
+    return entry_pos(i - i % KEYFRAME_INTERVAL);
+}
+
+
+/**
+ * 对一组目标时间按索引seek，检查读取位置落在目标之前最近的关键帧
+ * @return 不符合的目标数
+ */
+static int check_index_seek(MemoryInput *input, const char *format_name) {
+    AVFormatContext *format_ctx;
+    int64_t target, position;
+    int mismatches = 0, ret;
+    for (target = ENTRY_DURATION; target <= NB_ENTRIES * ENTRY_DURATION; target += ENTRY_DURATION / 3 + 7) {
+        format_ctx = open_indexed_input(input, format_name, NB_ENTRIES);
+        ret = seek_by_index(format_ctx, 0, target);
+        position = avio_tell(format_ctx->pb);
+        if (ret < 0 || position != expected_pos(target)) {
+            printf("%s, target %"PRId64": ret %d, position %"PRId64", expected %"PRId64"\n",
+                   format_name, target, ret, position, expected_pos(target));
+            mismatches++;
+        }
+        close_indexed_input(&format_ctx);
+    }
+    return mismatches;
+}
+
+
+static void test_index_seek(void) {
+    uint8_t *data = (uint8_t *) av_mallocz(INPUT_SIZE);
+    MemoryInput input = {data, INPUT_SIZE, 0};
+    // flv直接跳到字节位置，h264没有read_seek，由av_seek_frame按同一索引表跳转
+    CHECK_EQ(check_index_seek(&input, "flv"), 0);
+    CHECK_EQ(check_index_seek(&input, "h264"), 0);
+    av_free(data);
+}
+
+
+static void test_index_unavailable(void) {
+    uint8_t *data = (uint8_t *) av_mallocz(INPUT_SIZE);
+    MemoryInput input = {data, INPUT_SIZE, 0};
+    AVFormatContext *format_ctx = open_indexed_input(&input, "flv", 0);
+    CHECK_EQ(seek_by_index(format_ctx, 0, 5000), AVERROR(ENOENT));
+    close_indexed_input(&format_ctx);
+    format_ctx = open_indexed_input(&input, "flv", NB_ENTRIES);
+    // 目标在第一个索引项之前或最后一项之后
+    CHECK_EQ(seek_by_index(format_ctx, 0, ENTRY_DURATION - 1), AVERROR(ENOENT));
+    CHECK_EQ(seek_by_index(format_ctx, 0, NB_ENTRIES * ENTRY_DURATION + 1), AVERROR(ENOENT));
+    CHECK_EQ(avio_tell(format_ctx->pb), 0);
+    format_ctx->flags |= AVFMT_FLAG_IGNIDX;
+    CHECK_EQ(seek_by_index(format_ctx, 0, 5000), AVERROR(ENOENT));
+    close_indexed_input(&format_ctx);
+    av_free(data);
+}
+
+
+int main(void) {
+    test_index_seek();
+    test_index_unavailable();
+    return TEST_RESULT();
+}
@@ -0,0 +1,294 @@
+//
+// session.c：环形缓冲按时长和字节数淘汰、扩容时保持顺序，断线重连后的重新同步和流参数变化时清空缓冲
+// 读线程的输入由测试中的demuxer按脚本产生，每个连接读完后断开
+//
+#include "check.h"
+#include "../session.c"
+#include <libavutil/time.h>
+
+#define VIDEO_TIME_BASE 90000
+#define AUDIO_TIME_BASE 48000
+#define FRAME_TIME 40000 // 25fps，单位us
+#define GOP 10
+#define WAIT_TIMEOUT 5000000
+
+/**
+ * 一个连接读到的内容：每帧一个视频包和一个音频包，读完后断开或等待
+ */
+typedef struct Connection {
+    int width;
+    int64_t start_time; // 第一帧的时间，单位us
+    int nb_frames;
+    int lead_frames; // 第一个关键帧之前的非关键帧数
+    int last; // 读完后不断开，返回EAGAIN
+} Connection;
+
+static const Connection *connections;
+static int nb_connections;
+static int connection_index;
+static int packet_index;
+static int idle;
+
+
+static int script_read_header(AVFormatContext *format_ctx) {
+    const Connection *connection = &connections[connection_index];
+    AVStream *video = avformat_new_stream(format_ctx, NULL), *audio = avformat_new_stream(format_ctx, NULL);
+    if (!video || !audio) {
+        return AVERROR(ENOMEM);
+    }
+    video->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    video->codecpar->codec_id = AV_CODEC_ID_H264;
+    video->codecpar->width = connection->width;
+    video->codecpar->height = 720;
+    video->avg_frame_rate = video->r_frame_rate = (AVRational) {25, 1};
+    video->time_base = (AVRational) {1, VIDEO_TIME_BASE};
+    audio->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+    audio->codecpar->codec_id = AV_CODEC_ID_AAC;
+    audio->codecpar->sample_rate = AUDIO_TIME_BASE;
+    audio->codecpar->channels = 2;
+    audio->time_base = (AVRational) {1, AUDIO_TIME_BASE};
+    packet_index = 0;
+    return 0;
+}
+
+
+static int script_read_packet(AVFormatContext *format_ctx, AVPacket *packet) {
+    const Connection *connection = &connections[connection_index];
+    int frame = packet_index / 2, stream_index = packet_index % 2, ret;
+    int64_t time = connection->start_time + (int64_t) frame * FRAME_TIME;
+    if (frame >= connection->nb_frames) {
+        if (connection->last) {
+            __atomic_store_n(&idle, 1, __ATOMIC_SEQ_CST);
+            return AVERROR(EAGAIN);
+        }
+        connection_index++;
+        return AVERROR(EIO);
+    }
+    if ((ret = av_new_packet(packet, 100 + stream_index)) < 0) {
+        return ret;
+    }
+    memset(packet->data, frame, packet->size);
+    packet->stream_index = stream_index;
+    packet->dts = packet->pts = av_rescale(time, stream_index ? AUDIO_TIME_BASE : VIDEO_TIME_BASE, AV_TIME_BASE);
+    if (stream_index == 0 && frame >= connection->lead_frames && (frame - connection->lead_frames) % GOP == 0) {
+        packet->flags |= AV_PKT_FLAG_KEY;
+    }
+    packet_index++;
+    return 0;
+}
+
+
+static AVInputFormat script_format = {
+    .name = "script",
+    .long_name = "scripted live source",
+    .flags = AVFMT_NOFILE,
+    .read_header = script_read_header,
+    .read_packet = script_read_packet,
+};
+
+
+/**
+ * 代替shot.c：打开脚本demuxer，与shot.c相同只保留视频流
+ */
+int open_iformat_context(const char *filename, const InputSpec *input, AVFormatContext **format_ctx,
+                         AVDictionary **options, int *video_stream) {
+    int ret;
+    if (connection_index >= nb_connections) {
+        return -1;
+    }
+    if ((ret = avformat_open_input(format_ctx, filename, &script_format, options)) < 0) {
+        return ret;
+    }
+    (*format_ctx)->streams[1]->discard = AVDISCARD_ALL;
+    *video_stream = 0;
+    return 0;
+}
+
+
+void close_iformat_context(AVFormatContext **format_ctx) {
+    avformat_close_input(format_ctx);
+}
+
+
+// live_session_shot不在测试范围
+int render_shot_capture(const ShotCapture *capture, const OutputSpec *specs, int nb_specs,
+                        const ShotOptions *options) {
+    return AVERROR(ENOSYS);
+}
+
+
+static void push(PacketRing *ring, int64_t time, int size) {
+    AVPacket packet;
+    av_init_packet(&packet);
+    CHECK_EQ(av_new_packet(&packet, size), 0);
+    CHECK_EQ(push_packet_ring(ring, &packet, time), 0);
+    av_packet_unref(&packet);
+}
+
+
+/**
+ * @return 缓冲中的包按时间递增且与time_step一致时返回1
+ */
+static int is_ordered(PacketRing *ring, int64_t first_time, int64_t time_step) {
+    int i;
+    for (i = 0; i < ring->count; ++i) {
+        if (packet_ring_at(ring, i)->time != first_time + i * time_step) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static void test_trim(void) {
+    PacketRing ring = {NULL, 0, 0, 0, 0};
+    int i;
+    // 按时长：最新与最旧的包相差不超过1s
+    for (i = 0; i < 100; ++i) {
+        push(&ring, (int64_t) i * FRAME_TIME, 100);
+        trim_packet_ring(&ring, 1000, INT64_MAX);
+    }
+    CHECK_EQ(ring.count, 26);
+    CHECK_EQ(ring.bytes, 26 * 100);
+    CHECK(is_ordered(&ring, 74 * FRAME_TIME, FRAME_TIME));
+    // 按字节数
+    trim_packet_ring(&ring, 1000, 1000);
+    CHECK_EQ(ring.count, 10);
+    CHECK_EQ(ring.bytes, 1000);
+    CHECK(is_ordered(&ring, 90 * FRAME_TIME, FRAME_TIME));
+    // 超过上限的单个包也保留
+    push(&ring, 100 * FRAME_TIME, 5000);
+    trim_packet_ring(&ring, 1000, 1000);
+    CHECK_EQ(ring.count, 1);
+    CHECK_EQ(ring.bytes, 5000);
+    clear_packet_ring(&ring);
+    CHECK_EQ(ring.count, 0);
+    CHECK_EQ(ring.bytes, 0);
+    av_freep(&(ring.entries));
+}
+
+
+static void test_grow_wrapped(void) {
+    PacketRing ring = {NULL, 0, 0, 0, 0};
+    int i;
+    for (i = 0; i < 1000; ++i) {
+        push(&ring, i, 1);
+    }
+    for (i = 0; i < 900; ++i) {
+        pop_packet_ring(&ring);
+    }
+    // head在数组中间时扩容，包的顺序不变
+    for (i = 1000; i < 3000; ++i) {
+        push(&ring, i, 1);
+    }
+    CHECK_EQ(ring.capacity, 4096);
+    CHECK_EQ(ring.count, 2100);
+    CHECK_EQ(ring.bytes, 2100);
+    CHECK(is_ordered(&ring, 900, 1));
+    clear_packet_ring(&ring);
+    av_freep(&(ring.entries));
+}
+
+
+/**
+ * 按脚本运行会话，读完最后一个连接后返回
+ */
+static LiveSession *run_session(const Connection *script, int nb_script) {
+    ShotOptions options;
+    LiveSession *session;
+    int64_t deadline = av_gettime_relative() + WAIT_TIMEOUT;
+    memset(&options, 0, sizeof(options));
+    connections = script;
+    nb_connections = nb_script;
+    connection_index = 0;
+    idle = 0;
+    session = open_live_session("script:", &options, 3600 * 1000, INT64_MAX);
+    CHECK(session != NULL);
+    while (session && !__atomic_load_n(&idle, __ATOMIC_SEQ_CST) && av_gettime_relative() < deadline) {
+        av_usleep(1000);
+    }
+    CHECK(idle);
+    return session;
+}
+
+
+/**
+ * 检查每个包的时间与其平移后的dts一致，每个流的时间递增
+ * @return 不符合的包数
+ */
+static int check_timestamps(LiveSession *session) {
+    PacketRingEntry *entry;
+    int64_t last_times[2] = {INT64_MIN, INT64_MIN};
+    int i, mismatches = 0;
+    for (i = 0; i < session->ring.count; ++i) {
+        entry = packet_ring_at(&(session->ring), i);
+        if (av_rescale_q(entry->packet->dts, session->time_bases[entry->packet->stream_index], AV_TIME_BASE_Q) !=
+            entry->time || entry->time <= last_times[entry->packet->stream_index]) {
+            mismatches++;
+        }
+        last_times[entry->packet->stream_index] = entry->time;
+    }
+    return mismatches;
+}
+
+
+static void test_resync(void) {
+    // 第二个连接的时间戳从头开始，前3帧不是关键帧
+    static const Connection script[] = {
+        {1280, 10 * AV_TIME_BASE, 30, 0, 0},
+        {1280, 0, 25, 3, 1},
+    };
+    LiveSession *session = run_session(script, 2);
+    PacketRingEntry *entry;
+    if (!session) {
+        return;
+    }
+    pthread_mutex_lock(&(session->mutex));
+    CHECK_EQ(session->reconnects, 1);
+    // 新连接从第一个视频关键帧开始，之前的音频包也丢弃
+    CHECK_EQ(session->ring.count, 30 * 2 + (25 - 3) * 2);
+    entry = packet_ring_at(&(session->ring), 60);
+    CHECK_EQ(entry->packet->stream_index, 0);
+    CHECK(entry->packet->flags & AV_PKT_FLAG_KEY);
+    CHECK_EQ(entry->packet->data[0], 3);
+    CHECK_EQ(entry->time, packet_ring_at(&(session->ring), 59)->time + FRAME_TIME);
+    CHECK_EQ(packet_ring_at(&(session->ring), 59)->time, 10 * AV_TIME_BASE + 29 * FRAME_TIME);
+    CHECK_EQ(check_timestamps(session), 0);
+    pthread_mutex_unlock(&(session->mutex));
+    close_live_session(&session);
+    CHECK(session == NULL);
+}
+
+
+static void test_streams_changed(void) {
+    static const Connection script[] = {
+        {1280, 0, 30, 0, 0},
+        {1920, 5 * AV_TIME_BASE, 20, 2, 1},
+    };
+    LiveSession *session = run_session(script, 2);
+    PacketRingEntry *entry;
+    if (!session) {
+        return;
+    }
+    pthread_mutex_lock(&(session->mutex));
+    CHECK_EQ(session->reconnects, 1);
+    CHECK_EQ(session->codecpars[0]->width, 1920);
+    // 旧连接的包无法与新的流参数一起解码，缓冲只有新连接的包，时间戳不平移
+    CHECK_EQ(session->ring.count, 20 * 2);
+    entry = packet_ring_at(&(session->ring), 0);
+    CHECK_EQ(entry->time, 5 * AV_TIME_BASE);
+    CHECK_EQ(entry->packet->data[0], 0);
+    CHECK_EQ(check_timestamps(session), 0);
+    CHECK_EQ(find_clip_start(session, 0), 4);
+    pthread_mutex_unlock(&(session->mutex));
+    close_live_session(&session);
+}
+
+
+int main(void) {
+    test_trim();
+    test_grow_wrapped();
+    test_resync();
+    test_streams_changed();
+    return TEST_RESULT();
+}